@@ -1,6 +1,8 @@
 // librq
 // RISP-based queue system
 
+#define _GNU_SOURCE
+
 #include "rq.h"
 
 #include <rispbuf.h>
@@ -14,12 +16,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 
-#if (LIBRQ_VERSION != 0x00010800)
+#if (LIBRQ_VERSION != 0x00010900)
 	#error "Incorrect rq.h header version."
 #endif
 
@@ -29,6 +37,9 @@
 static void rq_read_handler(int fd, short int flags, void *arg);
 static void rq_write_handler(int fd, short int flags, void *arg);
 static void rq_connect_handler(int fd, short int flags, void *arg);
+static void rq_connect_wait_handler(int fd, short int flags, void *arg);
+static void rq_ring_handler(int fd, short int flags, void *arg);
+static void rq_batch_flush(rq_conn_t *conn);
 
 
 
@@ -164,6 +175,407 @@ int rq_new_socket(struct addrinfo *ai) {
 }
 
 
+//-----------------------------------------------------------------------------
+// Fill in the address of a controller, given as "host:port", or as
+// "unix:/path" for a unix socket.  'len' is the size of the space that
+// 'saddr' points to, and is set to the length of the address.  Returns 0 if
+// it was parsed, or -1 if it was not.
+int rq_parse_address(const char *target, struct sockaddr *saddr, int *len)
+{
+	struct sockaddr_un *sun;
+	const char *path;
+	int prefix;
+
+	assert(target);
+	assert(saddr);
+	assert(len && *len > 0);
+
+	prefix = strlen(RQ_UNIX_PREFIX);
+	if (strncmp(target, RQ_UNIX_PREFIX, prefix) != 0) {
+		return(evutil_parse_sockaddr_port(target, saddr, len));
+	}
+
+	path = target + prefix;
+	if (path[0] == '\0' || *len < sizeof(struct sockaddr_un) || strlen(path) >= sizeof(sun->sun_path)) {
+		return(-1);
+	}
+
+	sun = (struct sockaddr_un *) saddr;
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	*len = sizeof(*sun);
+
+	return(0);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Let the other core run while we are spinning on the ring.
+#if defined(__x86_64__) || defined(__i386__)
+	#define rq_ring_relax() __builtin_ia32_pause()
+#else
+	#define rq_ring_relax() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+
+//-----------------------------------------------------------------------------
+// Map the shared memory that holds the rings.  It has the control blocks of
+// both rings, followed by the data of the ring the client writes to, and then
+// the data of the ring the controller writes to.  'controller' is set when
+// the controller is mapping it, so that the rings are the other way around.
+static int rq_ring_map(rq_ring_t *ring, int fd, unsigned int size, int controller)
+{
+	rq_ring_half_t *client, *server;
+	unsigned char *base;
+
+	assert(ring);
+	assert(fd >= 0);
+	assert(ring->map == NULL);
+
+	ring->map_size = (2 * sizeof(rq_ring_ctl_t)) + (2 * (size_t) size);
+	base = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		return(-1);
+	}
+	ring->map = base;
+
+	client = controller ? &ring->in  : &ring->out;
+	server = controller ? &ring->out : &ring->in;
+
+	client->ctl  = (rq_ring_ctl_t *) base;
+	server->ctl  = (rq_ring_ctl_t *) (base + sizeof(rq_ring_ctl_t));
+	client->data = base + (2 * sizeof(rq_ring_ctl_t));
+	server->data = client->data + size;
+	client->size = size;
+	server->size = size;
+
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Create the shared memory for a pair of rings of 'size' bytes, and the
+// eventfds that each side is woken with.  This is done by the client, which
+// then passes the descriptors to the controller.  Returns 0 if the rings were
+// created, or -1 if they could not be.
+int rq_ring_create(rq_ring_t *ring, unsigned int size)
+{
+	assert(ring);
+	assert(size >= RQ_RING_MIN && size <= RQ_RING_MAX);
+	assert((size & (size - 1)) == 0);
+
+	ring->map = NULL;
+	ring->map_size = 0;
+	ring->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->map_fd = memfd_create("rq-ring", MFD_CLOEXEC);
+	ring->spin = RQ_RING_SPIN_MIN;
+	ring->corrupt = 0;
+
+	if (ring->wake_fd < 0 || ring->peer_fd < 0 || ring->map_fd < 0
+			|| ftruncate(ring->map_fd, (2 * sizeof(rq_ring_ctl_t)) + (2 * (off_t) size)) != 0
+			|| rq_ring_map(ring, ring->map_fd, size, 0) != 0) {
+		rq_ring_free(ring);
+		return(-1);
+	}
+
+	// neither side is reading yet, so the first data written to each ring
+	// will wake it.
+	ring->in.ctl->sleeping = 1;
+	ring->out.ctl->sleeping = 1;
+
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Attach to the rings that a client has created, using the descriptors that
+// it passed to us.  The ring takes over the descriptors, even if it fails.
+// Returns 0 if the rings are ready to use, or -1 if they are not.
+int rq_ring_attach(rq_ring_t *ring, int map_fd, int wake_fd, int peer_fd, unsigned int size)
+{
+	struct stat st;
+	int res;
+
+	assert(ring);
+	assert(map_fd >= 0 && wake_fd >= 0 && peer_fd >= 0);
+
+	ring->map = NULL;
+	ring->map_size = 0;
+	ring->map_fd = -1;
+	ring->wake_fd = wake_fd;
+	ring->peer_fd = peer_fd;
+	ring->spin = RQ_RING_SPIN_MIN;
+	ring->corrupt = 0;
+
+	res = -1;
+	if (size >= RQ_RING_MIN && size <= RQ_RING_MAX && (size & (size - 1)) == 0
+			&& fstat(map_fd, &st) == 0
+			&& st.st_size >= (2 * sizeof(rq_ring_ctl_t)) + (2 * (off_t) size)) {
+		res = rq_ring_map(ring, map_fd, size, 1);
+	}
+
+	// the mapping keeps the memory, we dont need the descriptor for it.
+	close(map_fd);
+
+	if (res != 0) {
+		rq_ring_free(ring);
+	}
+	return(res);
+}
+
+
+//-----------------------------------------------------------------------------
+// Unmap the rings and close the descriptors.
+void rq_ring_free(rq_ring_t *ring)
+{
+	assert(ring);
+
+	if (ring->map) {
+		munmap(ring->map, ring->map_size);
+		ring->map = NULL;
+		ring->map_size = 0;
+	}
+	if (ring->map_fd >= 0)  { close(ring->map_fd);  ring->map_fd = -1; }
+	if (ring->wake_fd >= 0) { close(ring->wake_fd); ring->wake_fd = -1; }
+	if (ring->peer_fd >= 0) { close(ring->peer_fd); ring->peer_fd = -1; }
+}
+
+
+//-----------------------------------------------------------------------------
+// Wake the other side thru its eventfd.
+static void rq_ring_wake(rq_ring_t *ring)
+{
+	uint64_t one = 1;
+	int res;
+
+	assert(ring);
+	assert(ring->peer_fd >= 0);
+
+	res = write(ring->peer_fd, &one, sizeof(one));
+	assert(res == sizeof(one) || errno == EAGAIN);
+}
+
+
+//-----------------------------------------------------------------------------
+// The positions are in memory that the other side can write to, so they cant
+// be trusted.  If there is more between them than the ring can hold, the ring
+// is marked as corrupt and nothing more is copied in or out of it.  Returns 0
+// if the positions are usable.
+static int rq_ring_check(rq_ring_t *ring, rq_ring_half_t *half, unsigned int head, unsigned int tail)
+{
+	assert(ring);
+	assert(half);
+
+	if (ring->corrupt == 0 && head - tail <= half->size) {
+		return(0);
+	}
+
+	ring->corrupt = 1;
+	errno = EPROTO;
+	return(-1);
+}
+
+
+//-----------------------------------------------------------------------------
+// Copy as much of the data in the iovecs as will fit into the outgoing ring.
+// If it doesnt all fit, the other side is asked to wake us when it has made
+// room.  Returns the number of bytes written, or -1 (with errno set to EAGAIN)
+// if the ring was full, so that it can be used the same way as writev().  If
+// the ring is corrupt, errno is set to EPROTO instead.
+int rq_ring_write(rq_ring_t *ring, const struct iovec *iov, int count)
+{
+	rq_ring_half_t *out;
+	unsigned int head, tail, space, pos, len, chunk;
+	unsigned char *ptr;
+	int i, offset, total;
+
+	assert(ring);
+	assert(iov);
+	assert(count > 0);
+
+	out = &ring->out;
+	assert(out->ctl);
+
+	head = out->ctl->head;
+	tail = __atomic_load_n(&out->ctl->tail, __ATOMIC_ACQUIRE);
+	total = 0;
+	offset = 0;
+	i = 0;
+
+	for (;;) {
+		if (rq_ring_check(ring, out, head, tail) != 0) {
+			return(-1);
+		}
+		space = out->size - (head - tail);
+		while (i < count && space > 0) {
+			len = iov[i].iov_len - offset;
+			if (len > space) { len = space; }
+			ptr = (unsigned char *) iov[i].iov_base + offset;
+
+			// the data may wrap around the end of the ring.
+			pos = head & (out->size - 1);
+			chunk = out->size - pos;
+			if (chunk > len) { chunk = len; }
+			memcpy(out->data + pos, ptr, chunk);
+			if (len > chunk) { memcpy(out->data, ptr + chunk, len - chunk); }
+
+			head += len;
+			space -= len;
+			total += len;
+			offset += len;
+			if (offset == iov[i].iov_len) {
+				offset = 0;
+				i ++;
+			}
+		}
+
+		if (i == count) { break; }
+
+		// there is no room for the rest.  The other side is asked to wake us
+		// when it makes some, and then we check again in case it already has.
+		__atomic_store_n(&out->ctl->head, head, __ATOMIC_RELEASE);
+		__atomic_store_n(&out->ctl->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&out->ctl->tail, __ATOMIC_ACQUIRE) == tail) { break; }
+		tail = __atomic_load_n(&out->ctl->tail, __ATOMIC_ACQUIRE);
+	}
+
+	if (total == 0) {
+		errno = EAGAIN;
+		return(-1);
+	}
+
+	// if the other side has gone to sleep waiting for data, it needs to be woken.
+	__atomic_store_n(&out->ctl->head, head, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&out->ctl->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&out->ctl->sleeping, 0, __ATOMIC_ACQ_REL)) {
+		rq_ring_wake(ring);
+	}
+
+	return(total);
+}
+
+
+//-----------------------------------------------------------------------------
+// Copy as much data as there is in the incoming ring (up to the space in the
+// iovecs) out of it.  If the other side was waiting for room, it is woken.
+// Returns the number of bytes read, or -1 (with errno set to EAGAIN) if the
+// ring was empty, so that it can be used the same way as readv().  If the ring
+// is corrupt, errno is set to EPROTO instead.
+int rq_ring_read(rq_ring_t *ring, const struct iovec *iov, int count)
+{
+	rq_ring_half_t *in;
+	unsigned int head, tail, avail, pos, len, chunk;
+	unsigned char *ptr;
+	int i, total;
+
+	assert(ring);
+	assert(iov);
+	assert(count > 0);
+
+	in = &ring->in;
+	assert(in->ctl);
+
+	tail = in->ctl->tail;
+	head = __atomic_load_n(&in->ctl->head, __ATOMIC_ACQUIRE);
+	if (rq_ring_check(ring, in, head, tail) != 0) {
+		return(-1);
+	}
+	avail = head - tail;
+	if (avail == 0) {
+		errno = EAGAIN;
+		return(-1);
+	}
+
+	total = 0;
+	for (i=0; i<count && avail > 0; i++) {
+		len = iov[i].iov_len;
+		if (len > avail) { len = avail; }
+		ptr = (unsigned char *) iov[i].iov_base;
+
+		pos = tail & (in->size - 1);
+		chunk = in->size - pos;
+		if (chunk > len) { chunk = len; }
+		memcpy(ptr, in->data + pos, chunk);
+		if (len > chunk) { memcpy(ptr + chunk, in->data, len - chunk); }
+
+		tail += len;
+		avail -= len;
+		total += len;
+	}
+
+	__atomic_store_n(&in->ctl->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&in->ctl->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&in->ctl->waiting, 0, __ATOMIC_ACQ_REL)) {
+		rq_ring_wake(ring);
+	}
+
+	assert(total > 0);
+	return(total);
+}
+
+
+//-----------------------------------------------------------------------------
+// The incoming ring is empty.  Rather than going back to the event loop
+// straight away, we spin for a little while in case more data is on its way.
+// The length of the spin grows while that keeps paying off, and shrinks when
+// it doesnt.  Returns 1 if there is data to read, or 0 if there is not, in
+// which case the other side will wake us thru the eventfd when there is.
+int rq_ring_wait(rq_ring_t *ring)
+{
+	rq_ring_half_t *in;
+	unsigned int tail;
+	int i;
+
+	assert(ring);
+	assert(ring->spin >= RQ_RING_SPIN_MIN && ring->spin <= RQ_RING_SPIN_MAX);
+
+	in = &ring->in;
+	assert(in->ctl);
+	tail = in->ctl->tail;
+
+	for (i=0; i<ring->spin; i++) {
+		if (__atomic_load_n(&in->ctl->head, __ATOMIC_ACQUIRE) != tail) {
+			if (ring->spin < RQ_RING_SPIN_MAX) { ring->spin *= 2; }
+			return(1);
+		}
+		rq_ring_relax();
+	}
+
+	if (ring->spin > RQ_RING_SPIN_MIN) { ring->spin /= 2; }
+
+	// tell the other side that we are going to sleep, and then check again in
+	// case something was written before it could see that.
+	__atomic_store_n(&in->ctl->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&in->ctl->head, __ATOMIC_ACQUIRE) != tail) {
+		__atomic_store_n(&in->ctl->sleeping, 0, __ATOMIC_RELAXED);
+		return(1);
+	}
+
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// We have been woken thru our eventfd, so it needs to be cleared before we
+// look at the rings.
+void rq_ring_woken(rq_ring_t *ring)
+{
+	uint64_t value;
+
+	assert(ring);
+	assert(ring->wake_fd >= 0);
+
+	if (read(ring->wake_fd, &value, sizeof(value)) < 0) {
+		assert(errno == EAGAIN);
+	}
+}
+
+
 
 
 
@@ -256,9 +668,10 @@ void rq_queue_free(rq_queue_t *queue)
 static void rq_connect(rq_t *rq)
 {
 	rq_conn_t *conn;
-	struct sockaddr saddr;
+	struct sockaddr_storage saddr;
 	int result;
 	int len;
+	struct timeval t = {.tv_sec = 1, .tv_usec = 0};
 
 	assert(rq != NULL);
 
@@ -278,20 +691,18 @@ static void rq_connect(rq_t *rq)
 		assert(conn->handle == INVALID_HANDLE);
 		
 		len = sizeof(saddr);
-		if (evutil_parse_sockaddr_port(conn->hostname, &saddr, &len) != 0) {
+		if (rq_parse_address(conn->hostname, (struct sockaddr *) &saddr, &len) != 0) {
 			// unable to parse the detail.  What do we need to do?
 			assert(0);
 		}
 		else {
 			// create the socket, and set to non-blocking mode.
 									
-			conn->handle = socket(AF_INET,SOCK_STREAM,0);
+			conn->handle = socket(saddr.ss_family, SOCK_STREAM, 0);
 			assert(conn->handle >= 0);
 			evutil_make_socket_nonblocking(conn->handle);
 
-			result = connect(conn->handle, &saddr, sizeof(saddr));
-			assert(result < 0);
-			assert(errno == EINPROGRESS);
+			result = connect(conn->handle, (struct sockaddr *) &saddr, len);
 	
 			assert(conn->inbuf == NULL);
 			assert(conn->outbuf == NULL);
@@ -299,12 +710,23 @@ static void rq_connect(rq_t *rq)
 
 			assert(conn->data == NULL);
 	
-			// connect process has been started.  Now we need to create an event so that we know when the connect has completed.
 			assert(conn->rq);
 			assert(conn->rq->evbase);
-			conn->connect_event = event_new(conn->rq->evbase, conn->handle, EV_WRITE, rq_connect_handler, conn);
-			assert(conn->connect_event);
-			event_add(conn->connect_event, NULL);	// TODO: Should we set a timeout on the connect?
+			if (result == 0 || errno == EINPROGRESS) {
+				// connect process has been started (a unix socket will already be
+				// connected).  Now we need to create an event so that we know when the
+				// connect has completed.
+				conn->connect_event = event_new(conn->rq->evbase, conn->handle, EV_WRITE, rq_connect_handler, conn);
+				assert(conn->connect_event);
+				event_add(conn->connect_event, NULL);	// TODO: Should we set a timeout on the connect?
+			}
+			else {
+				// a unix socket fails straight away if the controller is not there.
+				// We wait a bit before trying the next one, so that we dont spin.
+				conn->connect_event = evtimer_new(conn->rq->evbase, rq_connect_wait_handler, conn);
+				assert(conn->connect_event);
+				evtimer_add(conn->connect_event, &t);
+			}
 		}
 	}
 }
@@ -373,14 +795,36 @@ static void rq_conn_closed(rq_conn_t *conn)
 	}
 	assert(conn->connect_event == NULL);
 
+	// the controller has its own mapping of the rings, so we can let go of ours.
+	if (conn->ring) {
+		assert(conn->ring_event);
+		event_free(conn->ring_event);
+		conn->ring_event = NULL;
+		rq_ring_free(conn->ring);
+		free(conn->ring);
+		conn->ring = NULL;
+	}
+	conn->ring_in = 0;
+	conn->ring_out = 0;
+	conn->ring_pending = 0;
+
+	// the requests that were waiting to go out in a batch are lost along with
+	// anything else that hadnt been sent yet.
+	if (conn->batch) {
+		expbuf_clear(conn->batch);
+		expbuf_pool_return(conn->rq->bufpool, conn->batch);
+		conn->batch = NULL;
+	}
+	conn->batch_count = 0;
+	conn->batch_bytes = 0;
+
 	// timeout all the pending messages, if there are any.
 	if (conn->rq->msg_used > 0) {
 		for (i=0; i<conn->rq->msg_max; i++) {
-			if (conn->rq->msg_list[i]) {
-				msg = conn->rq->msg_list[i];
-				if (msg->conn == conn) {
-					assert(0);
-				}
+			assert(conn->rq->msg_list[i]);
+			msg = conn->rq->msg_list[i];
+			if (msg->conn == conn) {
+				assert(0);
 			}
 		}
 	}
@@ -398,11 +842,40 @@ static void rq_conn_closed(rq_conn_t *conn)
 // controller.  It will put the data in the outbuffer, and if the outbuffer was previously empty, then we will set the write event.
 static void rq_senddata(rq_conn_t *conn, char *data, int length)
 {
+	struct iovec iov;
+	int res;
+
 	assert(conn);
 	assert(data);
 	assert(length > 0);
 	assert(conn->handle != INVALID_HANDLE);
 
+	// once we are using the ring, the data is put straight into it.  Whatever
+	// doesnt fit is kept in the outbuf until the controller wakes us to say it
+	// has made room.
+	if (conn->ring_out) {
+		assert(conn->ring);
+		assert(conn->write_event == NULL);
+		if (conn->outbuf == NULL) {
+			iov.iov_base = data;
+			iov.iov_len = length;
+			res = rq_ring_write(conn->ring, &iov, 1);
+			if (res == length) {
+				return;
+			}
+			else if (res > 0) {
+				data += res;
+				length -= res;
+			}
+
+			assert(conn->rq);
+			assert(conn->rq->bufpool);
+			conn->outbuf = expbuf_pool_new(conn->rq->bufpool, length);
+		}
+		expbuf_add(conn->outbuf, data, length);
+		return;
+	}
+
 	// if we dont already have a buffer, then create one.
 	if (conn->outbuf == NULL) {
 		assert(conn->rq);
@@ -432,8 +905,12 @@ static void rq_send_closing(rq_conn_t *conn)
 {
 	char buf[1];
 	
-	buf[0] = RQ_CMD_CLOSING;
 	assert(conn);
+
+	// the requests that are waiting in a batch need to go before it.
+	rq_batch_flush(conn);
+
+	buf[0] = RQ_CMD_CLOSING;
 	rq_senddata(conn, buf, 1);
 }
 
@@ -536,6 +1013,8 @@ void rq_cleanup(rq_t *rq)
 		assert(conn->read_event == NULL);
 		assert(conn->write_event == NULL);
 		assert(conn->connect_event == NULL);
+		assert(conn->ring == NULL);
+		assert(conn->ring_event == NULL);
 
 		conn->rq = NULL;
 		conn->risp = NULL;
@@ -547,6 +1026,7 @@ void rq_cleanup(rq_t *rq)
 		assert(conn->inbuf == NULL);
 		assert(conn->outbuf == NULL);
 		assert(conn->readbuf == NULL);
+		assert(conn->batch == NULL);
 
 		assert(conn->data == NULL);
 	}
@@ -559,22 +1039,21 @@ void rq_cleanup(rq_t *rq)
 		free(q);
 	}
 
+	// cleanup the message table, and the slabs that hold the messages.
 	assert(rq->msg_list);
 	assert(rq->msg_used == 0);
-	while (rq->msg_max > 0) {
-		rq->msg_max --;
-		assert(rq->msg_list[rq->msg_max] == NULL);
-	}
 	free(rq->msg_list);
 	rq->msg_list = NULL;
+	rq->msg_max = 0;
+	rq->msg_free = NULL;
 
-
-	// cleanup the msgpool
-	assert(rq->msg_pool);
-	while ((ll_pop_head(rq->msg_pool)));
-	ll_free(rq->msg_pool);
-	free(rq->msg_pool);
-	rq->msg_pool = NULL;
+	assert(rq->msg_slabs);
+	while (rq->msg_slab_count > 0) {
+		rq->msg_slab_count --;
+		free(rq->msg_slabs[rq->msg_slab_count]);
+	}
+	free(rq->msg_slabs);
+	rq->msg_slabs = NULL;
 
 	assert(rq->bufpool);
 	expbuf_pool_free(rq->bufpool);
@@ -598,6 +1077,41 @@ void rq_setevbase(rq_t *rq, struct event_base *base)
 }
 
 
+//-----------------------------------------------------------------------------
+// Ask for shared-memory rings of 'size' bytes (each way) to be used instead of
+// the socket, when connecting to a controller thru a unix socket.  The size is
+// rounded up to a power of two.  A size of 0 turns them off.
+void rq_setring(rq_t *rq, unsigned int size)
+{
+	unsigned int ring;
+
+	assert(rq);
+
+	ring = 0;
+	if (size > 0) {
+		ring = RQ_RING_MIN;
+		while (ring < size && ring < RQ_RING_MAX) { ring *= 2; }
+	}
+	rq->ring_size = ring;
+}
+
+
+//-----------------------------------------------------------------------------
+// Set the most requests that will be sent to the controller together in one
+// BATCH.  A max of 1 (or less) sends every request on its own, which is the
+// default, because a controller from before batching cant handle a BATCH.
+// It should only be turned on when all the controllers support it.  Queues
+// that are consumed after it is turned on are also given their requests in
+// batches.
+void rq_setbatch(rq_t *rq, int max)
+{
+	assert(rq);
+
+	if (max > RQ_BATCH_MAX) { max = RQ_BATCH_MAX; }
+	rq->batch_max = max;
+}
+
+
 
 
 
@@ -608,6 +1122,7 @@ void rq_setevbase(rq_t *rq, struct event_base *base)
 static void rq_process_read(rq_conn_t *conn)
 {
 	int res, empty;
+	struct iovec iov;
 	
 	assert(conn);
 	assert(conn->rq);
@@ -623,7 +1138,20 @@ static void rq_process_read(rq_conn_t *conn)
 		assert(conn->handle != INVALID_HANDLE && conn->handle > 0);
 		assert(BUF_DATA(conn->readbuf) != NULL  && BUF_MAX(conn->readbuf) > 0);
 		
-		res = read(conn->handle, BUF_DATA(conn->readbuf), BUF_MAX(conn->readbuf));
+		if (conn->ring_in) {
+			// the controller sends everything thru the ring now.  If it is empty,
+			// we give it a little while before going back to the event loop.
+			assert(conn->ring);
+			iov.iov_base = BUF_DATA(conn->readbuf);
+			iov.iov_len = BUF_MAX(conn->readbuf);
+			res = rq_ring_read(conn->ring, &iov, 1);
+			if (res < 0 && rq_ring_wait(conn->ring)) {
+				res = rq_ring_read(conn->ring, &iov, 1);
+			}
+		}
+		else {
+			res = read(conn->handle, BUF_DATA(conn->readbuf), BUF_MAX(conn->readbuf));
+		}
 		if (res > 0) {
 			BUF_LENGTH(conn->readbuf) = res;
 			assert(BUF_LENGTH(conn->readbuf) <= BUF_MAX(conn->readbuf));
@@ -631,12 +1159,13 @@ static void rq_process_read(rq_conn_t *conn)
 			// if we pulled out the max we had avail in our buffer, that means we
 			// can pull out more at a time, so we should increase our buffer size by
 			// RQ_DEFAULT_BUFFSIZE amount.  This will increase the size of the
-			// buffer in rather small chunks, which might not be optimal.
+			// buffer in rather small chunks, which might not be optimal.  The ring
+			// is read until it is empty, so that the controller knows to wake us.
 			if (res == BUF_MAX(conn->readbuf)) {
 				expbuf_shrink(conn->readbuf, RQ_DEFAULT_BUFFSIZE);
 				assert(empty == 0);
 			}
-			else { empty = 1; }
+			else if (conn->ring_in == 0) { empty = 1; }
 			
 			// if there is no data in the in-buffer, then we will process the common buffer by itself.
 			if (conn->inbuf == NULL) {
@@ -707,6 +1236,28 @@ static void rq_process_read(rq_conn_t *conn)
 
 
 
+//-----------------------------------------------------------------------------
+// Everything we had for the socket has been sent, so the RING command is sent
+// to show the controller where the socket data ends, and the rest will go thru
+// the ring.  If the socket wont take it, then we just keep using the socket.
+static void rq_ring_switch(rq_conn_t *conn)
+{
+	char buf[1];
+
+	assert(conn);
+	assert(conn->ring);
+	assert(conn->ring_out == 0);
+	assert(conn->outbuf == NULL);
+	assert(conn->write_event == NULL);
+
+	conn->ring_pending = 0;
+	buf[0] = RQ_CMD_RING;
+	if (send(conn->handle, buf, 1, 0) == 1) {
+		conn->ring_out = 1;
+	}
+}
+
+
 static void rq_write_handler(int fd, short int flags, void *arg)
 {
 	rq_conn_t *conn = (rq_conn_t *) arg;
@@ -748,10 +1299,55 @@ static void rq_write_handler(int fd, short int flags, void *arg)
 		assert(conn->rq->bufpool);
 		expbuf_pool_return(conn->rq->bufpool, conn->outbuf);
 		conn->outbuf = NULL;
+
+		// we were waiting for the socket to be clear before moving to the ring.
+		if (conn->ring_pending) {
+			rq_ring_switch(conn);
+		}
 	}
 }	
 
 
+//-----------------------------------------------------------------------------
+// The controller has woken us thru the eventfd, either because there is data
+// for us in the ring, or because it has made room for the data we have
+// waiting.
+static void rq_ring_handler(int fd, short int flags, void *arg)
+{
+	rq_conn_t *conn = (rq_conn_t *) arg;
+	struct iovec iov;
+	int res;
+
+	assert(fd >= 0);
+	assert(conn);
+	assert(conn->ring);
+	assert(conn->ring->wake_fd == fd);
+	assert(conn->active > 0);
+
+	rq_ring_woken(conn->ring);
+
+	if (conn->ring_out && conn->outbuf) {
+		assert(BUF_LENGTH(conn->outbuf) > 0);
+		iov.iov_base = BUF_DATA(conn->outbuf);
+		iov.iov_len = BUF_LENGTH(conn->outbuf);
+		res = rq_ring_write(conn->ring, &iov, 1);
+		if (res > 0) {
+			expbuf_purge(conn->outbuf, res);
+			if (BUF_LENGTH(conn->outbuf) == 0) {
+				assert(conn->rq);
+				assert(conn->rq->bufpool);
+				expbuf_pool_return(conn->rq->bufpool, conn->outbuf);
+				conn->outbuf = NULL;
+			}
+		}
+	}
+
+	if (conn->ring_in) {
+		rq_process_read(conn);
+	}
+}
+
+
 
 //-----------------------------------------------------------------------------
 // This internal function is used to actually send a queue consume request 
@@ -773,8 +1369,12 @@ static void rq_send_consume(rq_conn_t *conn, rq_queue_t *queue)
 
 	// send consume request to controller.
 	addCmd(buf, RQ_CMD_CLEAR);
-	if (queue->exclusive != 0)
+	if (queue->exclusive != 0 && queue->exclusive != RQ_CONSUME_DURABLE)
 		addCmd(buf, RQ_CMD_EXCLUSIVE);
+	if (queue->exclusive & RQ_CONSUME_DURABLE)
+		addCmd(buf, RQ_CMD_DURABLE);
+	if (conn->rq->batch_max > 1)
+		addCmd(buf, RQ_CMD_BATCHING);
 	addCmdShortStr(buf, RQ_CMD_QUEUE, strlen(queue->queue), queue->queue);
 	addCmdInt(buf, RQ_CMD_MAX, queue->max);
 	addCmdShortInt(buf, RQ_CMD_PRIORITY, queue->priority);
@@ -788,6 +1388,108 @@ static void rq_send_consume(rq_conn_t *conn, rq_queue_t *queue)
 }
 
 
+//-----------------------------------------------------------------------------
+// If the application asked for it, and the controller is on a unix socket,
+// the shared-memory rings are created and offered to the controller.  The
+// memfd and the eventfds are passed along with the RING command.  If the
+// controller can use them, it sends a RING back, otherwise we just keep using
+// the socket.
+static void rq_ring_offer(rq_conn_t *conn)
+{
+	expbuf_t *buf;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	int *fds;
+	int res;
+
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->ring == NULL);
+	assert(conn->hostname);
+
+	if (conn->rq->ring_size == 0 || strncmp(conn->hostname, RQ_UNIX_PREFIX, strlen(RQ_UNIX_PREFIX)) != 0) {
+		return;
+	}
+
+	conn->ring = (rq_ring_t *) malloc(sizeof(rq_ring_t));
+	assert(conn->ring);
+	if (rq_ring_create(conn->ring, conn->rq->ring_size) != 0) {
+		free(conn->ring);
+		conn->ring = NULL;
+		return;
+	}
+
+	assert(conn->rq->bufpool);
+	buf = expbuf_pool_new(conn->rq->bufpool, 16);
+	addCmd(buf, RQ_CMD_CLEAR);
+	addCmdLargeInt(buf, RQ_CMD_SIZE, conn->rq->ring_size);
+	addCmd(buf, RQ_CMD_RING);
+
+	iov.iov_base = BUF_DATA(buf);
+	iov.iov_len = BUF_LENGTH(buf);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	// the controller gets the memory, then the eventfd it wakes us with, and
+	// then the one we wake it with.
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	fds = (int *) CMSG_DATA(cm);
+	fds[0] = conn->ring->map_fd;
+	fds[1] = conn->ring->wake_fd;
+	fds[2] = conn->ring->peer_fd;
+
+	// nothing has been sent on the socket yet, so it will take it all.
+	res = sendmsg(conn->handle, &mh, 0);
+	assert(res < 0 || res == BUF_LENGTH(buf));
+	if (res == BUF_LENGTH(buf)) {
+		close(conn->ring->map_fd);
+		conn->ring->map_fd = -1;
+
+		assert(conn->ring_event == NULL);
+		assert(conn->rq->evbase);
+		conn->ring_event = event_new(conn->rq->evbase, conn->ring->wake_fd, EV_READ | EV_PERSIST, rq_ring_handler, conn);
+		assert(conn->ring_event);
+		event_add(conn->ring_event, NULL);
+	}
+	else {
+		rq_ring_free(conn->ring);
+		free(conn->ring);
+		conn->ring = NULL;
+	}
+
+	expbuf_clear(buf);
+	expbuf_pool_return(conn->rq->bufpool, buf);
+}
+
+
+//-----------------------------------------------------------------------------
+// The connect failed straight away, and we have waited a bit.  The conn is
+// closed, which moves it to the tail of the list, and the next one is tried.
+static void rq_connect_wait_handler(int fd, short int flags, void *arg)
+{
+	rq_conn_t *conn = (rq_conn_t *) arg;
+
+	assert(fd < 0);
+	assert((flags & EV_TIMEOUT) == EV_TIMEOUT);
+	assert(conn);
+	assert(conn->active == 0);
+
+	assert(conn->connect_event);
+	event_free(conn->connect_event);
+	conn->connect_event = NULL;
+
+	rq_conn_closed(conn);
+}
+
+
 static void rq_connect_handler(int fd, short int flags, void *arg)
 {
 	rq_conn_t *conn = (rq_conn_t *) arg;
@@ -850,6 +1552,9 @@ static void rq_connect_handler(int fd, short int flags, void *arg)
 		assert(conn->handle > 0);
 		conn->read_event = event_new(conn->rq->evbase, conn->handle, EV_READ | EV_PERSIST, rq_read_handler, conn);
 		event_add(conn->read_event, NULL);
+
+		// this has to go before anything else is sent on the socket.
+		rq_ring_offer(conn);
 	
 		// if we have data in our out buffer, we need to create the WRITE event.
 		if (conn->outbuf && BUF_LENGTH(conn->outbuf) > 0) {
@@ -879,6 +1584,8 @@ static void rq_connect_handler(int fd, short int flags, void *arg)
 static void rq_read_handler(int fd, short int flags, void *arg)
 {
 	rq_conn_t *conn = (rq_conn_t *) arg;
+	char buf[1];
+	int res;
 
 	assert(fd >= 0);
 	assert(flags != 0);
@@ -886,8 +1593,23 @@ static void rq_read_handler(int fd, short int flags, void *arg)
 	assert(conn->rq);
 	assert(conn->active > 0);
 	assert(flags & EV_READ);
-	
-	rq_process_read(conn);
+
+	if (conn->ring_in) {
+		// nothing more is sent on the socket once the controller is using the
+		// ring, so it only becomes readable when it has been closed.  Whatever
+		// was put in the ring before that is processed first.
+		res = read(fd, buf, 1);
+		assert(res <= 0);
+		if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			rq_process_read(conn);
+			if (conn->handle == fd && conn->ring_in) {
+				rq_conn_closed(conn);
+			}
+		}
+	}
+	else {
+		rq_process_read(conn);
+	}
 }
 
 
@@ -941,6 +1663,17 @@ void rq_addcontroller(
 	conn->closing = 0;
 	conn->data = NULL;
 
+	conn->ring = NULL;
+	conn->ring_event = NULL;
+	conn->ring_in = 0;
+	conn->ring_out = 0;
+	conn->ring_pending = 0;
+
+	conn->batch = NULL;
+	conn->batch_count = 0;
+	conn->batch_bytes = 0;
+	conn->batch_scheduled = 0;
+
 	ll_push_tail(&rq->connlist, conn);
 
 	// if this is the only controller we have so far, then we need to attempt the
@@ -1134,15 +1867,135 @@ static void cmdConsuming(void *ptr)
 	}
 }
 
-static void cmdRequest(void *ptr)
+//-----------------------------------------------------------------------------
+// Find the queue that a request or a batch of requests is for, from the
+// QUEUEID or QUEUE that came with it.  Returns NULL if we are not consuming
+// it.
+static rq_queue_t * rq_request_queue(rq_conn_t *conn)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	msg_id_t msgid;
 	queue_id_t qid = 0;
 	char *qname = NULL;
 	rq_queue_t *tmp, *queue;
-	rq_message_t *msg;
+
+	assert(conn);
+	assert(conn->data);
+	assert(conn->rq);
+
+	// get queue Id or queue name.
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID))
+		qid = conn->data->qid;
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE))
+		qname = expbuf_string(conn->data->queue);
+	assert((qname == NULL && qid > 0) || (qname && qid == 0));
+
+	// find the queue to handle this request.
+	queue = NULL;
+	ll_start(&conn->rq->queues);
+	tmp = ll_next(&conn->rq->queues);
+	while (tmp) {
+		assert(tmp->qid > 0);
+		assert(tmp->queue);
+		if (qid == tmp->qid || (qname && strcmp(qname, tmp->queue) == 0)) {
+			queue = tmp;
+			tmp = NULL;
+		}
+		else {
+			tmp = ll_next(&conn->rq->queues);
+		}
+	}
+	ll_finish(&conn->rq->queues);
+
+	return(queue);
+}
+
+
+//-----------------------------------------------------------------------------
+// Tell the controller whether we have the request it sent.  The command is
+// either DELIVERED or UNDELIVERED.  A cumulative DELIVERED also covers every
+// request the controller sent us before this one.
+static void rq_send_ack(rq_conn_t *conn, msg_id_t msgid, int cmd, int cumulative)
+{
 	expbuf_t *buf;
+
+	assert(conn);
+	assert(msgid >= 0);
+	assert(cmd == RQ_CMD_DELIVERED || cmd == RQ_CMD_UNDELIVERED);
+	assert(conn->rq);
+	assert(conn->rq->bufpool);
+
+	buf = expbuf_pool_new(conn->rq->bufpool, 8);
+	assert(buf);
+	addCmd(buf, RQ_CMD_CLEAR);
+	addCmdLargeInt(buf, RQ_CMD_ID, msgid);
+	if (cumulative != 0)
+		addCmd(buf, RQ_CMD_CUMULATIVE);
+	addCmd(buf, cmd);
+	rq_senddata(conn, BUF_DATA(buf), BUF_LENGTH(buf));
+	expbuf_clear(buf);
+	expbuf_pool_return(conn->rq->bufpool, buf);
+}
+
+
+//-----------------------------------------------------------------------------
+// Give a request that the controller sent us to the queue's handler.  The
+// payload buffer is moved to the message.
+static void rq_request_handle(rq_conn_t *conn, rq_queue_t *queue, msg_id_t msgid, expbuf_t *payload)
+{
+	rq_message_t *msg;
+
+	assert(conn);
+	assert(conn->data);
+	assert(queue);
+	assert(msgid >= 0);
+	assert(payload);
+
+	// get a new message object from the pool.
+	msg = rq_msg_new(conn->rq, conn);
+	assert(msg);
+	assert(msg->id >= 0);
+	assert(msg->src_id == -1);
+	assert(msg->state == rq_msgstate_new);
+
+	// fill out the message details, and add it to the head of the messages list.
+	msg->src_id = msgid;
+	if (BIT_TEST(conn->data->flags, RQ_DATA_FLAG_NOREPLY)) {
+		msg->noreply = 1;
+	}
+
+	// move the payload buffer to the message.
+	assert(msg->data == NULL);
+	msg->data = payload;
+
+	msg->state = rq_msgstate_delivering;
+	queue->handler(msg, queue->arg);
+
+	// if the message was NOREPLY, then we dont need to reply, and we can clear the message.
+	if (msg->noreply == 1) {
+		rq_msg_clear(msg);
+		msg = NULL;
+	}
+	else if (msg->state == rq_msgstate_replied) {
+		// we already have replied to this message.  Dont need to add it to
+		// the out-process, as that would already have been done.  So all we
+		// need to do is clear the message and return it to the pool.
+		rq_msg_clear(msg);
+		msg = NULL;
+	}
+	else {
+		// we called the handled, but it hasn't replied yet.  We will need to
+		// wait until it calls rq_reply, which can clean up this message
+		// object.
+		msg->state = rq_msgstate_delivered;
+	}			
+}
+
+
+static void cmdRequest(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	msg_id_t msgid;
+	rq_queue_t *queue;
+	expbuf_t *payload;
 	
 	assert(conn);
 	assert(conn->data);
@@ -1153,140 +2006,163 @@ static void cmdRequest(void *ptr)
 		msgid = conn->data->id;
 		assert(msgid >= 0);
 
-		// get queue Id or queue name.
-		if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID))
-			qid = conn->data->qid;
-		if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE))
-			qname = expbuf_string(conn->data->queue);
-		assert((qname == NULL && qid > 0) || (qname && qid == 0));
-
-		// find the queue to handle this request.
-		// TODO: use a function call to do this.
-		queue = NULL;
-		ll_start(&conn->rq->queues);
-		tmp = ll_next(&conn->rq->queues);
-		while (tmp) {
-			assert(tmp->qid > 0);
-			assert(tmp->queue);
-			if (qid == tmp->qid || strcmp(qname, tmp->queue) == 0) {
-				queue = tmp;
-				tmp = NULL;
-			}
-			else {
-				tmp = ll_next(&conn->rq->queues);
-			}
-		}
-		ll_finish(&conn->rq->queues);
-
+		queue = rq_request_queue(conn);
 		if (queue == NULL) {
 			// we dont seem to be consuming that queue...
-			assert(conn->rq);
-			assert(conn->rq->bufpool);
-			buf = expbuf_pool_new(conn->rq->bufpool, 8);
-			assert(buf);
-			addCmd(buf, RQ_CMD_CLEAR);
-			addCmdLargeInt(buf, RQ_CMD_ID, (short int)msgid);
-			addCmd(buf, RQ_CMD_UNDELIVERED);
-			rq_senddata(conn, BUF_DATA(buf), BUF_LENGTH(buf));
-			expbuf_clear(buf);
-			expbuf_pool_return(conn->rq->bufpool, buf);
+			rq_send_ack(conn, msgid, RQ_CMD_UNDELIVERED, 0);
 		}
 		else {
 			// send a delivery message back to the controller.
-			assert(conn->rq);
-			assert(conn->rq->bufpool);
-			buf = expbuf_pool_new(conn->rq->bufpool, 8);
-			assert(buf);
-			addCmd(buf, RQ_CMD_CLEAR);
-			addCmdLargeInt(buf, RQ_CMD_ID, (short int)msgid);
-			addCmd(buf, RQ_CMD_DELIVERED);
-			rq_senddata(conn, BUF_DATA(buf), BUF_LENGTH(buf));
-			expbuf_clear(buf);
-			expbuf_pool_return(conn->rq->bufpool, buf);
-
-			// get a new message object from the pool.
-			msg = rq_msg_new(conn->rq, conn);
-			assert(msg);
-			assert(msg->id >= 0);
-			assert(msg->src_id == -1);
-			assert(msg->state == rq_msgstate_new);
-
-			// fill out the message details, and add it to the head of the messages list.
-			assert(conn->data);
-			assert(queue && msgid >= 0);
-			msg->src_id = msgid;
-			if (BIT_TEST(conn->data->flags, RQ_DATA_FLAG_NOREPLY)) {
-				msg->noreply = 1;
-			}
+			rq_send_ack(conn, msgid, RQ_CMD_DELIVERED, 0);
 
-			// move the payload buffer to the message.
-			assert(msg->data == NULL);
-			assert(conn->data);
 			assert(conn->data->payload);
-			msg->data = conn->data->payload;
+			payload = conn->data->payload;
 			conn->data->payload = NULL;
+			rq_request_handle(conn, queue, msgid, payload);
+		}
+	}
+	else {
+		// we dont have the required data to handle a request.
+		// TODO: This should be handled better.
+		assert(0);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Read a 32-bit value from a batch, which are in network byte order.
+static unsigned int rq_batch_int(const unsigned char *ptr)
+{
+	assert(ptr);
+	return((ptr[0] << 24) + (ptr[1] << 16) + (ptr[2] << 8) + ptr[3]);
+}
+
+
+//-----------------------------------------------------------------------------
+// The controller has sent us several requests for the same queue at once (see
+// RQ_CMD_BATCH).  One cumulative DELIVERED is sent for all of them, and then
+// each one is given to the handler in turn, the same as if they had come on
+// their own.
+static void cmdBatch(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	rq_queue_t *queue;
+	expbuf_t *batch, *payload;
+	const unsigned char *ids, *lengths, *data;
+	unsigned int count, i, length;
+
+	assert(conn);
+	assert(conn->data);
+	assert(conn->rq);
+	assert(conn->rq->bufpool);
+
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_PAYLOAD) && (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID) || BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE))) {
 
-			msg->state = rq_msgstate_delivering;
-			queue->handler(msg, queue->arg);
+		batch = conn->data->payload;
+		assert(batch);
+		conn->data->payload = NULL;
+
+		// the controller has already checked that it adds up.
+		assert(BUF_LENGTH(batch) >= 4);
+		count = rq_batch_int((unsigned char *) BUF_DATA(batch));
+		assert(count > 0 && count <= RQ_BATCH_MAX && BUF_LENGTH(batch) >= 4 + (count * 8));
+		ids = (unsigned char *) BUF_DATA(batch) + 4;
+		lengths = ids + (count * 4);
+		data = lengths + (count * 4);
 
-			// if the message was NOREPLY, then we dont need to reply, and we can clear the message.
-			if (msg->noreply == 1) {
-				rq_msg_clear(msg);
-				msg = NULL;
+		queue = rq_request_queue(conn);
+		if (queue == NULL) {
+			// we dont seem to be consuming that queue...
+			for (i = 0; i < count; i++) {
+				rq_send_ack(conn, rq_batch_int(ids + (i * 4)), RQ_CMD_UNDELIVERED, 0);
 			}
-			else if (msg->state == rq_msgstate_replied) {
-				// we already have replied to this message.  Dont need to add it to
-				// the out-process, as that would already have been done.  So all we
-				// need to do is clear the message and return it to the pool.
-				rq_msg_clear(msg);
-				msg = NULL;
+		}
+		else {
+			rq_send_ack(conn, rq_batch_int(ids + ((count - 1) * 4)), RQ_CMD_DELIVERED, 1);
+
+			for (i = 0; i < count; i++) {
+				length = rq_batch_int(lengths + (i * 4));
+				assert(length > 0);
+				payload = expbuf_pool_new(conn->rq->bufpool, length);
+				assert(payload);
+				expbuf_set(payload, (void *) data, length);
+				data += length;
+
+				rq_request_handle(conn, queue, rq_batch_int(ids + (i * 4)), payload);
 			}
-			else {
-				// we called the handled, but it hasn't replied yet.  We will need to
-				// wait until it calls rq_reply, which can clean up this message
-				// object.
-				msg->state = rq_msgstate_delivered;
-			}			
 		}
+
+		expbuf_clear(batch);
+		expbuf_pool_return(conn->rq->bufpool, batch);
 	}
 	else {
-		// we dont have the required data to handle a request.
-		// TODO: This should be handled better.
+		// we dont have the required data to handle a batch.
 		assert(0);
 	}
 }
 
 
+//-----------------------------------------------------------------------------
+// Mark a request that we sent as delivered.
+static void rq_msg_delivered(rq_conn_t *conn, msg_id_t id)
+{
+	rq_message_t *msg;
+
+	assert(conn);
+	assert(id >= 0);
+
+	// make sure that the message exists.
+	assert(conn->rq);
+	assert(conn->rq->msg_list);
+	assert(id >= 0 && id < conn->rq->msg_max);
+	assert(conn->rq->msg_list[id]);
+	msg = conn->rq->msg_list[id];
+
+	// make sure that it was a SENT message, and not a consumed one.
+	assert(msg->conn == NULL);
+	assert(msg->state == rq_msgstate_new);
+	msg->state = rq_msgstate_delivered;
+}
+
+
 //-----------------------------------------------------------------------------
 // The controller will return a DELIVERED command when a message has been
 // delivered to the consumer within the timeout period.  We will just mark it
 // as delivered.  The delivery messages are more useful to the controllers the
-// message passes through than the node that made the request.
+// message passes through than the node that made the request.  For NOREPLY
+// requests, the controller can send the ids of several of them together in a
+// PAYLOAD instead.
 static void cmdDelivered(void *ptr)
 {
 	rq_conn_t *conn = (rq_conn_t *) ptr;
-	msg_id_t id;
-	rq_message_t *msg;
+	expbuf_t *acks;
+	const unsigned char *ids;
+	unsigned int count, i;
 	
 	assert(conn);
 	assert(conn->data);
 	
-	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID)) {
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_PAYLOAD)) {
+		// the controller has packed several of them together.
+		acks = conn->data->payload;
+		assert(acks);
+		conn->data->payload = NULL;
 
-		id = conn->data->id;
-		assert(id >= 0);
+		assert(BUF_LENGTH(acks) >= 4);
+		count = rq_batch_int((unsigned char *) BUF_DATA(acks));
+		assert(count == (BUF_LENGTH(acks) - 4) / 4 && (BUF_LENGTH(acks) - 4) % 4 == 0);
+		ids = (unsigned char *) BUF_DATA(acks) + 4;
+		for (i = 0; i < count; i++) {
+			rq_msg_delivered(conn, rq_batch_int(ids + (i * 4)));
+		}
 
-		// make sure that the message exists.
+		expbuf_clear(acks);
 		assert(conn->rq);
-		assert(conn->rq->msg_list);
-		assert(id >= 0 && id < conn->rq->msg_max);
-		assert(conn->rq->msg_list[id]);
-		msg = conn->rq->msg_list[id];
-
-		// make sure that it was a SENT message, and not a consumed one.
-		assert(msg->conn == NULL);
-		assert(msg->state == rq_msgstate_new);
-		msg->state = rq_msgstate_delivered;
+		assert(conn->rq->bufpool);
+		expbuf_pool_return(conn->rq->bufpool, acks);
+	}
+	else if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID)) {
+		rq_msg_delivered(conn, conn->data->id);
 	}
 	else {
 		// we received a DELIVERED command, but we didn't have the required data also.
@@ -1319,7 +2195,6 @@ static void cmdReply(void *ptr)
 		assert(conn->rq->msg_used > 0);
 		assert(conn->rq->msg_max > 0);
 		assert(msgid < conn->rq->msg_max);
-		assert(msgid != conn->rq->msg_next);
 		assert(conn->rq->msg_list[msgid]);
 
 		msg = conn->rq->msg_list[msgid];
@@ -1398,14 +2273,42 @@ static void cmdClosing(void *ptr)
 	rq_connect(conn->rq);
 }
 	
+// The controller has too much pending data, and has stopped reading from this
+// connection for now.  Anything we send will be held by the socket until it
+// starts reading again, so there is nothing we need to do here.
 static void cmdServerFull(void *ptr)
 {
 	rq_conn_t *conn = (rq_conn_t *) ptr;
 
 	assert(conn);
 	assert(conn->data);
+}
 
-	assert(0);
+//-----------------------------------------------------------------------------
+// The controller has attached to the rings that we offered, and everything
+// it sends after this will come thru the ring.  We move our side over once
+// the data that is waiting for the socket has been sent.
+static void cmdRing(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(conn->ring);
+	assert(conn->ring_event);
+	assert(conn->ring_in == 0);
+
+	conn->ring_in = 1;
+
+	// the controller may have already put something in the ring, and woken us
+	// before we knew to look at it.
+	event_active(conn->ring_event, EV_READ, 0);
+
+	if (conn->outbuf == NULL) {
+		rq_ring_switch(conn);
+	}
+	else {
+		conn->ring_pending = 1;
+	}
 }
 	
 static void cmdID(void *ptr, risp_int_t value)
@@ -1510,6 +2413,54 @@ static void cmdInvalid(void *ptr, void *data, risp_length_t len)
 
 
 
+//-----------------------------------------------------------------------------
+// Allocate a slab of 'count' message objects and add them to the end of the
+// message table.  The messages in the slab are added to the free list, lowest
+// id first.  Since the messages are never moved, the pointers that the
+// application holds will remain valid as the table grows.
+static void rq_msg_addslab(rq_t *rq, int count)
+{
+	rq_message_t *slab;
+	int i;
+
+	assert(rq);
+	assert(count > 0);
+
+	slab = (rq_message_t *) malloc(sizeof(rq_message_t) * count);
+	assert(slab);
+
+	rq->msg_slabs = (void **) realloc(rq->msg_slabs, sizeof(void *) * (rq->msg_slab_count + 1));
+	assert(rq->msg_slabs);
+	rq->msg_slabs[rq->msg_slab_count] = slab;
+	rq->msg_slab_count ++;
+
+	rq->msg_list = (void **) realloc(rq->msg_list, sizeof(void *) * (rq->msg_max + count));
+	assert(rq->msg_list);
+
+	for (i=count-1; i>=0; i--) {
+		slab[i].id = rq->msg_max + i;
+		slab[i].src_id = -1;
+		slab[i].broadcast = 0;
+		slab[i].noreply = 0;
+		slab[i].durable = 0;
+		slab[i].retries = 0;
+		slab[i].data = NULL;
+		slab[i].queue = NULL;
+		slab[i].rq = rq;
+		slab[i].conn = NULL;
+		slab[i].state = rq_msgstate_new;
+		slab[i].reply_handler = NULL;
+		slab[i].fail_handler = NULL;
+		slab[i].arg = NULL;
+
+		rq->msg_list[rq->msg_max + i] = &slab[i];
+		slab[i].next_free = rq->msg_free;
+		rq->msg_free = &slab[i];
+	}
+	rq->msg_max += count;
+}
+
+
 // Initialise an RQ structure.  
 void rq_init(rq_t *rq)
 {
@@ -1524,6 +2475,7 @@ void rq_init(rq_t *rq)
 	risp_add_command(rq->risp, RQ_CMD_PING,         &cmdPing);
 	risp_add_command(rq->risp, RQ_CMD_PONG,         &cmdPong);
 	risp_add_command(rq->risp, RQ_CMD_REQUEST,      &cmdRequest);
+	risp_add_command(rq->risp, RQ_CMD_BATCH,        &cmdBatch);
 	risp_add_command(rq->risp, RQ_CMD_REPLY,        &cmdReply);
 	risp_add_command(rq->risp, RQ_CMD_DELIVERED,    &cmdDelivered);
 	risp_add_command(rq->risp, RQ_CMD_BROADCAST,    &cmdBroadcast);
@@ -1531,6 +2483,7 @@ void rq_init(rq_t *rq)
 	risp_add_command(rq->risp, RQ_CMD_CLOSING,      &cmdClosing);
 	risp_add_command(rq->risp, RQ_CMD_CONSUMING,    &cmdConsuming);
 	risp_add_command(rq->risp, RQ_CMD_SERVER_FULL,  &cmdServerFull);
+	risp_add_command(rq->risp, RQ_CMD_RING,         &cmdRing);
 	risp_add_command(rq->risp, RQ_CMD_ID,           &cmdID);
 	risp_add_command(rq->risp, RQ_CMD_QUEUEID,      &cmdQueueID);
 	risp_add_command(rq->risp, RQ_CMD_TIMEOUT,      &cmdTimeout);
@@ -1541,55 +2494,64 @@ void rq_init(rq_t *rq)
 	ll_init(&rq->connlist);
 	ll_init(&rq->queues);
 
-	// create an array of DEFAULT_MSG_ARRAY items;
+	// create the message table with a slab of DEFAULT_MSG_ARRAY items;
 	assert(DEFAULT_MSG_ARRAY > 0);
-	rq->msg_list = (void **) malloc(sizeof(void *) * DEFAULT_MSG_ARRAY);
-	assert(rq->msg_list);
-	for (rq->msg_max = 0; rq->msg_max < DEFAULT_MSG_ARRAY; rq->msg_max ++) {
-		rq->msg_list[rq->msg_max] = NULL;
-	}
-	assert(rq->msg_max == DEFAULT_MSG_ARRAY);
+	rq->msg_list = NULL;
+	rq->msg_max = 0;
 	rq->msg_used = 0;
-	rq->msg_next = 0;
-
-	rq->msg_pool = (list_t *) malloc(sizeof(list_t));
-	ll_init(rq->msg_pool);
+	rq->msg_free = NULL;
+	rq->msg_slabs = NULL;
+	rq->msg_slab_count = 0;
+	rq_msg_addslab(rq, DEFAULT_MSG_ARRAY);
+	assert(rq->msg_max == DEFAULT_MSG_ARRAY);
 
 	rq->bufpool = (expbuf_pool_t *) malloc(sizeof(expbuf_pool_t));
 	expbuf_pool_init(rq->bufpool, 0);		// TODO: should we have a max to avoid having large buffers that are not necessary?
+
+	rq->ring_size = 0;
+	rq->batch_max = 1;
 }
 
 
 
 
 //-----------------------------------------------------------------------------
-// Return a new message struct.  Will get one from the mempool if there are any
-// available, otherwise it will create a new entry.  Cannot assume that
-// anything left in the mempool has any valid data, so will initialise it as if
-// it was a fresh allocation.  The message will need to be applied to the
-// message list.  Even incoming messages need to be placed on the list in case
-// it receives cancel commands for it.
+// Return a new message struct.  It is taken from the head of the free list in
+// the message table.  If there are no free messages left, then a new slab is
+// created which doubles the size of the table.  Cannot assume that anything
+// left in the free list has any valid data, so will initialise it as if it
+// was a fresh allocation.  Even incoming messages need to be in the message
+// table in case it receives cancel commands for it.
 rq_message_t * rq_msg_new(rq_t *rq, rq_conn_t *conn)
 {
 	rq_message_t *msg;
-	int i;
 
-	// need to get a message struct from the mempool.
 	assert(rq);
-	assert(rq->msg_pool);
-	msg = ll_pop_head(rq->msg_pool);
-	if (msg == NULL) {
-		// there wasnt any messages available in the pool, so we need to create one.
-		msg = (rq_message_t *) malloc(sizeof(rq_message_t));
+	assert(rq->msg_list);
+	assert(rq->msg_max > 0);
+	assert(rq->msg_used >= 0 && rq->msg_used <= rq->msg_max);
+
+	// if the table is full, we need to expand it.
+	if (rq->msg_free == NULL) {
+		assert(rq->msg_used == rq->msg_max);
+		rq_msg_addslab(rq, rq->msg_max);
 	}
 
+	// take the message from the free list.
+	msg = rq->msg_free;
 	assert(msg);
-	msg->rq = rq;
+	rq->msg_free = msg->next_free;
+	msg->next_free = NULL;
+
+	assert(msg->id >= 0 && msg->id < rq->msg_max);
+	assert(rq->msg_list[msg->id] == msg);
+	assert(msg->rq == rq);
 	msg->queue = NULL;
-	msg->id = -1;
 	msg->src_id = -1;
 	msg->broadcast = 0;
 	msg->noreply = 0;
+	msg->durable = 0;
+	msg->retries = 0;
 	msg->state = rq_msgstate_new;
 	msg->conn = conn;
 	msg->reply_handler = NULL;
@@ -1609,39 +2571,6 @@ rq_message_t * rq_msg_new(rq_t *rq, rq_conn_t *conn)
 		msg->data = expbuf_pool_new(rq->bufpool, 0);
 	}
 
-	// add the message to the message list.
-	assert(rq->msg_list);
-	assert(rq->msg_max > 0);
-	assert(rq->msg_used >= 0 && rq->msg_used <= rq->msg_max);
-	if (rq->msg_used < rq->msg_max) {
-		// there has to be at least one empty slot in the list.
-		if (rq->msg_next >= 0) {
-			assert(rq->msg_next < rq->msg_max);
-			assert(rq->msg_list[rq->msg_next] == NULL);
-			rq->msg_list[rq->msg_next] = msg;
-			msg->id = rq->msg_next;
-			rq->msg_next = -1;
-		}
-		else {
-			// we need to go through the list, to find the empty slot.
-			for (i=0; i < rq->msg_max; i++) {
-				if (rq->msg_list[i] == NULL) {
-					rq->msg_list[i] = msg;
-					msg->id = i;
-					i = rq->msg_max;
-				}
-			}
-		}
-	}
-	else {
-		// the list is full, we need to expand it.
-		rq->msg_list = (void **) realloc(rq->msg_list, sizeof(void *) * (rq->msg_max + 1));
-		assert(rq->msg_list);
-		rq->msg_list[rq->msg_max] = msg;
-		msg->id = rq->msg_max;
-		rq->msg_max ++;
-	}
-
 	assert(rq->msg_used >= 0);
 	rq->msg_used ++;
 	assert(rq->msg_used > 0 && rq->msg_used <= rq->msg_max);
@@ -1653,27 +2582,30 @@ rq_message_t * rq_msg_new(rq_t *rq, rq_conn_t *conn)
 //-----------------------------------------------------------------------------
 // clean up the resources used by the message so that it can be used again.  We
 // will return the data buffer to the bufpool so that it can be used for
-// payloads of future messages.  We will also return the message to the message
-// pool.
+// payloads of future messages.  We will also put the message back on the free
+// list of the message table.
 void rq_msg_clear(rq_message_t *msg)
 {
+	rq_t *rq;
+
 	assert(msg);
 
-	// remove the message from the msg_list.
 	assert(msg->rq);
-	assert(msg->rq->msg_list);
-	assert(msg->rq->msg_used > 0);
+	rq = msg->rq;
+	assert(rq->msg_list);
+	assert(rq->msg_used > 0);
 	assert(msg->id >= 0);
-	assert(msg->id < msg->rq->msg_max);
-	assert(msg->rq->msg_list[msg->id] == msg);
-	msg->rq->msg_list[msg->id] = NULL;
-	msg->rq->msg_next = msg->id;
-	msg->rq->msg_used--;
+	assert(msg->id < rq->msg_max);
+	assert(rq->msg_list[msg->id] == msg);
+	assert(msg->next_free == NULL);
 	
-	msg->id = -1;
+	msg->src_id = -1;
 	msg->broadcast = 0;
 	msg->noreply = 0;
+	msg->durable = 0;
+	msg->retries = 0;
 	msg->queue = NULL;
+	msg->conn = NULL;
 	msg->state = rq_msgstate_new;
 
 	// clear the buffer, if we have one allocated.
@@ -1681,16 +2613,16 @@ void rq_msg_clear(rq_message_t *msg)
 		expbuf_clear(msg->data);
 	
 		// put the buffer back in the bufpool.
-		assert(msg->rq);
-		assert(msg->rq->bufpool);
-		expbuf_pool_return(msg->rq->bufpool, msg->data);
+		assert(rq->bufpool);
+		expbuf_pool_return(rq->bufpool, msg->data);
 		msg->data = NULL;
 	}
 	
-	// return the message to the msgpool.
-	assert(msg->rq);
-	assert(msg->rq->msg_pool);
-	ll_push_head(msg->rq->msg_pool, msg);
+	// return the message to the free list.
+	msg->next_free = rq->msg_free;
+	rq->msg_free = msg;
+	rq->msg_used--;
+	assert(rq->msg_used >= 0);
 }
 
 
@@ -1720,6 +2652,29 @@ void rq_msg_setnoreply(rq_message_t *msg)
 	msg->noreply = 1;
 }
 
+//-----------------------------------------------------------------------------
+// ask the controller to keep the message in its journal until it has been
+// processed, so that it is not lost if the controller restarts.
+void rq_msg_setdurable(rq_message_t *msg)
+{
+	assert(msg != NULL);
+	assert(msg->durable == 0);
+
+	msg->durable = 1;
+}
+
+
+//-----------------------------------------------------------------------------
+// If the consumer that has the message goes away before it is done, the
+// controller can send it to another consumer this many times, before telling
+// us that it was not delivered.
+void rq_msg_setretries(rq_message_t *msg, unsigned char retries)
+{
+	assert(msg != NULL);
+
+	msg->retries = retries;
+}
+
 
 //-----------------------------------------------------------------------------
 // This function copies the data that is presented, into an expanding buffer
@@ -1737,17 +2692,215 @@ void rq_msg_setdata(rq_message_t *msg, int length, char *data)
 
 
 
+//-----------------------------------------------------------------------------
+// Send a single request (or broadcast) to the controller.
+static void rq_send_request(rq_conn_t *conn, rq_message_t *msg)
+{
+	expbuf_t *buf;
+
+	assert(conn);
+	assert(msg);
+	assert(msg->data);
+	assert(msg->queue);
+	assert(conn->rq);
+	assert(conn->rq->bufpool);
+
+	// get a buffer from the bufpool.
+	buf = expbuf_pool_new(conn->rq->bufpool, 32);
+
+	addCmd(buf, RQ_CMD_CLEAR);
+	addCmdLargeInt(buf, RQ_CMD_ID, msg->id);
+	addCmdShortStr(buf, RQ_CMD_QUEUE, strlen(msg->queue), msg->queue);
+	addCmdLargeStr(buf, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data), BUF_DATA(msg->data));
+
+	if (msg->noreply > 0) { addCmd(buf, RQ_CMD_NOREPLY); }
+	if (msg->durable > 0) { addCmd(buf, RQ_CMD_DURABLE); }
+	if (msg->retries > 0) { addCmdShortInt(buf, RQ_CMD_RETRIES, msg->retries); }
+	if (msg->broadcast > 0) { addCmd(buf, RQ_CMD_BROADCAST); }
+	else { addCmd(buf, RQ_CMD_REQUEST); }
+
+	rq_senddata(conn, BUF_DATA(buf), BUF_LENGTH(buf));
+	
+	// return the buffer to the bufpool.
+	expbuf_clear(buf);
+	expbuf_pool_return(conn->rq->bufpool, buf);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a 32-bit value to a buffer in network byte order, as the values in a
+// BATCH are.
+static void rq_batch_addint(expbuf_t *buf, unsigned int value)
+{
+	unsigned char data[4];
+
+	assert(buf);
+
+	data[0] = (value >> 24) & 0xff;
+	data[1] = (value >> 16) & 0xff;
+	data[2] = (value >> 8) & 0xff;
+	data[3] = value & 0xff;
+	expbuf_add(buf, data, 4);
+}
+
+
+//-----------------------------------------------------------------------------
+// Send the requests that have been collected for the connection.  If there
+// is only one, then it is sent as a normal request.  Otherwise the shared
+// settings are taken from the first message (they are all the same), and the
+// ids, lengths and payloads are packed into the PAYLOAD of a BATCH (see
+// RQ_CMD_BATCH in rq.h).
+static void rq_batch_flush(rq_conn_t *conn)
+{
+	rq_t *rq;
+	rq_message_t *msg;
+	msg_id_t *ids;
+	expbuf_t *buf;
+	unsigned char cmd;
+	int i;
+
+	assert(conn);
+	assert(conn->rq);
+	rq = conn->rq;
+
+	if (conn->batch_count == 0) {
+		return;
+	}
+
+	assert(conn->batch);
+	assert(BUF_LENGTH(conn->batch) == conn->batch_count * sizeof(msg_id_t));
+	ids = (msg_id_t *) BUF_DATA(conn->batch);
+
+	if (conn->batch_count == 1) {
+		assert(rq->msg_list[ids[0]]);
+		rq_send_request(conn, rq->msg_list[ids[0]]);
+	}
+	else {
+		msg = rq->msg_list[ids[0]];
+		assert(msg);
+		assert(msg->queue);
+	
+		assert(rq->bufpool);
+		buf = expbuf_pool_new(rq->bufpool, 64 + (conn->batch_count * 8) + conn->batch_bytes);
+
+		addCmd(buf, RQ_CMD_CLEAR);
+		addCmdShortStr(buf, RQ_CMD_QUEUE, strlen(msg->queue), msg->queue);
+		if (msg->noreply > 0) { addCmd(buf, RQ_CMD_NOREPLY); }
+		if (msg->durable > 0) { addCmd(buf, RQ_CMD_DURABLE); }
+		if (msg->retries > 0) { addCmdShortInt(buf, RQ_CMD_RETRIES, msg->retries); }
+
+		// the PAYLOAD is put together in place, rather than built separately and
+		// then copied in, so the command and its length are added by hand.
+		cmd = RQ_CMD_PAYLOAD;
+		expbuf_add(buf, &cmd, 1);
+		rq_batch_addint(buf, 4 + (conn->batch_count * 8) + conn->batch_bytes);
+		rq_batch_addint(buf, conn->batch_count);
+		for (i = 0; i < conn->batch_count; i++) {
+			rq_batch_addint(buf, ids[i]);
+		}
+		for (i = 0; i < conn->batch_count; i++) {
+			msg = rq->msg_list[ids[i]];
+			assert(msg);
+			rq_batch_addint(buf, BUF_LENGTH(msg->data));
+		}
+		for (i = 0; i < conn->batch_count; i++) {
+			msg = rq->msg_list[ids[i]];
+			expbuf_add(buf, BUF_DATA(msg->data), BUF_LENGTH(msg->data));
+		}
+		addCmd(buf, RQ_CMD_BATCH);
+
+		rq_senddata(conn, BUF_DATA(buf), BUF_LENGTH(buf));
+		
+		expbuf_clear(buf);
+		expbuf_pool_return(rq->bufpool, buf);
+	}
+
+	expbuf_clear(conn->batch);
+	conn->batch_count = 0;
+	conn->batch_bytes = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// The event loop has finished the pass in which requests were added to the
+// batch, so it can be sent.
+static void rq_batch_handler(int fd, short int flags, void *arg)
+{
+	rq_conn_t *conn = (rq_conn_t *) arg;
+
+	assert(fd < 0);
+	assert(conn);
+
+	assert(conn->batch_scheduled);
+	conn->batch_scheduled = 0;
+
+	// if the connection was lost, the batch would have been lost with it.
+	if (conn->active > 0) {
+		rq_batch_flush(conn);
+	}
+	else {
+		assert(conn->batch_count == 0);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the request to the batch for the connection.  If it is for a different
+// queue, or has different settings to the ones already in the batch, then
+// those are sent first.  The batch is sent when the current pass of the event
+// loop is finished, unless it fills up before then.
+static void rq_batch_add(rq_conn_t *conn, rq_message_t *msg)
+{
+	rq_t *rq;
+	rq_message_t *first;
+	struct timeval t = {.tv_sec = 0, .tv_usec = 0};
+
+	assert(conn);
+	assert(msg);
+	assert(msg->broadcast == 0);
+	assert(conn->rq);
+	rq = conn->rq;
+
+	if (conn->batch_count > 0) {
+		assert(conn->batch);
+		first = rq->msg_list[*((msg_id_t *) BUF_DATA(conn->batch))];
+		assert(first);
+		if (strcmp(first->queue, msg->queue) != 0 || first->noreply != msg->noreply || first->durable != msg->durable || first->retries != msg->retries) {
+			rq_batch_flush(conn);
+		}
+	}
+
+	if (conn->batch == NULL) {
+		assert(rq->bufpool);
+		conn->batch = expbuf_pool_new(rq->bufpool, rq->batch_max * sizeof(msg_id_t));
+	}
+
+	expbuf_add(conn->batch, &msg->id, sizeof(msg_id_t));
+	conn->batch_count ++;
+	conn->batch_bytes += BUF_LENGTH(msg->data);
+
+	if (conn->batch_count >= rq->batch_max || conn->batch_bytes >= RQ_BATCH_BYTES) {
+		rq_batch_flush(conn);
+	}
+	else if (conn->batch_scheduled == 0) {
+		assert(rq->evbase);
+		conn->batch_scheduled = 1;
+		event_base_once(rq->evbase, -1, EV_TIMEOUT, rq_batch_handler, (void *) conn, &t);
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // send a message to the controller.   We dont need to worry about the
 // mechanics of the actual send, that will be done through the rq_senddata
-// function.
+// function.  Requests made during the same pass of the event loop are
+// collected and sent together in a BATCH.
 void rq_send(
 	rq_message_t *msg,
 	void (*reply_handler)(rq_message_t *reply),
 	void (*fail_handler)(rq_message_t *msg),
 	void *arg)
 {
-	expbuf_t *buf;
 	rq_conn_t *conn;
 	
 	assert(msg);
@@ -1772,25 +2925,14 @@ void rq_send(
 	conn = ll_get_head(&msg->rq->connlist);
 	if (conn && conn->active > 0 && conn->closing == 0) {
 
-		// get a buffer from the bufpool.
-		assert(msg->rq->bufpool);
-		buf = expbuf_pool_new(msg->rq->bufpool, 32);
-	
-		// send consume request to controller.
-		addCmd(buf, RQ_CMD_CLEAR);
-		addCmdLargeInt(buf, RQ_CMD_ID, msg->id);
-		addCmdShortStr(buf, RQ_CMD_QUEUE, strlen(msg->queue), msg->queue);
-		addCmdLargeStr(buf, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data), BUF_DATA(msg->data));
-
-		if (msg->noreply > 0) { addCmd(buf, RQ_CMD_NOREPLY); }
-		if (msg->broadcast > 0) { addCmd(buf, RQ_CMD_BROADCAST); }
-		else { addCmd(buf, RQ_CMD_REQUEST); }
-	
-		rq_senddata(conn, BUF_DATA(buf), BUF_LENGTH(buf));
-		
-		// return the buffer to the bufpool.
-		expbuf_clear(buf);
-		expbuf_pool_return(msg->rq->bufpool, buf);
+		if (msg->broadcast == 0 && msg->rq->batch_max > 1) {
+			rq_batch_add(conn, msg);
+		}
+		else {
+			// anything already in the batch was sent first.
+			rq_batch_flush(conn);
+			rq_send_request(conn, msg);
+		}
 	}
 	else {
 		// We need to put the message in a linked list so that we do send it in the right order.
@@ -1836,7 +2978,7 @@ void rq_reply(rq_message_t *msg, int length, char *data)
 	assert(msg->rq->bufpool);
 	buf = expbuf_pool_new(msg->rq->bufpool, 0);
 	addCmd(buf, RQ_CMD_CLEAR);
-	addCmdLargeInt(buf, RQ_CMD_ID, (short int) msg->src_id);
+	addCmdLargeInt(buf, RQ_CMD_ID, msg->src_id);
 	if (length > 0) {
 		assert(data);
 		addCmdLargeStr(buf, RQ_CMD_PAYLOAD, length, data);
@@ -1883,7 +3025,8 @@ rq_service_t *rq_svc_new(void)
 	}
 
 	service->svcname = NULL;
-	rq_svc_setoption(service, 'c', "ip:port",  "Controller to connect to.");
+	rq_svc_setoption(service, 'c', "ip:port",  "Controller to connect to (or unix:/path).");
+	rq_svc_setoption(service, 'R', "kb",       "Use shared-memory rings of <kb> with a unix: controller.");
 	rq_svc_setoption(service, 'd', NULL,       "Run as a daemon");
 	rq_svc_setoption(service, 'P', "file",     "save PID in <file>, only used with -d option");
 	rq_svc_setoption(service, 'u', "username", "assume identity of <username> (only when run as root)");
@@ -2152,6 +3295,10 @@ int rq_svc_connect(
 		return -1;
 	}	
 
+	if (rq_svc_getoption(service, 'R')) {
+		rq_setring(service->rq, atoi(rq_svc_getoption(service, 'R')) * 1024);
+	}
+
 	// make a copy of the supplied string, because we will be splitting it into
 	// its key/value pairs. We dont want to mangle the string that was supplied.
 	assert(str);
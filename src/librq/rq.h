@@ -3,6 +3,7 @@
 
 #include <event.h>
 #include <netdb.h>
+#include <sys/uio.h>
 #include <expbuf.h>
 #include <expbufpool.h>
 #include <linklist.h>
@@ -14,8 +15,8 @@
 // services can ensure that the correct version is installed.
 // This version number should be incremented with every change that would
 // effect logic.
-#define LIBRQ_VERSION  0x00010800
-#define LIBRQ_VERSION_NAME "v1.08.00"
+#define LIBRQ_VERSION  0x00010900
+#define LIBRQ_VERSION_NAME "v1.09.00"
 
 
 #if (LIBEVENT_VERSION_NUMBER < 0x02000200)
@@ -58,6 +59,10 @@
 // global constants and other things go here.
 #define RQ_DEFAULT_PORT      13700
 
+// controllers on the same host can be reached thru a unix socket, given as
+// "unix:/path/to/socket" instead of "host:port".
+#define RQ_UNIX_PREFIX       "unix:"
+
 // start out with an 1kb buffer.  Whenever it is full, we will double the
 // buffer, so this is just a minimum starting point.
 #define RQ_DEFAULT_BUFFSIZE	1024
@@ -89,10 +94,19 @@
 #define RQ_CMD_CLOSING          22
 #define RQ_CMD_SERVER_FULL      23
 #define RQ_CMD_CONSUMING        24
+#define RQ_CMD_STATS            25
+#define RQ_CMD_STATS_REPLY      26
+#define RQ_CMD_CREDIT           27
+#define RQ_CMD_RING             28
+#define RQ_CMD_BATCH            29
 
 /// flags (32 to 63)
 #define RQ_CMD_EXCLUSIVE        32
 #define RQ_CMD_NOREPLY          33
+#define RQ_CMD_DURABLE          34
+#define RQ_CMD_FORWARD          35
+#define RQ_CMD_BATCHING         36
+#define RQ_CMD_CUMULATIVE       37
 
 /// byte integer (64 to 95)
 #define RQ_CMD_PRIORITY         64
@@ -103,6 +117,7 @@
 #define RQ_CMD_MAX              98
 /// large integer (128 to 159 
 #define RQ_CMD_ID               128
+#define RQ_CMD_SIZE             129
 /// short string (160 to 192)
 #define RQ_CMD_QUEUE            160
 /// string (192 to 223)
@@ -110,10 +125,148 @@
 #define RQ_CMD_PAYLOAD          224
 
 
+/// The PAYLOAD of a STATS_REPLY is a RISP stream of its own, using these
+/// commands.  A QUEUE starts the details of a queue, a CONSUMER starts the
+/// details of a node consuming the last queue, and a NODE starts the details
+/// of a connection.  The values that follow belong to the last one started.
+/// The queue counters and latencies are for the last stats interval (one
+/// second), the node counters are totals for the connection, and wrap at 32
+/// bits.
+#define RQ_STAT_VERSION_1       1
+
+/// flags (32 to 63)
+#define RQ_STAT_STANDBY         32		// consumer is waiting for an exclusive queue.
+#define RQ_STAT_CONTROLLER      33		// node is a controller, or another worker.
+#define RQ_STAT_PAUSED          34		// node is not being read from (backlog).
+/// byte integer (64 to 95)
+#define RQ_STAT_VERSION         64
+#define RQ_STAT_WORKER          65
+/// short integer (96 to 127)
+#define RQ_STAT_IDLE            96		// idle periods since the node last sent anything.
+/// large integer (128 to 159)
+#define RQ_STAT_TIME            128		// when the snapshot was taken (unix time).
+#define RQ_STAT_NODE            129		// handle of the node.
+#define RQ_STAT_CONSUMER        130		// handle of the consuming node.
+#define RQ_STAT_DEPTH           131		// messages pending.
+#define RQ_STAT_INFLIGHT        132		// messages sent to consumers, not done yet.
+#define RQ_STAT_WAITING         133
+#define RQ_STAT_MAX             134
+#define RQ_STAT_REQUESTS        135
+#define RQ_STAT_REPLIES         136
+#define RQ_STAT_BROADCASTS      137
+#define RQ_STAT_TIMEOUTS        138
+#define RQ_STAT_BYTES_IN        139
+#define RQ_STAT_BYTES_OUT       140
+#define RQ_STAT_MSGS_IN         141
+#define RQ_STAT_MSGS_OUT        142
+/// short string (160 to 192)
+#define RQ_STAT_QUEUE           160
+/// large string (224 to 255).  Latencies are RQ_STAT_LATENCY_SIZE bytes, made
+/// of 32-bit values (big-endian): count, mean, p50, p90, p99, max.  The times
+/// are in microseconds.
+#define RQ_STAT_WAIT            224		// from being queued, to being sent.
+#define RQ_STAT_SERVICE         225		// from being sent, to being done.
+#define RQ_STAT_TOTAL           226		// from being queued, to being done.
+#define RQ_STAT_FAILOVER        227		// from the exclusive consumer leaving, to a standby taking over.
+
+#define RQ_STAT_LATENCY_SIZE    24
+
+
 typedef int queue_id_t;
 typedef int msg_id_t;
 
 
+/*---------------------------------------------------------------------------*/
+// Batched requests.  Several requests for the same queue, with the same
+// options, can be sent as one BATCH command instead of one REQUEST each.
+// The QUEUE (or QUEUEID), NOREPLY, DURABLE, TIMEOUT and RETRIES are given
+// once, and the PAYLOAD holds the requests themselves, with all the values in
+// network byte order:
+//
+//    count (4 bytes)
+//    id (4 bytes) * count
+//    length (4 bytes) * count
+//    the payloads, one after the other.
+//
+// The replies still come back separately for each id.  Broadcasts are never
+// batched.  A controller from before batching treats BATCH as an invalid
+// command, so librq only sends them once the application has turned it on
+// with rq_setbatch().
+//
+// A consumer that sends BATCHING with its CONSUME can be given its requests
+// the same way, as many at a time as it has room for.  librq only sends it
+// when batching has been turned on.  The DELIVERED for a
+// request it was sent can then have CUMULATIVE, which means every request
+// sent to it before that one has been delivered too.  A node that has sent
+// BATCHING, or a BATCH, can also be told about several of its NOREPLY
+// requests at once, with a DELIVERED that has a PAYLOAD of the count and the
+// ids (packed the same way) instead of an ID.
+
+// most requests that can be put in one batch, and the most payload data
+// librq will collect in a batch before it is sent.
+#define RQ_BATCH_MAX            1024
+#define RQ_BATCH_BYTES          (64 * 1024)
+
+// a good number of requests to give rq_setbatch() when the controller
+// supports batches.
+#define RQ_BATCH_DEFAULT        256
+
+
+/*---------------------------------------------------------------------------*/
+// Shared-memory ring transport.  A client on the same host as the controller
+// (connected thru a unix socket) can ask for the RISP stream to be carried in
+// a pair of rings in shared memory, one for each direction, rather than thru
+// the socket.  Each ring has a single producer and a single consumer.  An
+// eventfd is used by each side to wake the other when there is data to read,
+// or room to write, after it has spun for a while without finding any.
+
+// sizes of each of the rings, which must be a power of two.
+#define RQ_RING_MIN             (64 * 1024)
+#define RQ_RING_MAX             (16 * 1024 * 1024)
+
+// number of times the reader will check the ring for more data before it
+// sleeps.  It grows while data keeps arriving during the spin, and shrinks
+// when it doesnt.
+#define RQ_RING_SPIN_MIN        16
+#define RQ_RING_SPIN_MAX        4096
+
+// the positions are free-running, and are only masked when the data is
+// accessed.  The producer and consumer each have a cache-line of their own.
+typedef struct {
+	unsigned int head;				// written by the producer.
+	unsigned int waiting;			// producer is waiting for room.
+	char pad1[56];
+	unsigned int tail;				// written by the consumer.
+	unsigned int sleeping;		// consumer is waiting for data.
+	char pad2[56];
+} rq_ring_ctl_t;
+
+typedef struct {
+	rq_ring_ctl_t *ctl;
+	unsigned char *data;
+	unsigned int size;
+} rq_ring_half_t;
+
+typedef struct {
+	void *map;
+	size_t map_size;
+	int map_fd;								// memfd, until it has been given to the controller.
+	rq_ring_half_t in, out;
+	int wake_fd;							// eventfd we are woken with.
+	int peer_fd;							// eventfd that wakes the other side.
+	int spin;
+	char corrupt;							// the other side has put positions in the ring that dont add up.
+} rq_ring_t;
+
+int  rq_ring_create(rq_ring_t *ring, unsigned int size);
+int  rq_ring_attach(rq_ring_t *ring, int map_fd, int wake_fd, int peer_fd, unsigned int size);
+void rq_ring_free(rq_ring_t *ring);
+int  rq_ring_write(rq_ring_t *ring, const struct iovec *iov, int count);
+int  rq_ring_read(rq_ring_t *ring, const struct iovec *iov, int count);
+int  rq_ring_wait(rq_ring_t *ring);
+void rq_ring_woken(rq_ring_t *ring);
+
+
 typedef struct {
 	risp_t *risp;
 	struct event_base *evbase;
@@ -126,16 +279,27 @@ typedef struct {
 	// Linked-list of queues that this node is consuming.
 	list_t queues;			/// rq_queue_t
 
-	// mempool of messages.
-	list_t *msg_pool;
-
+	// message table.  The message objects are allocated in slabs and are never
+	// moved, so the index in msg_list is used as the message id.  Messages that
+	// are not in use are kept in the msg_free list (linked through the
+	// messages themselves).
 	void **msg_list;
 	int msg_max;
 	int msg_used;
-	int msg_next;
+	struct __rq_message_t *msg_free;
+	void **msg_slabs;
+	int msg_slab_count;
 
 	// Buffer pool.
 	expbuf_pool_t *bufpool;
+
+	// size of the shared-memory rings to ask for, when the controller is on a
+	// unix socket (0 to only use the socket).
+	unsigned int ring_size;
+
+	// most requests that will be sent together in one BATCH (1 or less, which
+	// is the default, to send each one on its own).
+	int batch_max;
 } rq_t;
 
 
@@ -179,6 +343,22 @@ typedef struct {
 	
 	expbuf_t *inbuf, *outbuf, *readbuf;
 	rq_data_t *data;
+
+	// shared-memory rings, once they have been set up with the controller.
+	// Each direction moves from the socket to the ring separately, when the
+	// RING command is sent in that direction.
+	rq_ring_t *ring;
+	struct event *ring_event;
+	char ring_in, ring_out;
+	char ring_pending;		// RING needs to be sent once the outbuf is empty.
+
+	// requests that are waiting to be sent together in a BATCH, at the end of
+	// the current pass of the event loop (or sooner if it fills up).  The
+	// buffer holds the ids of the messages.
+	expbuf_t *batch;
+	int batch_count;
+	unsigned int batch_bytes;
+	char batch_scheduled;
 	
 } rq_conn_t;
 
@@ -188,6 +368,8 @@ typedef struct __rq_message_t {
 	msg_id_t  src_id;
 	char      broadcast;
 	char      noreply;
+	char      durable;
+	unsigned char retries;		// times it can be sent to another consumer.
 	expbuf_t *data;
 	char     *queue;
 	rq_t     *rq;
@@ -201,12 +383,13 @@ typedef struct __rq_message_t {
 	void (*reply_handler)(struct __rq_message_t *msg);
 	void (*fail_handler)(struct __rq_message_t *msg);
 	void *arg;
+	struct __rq_message_t *next_free;
 } rq_message_t;
 
 typedef struct {
 	char *queue;
 	queue_id_t qid;
-	char exclusive;
+	char exclusive;				// RQ_CONSUME_* options.
 	short int max;
 	unsigned char priority;
 	
@@ -238,12 +421,15 @@ typedef struct {
 
 void rq_set_maxconns(int maxconns);
 int  rq_new_socket(struct addrinfo *ai);
+int  rq_parse_address(const char *target, struct sockaddr *saddr, int *len);
 void rq_daemon(const char *username, const char *pidfile, const int noclose);
 
 void rq_init(rq_t *rq);
 void rq_shutdown(rq_t *rq);
 void rq_cleanup(rq_t *rq);
 void rq_setevbase(rq_t *rq, struct event_base *base);
+void rq_setring(rq_t *rq, unsigned int size);
+void rq_setbatch(rq_t *rq, int max);
 
 // add a controller to the list, and it should attempt to connect to one of
 // them.   Callback functions can be provided so that actions can be performed
@@ -255,6 +441,11 @@ void rq_addcontroller(
 	void (*dropped_handler)(rq_service_t *service, void *arg),
 	void *arg);
 
+// options that can be given to rq_consume.  For compatibility, any other
+// non-zero value means exclusive.
+#define RQ_CONSUME_EXCLUSIVE  1
+#define RQ_CONSUME_DURABLE    2
+
 // start consuming a queue.
 void rq_consume(
 	rq_t *rq,
@@ -273,6 +464,8 @@ void rq_msg_clear(rq_message_t *msg);
 void rq_msg_setqueue(rq_message_t *msg, char *queue);
 void rq_msg_setbroadcast(rq_message_t *msg);
 void rq_msg_setnoreply(rq_message_t *msg);
+void rq_msg_setdurable(rq_message_t *msg);
+void rq_msg_setretries(rq_message_t *msg, unsigned char retries);
 
 
 // macros to add RISP commands to the message buffer.   This is better than
@@ -336,8 +529,9 @@ int rq_svc_connect(
 
 // This value is the number of elements we pre-create for the message list.
 // When the system is running, it should always assume that there is at least
-// something in the list.   The list will grow as the need arises, so this
-// number doesn't really matter much, except to maybe tune it a little better.
+// something in the list.   The list will double in size as the need arises,
+// so this number doesn't really matter much, except to maybe tune it a little
+// better.
 #define DEFAULT_MSG_ARRAY 10
 
 
@@ -0,0 +1,765 @@
+//-----------------------------------------------------------------------------
+// rq-stat
+//	Shows what is going on inside an rqd instance.  It connects to the daemon,
+//	and every interval asks it for a snapshot of its queues and connections
+//	(the STATS command), and prints a line for each one, much like vmstat.
+//
+//	Each connection is handled by one of the worker processes, so when rqd is
+//	running more than one worker, only the queues and connections of the
+//	worker that accepted this connection are shown.
+//-----------------------------------------------------------------------------
+
+
+// includes
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <expbuf.h>
+#include <linklist.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <risp.h>
+#include <rispbuf.h>
+#include <rq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+#define PACKAGE						"rq-stat"
+#define VERSION						"1.0"
+
+// number of lines printed before the column headings are printed again.
+#define HEADER_LINES   20
+
+
+// latency summary, as it is sent in the snapshot.
+typedef struct {
+	unsigned int count, mean, p50, p90, p99, max;
+} latency_t;
+
+typedef struct {
+	int handle;
+	int waiting, max;
+	int standby;
+} consumer_t;
+
+typedef struct {
+	char *name;
+	unsigned int depth, inflight;
+	unsigned int requests, replies, broadcasts, timeouts;
+	unsigned int bytes_in, bytes_out;
+	latency_t wait, service, total, failover;
+	list_t consumers;		// consumer_t
+} queue_t;
+
+typedef struct {
+	int handle;
+	unsigned int bytes_in, bytes_out;
+	unsigned int msgs_in, msgs_out;
+	int idle;
+	int controller, paused;
+} node_t;
+
+// one snapshot, as received from the daemon.
+typedef struct {
+	int version;
+	int worker;
+	unsigned int time;
+	list_t queues;			// queue_t
+	list_t nodes;				// node_t
+	queue_t *queue;			// the queue that values currently belong to.
+	consumer_t *consumer;
+	node_t *node;
+} snapshot_t;
+
+
+typedef struct {
+	int handle;
+	risp_t *risp;			// the commands from the daemon.
+	risp_t *risp_snap;	// the commands inside the snapshot.
+	expbuf_t in;
+	expbuf_t payload;
+	int replied;
+
+	snapshot_t *snap, *prev;
+
+	// options.
+	char *host;
+	int port;
+	int interval;
+	int count;
+	int show_nodes;
+	int show_consumers;
+	char *only;
+	int lines;
+} control_t;
+
+
+
+//-----------------------------------------------------------------------------
+// Initialise a snapshot object.
+static void snapshot_init(snapshot_t *snap)
+{
+	assert(snap);
+	snap->version = 0;
+	snap->worker = 0;
+	snap->time = 0;
+	ll_init(&snap->queues);
+	ll_init(&snap->nodes);
+	snap->queue = NULL;
+	snap->consumer = NULL;
+	snap->node = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Free the resources used by the snapshot, but not the snapshot itself.
+static void snapshot_free(snapshot_t *snap)
+{
+	queue_t *q;
+	consumer_t *c;
+	node_t *n;
+
+	assert(snap);
+
+	while ((q = ll_pop_head(&snap->queues))) {
+		while ((c = ll_pop_head(&q->consumers))) {
+			free(c);
+		}
+		ll_free(&q->consumers);
+		free(q->name);
+		free(q);
+	}
+	ll_free(&snap->queues);
+
+	while ((n = ll_pop_head(&snap->nodes))) {
+		free(n);
+	}
+	ll_free(&snap->nodes);
+
+	snap->queue = NULL;
+	snap->consumer = NULL;
+	snap->node = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Find the node in the snapshot.
+static node_t * snapshot_node(snapshot_t *snap, int handle)
+{
+	node_t *n, *found = NULL;
+
+	assert(snap);
+
+	ll_start(&snap->nodes);
+	while (found == NULL && (n = ll_next(&snap->nodes))) {
+		if (n->handle == handle) { found = n; }
+	}
+	ll_finish(&snap->nodes);
+
+	return(found);
+}
+
+
+//-----------------------------------------------------------------------------
+// The commands inside the snapshot.  The values belong to the queue, consumer
+// or node that was started last.
+
+static void statVersion(void *base, risp_int_t value)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl && ctl->snap);
+	ctl->snap->version = value;
+}
+
+static void statWorker(void *base, risp_int_t value)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl && ctl->snap);
+	ctl->snap->worker = value;
+}
+
+static void statTime(void *base, risp_int_t value)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl && ctl->snap);
+	ctl->snap->time = (unsigned int) value;
+}
+
+static void statQueue(void *base, risp_length_t length, risp_char_t *data)
+{
+	control_t *ctl = (control_t *) base;
+	queue_t *q;
+
+	assert(ctl && ctl->snap);
+	assert(data);
+
+	q = (queue_t *) calloc(1, sizeof(queue_t));
+	assert(q);
+	q->name = (char *) malloc(length + 1);
+	memcpy(q->name, data, length);
+	q->name[length] = '\0';
+	ll_init(&q->consumers);
+	ll_push_tail(&ctl->snap->queues, q);
+
+	ctl->snap->queue = q;
+	ctl->snap->consumer = NULL;
+	ctl->snap->node = NULL;
+}
+
+static void statConsumer(void *base, risp_int_t value)
+{
+	control_t *ctl = (control_t *) base;
+	consumer_t *c;
+
+	assert(ctl && ctl->snap);
+	if (ctl->snap->queue) {
+		c = (consumer_t *) calloc(1, sizeof(consumer_t));
+		assert(c);
+		c->handle = value;
+		ll_push_tail(&ctl->snap->queue->consumers, c);
+		ctl->snap->consumer = c;
+	}
+}
+
+static void statNode(void *base, risp_int_t value)
+{
+	control_t *ctl = (control_t *) base;
+	node_t *n;
+
+	assert(ctl && ctl->snap);
+
+	n = (node_t *) calloc(1, sizeof(node_t));
+	assert(n);
+	n->handle = value;
+	ll_push_tail(&ctl->snap->nodes, n);
+
+	ctl->snap->node = n;
+	ctl->snap->queue = NULL;
+	ctl->snap->consumer = NULL;
+}
+
+static void statInt(void *base, risp_command_t cmd, risp_int_t value)
+{
+	control_t *ctl = (control_t *) base;
+	snapshot_t *snap;
+	unsigned int v = (unsigned int) value;
+
+	assert(ctl && ctl->snap);
+	snap = ctl->snap;
+
+	if (snap->consumer && (cmd == RQ_STAT_WAITING || cmd == RQ_STAT_MAX)) {
+		if (cmd == RQ_STAT_WAITING) { snap->consumer->waiting = value; }
+		else                        { snap->consumer->max = value; }
+	}
+	else if (snap->queue) {
+		switch (cmd) {
+			case RQ_STAT_DEPTH:      snap->queue->depth = v;        break;
+			case RQ_STAT_INFLIGHT:   snap->queue->inflight = v;     break;
+			case RQ_STAT_REQUESTS:   snap->queue->requests = v;     break;
+			case RQ_STAT_REPLIES:    snap->queue->replies = v;      break;
+			case RQ_STAT_BROADCASTS: snap->queue->broadcasts = v;   break;
+			case RQ_STAT_TIMEOUTS:   snap->queue->timeouts = v;     break;
+			case RQ_STAT_BYTES_IN:   snap->queue->bytes_in = v;     break;
+			case RQ_STAT_BYTES_OUT:  snap->queue->bytes_out = v;    break;
+		}
+	}
+	else if (snap->node) {
+		switch (cmd) {
+			case RQ_STAT_BYTES_IN:   snap->node->bytes_in = v;      break;
+			case RQ_STAT_BYTES_OUT:  snap->node->bytes_out = v;     break;
+			case RQ_STAT_MSGS_IN:    snap->node->msgs_in = v;       break;
+			case RQ_STAT_MSGS_OUT:   snap->node->msgs_out = v;      break;
+		}
+	}
+}
+
+// librisp doesnt tell the callback which command it was, so each one needs a
+// small function of its own.
+#define STAT_INT(name, cmd) \
+	static void name(void *base, risp_int_t value) { statInt(base, cmd, value); }
+
+STAT_INT(statDepth,      RQ_STAT_DEPTH)
+STAT_INT(statInflight,   RQ_STAT_INFLIGHT)
+STAT_INT(statWaiting,    RQ_STAT_WAITING)
+STAT_INT(statMax,        RQ_STAT_MAX)
+STAT_INT(statRequests,   RQ_STAT_REQUESTS)
+STAT_INT(statReplies,    RQ_STAT_REPLIES)
+STAT_INT(statBroadcasts, RQ_STAT_BROADCASTS)
+STAT_INT(statTimeouts,   RQ_STAT_TIMEOUTS)
+STAT_INT(statBytesIn,    RQ_STAT_BYTES_IN)
+STAT_INT(statBytesOut,   RQ_STAT_BYTES_OUT)
+STAT_INT(statMsgsIn,     RQ_STAT_MSGS_IN)
+STAT_INT(statMsgsOut,    RQ_STAT_MSGS_OUT)
+
+static void statIdle(void *base, risp_int_t value)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl && ctl->snap);
+	if (ctl->snap->node) { ctl->snap->node->idle = value; }
+}
+
+static void statStandby(void *base)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl && ctl->snap);
+	if (ctl->snap->consumer) { ctl->snap->consumer->standby = 1; }
+}
+
+static void statController(void *base)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl && ctl->snap);
+	if (ctl->snap->node) { ctl->snap->node->controller = 1; }
+}
+
+static void statPaused(void *base)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl && ctl->snap);
+	if (ctl->snap->node) { ctl->snap->node->paused = 1; }
+}
+
+static void statLatency(void *base, risp_command_t cmd, risp_length_t length, risp_char_t *data)
+{
+	control_t *ctl = (control_t *) base;
+	latency_t *lat;
+	unsigned int values[6];
+	int i;
+
+	assert(ctl && ctl->snap);
+	assert(data);
+
+	if (ctl->snap->queue == NULL || length < RQ_STAT_LATENCY_SIZE) {
+		return;
+	}
+
+	for (i=0; i<6; i++) {
+		values[i] = ((unsigned int) data[(i*4)+0] << 24)
+		          | ((unsigned int) data[(i*4)+1] << 16)
+		          | ((unsigned int) data[(i*4)+2] << 8)
+		          |  (unsigned int) data[(i*4)+3];
+	}
+
+	switch (cmd) {
+		case RQ_STAT_WAIT:     lat = &ctl->snap->queue->wait;     break;
+		case RQ_STAT_SERVICE:  lat = &ctl->snap->queue->service;  break;
+		case RQ_STAT_FAILOVER: lat = &ctl->snap->queue->failover; break;
+		default:               lat = &ctl->snap->queue->total;    break;
+	}
+	lat->count = values[0];
+	lat->mean  = values[1];
+	lat->p50   = values[2];
+	lat->p90   = values[3];
+	lat->p99   = values[4];
+	lat->max   = values[5];
+}
+
+static void statWait(void *base, risp_length_t length, risp_char_t *data)
+	{ statLatency(base, RQ_STAT_WAIT, length, data); }
+static void statService(void *base, risp_length_t length, risp_char_t *data)
+	{ statLatency(base, RQ_STAT_SERVICE, length, data); }
+static void statTotal(void *base, risp_length_t length, risp_char_t *data)
+	{ statLatency(base, RQ_STAT_TOTAL, length, data); }
+static void statFailover(void *base, risp_length_t length, risp_char_t *data)
+	{ statLatency(base, RQ_STAT_FAILOVER, length, data); }
+
+
+//-----------------------------------------------------------------------------
+// The commands from the daemon.
+
+static void cmdClear(void *base)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl);
+	expbuf_clear(&ctl->payload);
+}
+
+static void cmdPayload(void *base, risp_length_t length, risp_char_t *data)
+{
+	control_t *ctl = (control_t *) base;
+	assert(ctl);
+	expbuf_set(&ctl->payload, data, length);
+}
+
+static void cmdStatsReply(void *base)
+{
+	control_t *ctl = (control_t *) base;
+	risp_length_t processed;
+
+	assert(ctl);
+	assert(ctl->snap);
+
+	processed = risp_process(ctl->risp_snap, ctl, BUF_LENGTH(&ctl->payload), (risp_char_t *) BUF_DATA(&ctl->payload));
+	if (processed != BUF_LENGTH(&ctl->payload)) {
+		fprintf(stderr, "Snapshot was not complete.\n");
+	}
+	ctl->replied = 1;
+}
+
+static void cmdServerFull(void *base)
+{
+	fprintf(stderr, "Server is full.\n");
+	exit(1);
+}
+
+static void cmdClosing(void *base)
+{
+	fprintf(stderr, "Server is closing.\n");
+	exit(1);
+}
+
+static void cmdIgnore(void *base, void *data, risp_length_t len)
+{
+}
+
+
+//-----------------------------------------------------------------------------
+// Connect to the daemon.  Returns the socket, or -1 if it could not connect.
+static int stat_connect(const char *host, int port)
+{
+	struct addrinfo hints, *res, *ai;
+	char service[16];
+	int handle = -1;
+
+	assert(host);
+	assert(port > 0);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+
+	if (getaddrinfo(host, service, &hints, &res) != 0) {
+		return(-1);
+	}
+
+	for (ai = res; ai && handle < 0; ai = ai->ai_next) {
+		handle = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (handle >= 0 && connect(handle, ai->ai_addr, ai->ai_addrlen) != 0) {
+			close(handle);
+			handle = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	return(handle);
+}
+
+
+//-----------------------------------------------------------------------------
+// Ask the daemon for a snapshot, and wait for it to arrive.  Returns 0 if the
+// connection was lost.
+static int stat_poll(control_t *ctl)
+{
+	expbuf_t out;
+	risp_length_t processed;
+	ssize_t res;
+
+	assert(ctl);
+	assert(ctl->handle >= 0);
+	assert(ctl->snap);
+
+	expbuf_init(&out, 8);
+	addCmd(&out, RQ_CMD_CLEAR);
+	addCmd(&out, RQ_CMD_STATS);
+	res = write(ctl->handle, BUF_DATA(&out), BUF_LENGTH(&out));
+	expbuf_free(&out);
+	if (res <= 0) {
+		return(0);
+	}
+
+	ctl->replied = 0;
+	while (ctl->replied == 0) {
+		if (BUF_MAX(&ctl->in) - BUF_LENGTH(&ctl->in) < 1024) {
+			expbuf_shrink(&ctl->in, BUF_MAX(&ctl->in));
+		}
+
+		res = read(ctl->handle, BUF_DATA(&ctl->in) + BUF_LENGTH(&ctl->in), BUF_MAX(&ctl->in) - BUF_LENGTH(&ctl->in));
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			return(0);
+		}
+		ctl->in.length += res;
+
+		processed = risp_process(ctl->risp, ctl, BUF_LENGTH(&ctl->in), (risp_char_t *) BUF_DATA(&ctl->in));
+		if (processed > 0) {
+			expbuf_purge(&ctl->in, processed);
+		}
+	}
+
+	return(1);
+}
+
+
+//-----------------------------------------------------------------------------
+// Difference between two counters, per second.  The node counters wrap at 32
+// bits, which the unsigned subtraction takes care of.
+static unsigned int rate(unsigned int now, unsigned int before, unsigned int seconds)
+{
+	assert(seconds > 0);
+	return((now - before) / seconds);
+}
+
+
+//-----------------------------------------------------------------------------
+// Print the column headings, if they are due.
+static void print_header(control_t *ctl)
+{
+	assert(ctl);
+
+	if (ctl->lines == 0) {
+		printf("%-20s %7s %6s %5s %7s %7s %6s %5s %8s %8s %7s %7s %7s %7s %7s\n",
+			"queue", "depth", "infl", "cons", "req/s", "rep/s", "bc/s", "tmo",
+			"KBin/s", "KBout/s", "wait50", "wait99", "svc50", "svc99", "tot99");
+	}
+	ctl->lines ++;
+	if (ctl->lines >= HEADER_LINES) {
+		ctl->lines = 0;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Print the lines for the snapshot that has just been received.
+static void print_snapshot(control_t *ctl)
+{
+	snapshot_t *snap, *prev;
+	queue_t *q;
+	consumer_t *c;
+	node_t *n, *p;
+	int consumers, waiting, max;
+	unsigned int seconds;
+
+	assert(ctl);
+	snap = ctl->snap;
+	prev = ctl->prev;
+	assert(snap && prev);
+
+	ll_start(&snap->queues);
+	while ((q = ll_next(&snap->queues))) {
+		if (ctl->only && strcmp(ctl->only, q->name) != 0) {
+			continue;
+		}
+
+		consumers = 0; waiting = 0; max = 0;
+		ll_start(&q->consumers);
+		while ((c = ll_next(&q->consumers))) {
+			if (c->standby == 0) {
+				consumers ++;
+				waiting += c->waiting;
+				max += c->max;
+			}
+		}
+		ll_finish(&q->consumers);
+
+		print_header(ctl);
+		printf("%-20s %7u %6u %5d %7u %7u %6u %5u %8u %8u %7u %7u %7u %7u %7u\n",
+			q->name, q->depth, q->inflight, consumers,
+			q->requests, q->replies, q->broadcasts, q->timeouts,
+			q->bytes_in / 1024, q->bytes_out / 1024,
+			q->wait.p50, q->wait.p99, q->service.p50, q->service.p99, q->total.p99);
+
+		if (ctl->show_consumers) {
+			if (q->failover.count > 0) {
+				print_header(ctl);
+				printf("  failovers %u, mean %u, max %u\n",
+					q->failover.count, q->failover.mean, q->failover.max);
+			}
+			ll_start(&q->consumers);
+			while ((c = ll_next(&q->consumers))) {
+				print_header(ctl);
+				printf("  node:%-13d waiting/max %d/%d%s\n",
+					c->handle, c->waiting, c->max, c->standby ? " standby" : "");
+			}
+			ll_finish(&q->consumers);
+		}
+	}
+	ll_finish(&snap->queues);
+
+	if (ctl->show_nodes) {
+		// the node counters are totals, so the rate is worked out from the last
+		// snapshot.  For the first one, it is the total since it connected.
+		seconds = 1;
+		if (prev->time > 0 && snap->time > prev->time) {
+			seconds = snap->time - prev->time;
+		}
+
+		ll_start(&snap->nodes);
+		while ((n = ll_next(&snap->nodes))) {
+			p = snapshot_node(prev, n->handle);
+			print_header(ctl);
+			printf("  node:%-13d KBin/s %u, KBout/s %u, msgin/s %u, msgout/s %u, idle %d%s%s\n",
+				n->handle,
+				rate(n->bytes_in,  p ? p->bytes_in : 0,  seconds) / 1024,
+				rate(n->bytes_out, p ? p->bytes_out : 0, seconds) / 1024,
+				rate(n->msgs_in,   p ? p->msgs_in : 0,   seconds),
+				rate(n->msgs_out,  p ? p->msgs_out : 0,  seconds),
+				n->idle,
+				n->controller ? " controller" : "",
+				n->paused ? " paused" : "");
+		}
+		ll_finish(&snap->nodes);
+	}
+
+	fflush(stdout);
+}
+
+
+//-----------------------------------------------------------------------------
+static void usage(void) {
+	printf(PACKAGE " " VERSION "\n");
+	printf("-c <host>     rqd to connect to (default: 127.0.0.1).\n");
+	printf("-p <num>      port it is listening on (default: %d).\n", RQ_DEFAULT_PORT);
+	printf("-i <secs>     seconds between each snapshot (default: 1).\n");
+	printf("-n <num>      number of snapshots, then exit (default: no limit).\n");
+	printf("-q <queue>    only show this queue.\n");
+	printf("-v            also show the consumers of each queue.\n");
+	printf("-N            also show the connections.\n");
+	printf("-h            print this help and exit\n");
+	return;
+}
+
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	control_t *ctl;
+	snapshot_t *tmp;
+	int c;
+	int polls;
+
+	ctl = (control_t *) malloc(sizeof(control_t));
+	assert(ctl);
+	ctl->handle = -1;
+	ctl->host = "127.0.0.1";
+	ctl->port = RQ_DEFAULT_PORT;
+	ctl->interval = 1;
+	ctl->count = 0;
+	ctl->show_nodes = 0;
+	ctl->show_consumers = 0;
+	ctl->only = NULL;
+	ctl->lines = 0;
+	ctl->replied = 0;
+
+	while ((c = getopt(argc, argv, "c:p:i:n:q:vNh")) != -1) {
+		switch (c) {
+			case 'c': ctl->host = optarg;                break;
+			case 'p': ctl->port = atoi(optarg);          break;
+			case 'i': ctl->interval = atoi(optarg);      break;
+			case 'n': ctl->count = atoi(optarg);         break;
+			case 'q': ctl->only = optarg;                break;
+			case 'v': ctl->show_consumers = 1;           break;
+			case 'N': ctl->show_nodes = 1;               break;
+			case 'h':
+				usage();
+				exit(EXIT_SUCCESS);
+			default:
+				fprintf(stderr, "Illegal argument \"%c\"\n", c);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (ctl->interval < 1 || ctl->port <= 0) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	ctl->handle = stat_connect(ctl->host, ctl->port);
+	if (ctl->handle < 0) {
+		fprintf(stderr, "Unable to connect to %s:%d\n", ctl->host, ctl->port);
+		exit(EXIT_FAILURE);
+	}
+
+	expbuf_init(&ctl->in, 4096);
+	expbuf_init(&ctl->payload, 0);
+
+	ctl->risp = risp_init();
+	assert(ctl->risp);
+	risp_add_invalid(ctl->risp, cmdIgnore);
+	risp_add_command(ctl->risp, RQ_CMD_CLEAR,       &cmdClear);
+	risp_add_command(ctl->risp, RQ_CMD_PAYLOAD,     &cmdPayload);
+	risp_add_command(ctl->risp, RQ_CMD_STATS_REPLY, &cmdStatsReply);
+	risp_add_command(ctl->risp, RQ_CMD_SERVER_FULL, &cmdServerFull);
+	risp_add_command(ctl->risp, RQ_CMD_CLOSING,     &cmdClosing);
+
+	ctl->risp_snap = risp_init();
+	assert(ctl->risp_snap);
+	risp_add_invalid(ctl->risp_snap, cmdIgnore);
+	risp_add_command(ctl->risp_snap, RQ_STAT_VERSION,    &statVersion);
+	risp_add_command(ctl->risp_snap, RQ_STAT_WORKER,     &statWorker);
+	risp_add_command(ctl->risp_snap, RQ_STAT_TIME,       &statTime);
+	risp_add_command(ctl->risp_snap, RQ_STAT_QUEUE,      &statQueue);
+	risp_add_command(ctl->risp_snap, RQ_STAT_CONSUMER,   &statConsumer);
+	risp_add_command(ctl->risp_snap, RQ_STAT_NODE,       &statNode);
+	risp_add_command(ctl->risp_snap, RQ_STAT_DEPTH,      &statDepth);
+	risp_add_command(ctl->risp_snap, RQ_STAT_INFLIGHT,   &statInflight);
+	risp_add_command(ctl->risp_snap, RQ_STAT_WAITING,    &statWaiting);
+	risp_add_command(ctl->risp_snap, RQ_STAT_MAX,        &statMax);
+	risp_add_command(ctl->risp_snap, RQ_STAT_REQUESTS,   &statRequests);
+	risp_add_command(ctl->risp_snap, RQ_STAT_REPLIES,    &statReplies);
+	risp_add_command(ctl->risp_snap, RQ_STAT_BROADCASTS, &statBroadcasts);
+	risp_add_command(ctl->risp_snap, RQ_STAT_TIMEOUTS,   &statTimeouts);
+	risp_add_command(ctl->risp_snap, RQ_STAT_BYTES_IN,   &statBytesIn);
+	risp_add_command(ctl->risp_snap, RQ_STAT_BYTES_OUT,  &statBytesOut);
+	risp_add_command(ctl->risp_snap, RQ_STAT_MSGS_IN,    &statMsgsIn);
+	risp_add_command(ctl->risp_snap, RQ_STAT_MSGS_OUT,   &statMsgsOut);
+	risp_add_command(ctl->risp_snap, RQ_STAT_IDLE,       &statIdle);
+	risp_add_command(ctl->risp_snap, RQ_STAT_STANDBY,    &statStandby);
+	risp_add_command(ctl->risp_snap, RQ_STAT_CONTROLLER, &statController);
+	risp_add_command(ctl->risp_snap, RQ_STAT_PAUSED,     &statPaused);
+	risp_add_command(ctl->risp_snap, RQ_STAT_WAIT,       &statWait);
+	risp_add_command(ctl->risp_snap, RQ_STAT_SERVICE,    &statService);
+	risp_add_command(ctl->risp_snap, RQ_STAT_TOTAL,      &statTotal);
+	risp_add_command(ctl->risp_snap, RQ_STAT_FAILOVER,   &statFailover);
+
+	ctl->snap = (snapshot_t *) malloc(sizeof(snapshot_t));
+	ctl->prev = (snapshot_t *) malloc(sizeof(snapshot_t));
+	assert(ctl->snap && ctl->prev);
+	snapshot_init(ctl->snap);
+	snapshot_init(ctl->prev);
+
+	for (polls = 0; ctl->count == 0 || polls < ctl->count; polls ++) {
+		if (polls > 0) {
+			sleep(ctl->interval);
+		}
+
+		if (stat_poll(ctl) == 0) {
+			fprintf(stderr, "Connection to %s:%d was lost.\n", ctl->host, ctl->port);
+			break;
+		}
+
+		if (ctl->snap->version != RQ_STAT_VERSION_1) {
+			fprintf(stderr, "Snapshot version %d is not supported.\n", ctl->snap->version);
+			break;
+		}
+		print_snapshot(ctl);
+
+		// keep this snapshot, so that the next one can be compared with it.
+		tmp = ctl->prev;
+		ctl->prev = ctl->snap;
+		ctl->snap = tmp;
+		snapshot_free(ctl->snap);
+		snapshot_init(ctl->snap);
+	}
+
+	close(ctl->handle);
+
+	snapshot_free(ctl->snap);
+	snapshot_free(ctl->prev);
+	free(ctl->snap);
+	free(ctl->prev);
+	risp_shutdown(ctl->risp);
+	risp_shutdown(ctl->risp_snap);
+	expbuf_free(&ctl->in);
+	expbuf_free(&ctl->payload);
+	free(ctl);
+
+	return(0);
+}
@@ -101,88 +101,157 @@ void cmdPong(void *base)
 }
 
 //-----------------------------------------------------------------------------
-// This function is used to find the next available message object that is not
-// in use.  We will first check the 'next' value.  If it is available, then we
-// will use that, and then increment the 'next' value.  If we dont find what we
-// are looking for with 'next', then we will go trhough the list and try to
-// find one.  If we still dont find one, then we need to increase the number of
-// elements in the list, and create a new one.
+// This function is used to get the next available message object that is not
+// in use.  The message list keeps its unused messages in a free-list, so we
+// just take the one at the head.  If there are none left, then we need to
+// increase the size of the list first.
 static message_t * next_message(node_t *node)
 {
 	message_t *msg = NULL;
 	system_data_t *sysdata;
-	int i;
 
 	assert(node);
 	
 	sysdata = node->sysdata;
 	assert(sysdata);
+	assert(sysdata->msglist);
+	assert(sysdata->stats);
 
-	assert(sysdata->msg_list);
-	assert(sysdata->msg_max > 0);
-	assert(sysdata->msg_next < sysdata->msg_max);
-	assert(sysdata->msg_used <= sysdata->msg_max);
+	if (sysdata->msglist->free == NULL) {
+		// the list is full of active messages, so we need to create more.
+		msglist_grow(sysdata->msglist);
+		sysdata->stats->msg_grows ++;
+		logger(sysdata->logging, 2, "Message list increased to %d.", sysdata->msglist->max);
+	}
 
-	if (sysdata->msg_used < sysdata->msg_max) {
-		// We know that there must be at least one availble message in the list.
+	// get the message, it will already be marked as active.
+	msg = msglist_alloc(sysdata->msglist);
+	assert(msg);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
 
-		// first check the 'next' entry and see if it contains an empty slot.
-		if (sysdata->msg_next != -1) {
-			assert(sysdata->msg_next >= 0 && sysdata->msg_next < sysdata->msg_max);
-			assert(sysdata->msg_list[sysdata->msg_next]);
-			assert(sysdata->msg_list[sysdata->msg_next]->id == sysdata->msg_next);
-			assert(sysdata->msg_list[sysdata->msg_next]->flags == 0);
-			
-			msg = sysdata->msg_list[sysdata->msg_next];
-			sysdata->msg_next = -1;
-		}
+	// the node provided would have to be the source, so we should assign it as the source node.
+	assert(msg->source_node == NULL);
+	assert(node);
+	msg->source_node = node;
 
-		// if we still dont have a message object, then we need to go through the
-		// list and find one.
-		for (i=0; i < sysdata->msg_max && msg == NULL; i++) {
-			assert(sysdata->msg_list[i]);
-			if (sysdata->msg_list[i]->flags == 0) {
-				msg = sysdata->msg_list[i];
-				assert(sysdata->msg_next == -1);
-			}
-		}
+	// we're done.  Return the message object.
+	assert(msg);
+	return(msg);
+}
 
-		assert(msg);
+
+//-----------------------------------------------------------------------------
+// Find the queue that the request in the node data is for.  If we dont have
+// it yet, then it is created.
+static queue_t * request_queue(node_t *node)
+{
+	queue_t *q;
+
+	assert(node);
+	assert(node->sysdata);
+
+	if (BIT_TEST(node->data.mask, DATA_MASK_QUEUE)) {
+		q = queue_get_name(node->sysdata, expbuf_string(&node->data.queue));
+	}
+	else if (BIT_TEST(node->data.mask, DATA_MASK_QUEUEID)) {
+		q = queue_get_id(node->sysdata, node->data.qid);
 	}
 	else {
-		// the list is full of active messages, so we need to create more.
-		assert(sysdata->msg_next == -1);
 		assert(0);
+		q = NULL;
+	}
 
-		// increase the size of the list.
-		sysdata->msg_list = (message_t **) realloc(sysdata->msg_list, sizeof(message_t *) * (sysdata->msg_max + 1));
-		assert(sysdata->msg_list);
-		msg = (message_t *) malloc(sizeof(message_t));
-		assert(msg);
-		message_init(msg, sysdata->msg_max);
-		sysdata->msg_list[sysdata->msg_max] = msg;
-		sysdata->msg_max ++;
+	if (q == NULL) {
+		// we dont have a queue, so we will need to create one.
+		q = queue_create(node->sysdata, expbuf_string(&node->data.queue));
 	}
+	assert(q);
+	assert(ll_count(node->sysdata->queues) > 0);
 
-	// at this point, we should have a message object.
-	assert(msg);
+	return(q);
+}
 
-	// increment the count.
-	sysdata->msg_used ++;
-	assert(sysdata->msg_used <= sysdata->msg_max);
 
-	// mark the message as active.
-	assert(msg->flags == 0);
-	BIT_SET(msg->flags, FLAG_MSG_ACTIVE);
+//-----------------------------------------------------------------------------
+// Create the message for a request from the node, with the payload buffer
+// given, and add it to the queue.  The flags and settings all come from the
+// node data, so every request in a batch gets the same ones.
+static void request_add(node_t *node, queue_t *q, expbuf_t *payload, msg_id_t id)
+{
+	message_t *msg;
 
-	// the node provided would have to be the source, so we should assign it as the source node.
-	assert(msg->source_node == NULL);
 	assert(node);
-	msg->source_node = node;
+	assert(q);
+	assert(payload);
+	assert(node->sysdata);
+	assert(node->sysdata->bufpool);
 
-	// we're done.  Return the message object.
+	// create the message object to hold the data.
+	assert(node->sysdata->msglist);
+	msg = next_message(node);
 	assert(msg);
-	return(msg);
+
+	// The buffer is moved to the message, where it will be handled from there.
+	assert(msg->data == NULL);
+	msg->data = payload_new(node->sysdata->bufpool, payload);
+
+	// requests handed to us by another worker are only for our own consumers.
+	if (BIT_TEST(node->flags, FLAG_NODE_PEER)) {
+		BIT_SET(msg->flags, FLAG_MSG_PEER);
+	}
+
+	// the queue will record it in the journal.
+	if (BIT_TEST(node->data.flags, DATA_FLAG_DURABLE)) {
+		BIT_SET(msg->flags, FLAG_MSG_DURABLE);
+	}
+	
+	// if message is NOREPLY, then we dont need some bits.  However, we will need to send a DELIVERED.
+	if (BIT_TEST(node->data.flags, DATA_FLAG_NOREPLY)) {
+		BIT_SET(msg->flags, FLAG_MSG_NOREPLY);
+		assert(msg->source_id == 0);
+
+		// the source_node would have been set when the message object was
+		// obtained.  But since we dont want it in this mode, we set it to
+		// NULL.
+		assert(msg->source_node != NULL);
+		msg->source_node = NULL;
+
+		// a node that can take a BATCH gets all of these together, at the end
+		// of the pass.
+		if (BIT_TEST(node->flags, FLAG_NODE_BATCH)) {
+			node_ack(node, id);
+		}
+		else {
+			sendDelivered(node, id);
+		}
+	}
+	else {
+		assert(BIT_TEST(msg->flags, FLAG_MSG_NOREPLY) == 0);
+	
+		// make a note in the msg object, the source node. If a reply is
+		// expected, a messageid should also have been supplied, use that for
+		// the node_side.
+		assert(msg->source_node == node);
+		message_set_origid(msg, id);
+	}
+	
+	if (BIT_TEST(node->data.mask, DATA_MASK_TIMEOUT)) {
+		// set the timeout... 
+		message_set_timeout(msg, node->data.timeout);
+	}
+
+	// if the consumer goes away before it is done, the message can be sent to
+	// another one this many times.
+	if (BIT_TEST(node->data.mask, DATA_MASK_RETRIES)) {
+		msg->retries = node->data.retries;
+	}
+
+	// add the message to the queue.
+	logger(node->sysdata->logging, 2, "processRequest: node:%d, msg_id:%d, q:%d", node->handle, msg->id, q->qid);
+	assert(q->sysdata);
+	queue_addmsg(q, msg);
+
+	node->msgs_in ++;
 }
 
 
@@ -192,9 +261,8 @@ static message_t * next_message(node_t *node)
 void cmdRequest(void *base)
 {
 	node_t *node = (node_t *) base;
-	message_t *msg;
 	queue_t *q;
-	stats_t *stats;
+	expbuf_t *payload;
 
  	assert(node);
  	assert(node->handle >= 0);
@@ -203,81 +271,25 @@ void cmdRequest(void *base)
 		"node:%d REQUEST (flags:%x, mask:%x)", node->handle, node->data.flags, node->data.mask);
 
 	assert(node->sysdata->queues);
-	assert(node->sysdata->bufpool);
 
-	// make sure we have the required data. At least payload, and a queueid or queue.
-	if (BIT_TEST(node->data.mask, DATA_MASK_PAYLOAD) && (BIT_TEST(node->data.mask, DATA_MASK_QUEUE) || BIT_TEST(node->data.mask, DATA_MASK_QUEUEID))) {
+	// make sure we have the required data. At least payload, an id, and a queueid or queue.
+	if (BIT_TEST(node->data.mask, DATA_MASK_PAYLOAD) && BIT_TEST(node->data.mask, DATA_MASK_ID) && (BIT_TEST(node->data.mask, DATA_MASK_QUEUE) || BIT_TEST(node->data.mask, DATA_MASK_QUEUEID))) {
 
-		// create the message object to hold the data.
-		assert(node->sysdata->msg_list);
-		msg = next_message(node);
-		assert(msg);
+		q = request_queue(node);
 
 		// The node should have received a payload command.  It would have been
 		// assigned to an appropriate buffer.  We need to move that buffer to the
-		// message, where it will be handled from there.
+		// message.
 		assert(node->data.payload);
-		assert(msg->data == NULL);
-		msg->data = node->data.payload;
+		payload = node->data.payload;
 		node->data.payload = NULL;
-		
-		// if message is NOREPLY, then we dont need some bits.  However, we will need to send a DELIVERED.
-		if (BIT_TEST(node->data.flags, DATA_FLAG_NOREPLY)) {
-			BIT_SET(msg->flags, FLAG_MSG_NOREPLY);
-			assert(msg->source_id == 0);
-
-			// the source_node would have been set when the message object was
-			// obtained.  But since we dont want it in this mode, we set it to
-			// NULL.
-			assert(msg->source_node != NULL);
-			msg->source_node = NULL;
-
-			assert(BIT_TEST(node->data.mask, DATA_MASK_ID));
-			sendDelivered(node, node->data.id);
-		}
-		else {
-			assert(BIT_TEST(msg->flags, FLAG_MSG_NOREPLY) == 0);
-		
-			// make a note in the msg object, the source node. If a reply is
-			// expected, a messageid should also have been supplied, use that for
-			// the node_side.
-			assert(msg->source_node == node);
-			assert(BIT_TEST(node->data.mask, DATA_MASK_ID));
-			message_set_origid(msg, node->data.id);
-		}
-		
-		if (BIT_TEST(node->data.mask, DATA_MASK_TIMEOUT)) {
-			// set the timeout... 
-			message_set_timeout(msg, node->data.timeout);
-		}
-		
-		// find the q object for this queue.
-		if (BIT_TEST(node->data.mask, DATA_MASK_QUEUE)) {
-			q = queue_get_name(node->sysdata->queues, expbuf_string(&node->data.queue));
-		}
-		else if (BIT_TEST(node->data.mask, DATA_MASK_QUEUEID)) {
-			q = queue_get_id(node->sysdata->queues, node->data.qid);
-		}
-		else {
-			assert(0);
-		}
-	
-		if (q == NULL) {
-			// we dont have a queue, so we will need to create one.
-			q = queue_create(node->sysdata, expbuf_string(&node->data.queue));
-		}
-		assert(q);
-		assert(ll_count(node->sysdata->queues) > 0);
-		
-		// add the message to the queue.
+		request_add(node, q, payload, node->data.id);
 
-		logger(node->sysdata->logging, 2, "processRequest: node:%d, msg_id:%d, q:%d", node->handle, msg->id, q->qid);
-		assert(q->sysdata);
-		queue_addmsg(q, msg);
+		// stop reading more requests from the node if the queue is full.
+		queue_throttle(q, node);
 
-		stats = node->sysdata->stats;
-		assert(stats);
-		stats->requests ++;
+		assert(node->sysdata->stats);
+		node->sysdata->stats->requests ++;
 	}
 	else {
 		// required data was not found.
@@ -287,6 +299,128 @@ void cmdRequest(void *base)
 }
 
 
+//-----------------------------------------------------------------------------
+// Read a 32-bit value from a batch, which are in network byte order.
+static unsigned int batch_int(const unsigned char *ptr)
+{
+	assert(ptr);
+	return(((unsigned int) ptr[0] << 24) + ((unsigned int) ptr[1] << 16) + ((unsigned int) ptr[2] << 8) + (unsigned int) ptr[3]);
+}
+
+
+//-----------------------------------------------------------------------------
+// A batch of requests for the same queue has been received.  Everything
+// except the id and the payload is shared by all of them, and the PAYLOAD
+// holds the count, then all the ids, then all the lengths, and then all the
+// payloads one after the other (see RQ_CMD_BATCH).  The queue is only looked
+// up once, and the requests are added to it together, so they will all be
+// handed out in the same delivery pass.  If the batch doesnt add up, but the
+// ids can be read, the producer is told that none of them were delivered.
+// Otherwise the node is closed, because there is no way to answer it.
+void cmdBatch(void *base)
+{
+	node_t *node = (node_t *) base;
+	queue_t *q;
+	expbuf_t *batch, *payload;
+	const unsigned char *ids, *lengths, *data;
+	unsigned int count, i, length, total;
+	int valid;
+
+ 	assert(node);
+ 	assert(node->handle >= 0);
+	assert(node->sysdata);
+	assert(node->sysdata->bufpool);
+
+	if (BIT_TEST(node->data.mask, DATA_MASK_PAYLOAD) == 0 || (BIT_TEST(node->data.mask, DATA_MASK_QUEUE) == 0 && BIT_TEST(node->data.mask, DATA_MASK_QUEUEID) == 0)) {
+		// required data was not found.
+		assert(0);
+		return;
+	}
+
+	batch = node->data.payload;
+	assert(batch);
+	node->data.payload = NULL;
+
+	// check that the arrays and the payloads all fit, before anything is
+	// added.  A batch that doesnt add up is not added at all.  'count' is only
+	// left set if the ids can still be read.
+	count = 0;
+	total = 0;
+	valid = 0;
+	if (BUF_LENGTH(batch) >= 4) {
+		count = batch_int((unsigned char *) BUF_DATA(batch));
+		if (count > 0 && count <= RQ_BATCH_MAX && BUF_LENGTH(batch) >= 4 + (count * 4)) {
+			ids = (unsigned char *) BUF_DATA(batch) + 4;
+			for (i = 0; i < count; i++) {
+				if ((message_id_t) batch_int(ids + (i * 4)) < 0) { break; }
+			}
+			if (i < count) {
+				count = 0;
+			}
+			else if (BUF_LENGTH(batch) >= 4 + (count * 8)) {
+				lengths = ids + (count * 4);
+				for (i = 0; i < count; i++) {
+					length = batch_int(lengths + (i * 4));
+					// each one has to fit in what is left, so the total cant wrap around.
+					if (length == 0 || length > BUF_LENGTH(batch) - (4 + (count * 8) + total)) { break; }
+					total += length;
+				}
+				if (i == count && 4 + (count * 8) + total == BUF_LENGTH(batch)) {
+					valid = 1;
+				}
+			}
+		}
+		else {
+			count = 0;
+		}
+	}
+
+	logger(node->sysdata->logging, 3,
+		"node:%d BATCH (count:%u, flags:%x, mask:%x)", node->handle, count, node->data.flags, node->data.mask);
+
+	if (valid == 0 && count == 0) {
+		logger(node->sysdata->logging, 1, "node:%d sent a BATCH that is not valid (len:%d), closing it.", node->handle, BUF_LENGTH(batch));
+		BIT_SET(node->flags, FLAG_NODE_INVALID);
+	}
+	else if (valid == 0) {
+		logger(node->sysdata->logging, 1, "node:%d sent a BATCH that is not valid (len:%d), returning the %u requests.", node->handle, BUF_LENGTH(batch), count);
+		ids = (unsigned char *) BUF_DATA(batch) + 4;
+		for (i = 0; i < count; i++) {
+			sendUndelivered(node, batch_int(ids + (i * 4)));
+		}
+	}
+	else {
+		// a node that sends batches can also be given them.
+		BIT_SET(node->flags, FLAG_NODE_BATCH);
+
+		q = request_queue(node);
+
+		ids = (unsigned char *) BUF_DATA(batch) + 4;
+		lengths = ids + (count * 4);
+		data = lengths + (count * 4);
+		for (i = 0; i < count; i++) {
+			length = batch_int(lengths + (i * 4));
+			payload = expbuf_pool_new(node->sysdata->bufpool, length);
+			assert(payload);
+			expbuf_set(payload, (void *) data, length);
+			data += length;
+
+			request_add(node, q, payload, batch_int(ids + (i * 4)));
+		}
+
+		// stop reading more requests from the node if the queue is full.
+		queue_throttle(q, node);
+
+		assert(node->sysdata->stats);
+		node->sysdata->stats->requests += count;
+		node->sysdata->stats->batches ++;
+	}
+
+	expbuf_clear(batch);
+	expbuf_pool_return(node->sysdata->bufpool, batch);
+}
+
+
 void cmdReply(void *base)
 {
 	node_t *node = (node_t *) base;
@@ -309,31 +443,49 @@ void cmdReply(void *base)
 
 		// find the message that the reply belongs to.
 		assert(node->sysdata);
-		assert(node->sysdata->msg_list);
-		assert(id < node->sysdata->msg_max);
-		msg = node->sysdata->msg_list[id];
+		assert(node->sysdata->msglist);
+		msg = msglist_get(node->sysdata->msglist, id);
 		assert(msg);
 		assert(msg->id == id);
 		assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
 		assert(msg->target_node == node);
 
+		if (BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT)) {
+			// the message has already timed out, and the source has been told, so
+			// the reply is not needed.
+			logger(node->sysdata->logging, 2, "reply(%d): message already timed out.", id);
+			assert(node->data.payload);
+			expbuf_clear(node->data.payload);
+			expbuf_pool_return(node->sysdata->bufpool, node->data.payload);
+			node->data.payload = NULL;
+			
+			assert(msg->queue);
+			queue_msg_expired_done(msg->queue, msg);
+			return;
+		}
+
 		// apply the payload which is part of the reply, replacing the payload which was the request.
+		// The request is still here if it could have been sent to another consumer.
 		assert(node->sysdata);
 		assert(node->sysdata->bufpool);
 		assert(node->data.payload);
-		assert(msg->data == NULL);
-		msg->data = node->data.payload;
+		if (msg->data) {
+			assert(msg->retries > 0);
+			payload_release(msg->data);
+			msg->data = NULL;
+		}
+		msg->data = payload_new(node->sysdata->bufpool, node->data.payload);
 		node->data.payload = NULL;
 		
 		// send the payload to the source node of the message.
 		assert(msg->source_node);
 		sendReply(msg->source_node, msg);
 
-		// tell the queue that the node has finished processing a message.  This
-		// will find the node, and remove it from the node_busy list.
+		// tell the queue that the node has finished processing a message.  If
+		// the node was in the busy list, it will be moved back to the ready list.
 		assert(msg->queue);
 		assert(msg->target_node);
-		queue_msg_done(msg->queue, msg->target_node);
+		queue_msg_done(msg->queue, msg);
 
 		// then remove from the queue->msg_proc list
 		assert(msg->queue);
@@ -341,28 +493,28 @@ void cmdReply(void *base)
 		ll_remove(&q->msg_proc, msg);
 		msg->queue = NULL;
 
+		// release our reference to the payload.  If it hasn't all been sent yet,
+		// the node will still have a reference to it.
 		assert(msg->data);
-		assert(node->sysdata);
-		assert(node->sysdata->bufpool);
-		expbuf_clear(msg->data);
-		expbuf_pool_return(node->sysdata->bufpool, msg->data);
+		payload_release(msg->data);
 		msg->data = NULL;
 
 
 		// set action to remove the message.
 		msg->source_node = NULL;
+		node_inflight_remove(node, msg);
 		msg->target_node = NULL;
 		assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
+		if (msg->jid > 0) {
+			journal_done(node->sysdata->journal, msg);
+		}
 		message_clear(msg);
-		assert(node->sysdata->msg_used > 0);
-		node->sysdata->msg_used --;
-		assert(node->sysdata->msg_used >= 0);
-		node->sysdata->msg_next = msg->id;
+		msglist_release(node->sysdata->msglist, msg);
 
 		// if there are more messages in the queue, then we need to deliver them.
 		if (ll_count(&q->msg_pending) > 0) {
 			logger(node->sysdata->logging, 2, "delivery: setting delivery action.");
-			queue_deliver(q);
+			queue_schedule(q);
 		}
 		else {
 			logger(node->sysdata->logging, 2, "delivery: no items to deliver.");
@@ -372,6 +524,7 @@ void cmdReply(void *base)
 		stats = node->sysdata->stats;
 		assert(stats);
 		stats->replies ++;
+		node->msgs_in ++;
 	}
 	else {
 		// we should handle failure a bit better, and log the information.
@@ -397,10 +550,10 @@ void cmdBroadcast(void *base)
 	if (BIT_TEST(node->data.mask, DATA_MASK_QUEUE) || BIT_TEST(node->data.mask, DATA_MASK_QUEUEID)) {
 
 		if (BIT_TEST(node->data.mask, DATA_MASK_QUEUE)) {
-			q = queue_get_name(node->sysdata->queues, expbuf_string(&node->data.queue));
+			q = queue_get_name(node->sysdata, expbuf_string(&node->data.queue));
 		}
 		else if (BIT_TEST(node->data.mask, DATA_MASK_QUEUEID)) {
-			q = queue_get_id(node->sysdata->queues, node->data.qid);
+			q = queue_get_id(node->sysdata, node->data.qid);
 		}
 
 		if (q == NULL) {
@@ -414,9 +567,29 @@ void cmdBroadcast(void *base)
 		msg = next_message(node);
 		assert(msg);
 
-		// now that we have a message structure completely filled out with the
-		// data from the node, then we need to do something with it.
-		assert(0);
+		// the payload buffer is moved to the message.
+		assert(BIT_TEST(node->data.mask, DATA_MASK_PAYLOAD));
+		assert(node->data.payload);
+		assert(msg->data == NULL);
+		msg->data = payload_new(node->sysdata->bufpool, node->data.payload);
+		node->data.payload = NULL;
+
+		// broadcasts dont get a reply, and dont need to be tracked back to the
+		// node that sent it.
+		message_set_broadcast(msg);
+		message_set_noreply(msg);
+		assert(msg->source_node == node);
+		msg->source_node = NULL;
+		if (BIT_TEST(node->flags, FLAG_NODE_PEER)) {
+			BIT_SET(msg->flags, FLAG_MSG_PEER);
+		}
+
+		logger(node->sysdata->logging, 2, "processBroadcast: node:%d, msg_id:%d, q:%d", node->handle, msg->id, q->qid);
+		queue_addmsg(q, msg);
+
+		assert(node->sysdata->stats);
+		node->sysdata->stats->broadcasts ++;
+		node->msgs_in ++;
 	}
 	else {
 		// we didn't have a queue name, or a queue id.   We need to handle this gracefully.
@@ -470,11 +643,9 @@ void cmdClosing(void *base)
 	// not have pending requests for this node.
 	queue_cancel_node(node);
 
-	// if we have messages still in the list, we need to go through them, to see
-	// if there are any for this node that we need to set timeouts on.
-	if (node->sysdata->msg_used > 0) {
-		assert(0);
-	}
+	// the node can still reply to the messages it has.  They are kept in its
+	// in-flight list, and still time out as normal.  If an exclusive queue
+	// has a standby, it takes over when they are done.
 
 	// mark the node as closing so that as soon as all the messages have
 	// completed, the node can be shutdown.
@@ -491,6 +662,77 @@ void cmdClosing(void *base)
 }
 
 
+//-----------------------------------------------------------------------------
+// The request, or the queue being consumed, should be recorded in the journal.
+void cmdDurable(void *base)
+{
+	node_t *node = (node_t *) base;
+ 	assert(node);
+
+ 	// set our specific flag.
+	BIT_SET(node->data.flags, DATA_FLAG_DURABLE);
+
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3,
+		"node:%d DURABLE (flags:%x, mask:%x)",
+		node->handle, node->data.flags, node->data.mask);
+}
+
+
+//-----------------------------------------------------------------------------
+// The consume request is from another controller, which will be handing the
+// requests to its own consumers.
+void cmdForward(void *base)
+{
+	node_t *node = (node_t *) base;
+ 	assert(node);
+
+ 	// set our specific flag.
+	BIT_SET(node->data.flags, DATA_FLAG_FORWARD);
+
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3,
+		"node:%d FORWARD (flags:%x, mask:%x)",
+		node->handle, node->data.flags, node->data.mask);
+}
+
+
+//-----------------------------------------------------------------------------
+// The consumer can be given several requests at a time in a BATCH, and it
+// can send DELIVERED for them together.
+void cmdBatching(void *base)
+{
+	node_t *node = (node_t *) base;
+ 	assert(node);
+
+ 	// set our specific flag.
+	BIT_SET(node->data.flags, DATA_FLAG_BATCHING);
+
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3,
+		"node:%d BATCHING (flags:%x, mask:%x)",
+		node->handle, node->data.flags, node->data.mask);
+}
+
+
+//-----------------------------------------------------------------------------
+// The DELIVERED is for every request sent to the node up to and including
+// the one with the ID.
+void cmdCumulative(void *base)
+{
+	node_t *node = (node_t *) base;
+ 	assert(node);
+
+ 	// set our specific flag.
+	BIT_SET(node->data.flags, DATA_FLAG_CUMULATIVE);
+
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3,
+		"node:%d CUMULATIVE (flags:%x, mask:%x)",
+		node->handle, node->data.flags, node->data.mask);
+}
+
+
 //-----------------------------------------------------------------------------
 // When a node indicates that it wants to consume a queue,the node needs to be
 // added to the queue list.  If this is the first time this queue is being
@@ -521,8 +763,8 @@ void cmdConsume(void *base)
 	
 		// check to see if we already have a queue with this name, in our list.		
 		assert(q == NULL);
-		if (node->sysdata->queues)
-			q = queue_get_name(node->sysdata->queues, expbuf_string(&node->data.queue));
+		if (node->sysdata->qdir)
+			q = queue_get_name(node->sysdata, expbuf_string(&node->data.queue));
 		
 		if (q == NULL) {
 			// we didn't find the queue...
@@ -549,6 +791,19 @@ void cmdConsume(void *base)
 			
 		if (BIT_TEST(node->data.flags, DATA_FLAG_EXCLUSIVE))
 			BIT_SET(qflags, QUEUE_FLAG_EXCLUSIVE);
+
+		// another controller is not counted as one of our consumers when we tell
+		// our own controllers how much we can take.
+		if (BIT_TEST(node->data.flags, DATA_FLAG_FORWARD))
+			BIT_SET(node->flags, FLAG_NODE_FORWARDER);
+
+		// the node can take several requests in one BATCH.
+		if (BIT_TEST(node->data.flags, DATA_FLAG_BATCHING))
+			BIT_SET(node->flags, FLAG_NODE_BATCH);
+
+		// all the messages for a durable queue are recorded in the journal.
+		if (BIT_TEST(node->data.flags, DATA_FLAG_DURABLE))
+			queue_set_durable(q);
 		
 		if (queue_add_node(q, node, max, priority, qflags) > 0) {
 			// send reply back to the node.
@@ -558,7 +813,31 @@ void cmdConsume(void *base)
 		// need to check the queue to see if there are messages pending.  If there
 		// are, then send some to this node.
 		if (ll_count(&q->msg_pending) > 0) {
-			queue_deliver(q);
+			queue_schedule(q);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// A controller that is consuming a queue from us is telling us how many
+// requests its own consumers can take at a time.
+void cmdCredit(void *base)
+{
+	node_t *node = (node_t *) base;
+	queue_t *q = NULL;
+
+	assert(node);
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3,
+		"node:%d CREDIT (flags:%x, mask:%x)",
+		node->handle, node->data.flags, node->data.mask);
+
+	if (BIT_TEST(node->data.mask, DATA_MASK_QUEUE) && BIT_TEST(node->data.mask, DATA_MASK_MAX) && node->data.max > 0) {
+		assert(BUF_LENGTH(&node->data.queue) > 0);
+		if (node->sysdata->qdir)
+			q = queue_get_name(node->sysdata, expbuf_string(&node->data.queue));
+		if (q) {
+			queue_set_credit(q, node, node->data.max);
 		}
 	}
 }
@@ -634,6 +913,32 @@ void cmdMax(void *base, risp_int_t value)
 		"node:%d MAX (%d)", node->handle, value);
 }
 
+void cmdRetries(void *base, risp_int_t value)
+{
+	node_t *node= (node_t *) base;
+ 	assert(node != NULL);
+ 	assert(value >= 0 && value <= 0xff);
+	node->data.mask |= (DATA_MASK_RETRIES);
+	node->data.retries = value;
+
+	assert(node->sysdata != NULL);
+	logger(node->sysdata->logging, 3,
+		"node:%d RETRIES (%d)", node->handle, value);
+}
+
+void cmdSize(void *base, risp_int_t value)
+{
+	node_t *node= (node_t *) base;
+ 	assert(node != NULL);
+ 	assert(value >= 0);
+	node->data.mask |= (DATA_MASK_SIZE);
+	node->data.size = value;
+
+	assert(node->sysdata != NULL);
+	logger(node->sysdata->logging, 3,
+		"node:%d SIZE (%d)", node->handle, value);
+}
+
 void cmdPriority(void *base, risp_int_t value)
 {
 	node_t *node= (node_t *) base;
@@ -699,31 +1004,35 @@ void cmdPayload(void *base, risp_length_t length, risp_char_t *data)
 }
 
 
-void cmdDelivered(void *base)
+//-----------------------------------------------------------------------------
+// The node has said that it has the message we sent it.  A message can be
+// covered by more than one DELIVERED when they are cumulative, so only the
+// first one does anything.
+static void delivered_msg(node_t *node, message_t *msg)
 {
-	node_t *node = (node_t *) base;
 	msg_id_t msgid;
-	message_t *msg;
 	queue_t *q;
- 	
- 	assert(node);
-	assert(node->sysdata);
-	logger(node->sysdata->logging, 3, 
-		"node:%d DELIVERED (flags:%x, mask:%x)",
-		node->handle, node->data.flags, node->data.mask);
 
-	// get the messageID
-	assert(BIT_TEST(node->data.mask, DATA_MASK_ID));
-	msgid = node->data.id;
-	assert(msgid >= 0);
-
-	logger(node->sysdata->logging, 2, "processDelivered.  Node:%d, msg_id:%d", node->handle, msgid);
+	assert(node);
+	assert(node->sysdata);
+	assert(msg);
+	assert(msg->target_node == node);
 
-	// find message in node->out_msg
-	msg = node_findoutmsg(node, msgid);
-	if (msg == NULL) {
-		// didn't find the message that is being marked as delivered.
-		assert(0);
+	if (BIT_TEST(msg->flags, FLAG_MSG_ACKED)) {
+		return;
+	}
+	BIT_SET(msg->flags, FLAG_MSG_ACKED);
+	msgid = msg->id;
+
+	if (BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT)) {
+		// the message has already timed out, and the source has been told.  If
+		// a reply is expected, we still wait for it before the message is
+		// discarded, so the id is not re-used while the node has it.
+		logger(node->sysdata->logging, 2, "delivery(%d): message already timed out.", msgid);
+		if (BIT_TEST(msg->flags, FLAG_MSG_NOREPLY)) {
+			assert(msg->queue);
+			queue_msg_expired_done(msg->queue, msg);
+		}
 	}
 	else {
 
@@ -735,58 +1044,170 @@ void cmdDelivered(void *base)
 			// assert that message doesnt have source-node.
 			assert(msg->source_node == NULL);
 			
-			// tell the queue that the node has finished processing a message.  This
-			// will find the node, and remove it from the node_busy list.
+			// tell the queue that the node has finished processing a message.  If
+			// the node was in the busy list, it will be moved back to the ready list.
 			assert(msg->queue);
 			assert(msg->target_node);
-			queue_msg_done(msg->queue, msg->target_node);
+			queue_msg_done(msg->queue, msg);
 						
 			// then remove from the queue->msg_proc list
 			assert(msg->queue);
 			q = msg->queue;
 			ll_remove(&q->msg_proc, msg);
 			msg->queue = NULL;
+			node_inflight_remove(node, msg);
+			msg->target_node = NULL;
+
+			assert(msg->data);
+			payload_release(msg->data);
+			msg->data = NULL;
 			
 			// set action to remove the message.
 			assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
+			if (msg->jid > 0) {
+				journal_done(node->sysdata->journal, msg);
+			}
 			message_clear(msg);
-			assert(node->sysdata->msg_used > 0);
-			node->sysdata->msg_used --;
-			assert(node->sysdata->msg_used >= 0);
-			node->sysdata->msg_next = msg->id;
+			msglist_release(node->sysdata->msglist, msg);
 
 			// if there are more messages in the queue, then we need to deliver them.
 			if (ll_count(&q->msg_pending) > 0) {
 				logger(node->sysdata->logging, 2, "delivery(%d): setting delivery action.", msgid);
-				queue_deliver(q);
+				queue_schedule(q);
 			}
 			else {
 				logger(node->sysdata->logging, 2, "delivery(%d): no items to deliver.", msgid);
 			}
 		}
 		else {
-			// message is expecting a reply, so we need to tell the source that it was delivered.
-			
-			// mark the message as delivered.
-			assert(BIT_TEST(msg->flags, FLAG_MSG_DELIVERED) == 0);
-			BIT_SET(msg->flags, FLAG_MSG_DELIVERED);
-
-			// send delivery message back to source.
-			assert(msg->source_node);
-			assert(msg->source_id >= 0);
-			sendDelivered(msg->source_node, msg->source_id);
+			// message is expecting a reply, so we need to tell the source that it
+			// was delivered.  If it has been sent again after another consumer went
+			// away, the source has already been told.
+			if (BIT_TEST(msg->flags, FLAG_MSG_DELIVERED) == 0) {
+				BIT_SET(msg->flags, FLAG_MSG_DELIVERED);
+
+				// send delivery message back to source.
+				assert(msg->source_node);
+				assert(msg->source_id >= 0);
+				sendDelivered(msg->source_node, msg->source_id);
+			}
 
-			// but we dont need to original payload anymore, so we can release that back into the bufpool.
+			// but we dont need to original payload anymore, so we can release our
+			// reference to it.  Unless it might need to be sent to another consumer.
 			assert(msg->data);
-			assert(node->sysdata);
-			assert(node->sysdata->bufpool);
-			expbuf_clear(msg->data);
-			expbuf_pool_return(node->sysdata->bufpool, msg->data);
-			msg->data = NULL;
+			if (msg->retries == 0) {
+				payload_release(msg->data);
+				msg->data = NULL;
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The node has received messages that we sent it.  Usually it is the one
+// with the ID, but with CUMULATIVE it is that one and every one that was sent
+// to the node before it.  A node that can take a BATCH can also send all the
+// ids packed in a PAYLOAD instead (see RQ_CMD_BATCH).
+void cmdDelivered(void *base)
+{
+	node_t *node = (node_t *) base;
+	message_t *msg, *next;
+	expbuf_t *acks;
+	const unsigned char *ids;
+	unsigned int count, i;
+ 	
+ 	assert(node);
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3, 
+		"node:%d DELIVERED (flags:%x, mask:%x)",
+		node->handle, node->data.flags, node->data.mask);
+
+	if (BIT_TEST(node->data.mask, DATA_MASK_PAYLOAD)) {
+		acks = node->data.payload;
+		assert(acks);
+		node->data.payload = NULL;
+
+		count = 0;
+		if (BUF_LENGTH(acks) >= 4) {
+			count = batch_int((unsigned char *) BUF_DATA(acks));
+			// the count is compared with the length, rather than the other way
+			// round, so that a large count cant wrap around.
+			if (count != (BUF_LENGTH(acks) - 4) / 4 || (BUF_LENGTH(acks) - 4) % 4 != 0) {
+				logger(node->sysdata->logging, 1, "node:%d sent a DELIVERED that is not valid (len:%d), ignoring it.", node->handle, BUF_LENGTH(acks));
+				count = 0;
+			}
+		}
+
+		ids = (unsigned char *) BUF_DATA(acks) + 4;
+		for (i = 0; i < count; i++) {
+			msg = node_findoutmsg(node, batch_int(ids + (i * 4)));
+			assert(msg);
+			delivered_msg(node, msg);
+		}
+
+		assert(node->sysdata->stats);
+		node->sysdata->stats->acks_in ++;
+
+		expbuf_clear(acks);
+		expbuf_pool_return(node->sysdata->bufpool, acks);
+	}
+	else {
+		// get the messageID
+		assert(BIT_TEST(node->data.mask, DATA_MASK_ID));
+		assert(node->data.id >= 0);
+		logger(node->sysdata->logging, 2, "processDelivered.  Node:%d, msg_id:%d", node->handle, node->data.id);
+
+		// find message in node->out_msg
+		msg = node_findoutmsg(node, node->data.id);
+		assert(msg);
+
+		if (BIT_TEST(node->data.flags, DATA_FLAG_CUMULATIVE)) {
+			// the messages that are older than this one are after it in the
+			// node's list.
+			while (msg) {
+				next = msg->inflight_next;
+				delivered_msg(node, msg);
+				msg = next;
+			}
+			assert(node->sysdata->stats);
+			node->sysdata->stats->acks_in ++;
+		}
+		else {
+			delivered_msg(node, msg);
 		}
 	}
 }
 
+//-----------------------------------------------------------------------------
+// The node could not deliver a message that we sent it.  This comes from
+// another controller or worker, when the consumer it gave the message to has
+// gone away.  The message is sent to another consumer if it has retries left.
+void cmdUndelivered(void *base)
+{
+	node_t *node = (node_t *) base;
+	message_t *msg;
+
+	assert(node);
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3,
+		"node:%d UNDELIVERED (flags:%x, mask:%x)",
+		node->handle, node->data.flags, node->data.mask);
+
+	assert(BIT_TEST(node->data.mask, DATA_MASK_ID));
+	msg = node_findoutmsg(node, node->data.id);
+	assert(msg);
+	assert(msg->queue);
+
+	if (BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT)) {
+		// the source has already been told.
+		queue_msg_expired_done(msg->queue, msg);
+	}
+	else {
+		queue_msg_lost(msg->queue, msg);
+	}
+}
+
 void cmdConsuming(void *base)
 {
 	node_t *node = (node_t *) base;
@@ -801,8 +1222,49 @@ void cmdConsuming(void *base)
 	assert(BIT_TEST(node->data.mask, DATA_MASK_QUEUE));
 
 	assert(node->sysdata);
-	assert(node->sysdata->queues);
-	queue_set_id(node->sysdata->queues, expbuf_string(&node->data.queue), node->data.qid);
+	assert(node->sysdata->qdir);
+	queue_set_id(node->sysdata, expbuf_string(&node->data.queue), node->data.qid);
+}
+
+
+//-----------------------------------------------------------------------------
+// A client on the same host wants to use shared-memory rings instead of the
+// socket.  The first RING comes with the descriptors for the rings, and the
+// SIZE of each one.  The second one marks the end of what the client sends on
+// the socket.
+void cmdRing(void *base)
+{
+	node_t *node = (node_t *) base;
+
+	assert(node);
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3,
+		"node:%d RING (size:%u, flags:%x, mask:%x)",
+		node->handle, node->data.size, node->data.flags, node->data.mask);
+
+	if (node->ring == NULL) {
+		if (BIT_TEST(node->data.mask, DATA_MASK_SIZE)) {
+			node_ring_attach(node, node->data.size);
+		}
+	}
+	else if (BIT_TEST(node->flags, FLAG_NODE_RING_IN) == 0) {
+		node_ring_start(node);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The node wants a snapshot of what is going on inside the daemon.  It is
+// built and sent straight away, it doesnt need anything else to be done first.
+void cmdStats(void *base)
+{
+	node_t *node = (node_t *) base;
+
+	assert(node);
+	assert(node->sysdata);
+	logger(node->sysdata->logging, 3, "node:%d STATS", node->handle);
+
+	sendStats(node);
 }
 
 
@@ -814,20 +1276,31 @@ void command_init(risp_t *risp)
 	risp_add_command(risp, RQ_CMD_PING,         &cmdPing);
 	risp_add_command(risp, RQ_CMD_PONG,         &cmdPong);
 	risp_add_command(risp, RQ_CMD_REQUEST,      &cmdRequest);
+	risp_add_command(risp, RQ_CMD_BATCH,        &cmdBatch);
 	risp_add_command(risp, RQ_CMD_REPLY,        &cmdReply);
 	risp_add_command(risp, RQ_CMD_DELIVERED,    &cmdDelivered);
+	risp_add_command(risp, RQ_CMD_UNDELIVERED,  &cmdUndelivered);
 	risp_add_command(risp, RQ_CMD_BROADCAST,    &cmdBroadcast);
 	risp_add_command(risp, RQ_CMD_NOREPLY,      &cmdNoReply);
 	risp_add_command(risp, RQ_CMD_CONSUME,      &cmdConsume);
 	risp_add_command(risp, RQ_CMD_CANCEL_QUEUE, &cmdCancelQueue);
 	risp_add_command(risp, RQ_CMD_CONSUMING,    &cmdConsuming);
+	risp_add_command(risp, RQ_CMD_STATS,        &cmdStats);
 	risp_add_command(risp, RQ_CMD_CLOSING,      &cmdClosing);
 	risp_add_command(risp, RQ_CMD_EXCLUSIVE,    &cmdExclusive);
+	risp_add_command(risp, RQ_CMD_DURABLE,      &cmdDurable);
+	risp_add_command(risp, RQ_CMD_FORWARD,      &cmdForward);
+	risp_add_command(risp, RQ_CMD_BATCHING,     &cmdBatching);
+	risp_add_command(risp, RQ_CMD_CUMULATIVE,   &cmdCumulative);
+	risp_add_command(risp, RQ_CMD_CREDIT,       &cmdCredit);
+	risp_add_command(risp, RQ_CMD_RING,         &cmdRing);
 	risp_add_command(risp, RQ_CMD_QUEUEID,      &cmdQueueID);
 	risp_add_command(risp, RQ_CMD_ID,           &cmdId);
+	risp_add_command(risp, RQ_CMD_SIZE,         &cmdSize);
 	risp_add_command(risp, RQ_CMD_TIMEOUT,      &cmdTimeout);
 	risp_add_command(risp, RQ_CMD_MAX,          &cmdMax);
 	risp_add_command(risp, RQ_CMD_PRIORITY,     &cmdPriority);
+	risp_add_command(risp, RQ_CMD_RETRIES,      &cmdRetries);
 	risp_add_command(risp, RQ_CMD_QUEUE,        &cmdQueue);
 	risp_add_command(risp, RQ_CMD_PAYLOAD,      &cmdPayload);
 }
@@ -83,7 +83,6 @@ static void controller_connect_handler(int fd, short int flags, void *arg)
 	int error;
 	socklen_t foo;
 	struct timeval t = {.tv_sec = 1, .tv_usec = 0};
-	short int exclusive;
 
 	assert(fd >= 0);
 	assert(flags != 0);
@@ -143,17 +142,12 @@ static void controller_connect_handler(int fd, short int flags, void *arg)
 			assert(q->qid > 0);
 			assert(q->name);
 	
-			if (ll_count(&q->nodes_busy) > 0 || ll_count(&q->nodes_ready) > 0) {
+			if (q->nodes_busy.count > 0 || q->nodes_ready.count > 0) {
 				logger(((system_data_t *)ct->sysdata)->logging, 2, 
 					"Sending queue consume ('%s') to alternate controller at %s",
 					q->name, ct->target );
 
-				exclusive = 0;
-				if (BIT_TEST(q->flags, QUEUE_FLAG_EXCLUSIVE))
-					exclusive = 1;
-				
-				sendConsume(node, q->name, 1, RQ_PRIORITY_LOW, exclusive);
-				ll_push_head(&q->nodes_consuming, node);
+				queue_notify_controller(q, node);
 			}
 		}
 		ll_finish(sysdata->queues);
@@ -168,7 +162,7 @@ void controller_connect(controller_t *ct)
 {
 	evutil_socket_t sock;
 	int result;
-	int len;
+	struct timeval t = {.tv_sec = 1, .tv_usec = 0};
 
 	assert(ct);
 	assert(ct->target);
@@ -183,8 +177,8 @@ void controller_connect(controller_t *ct)
 		
 		logger(((system_data_t *)ct->sysdata)->logging, 3, "resolving controller %s.", ct->target);
 
-		len = sizeof(ct->saddr);
-		if (evutil_parse_sockaddr_port(ct->target, &ct->saddr, &len) == 0) {
+		ct->saddr_len = sizeof(ct->saddr);
+		if (rq_parse_address(ct->target, (struct sockaddr *) &ct->saddr, &ct->saddr_len) == 0) {
 			BIT_SET(ct->flags, FLAG_CONTROLLER_RESOLVED);
 		}
 		else {
@@ -198,7 +192,7 @@ void controller_connect(controller_t *ct)
 
 		BIT_SET(ct->flags, FLAG_CONTROLLER_CONNECTING);
 
-		sock = socket(AF_INET,SOCK_STREAM,0);
+		sock = socket(ct->saddr.ss_family, SOCK_STREAM, 0);
 		assert(sock >= 0);
 						
 		// Before we attempt to connect, set the socket to non-blocking mode.
@@ -206,16 +200,27 @@ void controller_connect(controller_t *ct)
 
 		logger(((system_data_t *)ct->sysdata)->logging, 3, "Attempting Remote connect to %s.", ct->target);
 
-		result = connect(sock, &ct->saddr, sizeof(struct sockaddr));
-		assert(result < 0);
-		assert(errno == EINPROGRESS);
+		result = connect(sock, (struct sockaddr *) &ct->saddr, ct->saddr_len);
 
-		// connect process has been started.  Now we need to create an event so that we know when the connect has completed.
 		assert(ct->connect_event == NULL);
 		assert(ct->sysdata);
 		assert(((system_data_t *)ct->sysdata)->evbase);
-		ct->connect_event = event_new(((system_data_t *)ct->sysdata)->evbase, sock, EV_WRITE, controller_connect_handler, ct);
-		event_add(ct->connect_event, NULL);
+		if (result == 0 || errno == EINPROGRESS) {
+			// connect process has been started (a unix socket will already be
+			// connected).  Now we need to create an event so that we know when the
+			// connect has completed.
+			ct->connect_event = event_new(((system_data_t *)ct->sysdata)->evbase, sock, EV_WRITE, controller_connect_handler, ct);
+			event_add(ct->connect_event, NULL);
+		}
+		else {
+			// a unix socket fails straight away if the controller is not there, so
+			// we wait, and try again, the same as when the connect is refused.
+			BIT_CLEAR(ct->flags, FLAG_CONTROLLER_CONNECTING);
+			BIT_SET(ct->flags, FLAG_CONTROLLER_CLOSED);
+			close(sock);
+			ct->connect_event = evtimer_new(((system_data_t *)ct->sysdata)->evbase, controller_wait_handler, (void *) ct);
+			evtimer_add(ct->connect_event, &t);
+		}
 	}
 	else {
 		assert(ct->target);
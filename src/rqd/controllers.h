@@ -15,7 +15,8 @@
 
 typedef struct {
 	char *target;
-	struct sockaddr saddr;
+	struct sockaddr_storage saddr;
+	int saddr_len;
 	void *node;
 	unsigned short flags;
 	void *sysdata;
@@ -20,6 +20,8 @@ void data_clear(data_t *data)
 	data->id = 0;
 	data->timeout = 0;
 	data->max = 0;
+	data->retries = 0;
+	data->size = 0;
 	data->priority = RQ_PRIORITY_NONE;
 	
 	expbuf_clear(&data->queue);
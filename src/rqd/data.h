@@ -16,6 +16,8 @@
 #define DATA_MASK_QUEUEID   16
 #define DATA_MASK_QUEUE     32
 #define DATA_MASK_PAYLOAD   64
+#define DATA_MASK_RETRIES   128
+#define DATA_MASK_SIZE      256
 
 // operational flags.
 // #define DATA_FLAG_REQUEST       1
@@ -29,6 +31,10 @@
 // #define DATA_FLAG_RECEIVED      512
 // #define DATA_FLAG_DELIVERED     1024
 #define DATA_FLAG_EXCLUSIVE     2048
+#define DATA_FLAG_DURABLE       4096
+#define DATA_FLAG_FORWARD       8192
+#define DATA_FLAG_BATCHING      16384
+#define DATA_FLAG_CUMULATIVE    32768
 
 
 
@@ -38,6 +44,8 @@ typedef struct {
 	short int max;
 	short int priority;
 	short int qid;
+	short int retries;
+	unsigned int size;
 	
 	expbuf_t queue;
 	expbuf_t *payload;
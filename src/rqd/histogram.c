@@ -0,0 +1,144 @@
+// histogram.c
+
+#include "histogram.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+
+//-----------------------------------------------------------------------------
+// Clear all the buckets.
+void hist_init(histogram_t *hist)
+{
+	assert(hist);
+	memset(hist, 0, sizeof(histogram_t));
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the bucket that the value goes in.  Values smaller than HIST_SUB have
+// a bucket each.  Above that, the top bit gives the power of two, and the next
+// HIST_SUB_BITS bits give the bucket within it.
+static int hist_bucket(unsigned int value)
+{
+	int bits;
+
+	if (value < HIST_SUB) {
+		return(value);
+	}
+
+	bits = 31 - __builtin_clz(value);
+	assert(bits >= HIST_SUB_BITS);
+	return(((bits - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((value >> (bits - HIST_SUB_BITS)) & (HIST_SUB - 1)));
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the highest value that goes in the bucket.
+static unsigned int hist_bucket_max(int bucket)
+{
+	int bits;
+	unsigned long long top;
+
+	assert(bucket >= 0 && bucket < HIST_BUCKETS);
+
+	if (bucket < HIST_SUB) {
+		return(bucket);
+	}
+
+	bits = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	top = ((unsigned long long) (HIST_SUB + (bucket & (HIST_SUB - 1)) + 1) << (bits - HIST_SUB_BITS)) - 1;
+	return(top > UINT_MAX ? UINT_MAX : (unsigned int) top);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a value to the histogram.  Values that are too big are counted as the
+// biggest that can be recorded.
+void hist_record(histogram_t *hist, unsigned long long value)
+{
+	unsigned int v;
+
+	assert(hist);
+
+	v = value > UINT_MAX ? UINT_MAX : (unsigned int) value;
+	hist->counts[hist_bucket(v)] ++;
+	hist->count ++;
+	hist->sum += v;
+	if (v > hist->max) { hist->max = v; }
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the counts of another histogram to this one.
+void hist_merge(histogram_t *hist, const histogram_t *other)
+{
+	int i;
+
+	assert(hist);
+	assert(other);
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		hist->counts[i] += other->counts[i];
+	}
+	hist->count += other->count;
+	hist->sum += other->sum;
+	if (other->max > hist->max) { hist->max = other->max; }
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the value that 'percent' of the recorded values are at or below.  The
+// top of the bucket is returned, but never more than the biggest value
+// recorded.
+unsigned int hist_percentile(const histogram_t *hist, unsigned int percent)
+{
+	unsigned long long target, seen;
+	unsigned int value;
+	int i;
+
+	assert(hist);
+	assert(percent <= 100);
+
+	if (hist->count == 0) {
+		return(0);
+	}
+
+	target = ((unsigned long long) hist->count * percent + 99) / 100;
+	if (target == 0) { target = 1; }
+
+	seen = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= target) {
+			value = hist_bucket_max(i);
+			return(value < hist->max ? value : hist->max);
+		}
+	}
+
+	return(hist->max);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the average of the recorded values.
+unsigned int hist_mean(const histogram_t *hist)
+{
+	assert(hist);
+	return(hist->count > 0 ? (unsigned int) (hist->sum / hist->count) : 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// The current time in microseconds, from the monotonic clock.  This is only
+// used for measuring how long things take, so it doesnt matter what it is
+// relative to.
+unsigned long long hist_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((unsigned long long) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
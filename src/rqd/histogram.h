@@ -0,0 +1,33 @@
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+// A fixed size latency histogram, in microseconds.  Values are put in
+// log-linear buckets: each power of two is split into HIST_SUB equal
+// buckets, so the value of a bucket is never out by more than 1/HIST_SUB
+// (12.5%), no matter how big the values are.  Recording a value is just an
+// increment, there is no allocation, and the whole range of an unsigned int
+// (over an hour) is covered in less than 1KB.
+
+
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+
+typedef struct {
+	unsigned int counts[HIST_BUCKETS];
+	unsigned int count;
+	unsigned int max;
+	unsigned long long sum;
+} histogram_t;
+
+
+void         hist_init(histogram_t *hist);
+void         hist_record(histogram_t *hist, unsigned long long value);
+void         hist_merge(histogram_t *hist, const histogram_t *other);
+unsigned int hist_percentile(const histogram_t *hist, unsigned int percent);
+unsigned int hist_mean(const histogram_t *hist);
+
+unsigned long long hist_now(void);
+
+#endif
@@ -0,0 +1,591 @@
+// journal.c
+
+#include "journal.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <rq.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// the header of each record in the journal.  It is followed by the queue
+// name, and then the payload.
+typedef struct {
+	unsigned char type;
+	unsigned char flags;
+	unsigned short qlength;
+	unsigned int length;
+	int timeout;
+	unsigned long long jid;
+} journal_record_t;
+
+// an enqueue record that was found while replaying the journal.  The records
+// are not aligned in the file, so the header is copied out of it.
+typedef struct {
+	journal_record_t rec;
+	char *name;
+	int done;
+} journal_entry_t;
+
+// an old segment file that is being replayed.
+typedef struct {
+	int seq;
+	char *map;
+	size_t size;
+} journal_file_t;
+
+
+//-----------------------------------------------------------------------------
+// Initialise the journal.  No segment is opened until journal_replay() is
+// called, which must be done before any records are added.
+void journal_init(journal_t *journal, const char *path, int worker, struct event_base *evbase, stats_t *stats)
+{
+	assert(journal);
+	assert(path);
+	assert(worker >= 0);
+	assert(evbase);
+	assert(stats);
+
+	journal->path = strdup(path);
+	journal->worker = worker;
+	journal->handle = INVALID_HANDLE;
+	journal->size = 0;
+	journal->head = NULL;
+	journal->tail = NULL;
+	journal->next_jid = 1;
+	ll_init(&journal->queues);
+	expbuf_init(&journal->out, 0);
+	journal->scheduled = 0;
+	journal->evbase = evbase;
+	journal->stats = stats;
+}
+
+
+//-----------------------------------------------------------------------------
+// Build the filename of a segment.
+static void journal_filename(journal_t *journal, int seq, char *filename, size_t length)
+{
+	assert(journal);
+	assert(journal->path);
+	assert(filename);
+	snprintf(filename, length, "%s/rqd-journal.%d.%d", journal->path, journal->worker, seq);
+}
+
+
+//-----------------------------------------------------------------------------
+// write out the records that are waiting, and make sure they are on disk.  If
+// they cant be written, the messages in them would not be durable, so there
+// is no point carrying on.
+static void journal_sync(journal_t *journal)
+{
+	char *data;
+	unsigned int length;
+	ssize_t sent;
+
+	assert(journal);
+	assert(journal->handle != INVALID_HANDLE);
+
+	data = BUF_DATA(&journal->out);
+	length = BUF_LENGTH(&journal->out);
+	while (length > 0) {
+		sent = write(journal->handle, data, length);
+		if (sent < 0) {
+			if (errno == EINTR) { continue; }
+			perror("journal write()");
+			exit(EXIT_FAILURE);
+		}
+		data += sent;
+		length -= sent;
+	}
+	expbuf_clear(&journal->out);
+
+	if (fdatasync(journal->handle) != 0) {
+		perror("journal fdatasync()");
+		exit(EXIT_FAILURE);
+	}
+
+	journal->stats->journal_commits ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a record to the list that will be written.
+static void journal_add(journal_t *journal, journal_record_t *rec, const char *name, char *data)
+{
+	assert(journal);
+	assert(rec);
+	assert(rec->qlength == 0 || name);
+	assert(rec->length == 0 || data);
+
+	expbuf_add(&journal->out, rec, sizeof(*rec));
+	if (rec->qlength > 0) { expbuf_add(&journal->out, (char *) name, rec->qlength); }
+	if (rec->length > 0)  { expbuf_add(&journal->out, data, rec->length); }
+	journal->size += sizeof(*rec) + rec->qlength + rec->length;
+	journal->stats->journal_records ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the record of a durable queue.
+static void journal_add_queue(journal_t *journal, const char *name)
+{
+	journal_record_t rec;
+
+	assert(journal);
+	assert(name);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = JOURNAL_RECORD_QUEUE;
+	rec.qlength = strlen(name);
+	journal_add(journal, &rec, name, NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// Start a new segment.  The durable queues are recorded at the start of each
+// segment, so they are not lost when older segments are removed.
+static void journal_open(journal_t *journal, int seq)
+{
+	journal_segment_t *seg;
+	char filename[PATH_MAX];
+	char *name;
+
+	assert(journal);
+	assert(journal->handle == INVALID_HANDLE);
+	assert(BUF_LENGTH(&journal->out) == 0);
+
+	journal_filename(journal, seq, filename, sizeof(filename));
+	journal->handle = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (journal->handle < 0) {
+		perror("journal open()");
+		exit(EXIT_FAILURE);
+	}
+	journal->size = 0;
+
+	seg = (journal_segment_t *) malloc(sizeof(journal_segment_t));
+	assert(seg);
+	seg->seq = seq;
+	seg->live = 0;
+	seg->next = NULL;
+	if (journal->tail) { journal->tail->next = seg; }
+	else               { journal->head = seg; }
+	journal->tail = seg;
+
+	ll_start(&journal->queues);
+	while ((name = ll_next(&journal->queues))) {
+		journal_add_queue(journal, name);
+	}
+	ll_finish(&journal->queues);
+}
+
+
+//-----------------------------------------------------------------------------
+// Write and sync all the records that are waiting.  After that, the oldest
+// segments can be removed if all their messages are done.  The current
+// segment is always kept.
+void journal_commit(journal_t *journal)
+{
+	journal_segment_t *seg;
+	char filename[PATH_MAX];
+
+	assert(journal);
+
+	if (BUF_LENGTH(&journal->out) > 0) {
+		journal_sync(journal);
+	}
+
+	while (journal->head != journal->tail && journal->head->live == 0) {
+		seg = journal->head;
+		journal->head = seg->next;
+		journal_filename(journal, seg->seq, filename, sizeof(filename));
+		unlink(filename);
+		free(seg);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Commit the records that were added during the last pass of the event loop.
+static void journal_commit_handler(int fd, short int flags, void *arg)
+{
+	journal_t *journal = (journal_t *) arg;
+
+	assert(fd < 0);
+	assert(journal);
+	assert(journal->scheduled != 0);
+
+	journal->scheduled = 0;
+	journal_commit(journal);
+}
+
+
+//-----------------------------------------------------------------------------
+// Make sure a commit will be done at the end of this pass of the event loop.
+static void journal_schedule(journal_t *journal)
+{
+	struct timeval t = {0, 0};
+
+	assert(journal);
+
+	if (journal->scheduled == 0) {
+		journal->scheduled = 1;
+		event_base_once(journal->evbase, -1, EV_TIMEOUT, journal_commit_handler, journal, &t);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a record, and make sure there is a commit scheduled.  If the current
+// segment is full, it is synced and a new one is started.
+static void journal_write(journal_t *journal, journal_record_t *rec, const char *name, char *data)
+{
+	assert(journal);
+	assert(journal->tail);
+
+	if (journal->size > 0 && journal->size + sizeof(*rec) + rec->qlength + rec->length > JOURNAL_SEGMENT_SIZE) {
+		journal_sync(journal);
+		close(journal->handle);
+		journal->handle = INVALID_HANDLE;
+		journal_open(journal, journal->tail->seq + 1);
+	}
+
+	journal_add(journal, rec, name, data);
+	journal_schedule(journal);
+}
+
+
+//-----------------------------------------------------------------------------
+// Record that the queue is durable.  The caller should only do this once for
+// each queue.
+void journal_queue(journal_t *journal, const char *name)
+{
+	assert(journal);
+	assert(name);
+
+	ll_push_tail(&journal->queues, strdup(name));
+	if (journal->tail) {
+		journal_add_queue(journal, name);
+		journal_schedule(journal);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Record a message that has been queued.
+void journal_enqueue(journal_t *journal, message_t *msg, const char *name)
+{
+	journal_record_t rec;
+
+	assert(journal);
+	assert(msg);
+	assert(msg->jid == 0);
+	assert(msg->data);
+	assert(msg->data->buf);
+	assert(name);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = JOURNAL_RECORD_ENQUEUE;
+	rec.flags = BIT_TEST(msg->flags, FLAG_MSG_NOREPLY) ? 1 : 0;
+	rec.qlength = strlen(name);
+	rec.length = BUF_LENGTH(msg->data->buf);
+	rec.timeout = BIT_TEST(msg->flags, FLAG_MSG_TIMEOUT) ? msg->timeout : 0;
+	rec.jid = journal->next_jid ++;
+	journal_write(journal, &rec, name, BUF_DATA(msg->data->buf));
+
+	// the record is in the current segment, which cant be removed until the
+	// message is done.
+	msg->jid = rec.jid;
+	msg->jseg = journal->tail;
+	journal->tail->live ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Record that the message is finished with, and will not need to be delivered
+// again.
+void journal_done(journal_t *journal, message_t *msg)
+{
+	journal_record_t rec;
+	journal_segment_t *seg;
+
+	assert(journal);
+	assert(msg);
+	assert(msg->jid > 0);
+	assert(msg->jseg);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = JOURNAL_RECORD_DONE;
+	rec.jid = msg->jid;
+	journal_write(journal, &rec, NULL, NULL);
+
+	seg = msg->jseg;
+	assert(seg->live > 0);
+	seg->live --;
+	msg->jid = 0;
+	msg->jseg = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+static int journal_seq_compare(const void *a, const void *b)
+{
+	return(((journal_file_t *) a)->seq - ((journal_file_t *) b)->seq);
+}
+
+
+//-----------------------------------------------------------------------------
+// Find the segment files from an earlier run, in the order they were written.
+static journal_file_t * journal_find_files(journal_t *journal, int *count)
+{
+	DIR *dir;
+	struct dirent *entry;
+	journal_file_t *files = NULL;
+	char prefix[64];
+	int size = 0;
+	int seq;
+	size_t plen;
+
+	assert(journal);
+	assert(count);
+
+	*count = 0;
+	dir = opendir(journal->path);
+	if (dir == NULL) {
+		perror("journal opendir()");
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(prefix, sizeof(prefix), "rqd-journal.%d.", journal->worker);
+	plen = strlen(prefix);
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, prefix, plen) == 0 && sscanf(entry->d_name + plen, "%d", &seq) == 1) {
+			if (*count >= size) {
+				size = size > 0 ? size * 2 : 8;
+				files = (journal_file_t *) realloc(files, sizeof(journal_file_t) * size);
+				assert(files);
+			}
+			files[*count].seq = seq;
+			files[*count].map = NULL;
+			files[*count].size = 0;
+			(*count) ++;
+		}
+	}
+	closedir(dir);
+
+	if (*count > 1) {
+		qsort(files, *count, sizeof(journal_file_t), journal_seq_compare);
+	}
+	return(files);
+}
+
+
+//-----------------------------------------------------------------------------
+// Map a segment file so that its records can be read.
+static void journal_map_file(journal_t *journal, journal_file_t *file)
+{
+	char filename[PATH_MAX];
+	struct stat st;
+	int handle;
+	void *map;
+
+	assert(journal);
+	assert(file);
+
+	journal_filename(journal, file->seq, filename, sizeof(filename));
+	handle = open(filename, O_RDONLY);
+	if (handle < 0) {
+		perror("journal open()");
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(handle, &st) == 0 && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+		if (map != MAP_FAILED) {
+			file->map = (char *) map;
+			file->size = st.st_size;
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+		}
+	}
+	close(handle);
+}
+
+
+//-----------------------------------------------------------------------------
+// find the entry with this id.  The entries are in the order they were
+// written, so they are already sorted.
+static journal_entry_t * journal_find_entry(journal_entry_t *entries, int count, unsigned long long jid)
+{
+	int low = 0, high = count - 1, mid;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (entries[mid].rec.jid == jid)     { return(&entries[mid]); }
+		else if (entries[mid].rec.jid < jid) { low = mid + 1; }
+		else                             { high = mid - 1; }
+	}
+	return(NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// Read the segments from an earlier run, and pass the durable queues and the
+// messages that were not done to the handlers.  The handlers are expected to
+// queue them again, which writes them to a new segment.  Once that is synced,
+// the old segments are removed.  A record that was only partly written when
+// the daemon stopped is ignored.  Returns the number of messages restored.
+int journal_replay(
+	journal_t *journal,
+	void (*queue_handler)(const char *name, void *arg),
+	void (*msg_handler)(const char *name, unsigned int flags, int timeout, char *data, unsigned int length, void *arg),
+	void *arg)
+{
+	journal_file_t *files;
+	journal_entry_t *entries = NULL, *entry;
+	journal_record_t rec;
+	char **queues = NULL;
+	char filename[PATH_MAX];
+	char name[256];
+	int count, nentries = 0, sentries = 0, nqueues = 0, squeues = 0;
+	int restored = 0;
+	int i;
+	size_t pos, need;
+
+	assert(journal);
+	assert(journal->tail == NULL);
+	assert(queue_handler);
+	assert(msg_handler);
+
+	files = journal_find_files(journal, &count);
+
+	for (i=0; i<count; i++) {
+		journal_map_file(journal, &files[i]);
+
+		pos = 0;
+		while (files[i].map && pos + sizeof(journal_record_t) <= files[i].size) {
+			memcpy(&rec, files[i].map + pos, sizeof(rec));
+			need = sizeof(rec) + rec.qlength + rec.length;
+			if (pos + need > files[i].size) {
+				break;
+			}
+
+			// a queue name that is too long is as bad as an unknown record, the
+			// rest of the file can not be trusted.
+			if (rec.qlength >= sizeof(name)) {
+				break;
+			}
+
+			if (rec.jid >= journal->next_jid) {
+				journal->next_jid = rec.jid + 1;
+			}
+
+			if (rec.type == JOURNAL_RECORD_QUEUE) {
+				if (nqueues >= squeues) {
+					squeues = squeues > 0 ? squeues * 2 : 8;
+					queues = (char **) realloc(queues, sizeof(char *) * squeues);
+					assert(queues);
+				}
+				queues[nqueues++] = files[i].map + pos;
+			}
+			else if (rec.type == JOURNAL_RECORD_ENQUEUE) {
+				if (nentries >= sentries) {
+					sentries = sentries > 0 ? sentries * 2 : 64;
+					entries = (journal_entry_t *) realloc(entries, sizeof(journal_entry_t) * sentries);
+					assert(entries);
+				}
+				assert(nentries == 0 || entries[nentries-1].rec.jid < rec.jid);
+				entries[nentries].rec = rec;
+				entries[nentries].name = files[i].map + pos + sizeof(rec);
+				entries[nentries].done = 0;
+				nentries ++;
+			}
+			else if (rec.type == JOURNAL_RECORD_DONE) {
+				entry = journal_find_entry(entries, nentries, rec.jid);
+				if (entry) { entry->done = 1; }
+			}
+			else {
+				// the rest of the file can not be trusted.
+				break;
+			}
+
+			pos += need;
+		}
+	}
+
+	// new records go to a segment after the old ones.
+	journal_open(journal, count > 0 ? files[count-1].seq + 1 : 1);
+
+	for (i=0; i<nqueues; i++) {
+		memcpy(&rec, queues[i], sizeof(rec));
+		memcpy(name, queues[i] + sizeof(rec), rec.qlength);
+		name[rec.qlength] = '\0';
+		queue_handler(name, arg);
+	}
+
+	for (i=0; i<nentries; i++) {
+		if (entries[i].done == 0) {
+			memcpy(name, entries[i].name, entries[i].rec.qlength);
+			name[entries[i].rec.qlength] = '\0';
+			msg_handler(name, entries[i].rec.flags, entries[i].rec.timeout,
+				entries[i].name + entries[i].rec.qlength, entries[i].rec.length, arg);
+			restored ++;
+		}
+	}
+
+	// make sure the messages are safely in the new segment before removing the
+	// old ones.
+	journal_commit(journal);
+
+	for (i=0; i<count; i++) {
+		if (files[i].map) {
+			munmap(files[i].map, files[i].size);
+		}
+		journal_filename(journal, files[i].seq, filename, sizeof(filename));
+		unlink(filename);
+	}
+
+	free(files);
+	free(entries);
+	free(queues);
+
+	return(restored);
+}
+
+
+//-----------------------------------------------------------------------------
+// Write anything that is waiting, and free the resources.  Messages that are
+// not done are left in the journal, so they will be restored next time.
+void journal_free(journal_t *journal)
+{
+	journal_segment_t *seg;
+	char *name;
+
+	assert(journal);
+
+	if (journal->handle != INVALID_HANDLE) {
+		if (BUF_LENGTH(&journal->out) > 0) {
+			journal_sync(journal);
+		}
+		close(journal->handle);
+		journal->handle = INVALID_HANDLE;
+	}
+
+	while ((seg = journal->head)) {
+		journal->head = seg->next;
+		free(seg);
+	}
+	journal->tail = NULL;
+
+	while ((name = ll_pop_head(&journal->queues))) { free(name); }
+	ll_free(&journal->queues);
+
+	expbuf_free(&journal->out);
+	free(journal->path);
+	journal->path = NULL;
+}
@@ -0,0 +1,69 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+// The journal keeps a record of the messages in durable queues, so that they
+// can be delivered again after a restart.  A record is added when a durable
+// message is queued, and another when it is done with.  The records are
+// collected during each pass of the event loop, and are written and synced
+// together when the pass is finished (group commit), rather than syncing the
+// file for every message.
+//
+// The journal is a series of segment files.  Once all the messages in the
+// oldest segment are done, the segment is removed.  When the daemon starts, the
+// messages that were not done are queued again, and written to a new segment,
+// after which the old segments are removed.
+
+#include "message.h"
+#include "stats.h"
+
+#include <event.h>
+#include <expbuf.h>
+#include <linklist.h>
+
+
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+
+#define JOURNAL_RECORD_QUEUE    'Q'			// a queue that is durable.
+#define JOURNAL_RECORD_ENQUEUE  'E'			// a message was queued.
+#define JOURNAL_RECORD_DONE     'D'			// a message is finished with.
+
+
+typedef struct __journal_segment_t {
+	int seq;
+	int live;				// messages in this segment that are not done.
+	struct __journal_segment_t *next;
+} journal_segment_t;
+
+typedef struct {
+	char *path;
+	int worker;
+	int handle;												// the current segment file.
+	unsigned int size;								// bytes in the current segment.
+	journal_segment_t *head, *tail;		// oldest segment first, the current one last.
+	unsigned long long next_jid;
+	list_t queues;										// names of the durable queues.
+
+	// records waiting for the next commit.
+	expbuf_t out;
+	int scheduled;
+
+	struct event_base *evbase;
+	stats_t *stats;
+} journal_t;
+
+
+void journal_init(journal_t *journal, const char *path, int worker, struct event_base *evbase, stats_t *stats);
+void journal_free(journal_t *journal);
+
+int  journal_replay(
+	journal_t *journal,
+	void (*queue_handler)(const char *name, void *arg),
+	void (*msg_handler)(const char *name, unsigned int flags, int timeout, char *data, unsigned int length, void *arg),
+	void *arg);
+
+void journal_queue(journal_t *journal, const char *name);
+void journal_enqueue(journal_t *journal, message_t *msg, const char *name);
+void journal_done(journal_t *journal, message_t *msg);
+void journal_commit(journal_t *journal);
+
+#endif
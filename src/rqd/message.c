@@ -21,12 +21,25 @@ void message_clear(message_t *msg)
 	
 	msg->flags = 0;
 	msg->timeout = 0;
+	msg->retries = 0;
 	msg->source_id = 0;
+	msg->queued_at = 0;
+	msg->sent_at = 0;
+
+	// if the message had a timeout that has not expired, then it needs to be
+	// removed from the timing wheel.
+	if (tw_pending(&msg->timer)) {
+		tw_cancel(&msg->timer);
+	}
 	
 	assert(msg->source_node == NULL);
 	assert(msg->target_node == NULL);
+	assert(msg->target_nq == NULL);
+	assert(msg->inflight_prev == NULL && msg->inflight_next == NULL);
 	assert(msg->queue == NULL);
 	assert(msg->data == NULL);
+	assert(msg->jid == 0);
+	assert(msg->jseg == NULL);
 }
 
 
@@ -40,12 +53,22 @@ void message_init(message_t *msg, message_id_t id)
 	msg->id = id;
 	msg->flags = 0;
 	msg->timeout = 0;
+	msg->retries = 0;
 	msg->source_id = 0;
 	
 	msg->data = NULL;
 	msg->source_node = NULL;
 	msg->target_node = NULL;
+	msg->target_nq = NULL;
+	msg->inflight_prev = NULL;
+	msg->inflight_next = NULL;
 	msg->queue = NULL;
+	msg->jid = 0;
+	msg->jseg = NULL;
+	msg->queued_at = 0;
+	msg->sent_at = 0;
+	msg->next_free = NULL;
+	tw_entry_init(&msg->timer, msg);
 }
 
 
@@ -118,10 +141,164 @@ void message_set_timeout(message_t *msg, int seconds)
 	msg->timeout = seconds;
 	BIT_SET(msg->flags, FLAG_MSG_TIMEOUT);
 
-	// set some better values, because the timeout is not very accurate.  Need to look at hte current time, and specify an expiry.  Keep in mind that the socket will only break on Timeout every 5 seconds, so any timeout smaller than that might not get actioned unless there are other messages arriving on that queue that pushes it through.
-	assert(0);
+	// the timer itself is started when the message is added to a queue.
+	assert(tw_pending(&msg->timer) == 0);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Allocate a new slab of 'count' message objects and add them to the end of
+// the list.  The new messages are put on the free-list so that the lowest id
+// will be handed out first.
+static void msglist_add_slab(msglist_t *ml, int count)
+{
+	message_t *slab;
+	int i;
+
+	assert(ml);
+	assert(count > 0);
+
+	slab = (message_t *) malloc(sizeof(message_t) * count);
+	assert(slab);
+
+	ml->slabs = (message_t **) realloc(ml->slabs, sizeof(message_t *) * (ml->slab_count + 1));
+	assert(ml->slabs);
+	ml->slabs[ml->slab_count] = slab;
+	ml->slab_count ++;
+
+	ml->list = (message_t **) realloc(ml->list, sizeof(message_t *) * (ml->max + count));
+	assert(ml->list);
+
+	for (i=count-1; i >= 0; i--) {
+		message_init(&slab[i], ml->max + i);
+		ml->list[ml->max + i] = &slab[i];
+		slab[i].next_free = ml->free;
+		ml->free = &slab[i];
+	}
+	ml->max += count;
+}
+
+
+//-----------------------------------------------------------------------------
+// Initialise the message list, and pre-fill it with a slab of empty message
+// objects.  During the running of the daemon we should assume that the list
+// exists and that there is something in it.
+void msglist_init(msglist_t *ml, int size)
+{
+	assert(ml);
+	assert(size > 0);
+
+	ml->list = NULL;
+	ml->max = 0;
+	ml->used = 0;
+	ml->free = NULL;
+	ml->slabs = NULL;
+	ml->slab_count = 0;
+
+	msglist_add_slab(ml, size);
+	assert(ml->max == size);
+}
+
+
+//-----------------------------------------------------------------------------
+// All the messages should have been processed or cancelled at this point.
+void msglist_free(msglist_t *ml)
+{
+	int i;
+
+	assert(ml);
+	assert(ml->used == 0);
+
+	for (i=0; i < ml->max; i++) {
+		assert(ml->list[i]);
+		assert(ml->list[i]->id == i);
+		message_free(ml->list[i]);
+	}
+	free(ml->list);
+	ml->list = NULL;
+	ml->max = 0;
+	ml->free = NULL;
+
+	while (ml->slab_count > 0) {
+		ml->slab_count --;
+		free(ml->slabs[ml->slab_count]);
+	}
+	free(ml->slabs);
+	ml->slabs = NULL;
 }
 
 
+//-----------------------------------------------------------------------------
+// The list is full of active messages, so add another slab that doubles the
+// size of the list.  The existing messages are not moved.
+void msglist_grow(msglist_t *ml)
+{
+	assert(ml);
+	assert(ml->max > 0);
+	assert(ml->free == NULL);
+	assert(ml->used == ml->max);
+
+	msglist_add_slab(ml, ml->max);
+	assert(ml->free);
+}
+
+
+//-----------------------------------------------------------------------------
+// Take a message object off the free-list and mark it as active.  The list
+// must have a free message available (use msglist_grow() if it doesn't).
+message_t * msglist_alloc(msglist_t *ml)
+{
+	message_t *msg;
+
+	assert(ml);
+	assert(ml->free);
+	assert(ml->used < ml->max);
+
+	msg = ml->free;
+	ml->free = msg->next_free;
+	msg->next_free = NULL;
+
+	assert(msg->flags == 0);
+	BIT_SET(msg->flags, FLAG_MSG_ACTIVE);
+
+	ml->used ++;
+	assert(ml->used <= ml->max);
+
+	return(msg);
+}
 
 
+//-----------------------------------------------------------------------------
+// Put a message that has been cleared back on the free-list.
+void msglist_release(msglist_t *ml, message_t *msg)
+{
+	assert(ml);
+	assert(msg);
+	assert(msg->flags == 0);
+	assert(msg->id >= 0 && msg->id < ml->max);
+	assert(ml->list[msg->id] == msg);
+	assert(msg->next_free == NULL);
+
+	msg->next_free = ml->free;
+	ml->free = msg;
+
+	assert(ml->used > 0);
+	ml->used --;
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the message object for an id.  Returns NULL if the id is not valid.
+message_t * msglist_get(msglist_t *ml, message_id_t id)
+{
+	assert(ml);
+
+	if (id < 0 || id >= ml->max) {
+		return(NULL);
+	}
+
+	assert(ml->list[id]);
+	assert(ml->list[id]->id == id);
+	return(ml->list[id]);
+}
@@ -3,6 +3,9 @@
 
 //---------------------------------------------------------------------
 
+#include "payload.h"
+#include "timewheel.h"
+
 #include <expbuf.h>
 #include <rq.h>
 
@@ -12,22 +15,57 @@
 #define FLAG_MSG_NOREPLY		0x04
 #define FLAG_MSG_TIMEOUT    0x08		/* set if there is a timeout specified. */
 #define FLAG_MSG_DELIVERED  0x10
+#define FLAG_MSG_TIMEDOUT   0x20		/* timed out while the target node had it. */
+#define FLAG_MSG_PEER       0x40		/* received from another worker process. */
+#define FLAG_MSG_DURABLE    0x80		/* recorded in the journal. */
+#define FLAG_MSG_HANDOVER   0x100		/* held by an exclusive consumer that has left. */
+#define FLAG_MSG_ACKED      0x200		/* the target node has said it was delivered. */
 
 
 typedef int message_id_t;
 
-typedef struct {
+struct __journal_segment_t;
+
+typedef struct __message_t {
 	message_id_t   id;
 	unsigned int   flags;					// flags that indicate various modes and settings.
-	int            timeout;				// timeout value to be counted down.
-	expbuf_t      *data;
+	int            timeout;				// timeout value (in seconds).
+	int            retries;				// times it can still be sent to another consumer.
+	tw_entry_t     timer;					// entry in the timing wheel, if there is a timeout.
+	payload_t     *data;
 	message_id_t   source_id;			// ID received from the source.
 	void          *source_node;
 	void          *target_node;
+	void          *target_nq;			// the consumer entry of target_node in the queue.
+	struct __message_t *inflight_prev, *inflight_next;	// position in the list of messages target_node has.
 	void          *queue;
+	unsigned long long jid;				// id of the journal record, if it is durable.
+	struct __journal_segment_t *jseg;	// journal segment that has the record.
+	unsigned long long queued_at;	// when it was added to the queue (microseconds).
+	unsigned long long sent_at;		// when it was sent to the consumer.
+	struct __message_t *next_free;	// link in the msglist free-list, while not active.
 } message_t;
 
 
+// The message list is used for all the requests received by the system.  The
+// message objects are allocated in slabs, and are never moved, so pointers to
+// them stay valid.  The index into the list is used as the message ID that is
+// passed to the nodes for processing.  When replies are returned, the message
+// ID is again specified so that the reply payload can be returned to the node
+// that delivered it.  Unused messages are kept in a free-list so that finding
+// one does not require searching.
+#define MSGLIST_DEFAULT_SIZE 64
+
+typedef struct {
+	message_t **list;				// indexed by message id.
+	int max;
+	int used;
+	message_t *free;				// head of the free-list.
+	message_t **slabs;
+	int slab_count;
+} msglist_t;
+
+
 
 void message_init(message_t *msg, message_id_t id);
 void message_free(message_t *msg);
@@ -39,5 +77,12 @@ void message_set_noreply(message_t *msg);
 void message_set_queue(message_t *msg, void *queue);
 void message_set_timeout(message_t *msg, int seconds);
 
+void        msglist_init(msglist_t *ml, int size);
+void        msglist_free(msglist_t *ml);
+void        msglist_grow(msglist_t *ml);
+message_t * msglist_alloc(msglist_t *ml);
+void        msglist_release(msglist_t *ml, message_t *msg);
+message_t * msglist_get(msglist_t *ml, message_id_t id);
+
 #endif
 
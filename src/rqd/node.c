@@ -13,9 +13,21 @@
 #include <evlogging.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 
+// a payload that is waiting to be sent to the node.
+typedef struct {
+	payload_t *payload;
+	int offset;				// position in the 'out' buffer where the payload is sent.
+	int sent;					// how much of the payload has been sent already.
+} node_ref_t;
+
+
+static void node_flush_schedule(node_t *node);
+
 
 //-----------------------------------------------------------------------------
 // used to initialise an invalid node structure.  The values currently in the
@@ -37,8 +49,13 @@ void node_init(node_t *node, system_data_t *sysdata)
 	assert(sysdata->bufpool != NULL);
 	
   assert(DEFAULT_BUFFSIZE > 0);
-	node->waiting = expbuf_pool_new(sysdata->bufpool, DEFAULT_BUFFSIZE);
-	node->out     = expbuf_pool_new(sysdata->bufpool, DEFAULT_BUFFSIZE);
+	node->in = NULL;
+	node->in_start = 0;
+	node->in_payload = NULL;
+	node->in_payload_length = 0;
+	node->out = expbuf_pool_new(sysdata->bufpool, DEFAULT_BUFFSIZE);
+	node->out_start = 0;
+	ll_init(&node->out_refs);
 
 	data_init(&node->data);
 	
@@ -49,18 +66,48 @@ void node_init(node_t *node, system_data_t *sysdata)
 	node->write_event = NULL;
 	node->idle = 0;
 	node->controller = NULL;
-
+	node->queues = NULL;
+	node->paused = NULL;
+	node->inflight = NULL;
+	node->acks = NULL;
+	node->bytes_in = 0;
+	node->bytes_out = 0;
+	node->msgs_in = 0;
+	node->msgs_out = 0;
+	node->ring = NULL;
+	node->ring_event = NULL;
+	node->ring_fds[0] = -1;
+	node->ring_fds[1] = -1;
+	node->ring_fds[2] = -1;
 
 	// TODO:  we should actually have a count in the node of the number of incoming and outgoing messages we are handling, so that when we delete the node, we make sure this value is 0.
 }
 
 
+//-----------------------------------------------------------------------------
+// Close the ring descriptors that the node gave us, if they were not used.
+static void node_ring_fds_close(node_t *node)
+{
+	int i;
+
+	assert(node);
+
+	for (i=0; i<3; i++) {
+		if (node->ring_fds[i] >= 0) {
+			close(node->ring_fds[i]);
+			node->ring_fds[i] = -1;
+		}
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // prepare a node for de-allocation.  This means freeing buffers too.
 void node_free(node_t *node)
 {
 	assert(node != NULL);
 	system_data_t *sysdata;
+	node_ref_t *ref;
 	
 	assert(node != NULL);
 	assert(node->out != NULL);
@@ -70,6 +117,7 @@ void node_free(node_t *node)
 	
 	assert(sysdata->bufpool != NULL);
 	assert(node->controller == NULL);
+	assert(node->paused == NULL);
 
 	node->flags = 0;
 	
@@ -82,20 +130,56 @@ void node_free(node_t *node)
 	}
 
 	assert(node->write_event == NULL);
+
+	if (node->ring_event) {
+		event_del(node->ring_event);
+		event_free(node->ring_event);
+		node->ring_event = NULL;
+	}
+	if (node->ring) {
+		rq_ring_free(node->ring);
+		free(node->ring);
+		node->ring = NULL;
+	}
+	node_ring_fds_close(node);
 	
 	assert(node->out);
 	expbuf_clear(node->out);
 	expbuf_pool_return(sysdata->bufpool, node->out);
 	node->out = NULL;
+
+	// the acks that were not sent are not needed anymore.
+	if (node->acks) {
+		expbuf_clear(node->acks);
+		expbuf_pool_return(sysdata->bufpool, node->acks);
+		node->acks = NULL;
+	}
+
+	// release any payloads that were not sent.
+	while ((ref = ll_pop_head(&node->out_refs))) {
+		payload_release(ref->payload);
+		free(ref);
+	}
+	ll_free(&node->out_refs);
 	
-	assert(node->waiting);
-	expbuf_clear(node->waiting);
-	expbuf_pool_return(sysdata->bufpool, node->waiting);
-	node->waiting = NULL;
+	if (node->in) {
+		expbuf_clear(node->in);
+		expbuf_pool_return(sysdata->bufpool, node->in);
+		node->in = NULL;
+		node->in_start = 0;
+	}
+
+	if (node->in_payload) {
+		expbuf_clear(node->in_payload);
+		expbuf_pool_return(sysdata->bufpool, node->in_payload);
+		node->in_payload = NULL;
+		node->in_payload_length = 0;
+	}
 
 	// make sure that this node has been removed from all consumer queues.
 	if (node->sysdata->queues)
 		queue_cancel_node(node);
+	assert(node->queues == NULL);
 	
 	assert(node->data.payload == NULL);
 	data_clear(&node->data);
@@ -147,6 +231,24 @@ static void node_closed(node_t *node)
 		queue_cancel_node(node);
 	}
 
+	// the messages the node did not finish are sent to other consumers, or
+	// returned to their source.
+	queue_node_lost(node);
+
+	// there is nothing more to send.
+	if (BIT_TEST(node->flags, FLAG_NODE_FLUSH)) {
+		assert(node->sysdata->flushlist);
+		ll_remove(node->sysdata->flushlist, node);
+		BIT_CLEAR(node->flags, FLAG_NODE_FLUSH);
+	}
+
+	// there is nothing more to read, so it doesnt need to wait for the queues.
+	if (node->paused) {
+		ll_remove(node->paused, node);
+		node->paused = NULL;
+		BIT_CLEAR(node->flags, FLAG_NODE_PAUSED);
+	}
+
 	if (node->write_event) {
 		event_del(node->write_event);
 		event_free(node->write_event);
@@ -168,6 +270,13 @@ static void node_closed(node_t *node)
 	assert(ll_count(sysdata->nodelist) > 0);
 	ll_remove(sysdata->nodelist, node);
 
+	// now that the connection has gone, we might be able to accept another.
+	if (BIT_TEST(node->flags, FLAG_NODE_ACCEPTED)) {
+		assert(sysdata->connections > 0);
+		sysdata->connections --;
+		server_resume(sysdata);
+	}
+
 	// free the resources used by the node.
 	node_free(node);
 	free(node);
@@ -176,87 +285,767 @@ static void node_closed(node_t *node)
 
 
 //-----------------------------------------------------------------------------
-// write out data to the socket.  If we have data waiting in the 'out' buffer,
-// then we will just add this data to it.  If the out buffer is empty, then we
-// will attempt to send this to the socket now.  If there is any data that
-// wasn't sent, then it will be put in the out-buffer.
-void node_write_now(node_t *node, int length, char *data)
+// Add a reference to the payload to the outgoing data of the node.  It will be
+// sent after the data that is currently in the 'out' buffer.  'sent' is the
+// number of bytes of the payload that have already been sent.
+static void node_ref_add(node_t *node, payload_t *payload, int sent)
+{
+	node_ref_t *ref;
+
+	assert(node);
+	assert(payload);
+	assert(sent >= 0 && sent < BUF_LENGTH(payload->buf));
+
+	ref = (node_ref_t *) malloc(sizeof(node_ref_t));
+	assert(ref);
+	ref->payload = payload;
+	ref->offset = BUF_LENGTH(node->out);
+	ref->sent = sent;
+	payload_ref(payload);
+
+	ll_push_tail(&node->out_refs, ref);
+}
+
+
+//-----------------------------------------------------------------------------
+// Fill out the iovec array with the outgoing data of the node, in the order
+// it needs to be sent.  Returns the number of entries used, and the number of
+// bytes they cover in 'total'.
+static int node_out_iov(node_t *node, struct iovec *iov, int max, int *total)
+{
+	node_ref_t *ref;
+	int count = 0;
+	int pos;
+
+	assert(node);
+	assert(iov);
+	assert(max > 1);
+	assert(total);
+
+	*total = 0;
+	pos = node->out_start;
+
+	ll_start(&node->out_refs);
+	while (count < max - 1 && (ref = ll_next(&node->out_refs))) {
+		assert(ref->offset >= pos);
+		if (ref->offset > pos) {
+			iov[count].iov_base = BUF_DATA(node->out) + pos;
+			iov[count].iov_len  = ref->offset - pos;
+			*total += iov[count].iov_len;
+			count ++;
+			pos = ref->offset;
+		}
+		if (count < max) {
+			iov[count].iov_base = BUF_DATA(ref->payload->buf) + ref->sent;
+			iov[count].iov_len  = BUF_LENGTH(ref->payload->buf) - ref->sent;
+			*total += iov[count].iov_len;
+			count ++;
+		}
+	}
+	ll_finish(&node->out_refs);
+
+	if (ref == NULL && count < max && BUF_LENGTH(node->out) > pos) {
+		iov[count].iov_base = BUF_DATA(node->out) + pos;
+		iov[count].iov_len  = BUF_LENGTH(node->out) - pos;
+		*total += iov[count].iov_len;
+		count ++;
+	}
+
+	assert(count > 0);
+	return(count);
+}
+
+
+//-----------------------------------------------------------------------------
+// 'length' bytes of the outgoing data has been sent.  Rather than moving the
+// rest of the 'out' buffer down each time, we keep track of where the unsent
+// data starts.  The buffer is emptied once everything has been sent, and the
+// unsent data is only moved down when more than half of the buffer has been
+// sent.
+static void node_out_consume(node_t *node, int length)
+{
+	node_ref_t *ref;
+	int used;				// position reached in the 'out' buffer.
+	int avail;
+
+	assert(node);
+	assert(length > 0);
+
+	used = node->out_start;
+	while (length > 0) {
+		ref = ll_get_head(&node->out_refs);
+		avail = (ref ? ref->offset : BUF_LENGTH(node->out)) - used;
+		assert(avail >= 0);
+		if (avail > 0) {
+			if (avail > length) { avail = length; }
+			used += avail;
+			length -= avail;
+		}
+		else {
+			// we are at a payload.
+			assert(ref);
+			avail = BUF_LENGTH(ref->payload->buf) - ref->sent;
+			assert(avail > 0);
+			if (avail > length) { avail = length; }
+			ref->sent += avail;
+			length -= avail;
+
+			if (ref->sent == BUF_LENGTH(ref->payload->buf)) {
+				ll_pop_head(&node->out_refs);
+				payload_release(ref->payload);
+				free(ref);
+			}
+		}
+	}
+
+	assert(used <= BUF_LENGTH(node->out));
+	if (used == BUF_LENGTH(node->out) && ll_count(&node->out_refs) == 0) {
+		expbuf_clear(node->out);
+		used = 0;
+	}
+	else if (used > BUF_MAX(node->out) / 2) {
+		expbuf_purge(node->out, used);
+		ll_start(&node->out_refs);
+		while ((ref = ll_next(&node->out_refs))) {
+			assert(ref->offset >= used);
+			ref->offset -= used;
+		}
+		ll_finish(&node->out_refs);
+		used = 0;
+	}
+	node->out_start = used;
+}
+
+
+//-----------------------------------------------------------------------------
+// The node could not be written to, so close it.
+static void node_write_failed(node_t *node, int res)
+{
+	assert(node);
+	assert(res <= 0);
+	
+	if (res == 0) {
+		logger(node->sysdata->logging, 2, 
+			"Node[%d] closed while writing.", node->handle);
+	}
+	else {
+		logger(node->sysdata->logging, 2, 
+			"Node[%d] closed while writing - because of error: %d", node->handle, errno);
+		close(node->handle);
+	}
+	assert(node->out);
+	node->handle = INVALID_HANDLE;
+	node_closed(node);
+}
+
+
+//-----------------------------------------------------------------------------
+// Everything that was waiting for the socket has been sent, so the RING reply
+// is sent to tell the node that the rest will come thru the ring, and we start
+// using it.  If the socket wont take it, we just stay on the socket.
+static void node_ring_ack(node_t *node)
+{
+	char buf[2];
+	int res;
+
+	assert(node);
+	assert(node->ring);
+	assert(BIT_TEST(node->flags, FLAG_NODE_RING_OUT) == 0);
+	assert(node->write_event == NULL);
+
+	BIT_CLEAR(node->flags, FLAG_NODE_RING_ACK);
+
+	buf[0] = RQ_CMD_CLEAR;
+	buf[1] = RQ_CMD_RING;
+	res = write(node->handle, buf, 2);
+	if (res == 2) {
+		node->bytes_out += res;
+		BIT_SET(node->flags, FLAG_NODE_RING_OUT);
+		node->sysdata->stats->rings ++;
+		logger(node->sysdata->logging, 2, "Node[%d] is using shared-memory rings.", node->handle);
+	}
+	else {
+		logger(node->sysdata->logging, 2, "Node[%d] could not start using shared-memory rings.", node->handle);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Write as much of the outgoing data as the socket will take, using as few
+// writes as we can.  If there is anything left, the write event is set so that
+// we know when we can send more, otherwise it is removed.  Returns -1 if the
+// write failed and the node has been closed (and freed), otherwise 0.
+int node_flush(node_t *node)
 {
 	stats_t *stats;
+	struct iovec iov[NODE_MAX_IOV];
+	int count, total;
 	int res;
-	
+
+	assert(node);
+	assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE));
+	assert(node->sysdata);
+	assert(node->out);
+	assert(node->handle != INVALID_HANDLE);
+
+	stats = node->sysdata->stats;
+	assert(stats);
+
+	while (BUF_LENGTH(node->out) > node->out_start || ll_count(&node->out_refs) > 0) {
+		count = node_out_iov(node, iov, NODE_MAX_IOV, &total);
+		assert(total > 0);
+
+		if (BIT_TEST(node->flags, FLAG_NODE_RING_OUT)) {
+			res = rq_ring_write(node->ring, iov, count);
+			if (node->ring->corrupt) {
+				logger(node->sysdata->logging, 1,
+					"Node[%d] has corrupted the shared-memory ring.", node->handle);
+			}
+		}
+		else {
+			res = writev(node->handle, iov, count);
+		}
+		stats->out_writes ++;
+		if (res > 0) {
+			assert(res <= total);
+			stats->out_bytes += res;
+			node->bytes_out += res;
+			node_out_consume(node, res);
+
+			// if the socket didnt take everything, then it is full.
+			if (res < total) {
+				break;
+			}
+		}
+		else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			node_write_failed(node, res);
+			return(-1);
+		}
+		else {
+			break;
+		}
+	}
+
+	assert(node->out);
+	if (BUF_LENGTH(node->out) > node->out_start || ll_count(&node->out_refs) > 0) {
+		// we have ended up with data waiting, so we need to set the event so
+		// that we can be notified when it is safe to send more.  With the ring,
+		// the node wakes us when it has made room.
+		if (node->write_event == NULL && BIT_TEST(node->flags, FLAG_NODE_RING_OUT) == 0) {
+			assert(node->sysdata->evbase);
+			node->write_event = event_new(node->sysdata->evbase, node->handle, EV_WRITE | EV_PERSIST, node_write_handler, (void *)node);
+			event_add(node->write_event, 0);
+		}
+	}
+	else {
+		if (node->write_event) {
+			// we have sent everything, so we can remove the write event for this node.
+			event_del(node->write_event);
+			event_free(node->write_event);
+			node->write_event = NULL;
+		}
+
+		if (BIT_TEST(node->flags, FLAG_NODE_RING_ACK)) {
+			node_ring_ack(node);
+		}
+
+		// acks that were added while we were waiting for the socket still need
+		// to go.
+		if (node->acks && BUF_LENGTH(node->acks) > 0) {
+			node_flush_schedule(node);
+		}
+	}
+
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Flush all the nodes that were given data to send during this pass of the
+// event loop.
+static void node_flush_handler(int fd, short int flags, void *arg)
+{
+	system_data_t *sysdata = (system_data_t *) arg;
+	node_t *node;
+
+	assert(fd == -1);
+	assert(sysdata);
+	assert(sysdata->flushlist);
+	assert(sysdata->flush_scheduled != 0);
+
+	sysdata->flush_scheduled = 0;
+	while ((node = ll_pop_head(sysdata->flushlist))) {
+		assert(BIT_TEST(node->flags, FLAG_NODE_FLUSH));
+
+		// the acks collected during the pass go out with everything else.
+		if (node->acks && BUF_LENGTH(node->acks) > 0) {
+			sendAcks(node);
+		}
+
+		BIT_CLEAR(node->flags, FLAG_NODE_FLUSH);
+		node_flush(node);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The node has data to send.  Rather than writing it now, the node is added to
+// the flush list, so that everything that is sent to it while processing the
+// current events goes out together at the end.  If we are already waiting for
+// the socket to be writable, then the write event will take care of it.
+static void node_flush_schedule(node_t *node)
+{
+	system_data_t *sysdata;
+	struct timeval t = {0, 0};
+
+	assert(node);
+	assert(node->sysdata);
+
+	if (BIT_TEST(node->flags, FLAG_NODE_FLUSH) || node->write_event) {
+		return;
+	}
+
+	sysdata = node->sysdata;
+	assert(sysdata->flushlist);
+	BIT_SET(node->flags, FLAG_NODE_FLUSH);
+	ll_push_tail(sysdata->flushlist, node);
+
+	if (sysdata->flush_scheduled == 0) {
+		assert(sysdata->evbase);
+		sysdata->flush_scheduled = 1;
+		event_base_once(sysdata->evbase, -1, EV_TIMEOUT, node_flush_handler, (void *) sysdata, &t);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// add data to the outgoing buffer of the node.  It will be sent when the node
+// is flushed at the end of this pass of the event loop.
+void node_write_now(node_t *node, int length, char *data)
+{
 	assert(node);
 	assert(length > 0);
 	assert(data);
 
+	node_write_payload(node, length, data, NULL, 0, NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// add a header, a payload and a trailer to the outgoing data of the node.  The
+// header and trailer are copied into the 'out' buffer.  Large payloads are not
+// copied, the node will keep a reference to it until it has been sent.  Small
+// ones are copied along with the header, so that a lot of small messages do
+// not use up the iovecs of each write.
+void node_write_payload(node_t *node, int hlength, char *header, payload_t *payload, int tlength, char *trailer)
+{
+	stats_t *stats;
+	int plength;
+	
+	assert(node);
+	assert(hlength > 0);
+	assert(header);
+	assert((tlength == 0 && trailer == NULL) || (tlength > 0 && trailer));
+
 	assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE));
 	assert(node->sysdata);
 	assert(node->sysdata->stats);
-	assert(node->sysdata->bufpool);
+	assert(node->out);
 	
 	stats = node->sysdata->stats;
+	stats->out_frames ++;
+	node->msgs_out ++;
 
-	assert(node->out);
-	if (node->out && node->out->length > 0) {
-		// we already have data in the outbuffer, so we will add this new data to
-		// it, and wait for the event to fire.
-		assert(node->write_event);
-		expbuf_add(node->out, data, length);
+	plength = payload ? BUF_LENGTH(payload->buf) : 0;
+
+	expbuf_add(node->out, header, hlength);
+	stats->out_copied += hlength + tlength;
+	if (plength > 0) {
+		if (plength < NODE_OUT_COPY) {
+			expbuf_add(node->out, BUF_DATA(payload->buf), plength);
+			stats->out_copied += plength;
+		}
+		else {
+			node_ref_add(node, payload, 0);
+			stats->out_referenced += plength;
+		}
+	}
+	if (tlength > 0) { expbuf_add(node->out, trailer, tlength); }
+
+	node_flush_schedule(node);
+}
+
+
+//-----------------------------------------------------------------------------
+// Make sure the node has a receive buffer with some free space at the end.
+// The commands that have already been processed are dropped from the front
+// first, which only moves the part of a command that has not all arrived
+// yet.  If the buffer is still full, it is moved up to the next size.
+static void node_in_prepare(node_t *node)
+{
+	expbuf_t *in;
+	unsigned int left;
+
+	assert(node);
+	assert(node->sysdata);
+	assert(node->sysdata->bufpool);
+
+	if (node->in == NULL) {
+		node->in = expbuf_pool_new(node->sysdata->bufpool, NODE_IN_MIN);
+		assert(node->in);
+		assert(node->in->length == 0);
+		assert(node->in_start == 0);
+		if (node->in->max < NODE_IN_MIN) {
+			expbuf_shrink(node->in, NODE_IN_MIN);
+		}
+	}
+
+	in = node->in;
+	assert(in->length <= in->max);
+	assert(node->in_start <= in->length);
+
+	if (node->in_start > 0 && in->max - in->length < NODE_IN_MIN / 4) {
+		left = in->length - node->in_start;
+		if (left > 0) {
+			memmove(in->data, in->data + node->in_start, left);
+		}
+		in->length = left;
+		node->in_start = 0;
+	}
+
+	if (in->length == in->max) {
+		expbuf_shrink(in, in->max);
+		assert(in->max > in->length);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The large payload that was being read into its own buffer has all arrived.
+// The buffer is given to the node data, exactly as if the PAYLOAD command had
+// been processed, so that the message will take it over without copying it.
+static void node_in_payload_done(node_t *node)
+{
+	assert(node);
+	assert(node->in_payload);
+	assert(node->in_payload->length == node->in_payload_length);
+	assert(node->data.payload == NULL);
+	assert(BIT_TEST(node->data.mask, DATA_MASK_PAYLOAD) == 0);
+
+	node->data.payload = node->in_payload;
+	BIT_SET(node->data.mask, DATA_MASK_PAYLOAD);
+	node->in_payload = NULL;
+	node->in_payload_length = 0;
+
+	assert(node->sysdata);
+	assert(node->sysdata->stats);
+	node->sysdata->stats->in_adopted ++;
+
+	logger(node->sysdata->logging, 3,
+		"node:%d PAYLOAD (len:%d, flags:%x, mask:%x)",
+			node->handle,
+			node->data.payload->length,
+			node->data.flags,
+			node->data.mask);
+}
+
+
+//-----------------------------------------------------------------------------
+// Process the commands in the receive buffer, straight from where they were
+// read.  If what is left over is the start of a large payload, the rest of
+// the payload will be read directly into a buffer of its own.
+static void node_in_process(node_t *node)
+{
+	expbuf_t *in;
+	unsigned int left, length;
+	unsigned char *ptr;
+	int res;
+
+	assert(node);
+	assert(node->sysdata);
+	assert(node->sysdata->risp);
+	assert(node->in_payload == NULL);
+
+	in = node->in;
+	assert(in);
+	assert(node->in_start <= in->length);
+
+	left = in->length - node->in_start;
+	if (left > 0) {
+		res = risp_process(node->sysdata->risp, node, left, (unsigned char *) in->data + node->in_start);
+		assert(res >= 0 && res <= left);
+		node->in_start += res;
+		left -= res;
+	}
+
+	if (left == 0) {
+		in->length = 0;
+		node->in_start = 0;
+	}
+	else if (left >= 5) {
+		ptr = (unsigned char *) in->data + node->in_start;
+		if (ptr[0] == RQ_CMD_PAYLOAD) {
+			length = (ptr[1] << 24) + (ptr[2] << 16) + (ptr[3] << 8) + ptr[4];
+			if (length >= NODE_IN_DIRECT) {
+				assert(left - 5 < length);
+				assert(node->sysdata->bufpool);
+				node->in_payload = expbuf_pool_new(node->sysdata->bufpool, length);
+				assert(node->in_payload);
+				assert(node->in_payload->length == 0);
+				if (node->in_payload->max < length) {
+					expbuf_shrink(node->in_payload, length);
+				}
+				node->in_payload_length = length;
+				if (left > 5) {
+					expbuf_add(node->in_payload, ptr + 5, left - 5);
+				}
+				in->length = 0;
+				node->in_start = 0;
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Keep the descriptors for the shared-memory rings that came with the data
+// the node sent.  The RING command that they came with will attach them.
+static void node_recv_fds(node_t *node, struct msghdr *mh)
+{
+	struct cmsghdr *cm;
+	int *fds;
+	int count, i;
+
+	assert(node);
+	assert(mh);
+
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			fds = (int *) CMSG_DATA(cm);
+			count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (count == 3 && node->ring_fds[0] < 0) {
+				for (i=0; i<3; i++) {
+					node->ring_fds[i] = fds[i];
+				}
+			}
+			else {
+				for (i=0; i<count; i++) {
+					close(fds[i]);
+				}
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Read from the node into the iovecs.  Once the node has moved over to the
+// ring, the data is read from there, giving it a little while to arrive if the
+// ring is empty.  A node on the unix socket may pass us the descriptors for
+// the rings, so recvmsg is used to collect them until they are attached.
+static int node_recv(node_t *node, struct iovec *iov, int count)
+{
+	struct msghdr mh;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	int res;
+
+	assert(node);
+	assert(iov);
+	assert(count > 0);
+
+	if (BIT_TEST(node->flags, FLAG_NODE_RING_IN)) {
+		assert(node->ring);
+		res = rq_ring_read(node->ring, iov, count);
+		if (res < 0 && rq_ring_wait(node->ring)) {
+			res = rq_ring_read(node->ring, iov, count);
+		}
+		if (node->ring->corrupt) {
+			logger(node->sysdata->logging, 1,
+				"Node[%d] has corrupted the shared-memory ring.", node->handle);
+		}
+	}
+	else if (BIT_TEST(node->flags, FLAG_NODE_UNIX) && node->ring == NULL) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = count;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		res = recvmsg(node->handle, &mh, MSG_CMSG_CLOEXEC);
+		if (res > 0 && mh.msg_controllen > 0) {
+			node_recv_fds(node, &mh);
+		}
 	}
 	else {
-		// nothing already in the out-buffer, so we can try and send it now.
+		res = readv(node->handle, iov, count);
+	}
 
-		assert(node->handle != INVALID_HANDLE);
-		res = send(node->handle, data, length, 0);
+	return(res);
+}
+
+
+//-----------------------------------------------------------------------------
+// Read what the node has sent us straight into its receive buffer, and
+// process the commands from there.  A large payload is read directly into the
+// buffer that the message will use, along with whatever follows it.  Returns
+// -1 if the node has been closed (and freed), otherwise 0.
+static int node_receive(node_t *node)
+{
+	int res, empty;
+	int count, space;
+	unsigned int need;
+	stats_t *stats;
+	struct iovec iov[2];
+	expbuf_t *in;
+
+	assert(node);
+	assert(node->sysdata);
+	assert(node->sysdata->stats);
+
+	stats = node->sysdata->stats;
+
+	// if the node gets paused while processing the data, we stop reading, and
+	// leave the rest in the socket (or the ring).
+	empty = 0;
+	while (empty == 0 && BIT_TEST(node->flags, FLAG_NODE_PAUSED) == 0) {
+		assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE));
+		assert(node->handle >= 0);
+
+		node_in_prepare(node);
+		in = node->in;
+		assert(in && in->max > in->length);
+
+		count = 0;
+		space = 0;
+		need = 0;
+		if (node->in_payload) {
+			assert(node->in_payload->length < node->in_payload_length);
+			need = node->in_payload_length - node->in_payload->length;
+			iov[count].iov_base = node->in_payload->data + node->in_payload->length;
+			iov[count].iov_len = need;
+			space += need;
+			count ++;
+		}
+		iov[count].iov_base = in->data + in->length;
+		iov[count].iov_len = in->max - in->length;
+		space += in->max - in->length;
+		count ++;
+		
+		res = node_recv(node, iov, count);
 		if (res > 0) {
-			// we managed to send some, or maybe all....
-			assert(res <= length);
-			stats->out_bytes += res;
-			if (res < length) {
-				// not everything was sent, so we need to put the remainder in the 'out' queue.
-				expbuf_add(node->out, &data[res], length-res);
-				assert(node->out->length > 0);
-			
-				// we have ended up with data in the out-buffer, so we need to set the
-				// event so that we can be notified when it is safe to send more.
-				assert(node->write_event == NULL);
-				assert(node->sysdata->evbase);
-				node->write_event = event_new(node->sysdata->evbase, node->handle, EV_WRITE | EV_PERSIST, node_write_handler, (void *)node);
-				event_add(node->write_event, 0);
+			assert(res <= space);
+			stats->in_bytes += res;
+			node->bytes_in += res;
+
+			// if we filled all the space we had, there is probably more to read.
+			// The receive buffer goes up a size for next time.  The ring is read
+			// until it is empty, so that the node knows to wake us.
+			if (res == space) {
+				if (in->max < NODE_IN_MAX) {
+					expbuf_shrink(in, (in->max * 2) - in->length);
+				}
+				assert(empty == 0);
+			}
+			else if (BIT_TEST(node->flags, FLAG_NODE_RING_IN) == 0) { empty = 1; }
+
+			if (node->in_payload) {
+				if ((unsigned int) res < need) {
+					node->in_payload->length += res;
+					res = 0;
+				}
+				else {
+					node->in_payload->length += need;
+					res -= need;
+					node_in_payload_done(node);
+				}
+			}
+			in->length += res;
+
+			if (node->in_payload == NULL) {
+				node_in_process(node);
+			}
+
+			// a node that has broken the protocol cant be answered properly.
+			if (BIT_TEST(node->flags, FLAG_NODE_INVALID)) {
+				logger(node->sysdata->logging, 1,
+					"Node[%d] closed because it did not follow the protocol.", node->handle);
+				close(node->handle);
+				node->handle = INVALID_HANDLE;
+				node_closed(node);
+				return(-1);
 			}
-		}
-		else if (res == 0) {
-			logger(node->sysdata->logging, 2, 
-				"Node[%d] closed while writing.", node->handle);
-			assert(node->out);
-			node->handle = INVALID_HANDLE;
-			node_closed(node);
-			assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE) == 0);
 		}
 		else {
-			assert(res == -1);
-			if (errno != EAGAIN && errno != EWOULDBLOCK) {
-				logger(node->sysdata->logging, 2, 
-					"Node[%d] closed while writing - because of error: %d", node->handle, errno);
-				close(node->handle);
+
+			// either the socket has closed, or it would have blocked, even
+			// though we got an event to say it is ready.
+		
+			assert(empty == 0);
+			empty = 1;
+			
+			if (res == 0) {
+				logger(node->sysdata->logging, 3, 
+					"Node[%d] closed while reading.", node->handle);
+				assert(node->out);
 				node->handle = INVALID_HANDLE;
 				node_closed(node);
-				assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE) == 0);
+				return(-1);
+			}
+			else {
+				assert(res == -1);
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					logger(node->sysdata->logging, 3, 
+						"Node[%d] closed while reading- because of error: %d", node->handle, errno);
+					close(node->handle);
+					node->handle = INVALID_HANDLE;
+					node_closed(node);
+					return(-1);
+				}
 			}
 		}
 	}
+
+	return(0);
 }
 
 
+//-----------------------------------------------------------------------------
+// Once the node is using the ring, nothing more comes in on the socket, so it
+// only becomes readable when the node has closed it.  Whatever the node put
+// in the ring before that is processed first.  If we have to stop reading
+// part way thru, the socket is left until we start again.
+static void node_ring_closed(node_t *node)
+{
+	char buf[1];
+	int res;
+
+	assert(node);
+	assert(node->ring);
+
+	res = read(node->handle, buf, 1);
+	assert(res <= 0);
+	if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		// a corrupt ring will have closed the node already.
+		if (node_receive(node) < 0) {
+			return;
+		}
+		if (BIT_TEST(node->flags, FLAG_NODE_PAUSED) == 0) {
+			logger(node->sysdata->logging, 3, 
+				"Node[%d] closed while using shared-memory rings.", node->handle);
+			close(node->handle);
+			node->handle = INVALID_HANDLE;
+			node_closed(node);
+		}
+	}
+}
+
 
 //-----------------------------------------------------------------------------
-// this function is called when we have received data on our node socket.
+// this function is called when we have received data on our node socket, or
+// when it has been idle for a while.
 void node_read_handler(int hid, short flags, void *data)
 {
 	node_t *node = (node_t *) data;
-	int res, empty;
 	stats_t *stats;
-	expbuf_t *in;
 
 	assert(hid >= 0);
 	assert(node);
@@ -267,9 +1056,6 @@ void node_read_handler(int hid, short flags, void *data)
 	assert(node->sysdata->bufpool);
 	assert(node->read_event);
 
-	assert(node->sysdata->in_buf);
-	in = node->sysdata->in_buf;
-	
 	stats = node->sysdata->stats;
 	assert(stats);
 
@@ -285,111 +1071,176 @@ void node_read_handler(int hid, short flags, void *data)
 		else if (node->idle == 6) {
 			BIT_SET(node->flags, FLAG_NODE_BUSY);
 		} 
+
+		// we dont need to hold on to an empty receive buffer while the node is idle.
+		if (node->in && node->in_start == node->in->length) {
+			expbuf_clear(node->in);
+			expbuf_pool_return(node->sysdata->bufpool, node->in);
+			node->in = NULL;
+			node->in_start = 0;
+		}
 	}
 	else {
 		assert(flags & EV_READ);
 
 		stats->re ++;
 
-		// if we have data, then obviously we are not idle...
+		if (BIT_TEST(node->flags, FLAG_NODE_RING_IN)) {
+			node_ring_closed(node);
+		}
+		else {
+			// if we have data, then obviously we are not idle...
+			assert(node->idle >= 0);
+			node->idle = 0;
+			node_receive(node);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The node has woken us thru the eventfd, either because there is data for us
+// in the ring, or because it has made room for the data we have waiting.
+static void node_ring_handler(int fd, short flags, void *data)
+{
+	node_t *node = (node_t *) data;
+
+	assert(fd >= 0);
+	assert(node);
+	assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE));
+	assert(node->sysdata);
+	assert(node->sysdata->stats);
+	assert(node->ring);
+	assert(node->ring->wake_fd == fd);
+
+	node->sysdata->stats->ring_wakes ++;
+	rq_ring_woken(node->ring);
+
+	if (BIT_TEST(node->flags, FLAG_NODE_RING_OUT) && (BUF_LENGTH(node->out) > node->out_start || ll_count(&node->out_refs) > 0)) {
+		if (node_flush(node) < 0) {
+			// the node has been closed.
+			return;
+		}
+	}
+
+	if (BIT_TEST(node->flags, FLAG_NODE_RING_IN) && BIT_TEST(node->flags, FLAG_NODE_PAUSED) == 0) {
 		assert(node->idle >= 0);
 		node->idle = 0;
-	
-		empty = 0;
-		while (empty == 0) {
-			assert(in->length == 0 && in->max > 0 && in->data != NULL);
-			assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE));
-			assert(node->handle >= 0);
-			
-			res = read(node->handle, in->data, in->max);
-			if (res > 0) {
-				assert(res <= in->max);
-				stats->in_bytes += res;
-				in->length = res;
-	
-				// if we pulled out the max we had avail in our buffer, that means we
-				// can pull out more at a time, so increase our incoming buffer.
-				if (res == in->max) {
-					expbuf_shrink(in, in->max + DEFAULT_BUFFSIZE);
-					assert(empty == 0);
-				}
-				else { empty = 1; }
-	
-				assert(node->waiting);
-				if (node->waiting->length > 0) {
-					// we have data left in the in-buffer, so we add the content of the node->in buffer
-					assert(in->length > 0);
-					expbuf_add(node->waiting, in->data, in->length);
-					expbuf_clear(in);
-					assert(in->length == 0);
-					assert(node->waiting->length > 0 && node->waiting->data != NULL);
-	
-					assert(node->sysdata->risp != NULL);
-					res = risp_process(node->sysdata->risp, node, node->waiting->length, (unsigned char *) node->waiting->data);
-					assert(res <= node->waiting->length);
-					assert(res >= 0);
-					if (res > 0) { expbuf_purge(node->waiting, res); }
-				}
-				else {
-					// there is no data in the waiting-buffer, we will process the node->in buffer by itself.
-					assert(node->sysdata->risp != NULL);
-					res = risp_process(node->sysdata->risp, node, in->length, (unsigned char *) in->data);
-					assert(res <= in->length);
-					assert(res >= 0);
-					if (res > 0) { expbuf_purge(in, res); }
-	
-					// if there is data left over, then we need to add it to our in-buffer.
-					if (in->length > 0) {
-						assert(node->waiting);
-						expbuf_add(node->waiting, in->data, in->length);
-						expbuf_clear(in);
-					}
-				}
-			}
-			else {
+		node_receive(node);
+	}
+}
 
-				// either the socket has closed, or it would have blocked, even
-				// though we got an event to say it is ready.
-			
-				assert(empty == 0);
-				empty = 1;
-				
-				if (res == 0) {
-					logger(node->sysdata->logging, 3, 
-						"Node[%d] closed while reading.", node->handle);
-					assert(node->out);
-					node->handle = INVALID_HANDLE;
-					node_closed(node);
-					assert(empty != 0);
-				}
-				else {
-					assert(res == -1);
-					if (errno != EAGAIN && errno != EWOULDBLOCK) {
-						logger(node->sysdata->logging, 3, 
-							"Node[%d] closed while reading- because of error: %d", node->handle, errno);
-						close(node->handle);
-						node->handle = INVALID_HANDLE;
-						node_closed(node);
-						assert(empty != 0);
-					}
-				}
-			}
-		}
+
+//-----------------------------------------------------------------------------
+// The node has asked to use shared-memory rings of 'size' bytes, and passed
+// us the descriptors for them.  Once they are attached, the node can wake us
+// thru the eventfd.  We send the RING reply as soon as everything before it
+// has been sent on the socket, and then start writing to the ring.
+void node_ring_attach(node_t *node, unsigned int size)
+{
+	assert(node);
+	assert(node->sysdata);
+	assert(node->ring == NULL);
+
+	if (BIT_TEST(node->flags, FLAG_NODE_UNIX) == 0 || node->ring_fds[0] < 0) {
+		logger(node->sysdata->logging, 1, "Node[%d] asked for shared-memory rings, without giving us any.", node->handle);
+		node_ring_fds_close(node);
+		return;
+	}
+
+	node->ring = (rq_ring_t *) malloc(sizeof(rq_ring_t));
+	assert(node->ring);
+	if (rq_ring_attach(node->ring, node->ring_fds[0], node->ring_fds[2], node->ring_fds[1], size) != 0) {
+		logger(node->sysdata->logging, 1, "Node[%d] gave us shared-memory rings (size:%u) that could not be used.", node->handle, size);
+		free(node->ring);
+		node->ring = NULL;
+	}
+	node->ring_fds[0] = -1;
+	node->ring_fds[1] = -1;
+	node->ring_fds[2] = -1;
+
+	if (node->ring) {
+		assert(node->ring_event == NULL);
+		assert(node->sysdata->evbase);
+		node->ring_event = event_new(node->sysdata->evbase, node->ring->wake_fd, EV_READ | EV_PERSIST, node_ring_handler, (void *) node);
+		assert(node->ring_event);
+		event_add(node->ring_event, NULL);
+
+		BIT_SET(node->flags, FLAG_NODE_RING_ACK);
+		node_flush_schedule(node);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The node has sent everything it is going to send on the socket, the rest
+// will come thru the ring.  It may have already put something there, and
+// woken us before we knew to look at it, so we check it straight away.
+void node_ring_start(node_t *node)
+{
+	assert(node);
+	assert(node->ring);
+	assert(node->ring_event);
+	assert(BIT_TEST(node->flags, FLAG_NODE_RING_IN) == 0);
+
+	BIT_SET(node->flags, FLAG_NODE_RING_IN);
+	event_active(node->ring_event, EV_READ, 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Stop reading from the node, and add it to the list of paused nodes.  Any
+// more data that it sends will be left in the socket (or the ring), so flow
+// control will slow the node down until we start reading again.
+void node_pause(node_t *node, list_t *list)
+{
+	assert(node);
+	assert(list);
+	assert(node->paused == NULL);
+	assert(BIT_TEST(node->flags, FLAG_NODE_PAUSED) == 0);
+	assert(node->read_event);
+
+	event_del(node->read_event);
+	BIT_SET(node->flags, FLAG_NODE_PAUSED);
+	node->paused = list;
+	ll_push_tail(list, node);
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove the node from the list it was paused in, and start reading from it
+// again.
+void node_resume(node_t *node)
+{
+	struct timeval five_seconds = {5,0};
+
+	assert(node);
+	assert(node->paused);
+	assert(BIT_TEST(node->flags, FLAG_NODE_PAUSED));
+
+	ll_remove(node->paused, node);
+	node->paused = NULL;
+	BIT_CLEAR(node->flags, FLAG_NODE_PAUSED);
+
+	if (node->read_event) {
+		event_add(node->read_event, &five_seconds);
+	}
+
+	// the node will not wake us for what it has already put in the ring.
+	if (BIT_TEST(node->flags, FLAG_NODE_RING_IN)) {
+		assert(node->ring_event);
+		event_active(node->ring_event, EV_READ, 0);
 	}
 }
 
 
 //-----------------------------------------------------------------------------
-// if there is data waiting to be sent, we will send it.  This function will
-// write data that is placed in the outgoing buffer (normally because it
-// couldn't be sent before by node_write_now()).  It will try and send
-// everything in one go, and if it succeeds, then it will clear the 'write'
-// event.
+// The socket can take more data, so we send what is still waiting.  Once it
+// has all been sent, node_flush() will clear the 'write' event.
 void node_write_handler(int hid, short flags, void *data)
 {
 	node_t *node = (node_t *) data;
 	stats_t *stats;
-	int res;
 
 	assert(hid >= 0);
 	assert(node);
@@ -405,44 +1256,11 @@ void node_write_handler(int hid, short flags, void *data)
 
 	// we've requested the event, so we should have data to process.
 	assert(node->out);
-	assert(node->out->length > 0);
+	assert(BUF_LENGTH(node->out) > node->out_start || ll_count(&node->out_refs) > 0);
 	assert(node->out->length <= node->out->max);
-	assert(node->out->data);
-	assert(node->handle > 0 && node->handle != INVALID_HANDLE);
-	assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE));
+	assert(BIT_TEST(node->flags, FLAG_NODE_FLUSH) == 0);
 
-	res = send(node->handle, node->out->data, node->out->length, 0);
-	if (res > 0) {
-		// we managed to send some, or maybe all....
-		assert(res <= node->out->length);
-		stats->out_bytes += res;
-		expbuf_purge(node->out, res);
-
-		// if we have sent everything, then we can remove the write event for this node.
-		assert(node->out != NULL);
-		if (node->out->length == 0) {
-			event_del(node->write_event);
-			event_free(node->write_event);
-			node->write_event = NULL;
-		}
-	}
-	else if (res == 0) {
-		logger(node->sysdata->logging, 3, "Node[%d] closed while writing.", node->handle);
-		assert(node->out);
-		node->handle = INVALID_HANDLE;
-		node_closed(node);
-		assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE) == 0);
-	}
-	else {
-		assert(res == -1);
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			logger(node->sysdata->logging, 3, "Node[%d] closed while writing - because of error: %d", node->handle, errno);
-			close(node->handle);
-			node->handle = INVALID_HANDLE;
-			node_closed(node);
-			assert(BIT_TEST(node->flags, FLAG_NODE_ACTIVE) == 0);
-		}
-	}
+	node_flush(node);
 }
 
 
@@ -464,6 +1282,11 @@ void node_shutdown(node_t *node)
 	if (node->handle != INVALID_HANDLE && BIT_TEST(node->flags, FLAG_NODE_CLOSING) == 0) {
 		sendClosing(node);
 		BIT_SET(node->flags, FLAG_NODE_CLOSING);
+
+		// if the write fails, the node has already been closed and freed.
+		if (node_flush(node) < 0) {
+			return;
+		}
 	}
 
 	// We are still connected to the node, so we need to put a timeout on the
@@ -475,8 +1298,7 @@ void node_shutdown(node_t *node)
 // 	else {
 
 		// if we have done all we need to do, but still have a valid handle, then we should close it, and delete the event.
-		if (node->handle != INVALID_HANDLE && node->out->length == 0) {
-			assert(node->out->length == 0);
+		if (node->handle != INVALID_HANDLE && node->out->length == 0 && ll_count(&node->out_refs) == 0) {
 			assert(node->handle > 0);
 			close(node->handle);
 			node->handle = INVALID_HANDLE;
@@ -540,10 +1362,9 @@ message_t * node_findoutmsg(node_t *node, msg_id_t msgid)
 	assert(node);
 	assert(msgid >= 0);
 	assert(node->sysdata);
-	assert(node->sysdata->msg_list);
-	assert(node->sysdata->msg_max >= msgid);
+	assert(node->sysdata->msglist);
 	
-	msg = node->sysdata->msg_list[msgid];
+	msg = msglist_get(node->sysdata->msglist, msgid);
 	assert(msg);
 	assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
 
@@ -551,3 +1372,64 @@ message_t * node_findoutmsg(node_t *node, msg_id_t msgid)
 
 	return(msg);
 }
+
+
+//-----------------------------------------------------------------------------
+// The message has been sent to the node to process.
+void node_inflight_add(node_t *node, message_t *msg)
+{
+	assert(node);
+	assert(msg);
+	assert(msg->inflight_prev == NULL && msg->inflight_next == NULL);
+	assert(node->inflight != msg);
+
+	msg->inflight_next = node->inflight;
+	if (node->inflight) { node->inflight->inflight_prev = msg; }
+	node->inflight = msg;
+}
+
+
+//-----------------------------------------------------------------------------
+// The node has finished with the message, or it is being taken away from it.
+void node_inflight_remove(node_t *node, message_t *msg)
+{
+	assert(node);
+	assert(msg);
+
+	if (msg->inflight_prev) { msg->inflight_prev->inflight_next = msg->inflight_next; }
+	else                    { assert(node->inflight == msg); node->inflight = msg->inflight_next; }
+	if (msg->inflight_next) { msg->inflight_next->inflight_prev = msg->inflight_prev; }
+
+	msg->inflight_prev = NULL;
+	msg->inflight_next = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// The NOREPLY request from the node has been added to a queue.  Rather than
+// telling it straight away, the id is kept with the others from this pass of
+// the event loop, and they are all sent in one DELIVERED when the node is
+// flushed.
+void node_ack(node_t *node, msg_id_t msgid)
+{
+	unsigned char data[4];
+
+	assert(node);
+	assert(msgid >= 0);
+	assert(BIT_TEST(node->flags, FLAG_NODE_BATCH));
+	assert(node->sysdata);
+	assert(node->sysdata->bufpool);
+
+	if (node->acks == NULL) {
+		node->acks = expbuf_pool_new(node->sysdata->bufpool, 256);
+		assert(node->acks);
+	}
+
+	data[0] = (msgid >> 24) & 0xff;
+	data[1] = (msgid >> 16) & 0xff;
+	data[2] = (msgid >> 8) & 0xff;
+	data[3] = msgid & 0xff;
+	expbuf_add(node->acks, data, 4);
+
+	node_flush_schedule(node);
+}
@@ -10,29 +10,99 @@
 #include "controllers.h"
 #include "data.h"
 #include "message.h"
+#include "payload.h"
 #include "system_data.h"
 
 
 #define DEFAULT_BUFFSIZE 1024
 
+// sizes of the receive buffer.  It starts at the smallest, and doubles each
+// time a read fills it, up to the largest.
+#define NODE_IN_MIN      4096
+#define NODE_IN_MAX      (256 * 1024)
+
+// payloads at least this big are read into a buffer of their own, which the
+// message then uses as it is.
+#define NODE_IN_DIRECT   (16 * 1024)
+
+// maximum number of pieces that will be given to writev at one time.
+#define NODE_MAX_IOV     64
+
+// payloads smaller than this are copied into the 'out' buffer, rather than
+// being sent by reference.
+#define NODE_OUT_COPY    512
+
 #define FLAG_NODE_ACTIVE			1
 #define FLAG_NODE_CLOSING 		2
 #define FLAG_NODE_CONTROLLER	4
 #define FLAG_NODE_BUSY        8
+#define FLAG_NODE_PEER        16		/* link to another worker process. */
+#define FLAG_NODE_PAUSED      32		/* not reading, because the queues are full. */
+#define FLAG_NODE_FLUSH       64		/* in the list of nodes to flush. */
+#define FLAG_NODE_ACCEPTED    128		/* connection accepted by one of our servers. */
+#define FLAG_NODE_FORWARDER   256		/* another controller, consuming for its own consumers. */
+#define FLAG_NODE_UNIX        512		/* accepted on the unix socket, so it can give us a ring. */
+#define FLAG_NODE_RING_IN     1024	/* reading from the shared-memory ring, not the socket. */
+#define FLAG_NODE_RING_OUT    2048	/* writing to the shared-memory ring, not the socket. */
+#define FLAG_NODE_RING_ACK    4096	/* RING is sent as soon as everything before it has been. */
+#define FLAG_NODE_BATCH       8192	/* can be sent a BATCH, and several DELIVERED ids at once. */
+#define FLAG_NODE_INVALID     16384	/* broke the protocol, so it is closed once its commands are processed. */
 
 typedef struct {
 	int handle;
 	unsigned short flags;
 	struct event *read_event,
 	             *write_event;
-	expbuf_t *waiting,
-	         *out;
+	expbuf_t *out;
+	unsigned int out_start;		// data in 'out' before this has been sent.
+
+	// data received from the node.  The commands from 'in_start' onwards have
+	// not been processed yet.  The buffer is released while the node is idle.
+	expbuf_t *in;
+	unsigned int in_start;
+
+	// a large payload that is being read straight into its own buffer, and
+	// the length it will be when it has all arrived.
+	expbuf_t *in_payload;
+	unsigned int in_payload_length;
+
+	// payloads that are still to be sent by reference.  Each one is sent at
+	// its position in the 'out' buffer, so the order of the data is kept
+	// without copying the payload into it.
+	list_t out_refs;			// node_ref_t
 	data_t data;
 	system_data_t *sysdata;
 // 	list_t in_msg;
 // 	list_t out_msg;
 	int idle;
 	controller_t *controller;
+
+	// list of the queues this node is a member of (consuming, waiting, or
+	// being sent consume requests as a controller).
+	struct __node_queue_t *queues;
+
+	// while reading from the node is paused, this is the list of paused nodes
+	// that it is in (either for a queue, or for all the queues).
+	list_t *paused;
+
+	// the messages that have been sent to the node, which it has not finished
+	// with.  If the connection is lost, they can be sent to another consumer.
+	message_t *inflight;
+
+	// ids of the NOREPLY requests from the node that it still needs to be told
+	// were delivered.  They are all sent together when the node is flushed.
+	expbuf_t *acks;
+
+	// totals for the connection, which are reported by the STATS command.
+	unsigned long long bytes_in, bytes_out;
+	unsigned int msgs_in, msgs_out;
+
+	// shared-memory rings, for a client on the same host.  Until they are
+	// attached, 'ring_fds' holds the descriptors that came with the RING
+	// command (the memory, the client's eventfd, and ours).
+	rq_ring_t *ring;
+	struct event *ring_event;
+	int ring_fds[3];
 } node_t ;
 
 
@@ -42,8 +112,17 @@ void node_shutdown(node_t *node);
 node_t * node_create(system_data_t *sysdata, int handle);
 
 void node_write_now(node_t *node, int length, char *data);
+void node_write_payload(node_t *node, int hlength, char *header, payload_t *payload, int tlength, char *trailer);
 void node_read_handler(int hid, short flags, void *data);
+void node_pause(node_t *node, list_t *list);
+void node_resume(node_t *node);
 void node_write_handler(int hid, short flags, void *data);
+int node_flush(node_t *node);
+void node_inflight_add(node_t *node, message_t *msg);
+void node_inflight_remove(node_t *node, message_t *msg);
+void node_ack(node_t *node, msg_id_t msgid);
+void node_ring_attach(node_t *node, unsigned int size);
+void node_ring_start(node_t *node);
 
 message_t * node_findoutmsg(node_t *node, msg_id_t msgid);
 
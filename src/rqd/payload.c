@@ -0,0 +1,66 @@
+// payload.c
+
+#include "payload.h"
+#include "spill.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+
+//-----------------------------------------------------------------------------
+// Create a payload object for the buffer, with one reference.  The payload
+// takes over the buffer, and will return it to the pool when it is released.
+payload_t * payload_new(expbuf_pool_t *pool, expbuf_t *buf)
+{
+	payload_t *payload;
+
+	assert(pool);
+	assert(buf);
+
+	payload = (payload_t *) malloc(sizeof(payload_t));
+	assert(payload);
+	payload->buf = buf;
+	payload->refs = 1;
+	payload->pool = pool;
+	payload->segment = NULL;
+	payload->offset = 0;
+	payload->length = 0;
+
+	return(payload);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a reference to the payload.
+void payload_ref(payload_t *payload)
+{
+	assert(payload);
+	assert(payload->refs > 0);
+	payload->refs ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Release a reference to the payload.  When there are no more references, the
+// buffer is returned to the pool, and the payload object is freed.
+void payload_release(payload_t *payload)
+{
+	assert(payload);
+	assert(payload->refs > 0);
+	assert(payload->buf || payload->segment);
+	assert(payload->pool);
+
+	payload->refs --;
+	if (payload->refs == 0) {
+		if (payload->segment) {
+			spill_release(payload);
+		}
+		else {
+			expbuf_clear(payload->buf);
+			expbuf_pool_return(payload->pool, payload->buf);
+			payload->buf = NULL;
+		}
+		payload->pool = NULL;
+		free(payload);
+	}
+}
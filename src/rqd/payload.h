@@ -0,0 +1,34 @@
+#ifndef __PAYLOAD_H
+#define __PAYLOAD_H
+
+// A payload is the data part of a message.  Since the same payload can be
+// queued to be sent to several nodes (broadcasts), or still be waiting to go
+// out after the message itself has been released, it is reference counted.
+// The buffer is returned to the pool when the last reference is released.
+// While a payload is spilled to disk, it has no buffer, and instead it
+// records where in the segment it was written.
+
+#include <expbuf.h>
+#include <expbufpool.h>
+
+
+struct __spill_segment_t;
+
+typedef struct {
+	expbuf_t *buf;
+	int refs;
+	expbuf_pool_t *pool;
+
+	struct __spill_segment_t *segment;		// set while the payload is spilled.
+	unsigned int offset, length;
+} payload_t;
+
+
+payload_t * payload_new(expbuf_pool_t *pool, expbuf_t *buf);
+void        payload_ref(payload_t *payload);
+void        payload_release(payload_t *payload);
+
+#define payload_spilled(p)  ((p)->segment != NULL)
+#define payload_length(p)   ((p)->segment ? (p)->length : BUF_LENGTH((p)->buf))
+
+#endif
@@ -0,0 +1,324 @@
+// qdir.c
+
+#include "qdir.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+//-----------------------------------------------------------------------------
+// FNV-1a hash of the queue name.  Queue names are short, so this is cheap
+// enough to do on every lookup.
+static unsigned int qdir_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	const unsigned char *p;
+
+	assert(name);
+	for (p = (const unsigned char *) name; *p != '\0'; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
+
+//-----------------------------------------------------------------------------
+// Initialise the directory, with empty tables.
+void qdir_init(qdir_t *qdir)
+{
+	int i;
+
+	assert(qdir);
+
+	assert((QDIR_DEFAULT_HASHSIZE & (QDIR_DEFAULT_HASHSIZE - 1)) == 0);
+	qdir->table_size = QDIR_DEFAULT_HASHSIZE;
+	qdir->table = (qdir_entry_t *) malloc(sizeof(qdir_entry_t) * qdir->table_size);
+	assert(qdir->table);
+	for (i=0; i < qdir->table_size; i++) {
+		qdir->table[i].hash = 0;
+		qdir->table[i].name = NULL;
+		qdir->table[i].queue = NULL;
+	}
+
+	qdir->ids_size = QDIR_DEFAULT_IDSIZE;
+	qdir->ids = (void **) malloc(sizeof(void *) * qdir->ids_size);
+	assert(qdir->ids);
+	for (i=0; i < qdir->ids_size; i++) {
+		qdir->ids[i] = NULL;
+	}
+
+	qdir->next_qid = 1;
+	qdir->count = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// free the resources used by the directory (but not the object itself).  The
+// queues themselves are not owned by the directory, so they are not touched.
+void qdir_free(qdir_t *qdir)
+{
+	assert(qdir);
+	assert(qdir->table);
+	assert(qdir->ids);
+
+	free(qdir->table);
+	qdir->table = NULL;
+	qdir->table_size = 0;
+
+	free(qdir->ids);
+	qdir->ids = NULL;
+	qdir->ids_size = 0;
+
+	qdir->count = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Find the slot in the hash table that either contains the entry for this
+// name, or the empty slot where it would be inserted.
+static int qdir_slot(qdir_t *qdir, unsigned int hash, const char *name)
+{
+	int mask;
+	int i;
+
+	assert(qdir && name);
+	assert(qdir->count < qdir->table_size);
+
+	mask = qdir->table_size - 1;
+	i = hash & mask;
+	while (qdir->table[i].queue != NULL) {
+		assert(qdir->table[i].name);
+		if (qdir->table[i].hash == hash && strcmp(qdir->table[i].name, name) == 0) {
+			return(i);
+		}
+		i = (i + 1) & mask;
+	}
+
+	return(i);
+}
+
+
+//-----------------------------------------------------------------------------
+// double the size of the hash table and re-insert all the entries.
+static void qdir_grow_table(qdir_t *qdir)
+{
+	qdir_entry_t *old;
+	int old_size;
+	int i, j, mask;
+
+	assert(qdir);
+
+	old = qdir->table;
+	old_size = qdir->table_size;
+
+	qdir->table_size = old_size * 2;
+	qdir->table = (qdir_entry_t *) malloc(sizeof(qdir_entry_t) * qdir->table_size);
+	assert(qdir->table);
+	for (i=0; i < qdir->table_size; i++) {
+		qdir->table[i].hash = 0;
+		qdir->table[i].name = NULL;
+		qdir->table[i].queue = NULL;
+	}
+
+	mask = qdir->table_size - 1;
+	for (i=0; i < old_size; i++) {
+		if (old[i].queue) {
+			j = old[i].hash & mask;
+			while (qdir->table[j].queue != NULL) {
+				j = (j + 1) & mask;
+			}
+			qdir->table[j] = old[i];
+		}
+	}
+
+	free(old);
+}
+
+
+//-----------------------------------------------------------------------------
+// make sure that the id array is big enough to hold the specified qid.
+static void qdir_grow_ids(qdir_t *qdir, queue_id_t qid)
+{
+	int size;
+	int i;
+
+	assert(qdir);
+	assert(qid > 0 && qid <= QDIR_MAX_QID);
+
+	if (qid >= qdir->ids_size) {
+		size = qdir->ids_size;
+		while (size <= qid) { size *= 2; }
+
+		qdir->ids = (void **) realloc(qdir->ids, sizeof(void *) * size);
+		assert(qdir->ids);
+		for (i=qdir->ids_size; i < size; i++) {
+			qdir->ids[i] = NULL;
+		}
+		qdir->ids_size = size;
+	}
+
+	assert(qid < qdir->ids_size);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return a queue-id that is not currently used in the directory.  Queue-ids
+// are handed out in sequence, and will wrap around once we reach the maximum,
+// skipping the ones that are still in use.
+queue_id_t qdir_new_qid(qdir_t *qdir)
+{
+	queue_id_t qid;
+	int tries;
+
+	assert(qdir);
+	assert(qdir->next_qid > 0 && qdir->next_qid <= QDIR_MAX_QID);
+
+	// we can never have more queues than the number of ids available.
+	assert(qdir->count < QDIR_MAX_QID);
+
+	qid = qdir->next_qid;
+	for (tries=0; tries < QDIR_MAX_QID; tries++) {
+		if (qid >= qdir->ids_size || qdir->ids[qid] == NULL) {
+			break;
+		}
+		qid = (qid >= QDIR_MAX_QID) ? 1 : qid + 1;
+	}
+	assert(qid > 0 && qid <= QDIR_MAX_QID);
+	assert(qid >= qdir->ids_size || qdir->ids[qid] == NULL);
+
+	qdir->next_qid = (qid >= QDIR_MAX_QID) ? 1 : qid + 1;
+	return(qid);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a queue to the directory.  The name is not copied, so it needs to stay
+// valid for as long as the queue is in the directory.
+void qdir_add(qdir_t *qdir, const char *name, queue_id_t qid, void *queue)
+{
+	unsigned int hash;
+	int i;
+
+	assert(qdir);
+	assert(name && name[0] != '\0');
+	assert(qid > 0 && qid <= QDIR_MAX_QID);
+	assert(queue);
+
+	// keep the hash table no more than half full, so the probe sequences stay short.
+	if ((qdir->count + 1) * 2 > qdir->table_size) {
+		qdir_grow_table(qdir);
+	}
+
+	hash = qdir_hash(name);
+	i = qdir_slot(qdir, hash, name);
+	assert(qdir->table[i].queue == NULL);
+	qdir->table[i].hash = hash;
+	qdir->table[i].name = name;
+	qdir->table[i].queue = queue;
+
+	qdir_grow_ids(qdir, qid);
+	assert(qdir->ids[qid] == NULL);
+	qdir->ids[qid] = queue;
+
+	qdir->count ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove a queue from the directory.  Since the hash table uses linear
+// probing, any entries that follow the removed one in the same run need to be
+// shifted back so that they can still be found.
+void qdir_remove(qdir_t *qdir, const char *name, queue_id_t qid)
+{
+	unsigned int hash;
+	int i, j, k, mask;
+
+	assert(qdir);
+	assert(name);
+	assert(qid > 0 && qid < qdir->ids_size);
+	assert(qdir->count > 0);
+
+	hash = qdir_hash(name);
+	i = qdir_slot(qdir, hash, name);
+	assert(qdir->table[i].queue != NULL);
+	assert(qdir->ids[qid] == qdir->table[i].queue);
+
+	mask = qdir->table_size - 1;
+	j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (qdir->table[j].queue == NULL) {
+			break;
+		}
+
+		// k is where this entry would ideally live.  If the hole we made at 'i'
+		// is cyclically between 'k' and 'j' then the entry can move into it.
+		k = qdir->table[j].hash & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			qdir->table[i] = qdir->table[j];
+			i = j;
+		}
+	}
+	qdir->table[i].hash = 0;
+	qdir->table[i].name = NULL;
+	qdir->table[i].queue = NULL;
+
+	qdir->ids[qid] = NULL;
+	qdir->count --;
+	assert(qdir->count >= 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Change the qid that a queue is indexed on.  Returns 0 if the new id is
+// already used by another queue, in which case nothing is changed.
+int qdir_set_qid(qdir_t *qdir, queue_id_t oldqid, queue_id_t newqid)
+{
+	assert(qdir);
+	assert(oldqid > 0 && oldqid < qdir->ids_size);
+	assert(newqid > 0 && newqid <= QDIR_MAX_QID);
+	assert(qdir->ids[oldqid]);
+
+	if (oldqid == newqid) {
+		return(1);
+	}
+
+	qdir_grow_ids(qdir, newqid);
+	if (qdir->ids[newqid] != NULL) {
+		return(0);
+	}
+
+	qdir->ids[newqid] = qdir->ids[oldqid];
+	qdir->ids[oldqid] = NULL;
+	return(1);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the queue with this name, or NULL if it is not in the directory.
+void * qdir_find_name(qdir_t *qdir, const char *name)
+{
+	int i;
+
+	assert(qdir);
+	assert(name);
+
+	i = qdir_slot(qdir, qdir_hash(name), name);
+	return(qdir->table[i].queue);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the queue with this id, or NULL if it is not in the directory.
+void * qdir_find_qid(qdir_t *qdir, queue_id_t qid)
+{
+	assert(qdir);
+	assert(qid > 0);
+
+	if (qid >= qdir->ids_size) {
+		return(NULL);
+	}
+	return(qdir->ids[qid]);
+}
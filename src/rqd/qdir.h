@@ -0,0 +1,53 @@
+#ifndef __QDIR_H
+#define __QDIR_H
+
+// The queue directory is used to find a queue object by its name or by its
+// queue id without having to walk the list of queues.  It does not own the
+// queue objects, it only keeps references to them, so the queue itself needs
+// to be removed from the directory before it is freed.
+
+#include <rq.h>
+
+
+// starting sizes for the hash table and the id array.  Both will double
+// whenever they need more room, so these are just starting points.
+#define QDIR_DEFAULT_HASHSIZE 64
+#define QDIR_DEFAULT_IDSIZE   64
+
+// queue-ids are sent to the nodes as a short-int, so we cannot go over this.
+#define QDIR_MAX_QID          0xffff
+
+
+typedef struct {
+	unsigned int hash;
+	const char *name;
+	void *queue;
+} qdir_entry_t;
+
+typedef struct {
+	// open-addressed hash table, keyed on the queue name.  The size of the
+	// table is always a power of two.
+	qdir_entry_t *table;
+	int table_size;
+
+	// array of queue pointers, indexed by the queue-id.
+	void **ids;
+	int ids_size;
+	queue_id_t next_qid;
+
+	int count;
+} qdir_t;
+
+
+void qdir_init(qdir_t *qdir);
+void qdir_free(qdir_t *qdir);
+
+queue_id_t qdir_new_qid(qdir_t *qdir);
+void       qdir_add(qdir_t *qdir, const char *name, queue_id_t qid, void *queue);
+void       qdir_remove(qdir_t *qdir, const char *name, queue_id_t qid);
+int        qdir_set_qid(qdir_t *qdir, queue_id_t oldqid, queue_id_t newqid);
+
+void * qdir_find_name(qdir_t *qdir, const char *name);
+void * qdir_find_qid(qdir_t *qdir, queue_id_t qid);
+
+#endif
@@ -12,14 +12,554 @@
 
 
 
-// structure to keep track of the node that is consuming the queue
-typedef struct {
+//-----------------------------------------------------------------------------
+// Returns non-zero if entry 'a' should be selected before entry 'b',
+// according to the selection policy of the queue.  Ties are broken by
+// choosing the one that was used the longest time ago, so that equal nodes
+// still get the messages in turn.  When both have a max, the one with the
+// smaller share of it outstanding is better, so that a link to another
+// controller with a large credit is filled in proportion to the others.
+static int nq_better(queue_t *queue, node_queue_t *a, node_queue_t *b)
+{
+	long long la, lb;
+
+	assert(queue && a && b);
+
+	if (queue->policy == QUEUE_POLICY_PRIORITY && a->priority != b->priority) {
+		return(a->priority > b->priority);
+	}
+
+	if (a->max > 0 && b->max > 0) {
+		la = (long long) a->waiting * b->max;
+		lb = (long long) b->waiting * a->max;
+		if (la != lb) {
+			return(la < lb);
+		}
+	}
+	else if (a->waiting != b->waiting) {
+		return(a->waiting < b->waiting);
+	}
+
+	return(((int) (a->last_used - b->last_used)) < 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// place the entry at this position in the heap.
+static inline void nq_heap_set(nq_heap_t *heap, int index, node_queue_t *nq)
+{
+	heap->items[index] = nq;
+	nq->heap_index = index;
+}
+
+
+//-----------------------------------------------------------------------------
+// move the entry towards the top of the heap until it is in order.
+static void nq_heap_up(queue_t *queue, int index)
+{
+	nq_heap_t *heap = &queue->ready_heap;
+	node_queue_t *nq;
+	int parent;
+
+	nq = heap->items[index];
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (nq_better(queue, nq, heap->items[parent]) == 0) {
+			break;
+		}
+		nq_heap_set(heap, index, heap->items[parent]);
+		index = parent;
+	}
+	nq_heap_set(heap, index, nq);
+}
+
+
+//-----------------------------------------------------------------------------
+// move the entry towards the bottom of the heap until it is in order.
+static void nq_heap_down(queue_t *queue, int index)
+{
+	nq_heap_t *heap = &queue->ready_heap;
+	node_queue_t *nq;
+	int child;
+
+	nq = heap->items[index];
+	for (;;) {
+		child = (index * 2) + 1;
+		if (child >= heap->count) {
+			break;
+		}
+		if (child + 1 < heap->count && nq_better(queue, heap->items[child+1], heap->items[child])) {
+			child ++;
+		}
+		if (nq_better(queue, heap->items[child], nq) == 0) {
+			break;
+		}
+		nq_heap_set(heap, index, heap->items[child]);
+		index = child;
+	}
+	nq_heap_set(heap, index, nq);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the entry to the ready heap of the queue.
+static void nq_heap_insert(queue_t *queue, node_queue_t *nq)
+{
+	nq_heap_t *heap;
+
+	assert(queue && nq);
+	assert(nq->heap_index < 0);
+
+	heap = &queue->ready_heap;
+	if (heap->count >= heap->size) {
+		heap->size = heap->size > 0 ? heap->size * 2 : 8;
+		heap->items = (node_queue_t **) realloc(heap->items, sizeof(node_queue_t *) * heap->size);
+		assert(heap->items);
+	}
+
+	nq_heap_set(heap, heap->count, nq);
+	heap->count ++;
+	nq_heap_up(queue, nq->heap_index);
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove the entry from the ready heap of the queue.
+static void nq_heap_remove(queue_t *queue, node_queue_t *nq)
+{
+	nq_heap_t *heap;
+	node_queue_t *last;
+	int index;
+
+	assert(queue && nq);
+	heap = &queue->ready_heap;
+	index = nq->heap_index;
+	assert(index >= 0 && index < heap->count);
+	assert(heap->items[index] == nq);
+
+	heap->count --;
+	last = heap->items[heap->count];
+	heap->items[heap->count] = NULL;
+	nq->heap_index = -1;
+
+	if (last != nq) {
+		// put the last entry in the hole, and then let it find its place.
+		nq_heap_set(heap, index, last);
+		nq_heap_up(queue, index);
+		nq_heap_down(queue, last->heap_index);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// the values used to order the entry have changed, so it needs to find its
+// new place in the heap.
+static void nq_heap_update(queue_t *queue, node_queue_t *nq)
+{
+	assert(queue && nq);
+	assert(nq->heap_index >= 0);
+
+	nq_heap_up(queue, nq->heap_index);
+	nq_heap_down(queue, nq->heap_index);
+}
+
+
+//-----------------------------------------------------------------------------
+// Select the ready node that the next request should be sent to.  Returns
+// NULL if there are no nodes ready.
+static node_queue_t * nq_select(queue_t *queue)
+{
+	nq_heap_t *heap;
+	node_queue_t *a, *b;
+	int i, j;
+
+	assert(queue);
+	heap = &queue->ready_heap;
+	assert(heap->count == queue->nodes_ready.count);
+
+	if (heap->count == 0) {
+		return(NULL);
+	}
+	else if (queue->policy == QUEUE_POLICY_P2C && heap->count > 2) {
+		// pick two different entries at random, and use the better of them.
+		i = random() % heap->count;
+		j = random() % (heap->count - 1);
+		if (j >= i) { j++; }
+		a = heap->items[i];
+		b = heap->items[j];
+		return(nq_better(queue, a, b) ? a : b);
+	}
+	else {
+		return(heap->items[0]);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Select the ready node for a request that was handed to us by another
+// worker.  Those are only given to nodes that are connected to this worker,
+// otherwise they could be passed back and forth.  Returns NULL if none of the
+// ready nodes are local.
+static node_queue_t * nq_select_local(queue_t *queue)
+{
+	nq_heap_t *heap;
+	node_queue_t *nq, *best;
+	int i;
+
+	assert(queue);
+
+	nq = nq_select(queue);
+	if (nq == NULL || BIT_TEST(nq->node->flags, FLAG_NODE_PEER) == 0) {
+		return(nq);
+	}
+
+	heap = &queue->ready_heap;
+	best = NULL;
+	for (i=0; i<heap->count; i++) {
+		nq = heap->items[i];
+		if (BIT_TEST(nq->node->flags, FLAG_NODE_PEER) == 0) {
+			if (best == NULL || nq_better(queue, nq, best)) {
+				best = nq;
+			}
+		}
+	}
+
+	return(best);
+}
+
+
+//-----------------------------------------------------------------------------
+// Initialise an empty list of node_queue_t entries.
+static void nq_list_init(nq_list_t *list)
+{
+	assert(list);
+	list->head = NULL;
+	list->tail = NULL;
+	list->count = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Add an entry to the head of the list.  The entry must not already be in a
+// list.
+static void nq_push_head(nq_list_t *list, node_queue_t *nq)
+{
+	assert(list && nq);
+	assert(nq->list == NULL);
+	assert(nq->prev == NULL && nq->next == NULL);
+
+	nq->next = list->head;
+	if (list->head) { list->head->prev = nq; }
+	else            { list->tail = nq; }
+	list->head = nq;
+
+	nq->list = list;
+	list->count ++;
+
+	if (list == &nq->queue->nodes_ready) {
+		nq_heap_insert(nq->queue, nq);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Add an entry to the tail of the list.  The entry must not already be in a
+// list.
+static void nq_push_tail(nq_list_t *list, node_queue_t *nq)
+{
+	assert(list && nq);
+	assert(nq->list == NULL);
+	assert(nq->prev == NULL && nq->next == NULL);
+
+	nq->prev = list->tail;
+	if (list->tail) { list->tail->next = nq; }
+	else            { list->head = nq; }
+	list->tail = nq;
+
+	nq->list = list;
+	list->count ++;
+
+	if (list == &nq->queue->nodes_ready) {
+		nq_heap_insert(nq->queue, nq);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove the entry from whichever queue list it is in.
+static void nq_remove(node_queue_t *nq)
+{
+	nq_list_t *list;
+
+	assert(nq);
+	assert(nq->list);
+	list = nq->list;
+	assert(list->count > 0);
+
+	if (list == &nq->queue->nodes_ready) {
+		nq_heap_remove(nq->queue, nq);
+	}
+
+	if (nq->prev) { nq->prev->next = nq->next; }
+	else          { assert(list->head == nq); list->head = nq->next; }
+
+	if (nq->next) { nq->next->prev = nq->prev; }
+	else          { assert(list->tail == nq); list->tail = nq->prev; }
+
+	nq->prev = NULL;
+	nq->next = NULL;
+	nq->list = NULL;
+	list->count --;
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove the entry from the list it is in, and add it to the tail of 'list'
+// (which can be the same list).
+static void nq_move_tail(nq_list_t *list, node_queue_t *nq)
+{
+	assert(list && nq);
+	nq_remove(nq);
+	nq_push_tail(list, nq);
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove and return the entry at the tail of the list.
+static node_queue_t * nq_pop_tail(nq_list_t *list)
+{
+	node_queue_t *nq;
+
+	assert(list);
+	nq = list->tail;
+	if (nq) { nq_remove(nq); }
+	return(nq);
+}
+
+
+//-----------------------------------------------------------------------------
+// Create a new entry for the node in this queue, and add it to the list of
+// memberships that the node has.  It will not be in any of the queue lists
+// yet.
+static node_queue_t * nq_new(queue_t *queue, node_t *node, int max, int priority)
+{
+	node_queue_t *nq;
+
+	assert(queue);
+	assert(node);
+	assert(max >= 0);
+	assert(priority >= 0);
+
+	nq = (node_queue_t *) malloc(sizeof(node_queue_t));
+	assert(nq);
+	nq->node = node;
+	nq->queue = queue;
+	nq->max = max;
+	nq->priority = priority;
+	nq->waiting = 0;
+	nq->expired = 0;
+	nq->last_used = 0;
+	nq->heap_index = -1;
+
+	nq->list = NULL;
+	nq->prev = NULL;
+	nq->next = NULL;
+
+	nq->node_prev = NULL;
+	nq->node_next = node->queues;
+	if (node->queues) { node->queues->node_prev = nq; }
+	node->queues = nq;
+
+	return(nq);
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove the entry from the queue list it is in, and from the memberships of
+// the node, and then free it.
+static void nq_delete(node_queue_t *nq)
+{
+	assert(nq);
+	assert(nq->node);
+
+	if (nq->list) { nq_remove(nq); }
+
+	if (nq->node_prev) { nq->node_prev->node_next = nq->node_next; }
+	else               { assert(nq->node->queues == nq); nq->node->queues = nq->node_next; }
+	if (nq->node_next) { nq->node_next->node_prev = nq->node_prev; }
+
+	nq->node = NULL;
+	nq->queue = NULL;
+	free(nq);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// make sure that the timeout event is set if there are timers in the wheel.
+// When we are shutting down, the event will have been removed, and the timers
+// will not fire.
+static void queue_timeout_arm(system_data_t *sysdata)
+{
+	struct timeval t = {.tv_sec = 0, .tv_usec = QUEUE_TIMEOUT_TICK * 1000};
+
+	assert(sysdata);
+	assert(sysdata->timewheel);
+
+	if (sysdata->timeout_event && sysdata->timewheel->count > 0) {
+		if (evtimer_pending(sysdata->timeout_event, NULL) == 0) {
+			evtimer_add(sysdata->timeout_event, &t);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the message to the timing wheel, so that it expires after its timeout.
+static void queue_timer_start(system_data_t *sysdata, message_t *msg)
+{
+	assert(sysdata);
+	assert(sysdata->timewheel);
+	assert(msg);
+	assert(msg->timeout > 0);
+
+	tw_add(sysdata->timewheel, &msg->timer, tw_now() + ((tw_time_t) msg->timeout * 1000));
+	queue_timeout_arm(sysdata);
+}
+
+
+//-----------------------------------------------------------------------------
+// A message has been added to the pending list.  If there is too much pending
+// data in memory, either in this queue or in all of them, then the payload is
+// written to disk until the message is about to be delivered.
+static void queue_pending_add(queue_t *queue, message_t *msg)
+{
+	system_data_t *sysdata;
+	settings_t *settings;
+	spill_t *spill;
+	unsigned int length;
+
+	assert(queue);
+	assert(queue->sysdata);
+	assert(msg);
+	assert(msg->data);
+
+	sysdata = queue->sysdata;
+	settings = sysdata->settings;
+	spill = sysdata->spill;
+	length = payload_length(msg->data);
+
+	queue->backlog += length;
+	sysdata->backlog += length;
+
+	if (spill) {
+		assert(settings);
+		if ((settings->spill_queue > 0 && queue->pending_bytes + length > settings->spill_queue) ||
+		    (spill->resident + length > settings->spill_limit)) {
+			if (spill_payload(spill, msg->data) != 0) {
+				queue->pending_spilled ++;
+				assert(sysdata->stats);
+				sysdata->stats->spilled ++;
+				return;
+			}
+		}
+		spill->resident += length;
+	}
+
+	queue->pending_bytes += length;
+}
+
+
+//-----------------------------------------------------------------------------
+// Start reading again from all the nodes in the paused list.
+static void queue_resume(list_t *paused, system_data_t *sysdata)
+{
 	node_t *node;
-	short int priority;
-	int max;				// maximum number of messages this node will process at a time.
-	int waiting;
-} node_queue_t;
 
+	assert(paused);
+	assert(sysdata);
+	assert(sysdata->stats);
+
+	while ((node = ll_get_head(paused))) {
+		assert(node->paused == paused);
+		logger(sysdata->logging, 2, "Resuming node:%d", node->handle);
+		node_resume(node);
+		sysdata->stats->resumed ++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// A message has been removed from the pending list.  If its payload was
+// spilled, and it is going to be delivered, it is read back in.
+static void queue_pending_remove(queue_t *queue, message_t *msg, int load)
+{
+	system_data_t *sysdata;
+	settings_t *settings;
+	unsigned int length;
+
+	assert(queue);
+	assert(queue->sysdata);
+	assert(msg);
+	assert(msg->data);
+
+	sysdata = queue->sysdata;
+	settings = sysdata->settings;
+	assert(settings);
+
+	length = payload_length(msg->data);
+	assert(queue->backlog >= length && sysdata->backlog >= length);
+	queue->backlog -= length;
+	sysdata->backlog -= length;
+
+	if (payload_spilled(msg->data)) {
+		assert(queue->pending_spilled > 0);
+		queue->pending_spilled --;
+		if (load) {
+			spill_load(msg->data);
+			assert(sysdata->stats);
+			sysdata->stats->unspilled ++;
+		}
+	}
+	else {
+		assert(queue->pending_bytes >= length);
+		queue->pending_bytes -= length;
+		if (sysdata->spill) {
+			assert(sysdata->spill->resident >= length);
+			sysdata->spill->resident -= length;
+		}
+	}
+
+	// start reading again from the nodes that were paused, once there is room.
+	if (ll_count(&queue->paused) > 0 && queue->backlog <= BACKLOG_RESUME(settings->backlog_queue)) {
+		queue_resume(&queue->paused, sysdata);
+	}
+	if (ll_count(sysdata->paused) > 0 && sysdata->backlog <= BACKLOG_RESUME(settings->backlog_limit)) {
+		queue_resume(sysdata->paused, sysdata);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Reset the stats of a queue for a new interval.  The depth starts at however
+// many messages are pending now.
+static void queue_stats_clear(queue_stats_t *qs, unsigned int depth)
+{
+	assert(qs);
+
+	qs->requests = 0;
+	qs->replies = 0;
+	qs->broadcasts = 0;
+	qs->timeouts = 0;
+	qs->bytes_in = 0;
+	qs->bytes_out = 0;
+	qs->depth_max = depth;
+	qs->inflight_max = 0;
+	hist_init(&qs->wait);
+	hist_init(&qs->service);
+	hist_init(&qs->total);
+	hist_init(&qs->failover);
+}
 
 
 //-----------------------------------------------------------------------------
@@ -33,10 +573,25 @@ void queue_init(queue_t *queue)
 
 	ll_init(&queue->msg_pending);
 	ll_init(&queue->msg_proc);
-	ll_init(&queue->nodes_busy);
-	ll_init(&queue->nodes_ready);
-	ll_init(&queue->nodes_waiting);
-	ll_init(&queue->nodes_consuming);
+	nq_list_init(&queue->nodes_busy);
+	nq_list_init(&queue->nodes_ready);
+	nq_list_init(&queue->nodes_waiting);
+	nq_list_init(&queue->nodes_consuming);
+	queue->handover = 0;
+	queue->failover_at = 0;
+
+	queue->policy = QUEUE_POLICY_PRIORITY;
+	queue->ready_heap.items = NULL;
+	queue->ready_heap.count = 0;
+	queue->ready_heap.size = 0;
+	queue->deliver_seq = 0;
+	queue->timeouts = 0;
+	queue_stats_clear(&queue->qstats, 0);
+	queue_stats_clear(&queue->qstats_last, 0);
+	queue->pending_bytes = 0;
+	queue->pending_spilled = 0;
+	queue->backlog = 0;
+	ll_init(&queue->paused);
 	
 	queue->sysdata = NULL;
 }
@@ -46,8 +601,15 @@ void queue_init(queue_t *queue)
 // free the resources in a queue object (but not the object itself.)
 void queue_free(queue_t *queue)
 {
+	node_t *node;
+
 	assert(queue != NULL);
 
+	while ((node = ll_get_head(&queue->paused))) {
+		node_resume(node);
+	}
+	ll_free(&queue->paused);
+
 	if (queue->name != NULL) {
 		free(queue->name);
 		queue->name = NULL;
@@ -59,74 +621,54 @@ void queue_free(queue_t *queue)
 	assert(ll_count(&queue->msg_proc) == 0);
 	ll_free(&queue->msg_proc);
 
-	assert(ll_count(&queue->nodes_busy) == 0);
-	ll_free(&queue->nodes_busy);
-
-	assert(ll_count(&queue->nodes_ready) == 0);
-	ll_free(&queue->nodes_ready);
-
-	assert(ll_count(&queue->nodes_waiting) == 0);
-	ll_free(&queue->nodes_waiting);
-
-	assert(ll_count(&queue->nodes_consuming) == 0);
-	ll_free(&queue->nodes_consuming);
+	assert(queue->nodes_busy.count == 0);
+	assert(queue->nodes_ready.count == 0);
+	assert(queue->nodes_waiting.count == 0);
+	assert(queue->nodes_consuming.count == 0);
+	assert(queue->handover == 0);
+
+	assert(queue->ready_heap.count == 0);
+	if (queue->ready_heap.items) {
+		free(queue->ready_heap.items);
+		queue->ready_heap.items = NULL;
+		queue->ready_heap.size = 0;
+	}
 }
 
 
 
 
-queue_t * queue_get_id(list_t *queues, queue_id_t qid)
+//-----------------------------------------------------------------------------
+// Find the queue object that has this queue-id.  Returns NULL if there is no
+// such queue.
+queue_t * queue_get_id(system_data_t *sysdata, queue_id_t qid)
 {
-	queue_t *q = NULL;
-	queue_t *tmp;
+	queue_t *q;
 
-	assert(queues);
+	assert(sysdata);
+	assert(sysdata->qdir);
 	assert(qid > 0);
 
-	ll_start(queues);
-	tmp = ll_next(queues);
-	while (tmp) {
-		assert(tmp->name != NULL);
-		assert(tmp->qid > 0);
-
-		if (tmp->qid == qid) {
-			q = tmp;
-			tmp = NULL;
-		}
-		else {
-			tmp = ll_next(queues);
-		}
-	}
-	ll_finish(queues);
+	q = qdir_find_qid(sysdata->qdir, qid);
+	assert(q == NULL || q->qid == qid);
 	
 	return(q);
 }
 
 
-// This could be improved a little... when a queue is found, it is removed from the spot in the list, and placed at the top of the list.  That means that queues with higher activity are found first.
-queue_t * queue_get_name(list_t *queues, const char *qname)
+//-----------------------------------------------------------------------------
+// Find the queue object that has this name.  Returns NULL if there is no such
+// queue.
+queue_t * queue_get_name(system_data_t *sysdata, const char *qname)
 {
-	queue_t *q = NULL;
-	queue_t *tmp;
+	queue_t *q;
 
-	assert(queues);
+	assert(sysdata);
+	assert(sysdata->qdir);
 	assert(qname);
 
-	ll_start(queues);
-	tmp = ll_next(queues);
-	while (tmp) {
-		assert(tmp->name);
-		assert(tmp->qid > 0);
-
-		if (strcmp(tmp->name, qname) == 0) {
-			q = tmp;
-			tmp = NULL;
-		}
-		else {
-			tmp = ll_next(queues);
-		}
-	}
-	ll_finish(queues);
+	q = qdir_find_name(sysdata->qdir, qname);
+	assert(q == NULL || (q->qid > 0 && strcmp(q->name, qname) == 0));
 	
 	return(q);
 }
@@ -148,98 +690,280 @@ void queue_addmsg(queue_t *queue, message_t *msg)
 	assert(msg->queue == NULL);
 	msg->queue = queue;
 
+	// record durable messages in the journal before the payload could be
+	// spilled.  Broadcasts are never kept.
+	if (queue->sysdata->journal && BIT_TEST(msg->flags, FLAG_MSG_BROADCAST) == 0) {
+		if (BIT_TEST(queue->flags, QUEUE_FLAG_DURABLE) || BIT_TEST(msg->flags, FLAG_MSG_DURABLE)) {
+			BIT_SET(msg->flags, FLAG_MSG_DURABLE);
+			journal_enqueue(queue->sysdata->journal, msg, queue->name);
+		}
+	}
+
 	// add the message to the queue
 	ll_push_tail(&queue->msg_pending, msg);
+	queue_pending_add(queue, msg);
+
+	msg->queued_at = hist_now();
+	if (BIT_TEST(msg->flags, FLAG_MSG_BROADCAST)) { queue->qstats.broadcasts ++; }
+	else                                           { queue->qstats.requests ++; }
+	queue->qstats.bytes_in += payload_length(msg->data);
+	if (ll_count(&queue->msg_pending) > queue->qstats.depth_max) {
+		queue->qstats.depth_max = ll_count(&queue->msg_pending);
+	}
 
-	// if the only message in the list is the one we just added, then we will
-	// deliver it now.
-	if (ll_count(&queue->msg_pending) == 1) {
-		queue_deliver(queue);
+	// if the message has a timeout, then start its timer.
+	if (BIT_TEST(msg->flags, FLAG_MSG_TIMEOUT) && msg->timeout > 0) {
+		queue_timer_start(queue->sysdata, msg);
 	}
+
+	// schedule a delivery pass.  Any other messages that are added before it
+	// runs will be delivered in the same pass.
+	queue_schedule(queue);
 }
 
+
 //-----------------------------------------------------------------------------
-// Check to see if a particular node is consuming the queue.  The node itself
-// does not know what queues it is consuming, so we must go thru the list that
-// the queue has.
-// Returns 0 if it is not in any of the lists for the queue.
-// Otherwise returns 1 if it is either ready or busy, and -1 if it is in the
-// waiting list.
-int queue_check_node(queue_t *queue, node_t *node)
+// A request from the node has been added to the queue.  If the queue (or all
+// the queues together) now has more pending data than it is allowed, we stop
+// reading from the node until it goes down again.  Nodes that are consuming
+// queues, and links to controllers and other workers, are never paused,
+// because we need to keep reading their replies for the queues to drain.
+void queue_throttle(queue_t *queue, node_t *node)
+{
+	system_data_t *sysdata;
+	settings_t *settings;
+	list_t *paused;
+
+	assert(queue);
+	assert(node);
+	assert(queue->sysdata);
+
+	sysdata = queue->sysdata;
+	settings = sysdata->settings;
+	assert(settings);
+
+	if (BIT_TEST(node->flags, FLAG_NODE_PAUSED) || BIT_TEST(node->flags, FLAG_NODE_PEER) || BIT_TEST(node->flags, FLAG_NODE_CONTROLLER) || node->queues) {
+		return;
+	}
+
+	if (settings->backlog_queue > 0 && queue->backlog > settings->backlog_queue) {
+		paused = &queue->paused;
+	}
+	else if (settings->backlog_limit > 0 && sysdata->backlog > settings->backlog_limit) {
+		assert(sysdata->paused);
+		paused = sysdata->paused;
+	}
+	else {
+		return;
+	}
+
+	logger(sysdata->logging, 2, "Pausing node:%d, queue:'%s' has %llu bytes pending (%llu total)",
+		node->handle, queue->name, queue->backlog, sysdata->backlog);
+	node_pause(node, paused);
+
+	assert(sysdata->stats);
+	sysdata->stats->paused ++;
+
+	if (settings->server_full) {
+		sendServerFull(node);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Check to see if a particular node is consuming the queue.  The node keeps a
+// list of the queues it is a member of, so we go thru that list.
+// Returns 0 if it is not in any of the lists for the queue.
+// Otherwise returns 1 if it is either ready or busy, -1 if it is in the
+// waiting list, and -2 if it is a controller that we have sent a consume to.
+int queue_check_node(queue_t *queue, node_t *node)
 {
 	int found = 0;
 	node_queue_t *nq;
-	node_t *tmp;
 
 	assert(queue);
 	assert(node);
 
-	ll_start(&queue->nodes_ready);
-	nq = ll_next(&queue->nodes_ready);
-	while (nq) {
-		assert(nq->node);
-		if (nq->node == node) {
-			found = 1;
-			nq = NULL;
-		}
-		else {
-			nq = ll_next(&queue->nodes_ready);
+	for (nq = node->queues; nq; nq = nq->node_next) {
+		assert(nq->node == node);
+		if (nq->queue == queue) {
+			if (nq->list == &queue->nodes_ready || nq->list == &queue->nodes_busy) {
+				return(1);
+			}
+			else if (nq->list == &queue->nodes_waiting) {
+				found = -1;
+			}
+			else {
+				assert(nq->list == &queue->nodes_consuming);
+				if (found == 0) { found = -2; }
+			}
 		}
 	}
-	ll_finish(&queue->nodes_ready);
-	assert(found >= 0);
 
-	if (found == 0) {
-		ll_start(&queue->nodes_busy);
-		nq = ll_next(&queue->nodes_busy);
-		while (nq) {
-			assert(nq->node);
-			if (nq->node == node) {
-				found = 1;
-				nq = NULL;
-			}
-			else {
-				nq = ll_next(&queue->nodes_busy);
+	assert(found <= 0);
+	return(found);
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns non-zero if the entry is for one of our own consumers, rather than
+// another controller or worker that is consuming the queue for its consumers.
+static int nq_local(node_queue_t *nq)
+{
+	assert(nq);
+	assert(nq->node);
+
+	return(BIT_TEST(nq->node->flags, FLAG_NODE_CONTROLLER) == 0
+		&& BIT_TEST(nq->node->flags, FLAG_NODE_PEER) == 0
+		&& BIT_TEST(nq->node->flags, FLAG_NODE_FORWARDER) == 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// The number of requests for the queue that our own consumers can process at
+// one time.  This is the credit that is given to the controllers we consume
+// the queue from, so that they can keep our consumers as busy as their own.
+// It is always at least one, so that the link is not treated as unlimited.
+static int queue_capacity(queue_t *queue)
+{
+	node_queue_t *nq;
+	int capacity = 0;
+	int i;
+	nq_list_t *lists[2];
+
+	assert(queue);
+
+	lists[0] = &queue->nodes_ready;
+	lists[1] = &queue->nodes_busy;
+	for (i=0; i<2; i++) {
+		for (nq = lists[i]->head; nq; nq = nq->next) {
+			if (nq_local(nq)) {
+				if (nq->max == 0) { capacity += QUEUE_CREDIT_MAX; }
+				else              { capacity += nq->max; }
 			}
 		}
-		ll_finish(&queue->nodes_busy);
-		assert(found >= 0);
-
-		if (found == 0) {
-			ll_start(&queue->nodes_waiting);
-			nq = ll_next(&queue->nodes_waiting);
-			while (nq) {
-				assert(nq->node);
-				if (nq->node == node) {
-					found = -1;
-					nq = NULL;
-				}
-				else {
-					nq = ll_next(&queue->nodes_waiting);
-				}
+	}
+
+	if (capacity < 1) { capacity = 1; }
+	else if (capacity > QUEUE_CREDIT_MAX) { capacity = QUEUE_CREDIT_MAX; }
+
+	return(capacity);
+}
+
+
+//-----------------------------------------------------------------------------
+// The consumers of the queue have changed, so tell the controllers that we
+// are consuming it from, if the credit they have given us is different.
+static void queue_credit(queue_t *queue)
+{
+	node_queue_t *nq;
+	int credit;
+
+	assert(queue);
+	assert(queue->name);
+	assert(queue->sysdata);
+
+	if (queue->nodes_consuming.count == 0) {
+		return;
+	}
+
+	credit = queue_capacity(queue);
+	for (nq = queue->nodes_consuming.head; nq; nq = nq->next) {
+		assert(nq->node);
+		if (nq->max != credit) {
+			logger(queue->sysdata->logging, 2,
+				"queue %d:'%s' credit for controller node:%d changed from %d to %d",
+				queue->qid, queue->name, nq->node->handle, nq->max, credit);
+			nq->max = credit;
+			sendCredit(nq->node, queue->name, credit);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// A controller that consumes the queue from us has said how many requests it
+// can take at a time.  Its entry is moved between the ready and busy lists to
+// suit, and any pending messages can be sent to it.
+void queue_set_credit(queue_t *queue, node_t *node, int max)
+{
+	node_queue_t *nq;
+
+	assert(queue);
+	assert(node);
+	assert(max > 0);
+
+	for (nq = node->queues; nq; nq = nq->node_next) {
+		assert(nq->node == node);
+		if (nq->queue == queue && (nq->list == &queue->nodes_ready || nq->list == &queue->nodes_busy)) {
+			nq->max = max;
+			if (nq->list == &queue->nodes_busy && nq->waiting < max) {
+				nq_move_tail(&queue->nodes_ready, nq);
 			}
-			ll_finish(&queue->nodes_waiting);
-
-			if (found == 0) {
-				ll_start(&queue->nodes_consuming);
-				tmp = ll_next(&queue->nodes_consuming);
-				while (tmp) {
-					if (tmp == node) {
-						found = -2;
-						tmp = NULL;
-					}
-					else {
-						tmp = ll_next(&queue->nodes_consuming);
-					}
-				}
-				ll_finish(&queue->nodes_consuming);
-				assert(found <= 0);
+			else if (nq->list == &queue->nodes_ready && nq->waiting >= max) {
+				nq_move_tail(&queue->nodes_busy, nq);
+			}
+			else if (nq->list == &queue->nodes_ready) {
+				nq_heap_update(queue, nq);
 			}
 		}
-		assert(found <= 0);
 	}
 
-	return(found);
+	if (ll_count(&queue->msg_pending) > 0) {
+		queue_schedule(queue);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a consume request for this queue to a controller node, and keep track
+// of it, so that we dont send it again.  The max is the credit: the number of
+// requests our consumers can take, which is updated as they come and go.
+void queue_notify_controller(queue_t *queue, node_t *node)
+{
+	node_queue_t *nq;
+	short int exclusive;
+	int max;
+
+	assert(queue);
+	assert(queue->qid > 0);
+	assert(queue->name != NULL);
+	assert(node);
+	assert((BIT_TEST(node->flags, FLAG_NODE_CONTROLLER) && node->controller) || BIT_TEST(node->flags, FLAG_NODE_PEER));
+
+	exclusive = 0;
+	if (BIT_TEST(queue->flags, QUEUE_FLAG_EXCLUSIVE)) {
+		exclusive = 1;
+	}
+
+	max = queue_capacity(queue);
+
+	// add the entry before sending, in case the send fails and the node is closed.
+	nq = nq_new(queue, node, max, QUEUE_LOW_PRIORITY);
+	nq_push_head(&queue->nodes_consuming, nq);
+
+	logger(node->sysdata->logging, 2, "Sending consume of '%s' to controller node %d", queue->name, node->handle);
+	sendConsume(node, queue->name, max, QUEUE_LOW_PRIORITY, exclusive);
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns non-zero if we have sent a consume request for the queue to this
+// node.
+static int queue_check_consuming(queue_t *queue, node_t *node)
+{
+	node_queue_t *nq;
+
+	assert(queue);
+	assert(node);
+
+	for (nq = node->queues; nq; nq = nq->node_next) {
+		assert(nq->node == node);
+		if (nq->queue == queue && nq->list == &queue->nodes_consuming) {
+			return(1);
+		}
+	}
+
+	return(0);
 }
 
 
@@ -250,7 +974,6 @@ int queue_check_node(queue_t *queue, node_t *node)
 static void queue_notify(queue_t *queue)
 {
 	node_t *node;
-	short int exclusive;
 	
 	assert(queue->qid > 0);
 	assert(queue->name != NULL);
@@ -263,452 +986,1011 @@ static void queue_notify(queue_t *queue)
 	while ((node = ll_next(queue->sysdata->nodelist))) {
 		
 		if (BIT_TEST(node->flags, FLAG_NODE_CONTROLLER)) {
-
 			assert(node->controller);
+			if (queue_check_node(queue, node) == 0) {
+				queue_notify_controller(queue, node);
+			}
+		}
+		else if (BIT_TEST(node->flags, FLAG_NODE_PEER)) {
+			// the other worker could also be consuming this queue from us, so
+			// we only look for a consume that we have sent to it.
+			assert(node->controller == NULL);
+			if (queue_check_consuming(queue, node) == 0) {
+				queue_notify_controller(queue, node);
+			}
+		}
+		else {
+			assert(node->controller == NULL);
+		}
+	}
+	ll_finish(queue->sysdata->nodelist);
+}
+
+
+//-----------------------------------------------------------------------------
+// The exclusive consumer of the queue has gone, and is not processing any of
+// its requests anymore.  The standby that has been waiting the longest takes
+// over, and the backlog is delivered to it straight away.
+static void queue_promote(queue_t *queue)
+{
+	node_queue_t *nq;
+
+	assert(queue);
+	assert(queue->name);
+	assert(queue->qid > 0);
+	assert(queue->sysdata);
+	assert(queue->handover == 0);
+	assert(queue->nodes_ready.count == 0);
+	assert(queue->nodes_busy.count == 0);
+
+	nq = nq_pop_tail(&queue->nodes_waiting);
+	if (nq) {
+		assert(nq->node);
+
+		// add it to the ready list.
+		nq_push_head(&queue->nodes_ready, nq);
+
+		// tell the node that we are consuming the queue now.
+		sendConsumeReply(nq->node, queue->name, queue->qid);
+
+		if (queue->failover_at > 0) {
+			hist_record(&queue->qstats.failover, hist_now() - queue->failover_at);
+		}
+
+		logger(queue->sysdata->logging, 2,
+			"Promoting waiting node:%d to EXCLUSIVE queue '%s' (%d pending).",
+			nq->node->handle, queue->name, ll_count(&queue->msg_pending));
+
+		// requests that were lost with the old consumer may still be going back
+		// on the pending list, so the delivery is done once they are all there.
+		if (ll_count(&queue->msg_pending) > 0) {
+			queue_schedule(queue);
+		}
+
+		queue_credit(queue);
+	}
+
+	queue->failover_at = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// A request that an exclusive consumer still had when it left the queue is
+// not being processed by it anymore.  When it was the last one, the standby
+// can take over.
+static void queue_handover_done(queue_t *queue, message_t *msg)
+{
+	assert(queue);
+	assert(msg);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_HANDOVER));
+	assert(queue->handover > 0);
+
+	BIT_CLEAR(msg->flags, FLAG_MSG_HANDOVER);
+	queue->handover --;
+
+	if (queue->handover == 0 && queue->nodes_ready.count == 0 && queue->nodes_busy.count == 0) {
+		queue_promote(queue);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// When a node needs to cancel all the queues that it is consuming, then we go
+// thru the list of queues that the node is a member of, and remove the node
+// from them.
+void queue_cancel_node(node_t *node)
+{
+	queue_t *queue;
+	node_queue_t *nq;
+	message_t *msg, *next;
 	
-			exclusive = 0;
-			if (BIT_TEST(queue->flags, QUEUE_FLAG_EXCLUSIVE)) {
-				exclusive = 1;
+	assert(node);
+	assert(node->sysdata);
+
+	while ((nq = node->queues)) {
+		assert(nq->node == node);
+		queue = nq->queue;
+		assert(queue);
+		assert(queue->qid > 0);
+		assert(queue->name);
+
+		if (nq->list == &queue->nodes_consuming) {
+			logger(node->sysdata->logging, 2,
+				"queue %d:'%s' removing node:%d from consuminglist",
+				queue->qid, queue->name, node->handle);
+			nq_delete(nq);
+		}
+		else if (nq->list == &queue->nodes_waiting) {
+			logger(node->sysdata->logging, 2,
+				"queue %d:'%s' removing node:%d from waitinglist",
+				queue->qid, queue->name, node->handle);
+			nq_delete(nq);
+		}
+		else {
+			assert(nq->list == &queue->nodes_ready || nq->list == &queue->nodes_busy);
+			logger(node->sysdata->logging, 2,
+				"queue %d:'%s' removing node:%d from %s list",
+				queue->qid, queue->name, node->handle,
+				nq->list == &queue->nodes_busy ? "busy" : "ready");
+
+			// if the node still has messages it was processing, they can no longer
+			// refer to this entry.  They are still in the list the node keeps, so
+			// they can be sent again if the connection is lost before they are
+			// done.  Messages that had already timed out were only waiting for this
+			// node to respond, so they can be discarded now.  For an exclusive
+			// queue, the standby has to wait for the rest.
+			if (nq->waiting > 0 || nq->expired > 0) {
+				msg = node->inflight;
+				while (msg) {
+					next = msg->inflight_next;
+					if (msg->target_nq == nq) {
+						if (BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT)) {
+							queue_msg_expired_done(queue, msg);
+						}
+						else {
+							msg->target_nq = NULL;
+							if (BIT_TEST(queue->flags, QUEUE_FLAG_EXCLUSIVE)) {
+								BIT_SET(msg->flags, FLAG_MSG_HANDOVER);
+								queue->handover ++;
+							}
+						}
+					}
+					msg = next;
+				}
+				assert(nq->expired == 0);
+			}
+			
+			nq_delete(nq);
+			nq = NULL;
+			
+			// The node was found already.  If the queue was in exclusive mode, need
+			// to update the lists and activate the one that is waiting.
+			if (BIT_TEST(queue->flags, QUEUE_FLAG_EXCLUSIVE) ||
+				(queue->nodes_ready.count == 0 && queue->nodes_busy.count == 0 && queue->nodes_waiting.count > 0)) {
+				// queue was already in exclusive mode, and we have removed a node, so that means our main lists should be empty.
+				assert(queue->nodes_ready.count == 0);
+				assert(queue->nodes_busy.count == 0);
+
+				if (queue->nodes_waiting.count > 0 || queue->handover > 0) {
+					queue->failover_at = hist_now();
+				}
+
+				if (queue->handover == 0) {
+					queue_promote(queue);
+				}
+				else {
+					logger(node->sysdata->logging, 2,
+						"queue %d:'%s' standby will take over when node:%d has finished %d requests.",
+						queue->qid, queue->name, node->handle, queue->handover);
+				}
 			}
 
-			if (queue_check_node(queue, node) == 0) {
-				sendConsume(node, queue->name, 1, QUEUE_LOW_PRIORITY, exclusive);
-				ll_push_head(&queue->nodes_consuming, node);
-				logger(node->sysdata->logging, 2, "Sending consume of '%s' to controller node %d", queue->name, node->handle);
+			// our consumers can take less now, so the controllers we consume the
+			// queue from should give us less.
+			queue_credit(queue);
+		}
+		
+		// the node has being removed from the queue, if there are no more nodes, and there are no messages in the queue, then the queue needs to be deleted.
+		if (queue->nodes_busy.count <= 0 && queue->nodes_ready.count == 0) {
+
+			if (queue->nodes_waiting.count > 0) {
+				// the waiting node will be promoted when the requests the exclusive
+				// consumer still has are done.
+				assert(queue->handover > 0);
+			}
+			else {
+				// this queue has no nodes at all, not even any waiting to start up exclusively.
+				if (ll_count(&queue->msg_pending) <= 0 && ll_count(&queue->msg_proc) <= 0) {
+					queue_shutdown(queue);
+				}
+				else {
+					// but it does have messages waiting to be deliverd... so we wont delete the queue just yet.
+				}
+			}
+		}
+	}
+
+	assert(node->queues == NULL);
+}
+
+
+
+queue_t * queue_create(system_data_t *sysdata, char *qname)
+{ 
+	queue_t *q;
+
+	assert(sysdata);
+	assert(sysdata->qdir);
+	assert(qname);
+	
+	// create an initialise a new queue structure.
+	q = (queue_t *) malloc(sizeof(queue_t));
+	queue_init(q);
+
+	// get an unused queue-id from the directory.
+	q->qid = qdir_new_qid(sysdata->qdir);
+	assert(q->qid > 0);
+
+	// ok, we should now have a 'q' pointer, so we should assign some data to it.
+	assert(q != NULL);
+	assert(q->name == NULL);
+	assert(strlen(qname) > 0);
+	assert(strlen(qname) < 256);
+	q->name =strdup(qname);
+
+	q->sysdata = sysdata;
+
+	assert(sysdata->settings);
+	q->policy = sysdata->settings->policy;
+
+	// add the queue to the queue list, and to the directory so that it can be found.
+	ll_push_head(sysdata->queues, q);
+	qdir_add(sysdata->qdir, q->name, q->qid, q);
+
+	return (q);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the node to the queue as a consumer.  If the node is requesting an
+// exclusive consume, then we will accept it if we aren't already processing
+// any others.  Otherwise it will go on the waiting list.
+int queue_add_node(queue_t *queue, node_t *node, int max, int priority, unsigned int flags)
+{
+	node_queue_t *nq;
+	
+	assert(queue);
+	assert(node);
+	assert(max >= 0);
+	assert(priority >= 0);
+		
+	// We need to create a node_queue_t object to hold the node details in it.
+	// It is also added to the list of queues that the node is a member of.
+	nq = nq_new(queue, node, max, priority);
+
+	// check to see if the current queue settings are for it to be
+	// exclusive.   If so, then we will need to add this node to the waiting
+	// list.
+	if (BIT_TEST(queue->flags, QUEUE_FLAG_EXCLUSIVE) && (queue->nodes_busy.count > 0 || queue->nodes_ready.count > 0 || queue->handover > 0)) {
+		// The queue is already in exclusive mode, and we have nodes processing
+		// it (or the one that left is still finishing its requests), so this
+		// node would need to be added to the waiting list.
+
+		nq_push_head(&queue->nodes_waiting, nq);
+		logger(node->sysdata->logging, 2, "processConsume - Defered, queue already consumed exclusively.");
+		return (0);
+	}
+	else {
+		assert(queue->nodes_waiting.count == 0);
+
+		// if the consume request was for an EXCLUSIVE queue (and since we got
+		// this far it means that no other nodes are consuming this queue yet),
+		// then we mark it as exclusive.
+		if (BIT_TEST(flags, QUEUE_FLAG_EXCLUSIVE)) {
+			assert(queue->nodes_ready.count == 0);
+			assert(queue->nodes_busy.count == 0);
+			BIT_SET(queue->flags, QUEUE_FLAG_EXCLUSIVE);
+			logger(node->sysdata->logging, 2, 
+				"Consuming Queue '%s' in EXCLUSIVE mode.",
+				expbuf_string(&node->data.queue));
+		}
+
+		// add the node to the appropriate list.
+		nq_push_head(&queue->nodes_ready, nq);
+
+		// notify other nodes (controllers) that we are consuming a queue.  If the
+		// consumer is another worker, then it has already done that itself.
+		assert(queue->sysdata);
+		if (BIT_TEST(node->flags, FLAG_NODE_PEER) == 0) {
+			queue_notify(queue);
+		}
+
+		// the controllers that already have our consume request can now give us
+		// more at a time.
+		if (nq_local(nq)) {
+			queue_credit(queue);
+		}
+
+		logger(node->sysdata->logging, 2, "Consuming queue: qid=%d", queue->qid);
+
+		return(1);	
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Take the message out of the pending list, and give it to the consumer.  It
+// is normally the one at the head of the list.  It is not sent here, so that
+// several can be sent together.
+static void queue_deliver_to(queue_t *queue, node_queue_t *nq, message_t *msg)
+{
+	system_data_t *sysdata;
+
+	assert(queue);
+	assert(queue->sysdata);
+	assert(nq);
+	assert(nq->node);
+	assert(msg);
+	sysdata = queue->sysdata;
+
+	assert(nq->max == 0 || (nq->waiting < nq->max));
+	if (msg == ll_get_head(&queue->msg_pending)) {
+		ll_pop_head(&queue->msg_pending);
+	}
+	else {
+		ll_remove(&queue->msg_pending, msg);
+	}
+	queue_pending_remove(queue, msg, 1);
+	
+	// add the node pointer to the message, and the entry, so that when
+	// the message is done we dont need to look for it.
+	msg->target_node = nq->node;
+	msg->target_nq = nq;
+	node_inflight_add(nq->node, msg);
+
+	// increment the 'waiting' count for the nq.
+	nq->waiting ++;
+	nq->last_used = ++queue->deliver_seq;
+	assert(nq->waiting > 0 && (nq->max == 0 || nq->waiting <= nq->max));
+
+	// if the node has reached the max number of consumed messages, then it
+	// will be put in the busy list.  Otherwise it stays ready, but needs
+	// to be re-ordered since it now has more outstanding.
+	if (nq->max > 0 && nq->waiting >= nq->max) {
+		nq_move_tail(&queue->nodes_busy, nq);
+	}
+	else {
+		nq_heap_update(queue, nq);
+	}
+		
+	// add the message to the msgproc list.
+	ll_push_head(&queue->msg_proc, msg);
+	if (ll_count(&queue->msg_proc) > queue->qstats.inflight_max) {
+		queue->qstats.inflight_max = ll_count(&queue->msg_proc);
+	}
+
+	msg->sent_at = hist_now();
+	hist_record(&queue->qstats.wait, msg->sent_at - msg->queued_at);
+
+	if (BIT_TEST(nq->node->flags, FLAG_NODE_PEER)) {
+		assert(sysdata->stats);
+		sysdata->stats->forwarded ++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Check if the message at the head of the pending list can go in the same
+// BATCH as the first one, which is already going to the node.
+static int queue_batchable(message_t *first, message_t *msg, node_t *node)
+{
+	assert(first);
+	assert(msg);
+	assert(node);
+
+	if (BIT_TEST(msg->flags, FLAG_MSG_BROADCAST)) {
+		return(0);
+	}
+	if (BIT_TEST(msg->flags, FLAG_MSG_NOREPLY) != BIT_TEST(first->flags, FLAG_MSG_NOREPLY)) {
+		return(0);
+	}
+
+	// requests from another worker are only for our own consumers.
+	if (BIT_TEST(msg->flags, FLAG_MSG_PEER) && BIT_TEST(node->flags, FLAG_NODE_PEER)) {
+		return(0);
+	}
+
+	assert(msg->data);
+	return(payload_spilled(msg->data) == 0 && payload_length(msg->data) < NODE_OUT_COPY);
+}
+
+
+//-----------------------------------------------------------------------------
+// A request from another worker is at the head of the pending list, but none
+// of our own consumers are ready for it.  Rather than hold up everything
+// behind it, find the first request that did not come from another worker,
+// so that it can go to one of the workers instead.  Returns NULL if there
+// isn't one.
+static message_t * queue_skip_peer(queue_t *queue)
+{
+	message_t *msg;
+
+	assert(queue);
+
+	ll_start(&queue->msg_pending);
+	while ((msg = ll_next(&queue->msg_pending))) {
+		if (BIT_TEST(msg->flags, FLAG_MSG_PEER) == 0 && BIT_TEST(msg->flags, FLAG_MSG_BROADCAST) == 0) {
+			break;
+		}
+	}
+	ll_finish(&queue->msg_pending);
+
+	return(msg);
+}
+
+
+//-----------------------------------------------------------------------------
+// Deliver the message at the head of the pending list.  If the consumer it
+// goes to can take a BATCH, then the messages behind it are sent with it, as
+// many as the consumer has room for.  Returns the number of messages that
+// were sent, or 0 if there were no nodes that could take it, in which case
+// the message is left at the head of the pending list.  A request from
+// another worker that only the other workers could take is passed over for
+// the next request that they can.
+static int queue_deliver_one(queue_t *queue)
+{
+	message_t *msg, *next;
+	message_t *batch[QUEUE_BATCH_MAX];
+	system_data_t *sysdata;
+	node_queue_t *nq;
+	unsigned int bytes;
+	int count;
+
+	assert(queue);
+	assert(queue->sysdata);
+	sysdata = queue->sysdata;
+
+	assert(ll_count(&queue->msg_pending) > 0);
+	msg = ll_get_head(&queue->msg_pending);
+	assert(msg);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
+	
+	// check the message to see if it is broadcast.
+	if (BIT_TEST(msg->flags, FLAG_MSG_BROADCAST)) {
+
+		// This is a broadcast message.
+		assert(BIT_TEST(msg->flags, FLAG_MSG_NOREPLY));
+		assert(msg->source_node == NULL);
+		assert(msg->target_node == NULL);
+		assert(msg->queue != NULL);
+
+		// if we have at least one node that is not busy, then we will send the message.
+		// even if a node is busy, we will send the broadcast to it.
+		if (queue->nodes_ready.count == 0) {
+			// we dont have any available nodes so we wont send the broadcast yet.
+			// We use this for throttling so we dont give our nodes a deluge if they
+			// are busy.   Of course, if there are a number of broadcast messages
+			// next in the queue, it will deliver them all pretty quickly until some
+			// normal requests come in.
+			return(0);
+		}
+
+		logger(sysdata->logging, 2, "queue_deliver: delivering broadcast message");
+		ll_pop_head(&queue->msg_pending);
+		queue_pending_remove(queue, msg, 1);
+		hist_record(&queue->qstats.wait, hist_now() - msg->queued_at);
+		sendBroadcast(queue, msg);
+		
+		// since it is broadcast, we are not expecting a reply, so we can delete
+		// the message.  Any node that has not sent the payload yet will still
+		// have its own reference to it.
+		assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
+		assert(msg->data);
+		payload_release(msg->data);
+		msg->data = NULL;
+		msg->queue = NULL;
+		message_clear(msg);
+		msglist_release(sysdata->msglist, msg);
+		count = 1;
+	}
+	else {
+		// This is a request.  Even requests with NOREPLY work the same at this
+		// point, because we keep the message in memory until DELIVERED is
+		// received.
+
+		// if we have a node that is ready, use it.
+		if (BIT_TEST(msg->flags, FLAG_MSG_PEER)) {
+			nq = nq_select_local(queue);
+			if (nq == NULL && nq_select(queue) != NULL) {
+				msg = queue_skip_peer(queue);
+				if (msg) {
+					nq = nq_select(queue);
+				}
 			}
 		}
 		else {
-			assert(node->controller == NULL);
+			nq = nq_select(queue);
+		}
+		if (nq == NULL) {
+			logger(sysdata->logging, 2,
+				"queue_deliver. q:%d, no nodes ready to consume.", queue->qid);
+			return(0);
 		}
+		
+		assert(nq->node);
+		queue_deliver_to(queue, nq, msg);
+		count = 1;
+
+		// fill up the rest of the room the consumer has with the messages that
+		// are behind it, if they are small.
+		if (BIT_TEST(nq->node->flags, FLAG_NODE_BATCH) && payload_spilled(msg->data) == 0 && payload_length(msg->data) < NODE_OUT_COPY) {
+			batch[0] = msg;
+			bytes = payload_length(msg->data);
+			while (count < QUEUE_BATCH_MAX && (nq->max == 0 || nq->waiting < nq->max) && (next = ll_get_head(&queue->msg_pending))) {
+				if (queue_batchable(msg, next, nq->node) == 0 || bytes + payload_length(next->data) > RQ_BATCH_BYTES) {
+					break;
+				}
+				bytes += payload_length(next->data);
+				queue_deliver_to(queue, nq, next);
+				batch[count] = next;
+				count ++;
+			}
+		}
+
+		// send the messages to the node.  This is done last, because if the
+		// send fails, the node will be closed and removed from the queue.
+		logger(sysdata->logging, 2, "queue_deliver: sending %d msgs to node:%d", count, nq->node->handle);
+		if (count > 1) {
+			sendBatch(nq->node, batch, count);
+		}
+		else {
+			sendMessage(nq->node, msg);
+		}
+	}
+
+	return(count);
+}
+
+
+//-----------------------------------------------------------------------------
+// Deliver as many of the pending messages as the consumers have capacity
+// for.  To avoid starving the socket reads when there is a large backlog, no
+// more than QUEUE_DRAIN_LIMIT messages are sent in one pass, and if there are
+// still messages that could be sent, another pass is scheduled.
+void queue_deliver(queue_t *queue)
+{
+	system_data_t *sysdata;
+	int sent = 0;
+	int count;
+
+	assert(queue);
+	assert(queue->sysdata);
+	sysdata = queue->sysdata;
+
+	while (sent < QUEUE_DRAIN_LIMIT && ll_count(&queue->msg_pending) > 0) {
+		count = queue_deliver_one(queue);
+		if (count == 0) {
+			break;
+		}
+		sent += count;
+	}
+
+	if (sent > 0) {
+		assert(sysdata->stats);
+		sysdata->stats->drain_passes ++;
+		sysdata->stats->drained += sent;
+		if (sent > sysdata->stats->drain_max) {
+			sysdata->stats->drain_max = sent;
+		}
+	}
+
+	if (sent >= QUEUE_DRAIN_LIMIT && ll_count(&queue->msg_pending) > 0) {
+		logger(sysdata->logging, 2,
+			"queue_deliver: queue:%d, drain limit reached, %d messages pending.",
+			queue->qid, ll_count(&queue->msg_pending));
+		queue_schedule(queue);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The deferred delivery event for the queue has fired.
+static void queue_deliver_handler(int fd, short int flags, void *arg)
+{
+	queue_t *queue = (queue_t *) arg;
+
+	assert(fd < 0);
+	assert(queue);
+
+	assert(BIT_TEST(queue->flags, QUEUE_FLAG_DELIVERY));
+	BIT_CLEAR(queue->flags, QUEUE_FLAG_DELIVERY);
+
+	if (ll_count(&queue->msg_pending) > 0) {
+		queue_deliver(queue);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Arrange for the pending messages in the queue to be delivered once the
+// current event has been processed.  If a delivery pass is already scheduled
+// then nothing more needs to be done, so lots of messages arriving in one read
+// will be delivered in one pass.
+void queue_schedule(queue_t *queue)
+{
+	struct timeval t = {.tv_sec = 0, .tv_usec = 0};
+	
+	assert(queue);
+	assert(queue->sysdata);
+	assert(queue->sysdata->evbase);
+
+	if (BIT_TEST(queue->flags, QUEUE_FLAG_DELIVERY) == 0) {
+		BIT_SET(queue->flags, QUEUE_FLAG_DELIVERY);
+		event_base_once(queue->sysdata->evbase, -1, EV_TIMEOUT, queue_deliver_handler, (void *) queue, &t);
 	}
-	ll_finish(queue->sysdata->nodelist);
 }
 
 
 //-----------------------------------------------------------------------------
-// When a node needs to cancel all the queues that it is consuming, then we go
-// thru the queue list, and remove the node from any of them.  At the point of
-// invocation, the node does not know what queues it is consuming.
-void queue_cancel_node(node_t *node)
+// The consumer that had the message is not processing it anymore, so it can
+// be given another one.
+static void queue_msg_release(queue_t *queue, message_t *msg)
 {
-	queue_t *queue;
 	node_queue_t *nq;
-	int found;
-	
-	assert(node);
-	assert(node->sysdata);
-	assert(node->sysdata->queues);
 
-	ll_start(node->sysdata->queues);
-	while ((queue = ll_next(node->sysdata->queues))) {
-		assert(queue->qid > 0);
-		assert(queue->name);
+	assert(queue);
+	assert(msg);
+
+	if (BIT_TEST(msg->flags, FLAG_MSG_HANDOVER)) {
+		assert(msg->target_nq == NULL);
+		queue_handover_done(queue, msg);
+	}
 
-		found = 0;
+	nq = msg->target_nq;
+	if (nq) {
+		assert(nq->queue == queue);
+		assert(nq->node == msg->target_node);
+		assert(nq->waiting > 0);
+		nq->waiting --;
 		
-		// need to check this node in the busy list.
-		ll_start(&queue->nodes_busy);
-		nq = ll_next(&queue->nodes_busy);
-		while (nq && found == 0) {
+		if (nq->list == &queue->nodes_busy && (nq->max == 0 || nq->waiting < nq->max)) {
+			nq_move_tail(&queue->nodes_ready, nq);
+		}
+		else if (nq->list == &queue->nodes_ready) {
+			nq_heap_update(queue, nq);
+		}
 
-			assert(nq->node);
-			if (nq->node == node) {
-				logger(node->sysdata->logging, 2, "queue %d:'%s' removing node:%d from busy list", queue->qid, queue->name, node->handle);
+		msg->target_nq = NULL;
+	}
+}
 
-				ll_remove(&queue->nodes_busy, nq);
 
-				free(nq);
-				nq = NULL;
-				found++;
-			}
-			else {
-				nq = ll_next(&queue->nodes_busy);
-			}
-		}
-		ll_finish(&queue->nodes_busy);
-		
-		// ready
-		if (found == 0) {
-			ll_start(&queue->nodes_ready);
-			nq = ll_next(&queue->nodes_ready);
-			while (nq) {
-	
-				assert(nq->node);
-				if (nq->node == node) {
-					logger(node->sysdata->logging, 2,
-						"queue %d:'%s' removing node:%d from ready list",
-						queue->qid, queue->name, node->handle);
+//-----------------------------------------------------------------------------
+// this function is called when a message has been delivered (in NOREPLY
+// mode), or a reply sent.  The message knows which entry it was sent to, so
+// we reduce the count of messages that node is processing, and if the node
+// was in the busy list, it can go back to the ready list.
+void queue_msg_done(queue_t *queue, message_t *msg)
+{
+	unsigned long long now;
 	
-					ll_remove(&queue->nodes_ready, nq);
-					
-					free(nq);
-					nq = NULL;
-					found++;
-				}
-				else {
-					nq = ll_next(&queue->nodes_ready);
-				}
-			}
-			ll_finish(&queue->nodes_ready);
+	assert(queue);
+	assert(msg);
+	assert(msg->queue == queue);
+
+	// messages that timed out are counted by the timeouts instead.
+	if (BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT) == 0) {
+		now = hist_now();
+		hist_record(&queue->qstats.service, now - msg->sent_at);
+		hist_record(&queue->qstats.total, now - msg->queued_at);
+		if (BIT_TEST(msg->flags, FLAG_MSG_NOREPLY) == 0) {
+			assert(msg->data);
+			queue->qstats.replies ++;
+			queue->qstats.bytes_out += payload_length(msg->data);
 		}
-		
-		if (found != 0) {
-			// The node was found already.  If the queue was in exclusive mode, need
-			// to update the lists and activate the one that is waiting.
+	}
 
-			if (BIT_TEST(queue->flags, QUEUE_FLAG_EXCLUSIVE) ||
-				(ll_count(&queue->nodes_ready) == 0 && ll_count(&queue->nodes_busy) == 0 && ll_count(&queue->nodes_waiting) > 0)) {
-				// queue was already in exclusive mode, and we have removed a node, so that means our main lists should be empty.
-				assert(ll_count(&queue->nodes_ready) == 0);
-				assert(ll_count(&queue->nodes_busy) == 0);
+	queue_msg_release(queue, msg);
+}
 
-				// if we have any nodes waiting, we will use it.
-				nq = ll_pop_tail(&queue->nodes_waiting);
-				if (nq) {
-					assert(nq->node);
-					assert(queue->name);
-					assert(queue->qid > 0);
 
-					// add it to the ready list.
-					ll_push_head(&queue->nodes_ready, nq);
 
-					// tell the node that we are consuming the queue now.
-					sendConsumeReply(nq->node, queue->name, queue->qid);
+//-----------------------------------------------------------------------------
+// The stats interval has finished.  Keep the stats that were collected, and
+// start again.
+void queue_stats_roll(queue_t *queue)
+{
+	assert(queue);
 
-					if (ll_count(&queue->msg_pending) > 0) {
-						// there are messages that need to be delivered.  Not sure yet, whether to assign an action to do this, or what...
-						assert(0);
-					}
+	queue->qstats_last = queue->qstats;
+	queue_stats_clear(&queue->qstats, ll_count(&queue->msg_pending));
+}
 
-					logger(node->sysdata->logging, 2,
-						"Promoting waiting node:%d to EXCLUSIVE queue '%s'.",
-						nq->node->handle, queue->name);
-				}
-			}
-		}
-		else {
-			assert(found == 0);
-		
-			// and waiting list.
-			ll_start(&queue->nodes_waiting);
-			nq = ll_next(&queue->nodes_waiting);
-			while (nq) {
-	
-				assert(nq->node);
-				if (nq->node == node) {
-					logger(node->sysdata->logging, 2,
-						"queue %d:'%s' removing node:%d from waitinglist",
-						queue->qid, queue->name, node->handle);
-	
-					ll_remove(&queue->nodes_waiting, nq);
-						
-					free(nq);
-					nq = NULL;
-					found++;
-				}
-				else {
-					nq = ll_next(&queue->nodes_waiting);
-				}
-			}
-			ll_finish(&queue->nodes_waiting);
-		}
-		
-		// the node has being removed from the queue, if there are no more nodes, and there are no messages in the queue, then the queue needs to be deleted.
-		if (ll_count(&queue->nodes_busy) <= 0 && ll_count(&queue->nodes_ready) == 0) {
 
-			if (ll_count(&queue->nodes_waiting) > 0) {
-				// we dont have any active nodes anymore, but we have a waiting node... we need to activate the waiting node.
-				assert(0);
-			}
-			else {
-				// this queue has no nodes at all, not even any waiting to start up exclusively.
-				if (ll_count(&queue->msg_pending) <= 0 && ll_count(&queue->msg_proc) <= 0) {
-					queue_shutdown(queue);
-				}
-				else {
-					// but it does have messages waiting to be deliverd... so we wont delete the queue just yet.
-				}
-			}
-		}
+//-----------------------------------------------------------------------------
+// The target node has responded to a message that had already timed out, or
+// the node has gone away.  The source has already been told, so the message
+// is discarded.
+void queue_msg_expired_done(queue_t *queue, message_t *msg)
+{
+	node_queue_t *nq;
+	system_data_t *sysdata;
+	
+	assert(queue);
+	assert(queue->sysdata);
+	assert(msg);
+	assert(msg->queue == queue);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT));
 
-		// and the nodes_consuming list
-		ll_start(&queue->nodes_consuming);
-		nq = ll_next(&queue->nodes_consuming);
-		while (nq) {
-			assert(nq->node);
-			if (nq->node == node) {
-				logger(node->sysdata->logging, 2,
-					"queue %d:'%s' removing node:%d from consuminglist",
-					queue->qid, queue->name, node->handle);
+	sysdata = queue->sysdata;
 	
-				ll_remove(&queue->nodes_consuming, nq);
-				free(nq);
-				nq = NULL;
-			}
-			else {
-				nq = ll_next(&queue->nodes_consuming);
-			}
-		}
-		ll_finish(&queue->nodes_consuming);
-		
+	nq = msg->target_nq;
+	if (nq) {
+		assert(nq->expired > 0);
+		nq->expired --;
+		msg->target_nq = NULL;
 	}
-	ll_finish(node->sysdata->queues);
 
-	
+	ll_remove(&queue->msg_proc, msg);
+	msg->queue = NULL;
+	assert(msg->target_node);
+	node_inflight_remove(msg->target_node, msg);
+	msg->target_node = NULL;
+	assert(msg->source_node == NULL);
+	assert(msg->data == NULL);
+
+	if (msg->jid > 0) {
+		journal_done(sysdata->journal, msg);
+	}
+	message_clear(msg);
+	msglist_release(sysdata->msglist, msg);
 }
 
 
+//-----------------------------------------------------------------------------
+// The node that was processing the message has gone away, or has said that it
+// could not deliver it (another controller or worker whose consumer went
+// away).  If the message has retries left, it goes back to the head of the
+// queue, and is sent to another consumer.  Otherwise the source is told that
+// it was not delivered, as it would have been when it timed out.
+void queue_msg_lost(queue_t *queue, message_t *msg)
+{
+	system_data_t *sysdata;
 
-queue_t * queue_create(system_data_t *sysdata, char *qname)
-{ 
-	queue_t *q, *tmp;
+	assert(queue);
+	assert(queue->sysdata);
+	assert(msg);
+	assert(msg->queue == queue);
+	assert(msg->target_node);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT) == 0);
 
-	assert(sysdata);
-	assert(qname);
-	
-	// create an initialise a new queue structure.
-	q = (queue_t *) malloc(sizeof(queue_t));
-	queue_init(q);
+	sysdata = queue->sysdata;
+	assert(sysdata->stats);
 
-	// look at the qid for the queue that is currently at the top of the list and set ours +1.
-	tmp = ll_get_head(sysdata->queues);
-	if (tmp) {
-		assert(tmp->qid > 0);
-		q->qid = tmp->qid + 1;
+	queue_msg_release(queue, msg);
+	ll_remove(&queue->msg_proc, msg);
+	node_inflight_remove(msg->target_node, msg);
+	msg->target_node = NULL;
+	BIT_CLEAR(msg->flags, FLAG_MSG_ACKED);
+
+	if (msg->retries > 0) {
+		assert(msg->data);
+		msg->retries --;
+		logger(sysdata->logging, 2, "queue %d:'%s' msg_id:%d consumer lost, sending again (%d retries left).",
+			queue->qid, queue->name, msg->id, msg->retries);
+
+		ll_push_head(&queue->msg_pending, msg);
+		queue_pending_add(queue, msg);
+		sysdata->stats->redelivered ++;
+
+		queue_schedule(queue);
 	}
 	else {
-		q->qid = 1;
-	}
-	assert(q->qid > 0);
+		logger(sysdata->logging, 2, "queue %d:'%s' msg_id:%d consumer lost, not delivered.",
+			queue->qid, queue->name, msg->id);
 
-	// ok, we should now have a 'q' pointer, so we should assign some data to it.
-	assert(q != NULL);
-	assert(q->name == NULL);
-	assert(strlen(qname) > 0);
-	assert(strlen(qname) < 256);
-	q->name =strdup(qname);
+		if (msg->source_node && BIT_TEST(msg->flags, FLAG_MSG_NOREPLY) == 0) {
+			sendUndelivered(msg->source_node, msg->source_id);
+		}
+		msg->source_node = NULL;
+		sysdata->stats->lost ++;
 
-	q->sysdata = sysdata;
+		if (msg->data) {
+			payload_release(msg->data);
+			msg->data = NULL;
+		}
 
-	// add the queue to the queue list.
-	ll_push_head(sysdata->queues, q);
+		msg->queue = NULL;
+		if (msg->jid > 0) {
+			journal_done(sysdata->journal, msg);
+		}
+		message_clear(msg);
+		msglist_release(sysdata->msglist, msg);
+	}
+}
 
-	return (q);
+
+//-----------------------------------------------------------------------------
+// The connection to the node has been lost, and it has already been removed
+// from the queues.  The messages it had not finished are either sent to
+// another consumer, or returned as undelivered.
+void queue_node_lost(node_t *node)
+{
+	message_t *msg;
+
+	assert(node);
+	assert(node->queues == NULL);
+
+	while ((msg = node->inflight)) {
+		assert(msg->target_node == node);
+		assert(msg->queue);
+		if (BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT)) {
+			// the source has already been told.
+			queue_msg_expired_done(msg->queue, msg);
+		}
+		else {
+			queue_msg_lost(msg->queue, msg);
+		}
+	}
 }
 
 
 //-----------------------------------------------------------------------------
-// Add the node to the queue as a consumer.  If the node is requesting an
-// exclusive consume, then we will accept it if we aren't already processing
-// any others.  Otherwise it will go on the waiting list.
-int queue_add_node(queue_t *queue, node_t *node, int max, int priority, unsigned int flags)
+// A message has timed out.  If it hasn't been sent to a node yet, then it is
+// removed from the queue.  If a node is processing it, then the slot the node
+// had for it is freed, but the message is kept until the node responds, so
+// that the message id cannot be re-used while the node still has it.  Either
+// way, the source is told that the message was not delivered.
+static void queue_msg_expired(tw_entry_t *entry, void *arg)
 {
+	message_t *msg = (message_t *) arg;
+	queue_t *queue;
+	system_data_t *sysdata;
 	node_queue_t *nq;
-	
+
+	assert(entry);
+	assert(msg);
+	assert(&msg->timer == entry);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
+	assert(BIT_TEST(msg->flags, FLAG_MSG_TIMEDOUT) == 0);
+
+	queue = msg->queue;
 	assert(queue);
-	assert(node);
-	assert(max >= 0);
-	assert(priority >= 0);
-		
-	// We need to create a node_queue_t object to hold the node details in it.
-	nq = (node_queue_t *) malloc(sizeof(node_queue_t));
-	nq->node = node;
-	nq->max = max;
-	nq->priority = priority;
-	nq->waiting = 0;
+	assert(queue->sysdata);
+	sysdata = queue->sysdata;
 
-	// check to see if the current queue settings are for it to be
-	// exclusive.   If so, then we will need to add this node to the waiting
-	// list.
-	if (BIT_TEST(queue->flags, QUEUE_FLAG_EXCLUSIVE) && (ll_count(&queue->nodes_busy) > 0 || ll_count(&queue->nodes_ready) > 0)) {
-		// The queue is already in exclusive mode, and we have nodes processing
-		// it, so this node would need to be added to the waiting list.
+	logger(sysdata->logging, 2, "queue %d:'%s' msg_id:%d timed out.", queue->qid, queue->name, msg->id);
+	queue->timeouts ++;
+	queue->qstats.timeouts ++;
+	assert(sysdata->stats);
+	sysdata->stats->timeouts ++;
 
-		ll_push_head(&queue->nodes_waiting, nq);
-		logger(node->sysdata->logging, 2, "processConsume - Defered, queue already consumed exclusively.");
-		return (0);
+	// tell the source that the message was not delivered.
+	if (msg->source_node && BIT_TEST(msg->flags, FLAG_MSG_NOREPLY) == 0) {
+		sendUndelivered(msg->source_node, msg->source_id);
+	}
+	msg->source_node = NULL;
+
+	if (msg->target_node == NULL) {
+		queue_pending_remove(queue, msg, 0);
+	}
+
+	if (msg->data) {
+		payload_release(msg->data);
+		msg->data = NULL;
+	}
+
+	if (msg->target_node == NULL) {
+		// the message was still waiting to be delivered.
+		ll_remove(&queue->msg_pending, msg);
+		msg->queue = NULL;
+		if (msg->jid > 0) {
+			journal_done(sysdata->journal, msg);
+		}
+		message_clear(msg);
+		msglist_release(sysdata->msglist, msg);
 	}
 	else {
-		assert(ll_count(&queue->nodes_waiting) == 0);
+		// the message was being processed by a node.
+		BIT_SET(msg->flags, FLAG_MSG_TIMEDOUT);
+		nq = msg->target_nq;
+		if (nq) {
+			// free up the slot the node had for it, and keep a note that it has an
+			// expired message.
+			queue_msg_done(queue, msg);
+			nq->expired ++;
+			msg->target_nq = nq;
+		}
+		else if (BIT_TEST(msg->flags, FLAG_MSG_HANDOVER)) {
+			// the exclusive consumer that left the queue did not finish it in time,
+			// so the standby does not wait for it any longer.  The message is still
+			// kept until the node responds to it.
+			queue_handover_done(queue, msg);
+		}
 
-		// if the consume request was for an EXCLUSIVE queue (and since we got
-		// this far it means that no other nodes are consuming this queue yet),
-		// then we mark it as exclusive.
-		if (BIT_TEST(flags, QUEUE_FLAG_EXCLUSIVE)) {
-			assert(ll_count(&queue->nodes_ready) == 0);
-			assert(ll_count(&queue->nodes_busy) == 0);
-			BIT_SET(queue->flags, QUEUE_FLAG_EXCLUSIVE);
-			logger(node->sysdata->logging, 2, 
-				"Consuming Queue '%s' in EXCLUSIVE mode.",
-				expbuf_string(&node->data.queue));
+		// the node may now be able to take more.
+		if (ll_count(&queue->msg_pending) > 0) {
+			queue_schedule(queue);
 		}
+	}
+}
 
-		// add the node to the appropriate list.
-		ll_push_head(&queue->nodes_ready, nq);
 
-		// notify other nodes (controllers) that we are consuming a queue.
-		assert(queue->sysdata);
-		queue_notify(queue);
+//-----------------------------------------------------------------------------
+// The timeout event has fired, so advance the timing wheel.
+void queue_timeout_handler(int fd, short int flags, void *arg)
+{
+	system_data_t *sysdata = (system_data_t *) arg;
 
-		logger(node->sysdata->logging, 2, "Consuming queue: qid=%d", queue->qid);
+	assert(fd < 0);
+	assert(sysdata);
+	assert(sysdata->timewheel);
 
-		return(1);	
-	}
+	tw_advance(sysdata->timewheel, tw_now(), queue_msg_expired);
+	queue_timeout_arm(sysdata);
 }
 
 
+
 //-----------------------------------------------------------------------------
-// This function should only be called from an action.  It will look at the
-// messages pending in the queue and will process the first one in the list.
-// If it is unable to process the message (because there are no available
-// consumers), then it will not send the message.  When consumers become
-// available, this action would be fired again anyway.  if there are any more
-// messages in the queue, it will fire the action again.
-void queue_deliver(queue_t *queue)
+// Mark the queue as durable, so that all of its messages are recorded in the
+// journal.  If there is no journal, then this does nothing.
+void queue_set_durable(queue_t *queue)
 {
-	message_t *msg;
-	system_data_t *sysdata;
-	node_queue_t *nq;
-
 	assert(queue);
 	assert(queue->sysdata);
+	assert(queue->name);
 
-	sysdata = queue->sysdata;
+	if (queue->sysdata->journal && BIT_TEST(queue->flags, QUEUE_FLAG_DURABLE) == 0) {
+		BIT_SET(queue->flags, QUEUE_FLAG_DURABLE);
+		journal_queue(queue->sysdata->journal, queue->name);
+		logger(queue->sysdata->logging, 2, "Queue '%s' is durable.", queue->name);
+	}
+}
 
-	// when this function is fired, there should be at least one message in the
-	// queue to process.
-	assert(ll_count(&queue->msg_pending) > 0);
-	msg = ll_pop_head(&queue->msg_pending);
-	if (msg) {
 
-		assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
-	
-		// check the message to see if it is broadcast.
-		if (BIT_TEST(msg->flags, FLAG_MSG_BROADCAST)) {
-	
-			logger(sysdata->logging, 2, "queue_deliver: delivering broadcast message");
-	
-			// This is a broadcast message.
-			assert(BIT_TEST(msg->flags, FLAG_MSG_NOREPLY));
-			assert(msg->source_node == NULL);
-			assert(msg->target_node == NULL);
-			assert(msg->queue != NULL);
-	
-			// if we have at least one node that is not busy, then we will send the message.
-			// even if a node is busy, we will send the broadcast to it.
-			if (ll_count(&queue->nodes_ready) > 0) {
-				ll_start(&queue->nodes_ready);
-				while ((nq = ll_next(&queue->nodes_ready))) {
-					assert(nq->node);
-					logger(sysdata->logging, 2, "queue_deliver: sending broadcast msg to node:%d", nq->node->handle);
-					assert(msg->target_node == NULL);
-					sendMessage(nq->node, msg);
-				}
-				ll_finish(&queue->nodes_ready);
-				
-				// since it is broadcast, we are not expecting a reply, so we can delete
-				// the message (it should already be removed from the node).
-				assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
-				message_clear(msg);
-
-				// at this point, we know about the message, but we dont really know
-				// it's id, so we wont update the 'next' value.  This is only a minor
-				// performance thing and we might spend more time trying to determine
-				// the id of this message than we would save.  This really only happens
-				// for broadcast messages, if we were using a REQUEST message, then we
-				// would actually know the ID when we got the REPLY back, so we could
-				// update the 'next' value then.  
-			}
-			else {
-				// we dont have any available nodes so we wont send the broadcast yet.
-				// We use this for throttling so we dont give our nodes a deluge if they
-				// are busy.   Of course, if there are a number of broadcast messages
-				// next in the queue, it will deliver them all pretty quickly until some
-				// normal requests come in.
-			}
-		}
-		else {
-			// This is a request.  Even requests with NOREPLY work the same at this
-			// point, because we keep the message in memory until DELIVERED is
-			// received.
-	
-			// if we have a node that is ready, use it.
-			nq = ll_pop_head(&queue->nodes_ready);
-			if (nq) {
-				assert(nq->max == 0 || (nq->waiting <= nq->max));
-				
-				// add the node pointer to the message.
-				msg->target_node = nq->node;
-
-				// send the message to the node.
-				logger(sysdata->logging, 2, "queue_deliver: sending msg to node:%d", nq->node->handle);
-				sendMessage(nq->node, msg);
-				// increment the 'waiting' count for the nq.
-				nq->waiting ++;
-				assert(nq->waiting > 0 && (nq->max == 0 || nq->waiting <= nq->max));
-		
-				// if the node has reached the max number of consumed messages, then it
-				// will be put in the busy list.  Otherwise it will be put in the tail
-				// of the ready list where it can receive more.
-				if (nq->max > 0 && nq->waiting >= nq->max) {
-					ll_push_tail(&queue->nodes_busy, nq);
-				}
-				else {
-					ll_push_tail(&queue->nodes_ready, nq);
-				}
-					
-				// add the message to the msgproc list.
-				ll_push_head(&queue->msg_proc, msg);
-			}
-			else {
-				logger(sysdata->logging, 2,
-					"queue_deliver. q:%d, no nodes ready to consume.", queue->qid);
+//-----------------------------------------------------------------------------
+// A durable queue was found in the journal when starting up.
+void queue_restore(const char *name, void *arg)
+{
+	system_data_t *sysdata = (system_data_t *) arg;
+	queue_t *q;
 
-				// we couldn't process the message, so put it back.
-				ll_push_head(&queue->msg_pending, msg);
-			}
-		}
-	}
-	else {
-		logger(sysdata->logging, 2,
-			"queue_deliver: queue:%d, no messages waiting.", queue->qid);
+	assert(name);
+	assert(sysdata);
+
+	q = queue_get_name(sysdata, name);
+	if (q == NULL) {
+		q = queue_create(sysdata, (char *) name);
 	}
+	assert(q);
+	queue_set_durable(q);
 }
 
 
-// this function is called when a message has been delivered (in NOREPLY
-// mode), or a reply sent.  It is used to remove a node from the busy list if
-// it is marked as busy.
-void queue_msg_done(queue_t *queue, node_t *node)
+//-----------------------------------------------------------------------------
+// A message that was not finished was found in the journal when starting up.
+// The node that sent it is gone, so there is nothing to send a reply to, and
+// it is queued as a NOREPLY message.
+void queue_restore_msg(const char *name, unsigned int flags, int timeout, char *data, unsigned int length, void *arg)
 {
-	node_queue_t *nq;
-	
-	assert(queue);
-	assert(node);
+	system_data_t *sysdata = (system_data_t *) arg;
+	queue_t *q;
+	message_t *msg;
+	expbuf_t *buf;
 
+	assert(name);
+	assert(data || length == 0);
+	assert(sysdata);
+	assert(sysdata->msglist);
+	assert(sysdata->bufpool);
 
-	ll_start(&queue->nodes_busy);
-	nq = ll_next(&queue->nodes_busy);
-	while (nq) {
-		assert(nq->node);
-		if (nq->node == node) {
-			// found it... in the busy list... so remove it from the busy list and add it back to the ready list.
+	q = queue_get_name(sysdata, name);
+	if (q == NULL) {
+		q = queue_create(sysdata, (char *) name);
+	}
+	assert(q);
 
-			assert(nq->waiting > 0);
-			nq->waiting --;
-			assert(nq->waiting >= 0);
-			
-			ll_remove(&queue->nodes_busy, nq);
-			ll_push_tail(&queue->nodes_ready, nq);
-			nq = NULL;
-		}
-		else {
-			nq = ll_next(&queue->nodes_busy);
-		}
+	if (sysdata->msglist->free == NULL) {
+		msglist_grow(sysdata->msglist);
 	}
-	ll_finish(&queue->nodes_busy);
-}
+	msg = msglist_alloc(sysdata->msglist);
+	assert(msg);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_ACTIVE));
 
+	buf = expbuf_pool_new(sysdata->bufpool, length);
+	assert(buf);
+	expbuf_set(buf, data, length);
+	msg->data = payload_new(sysdata->bufpool, buf);
+
+	BIT_SET(msg->flags, FLAG_MSG_NOREPLY);
+	BIT_SET(msg->flags, FLAG_MSG_DURABLE);
+	if (timeout > 0) {
+		message_set_timeout(msg, timeout);
+	}
+
+	queue_addmsg(q, msg);
+}
 
 
 //-----------------------------------------------------------------------------
@@ -739,45 +2021,45 @@ void queue_shutdown(queue_t *queue)
 
 
 	// delete the list of nodes that are consuming this queue.
-	if (ll_count(&queue->nodes_busy) > 0) {
+	if (queue->nodes_busy.count > 0) {
 		assert(0);
 	}
 
-	if (ll_count(&queue->nodes_ready) > 0) {
+	if (queue->nodes_ready.count > 0) {
 		assert(0);
 	}
 
-	if (ll_count(&queue->nodes_waiting) > 0) {
+	if (queue->nodes_waiting.count > 0) {
 		assert(0);
 	}
 }
 
 
-void queue_set_id(list_t *queues, const char *name, queue_id_t id)
+//-----------------------------------------------------------------------------
+// When another controller tells us the id it is using for a queue, we use the
+// same id for our copy of the queue.  If we are already using that id for a
+// different queue, we will keep the id that we have.
+void queue_set_id(system_data_t *sysdata, const char *name, queue_id_t id)
 {
-	queue_t *q = NULL;
-	queue_t *tmp;
+	queue_t *q;
 
-	assert(queues);
+	assert(sysdata);
+	assert(sysdata->qdir);
 	assert(name);
 	assert(id > 0);
 
-	ll_start(queues);
-	tmp = ll_next(queues);
-	while (tmp) {
-		assert(tmp->name);
-		assert(tmp->qid > 0);
-
-		if (strcmp(tmp->name, name) == 0) {
-			q = tmp;
+	q = qdir_find_name(sysdata->qdir, name);
+	if (q) {
+		assert(q->qid > 0);
+		if (qdir_set_qid(sysdata->qdir, q->qid, id) != 0) {
 			q->qid = id;
-			tmp = NULL;
 		}
 		else {
-			tmp = ll_next(queues);
+			logger(sysdata->logging, 1,
+				"Unable to change queue '%s' to qid:%d, already in use.  Keeping qid:%d.",
+				name, id, q->qid);
 		}
 	}
-	ll_finish(queues);
 }
 
 
@@ -785,6 +2067,8 @@ void queue_set_id(list_t *queues, const char *name, queue_id_t id)
 // This function is used to dump detailed information about the queue to a expanding buffer.
 void queue_dump(queue_t *q, expbuf_t *buf)
 {
+	node_queue_t *nq;
+	
 	assert(q && buf);
 
 	assert(q->name);
@@ -795,17 +2079,29 @@ void queue_dump(queue_t *q, expbuf_t *buf)
 	expbuf_print(buf, "\tFlags: ");
 	if (BIT_TEST(q->flags, QUEUE_FLAG_EXCLUSIVE))
 		expbuf_print(buf, "EXCLUSIVE ");
+	if (BIT_TEST(q->flags, QUEUE_FLAG_DURABLE))
+		expbuf_print(buf, "DURABLE ");
 	expbuf_print(buf, "\n");
+
+	expbuf_print(buf, "\tPolicy: %s\n",
+		q->policy == QUEUE_POLICY_LEAST ? "least-outstanding" :
+		q->policy == QUEUE_POLICY_P2C ? "power-of-two-choices" : "priority");
 	
-	expbuf_print(buf, "\tMessages Pending: %d\n", ll_count(&q->msg_pending));
+	expbuf_print(buf, "\tMessages Pending: %d (%llu bytes in memory, %u spilled)\n",
+		ll_count(&q->msg_pending), q->pending_bytes, q->pending_spilled);
 	// TODO: show info about the pending messages.
 	expbuf_print(buf, "\tMessages Processing: %d\n", ll_count(&q->msg_proc));
+	expbuf_print(buf, "\tMessages Timed Out: %u\n", q->timeouts);
 	// TODO: show info about the processing messages.
-	expbuf_print(buf, "\tNodes Ready: %d\n", ll_count(&q->nodes_ready));
-	// todo: show info about the ready nodes.
-	expbuf_print(buf, "\tNodes Busy: %d\n", ll_count(&q->nodes_busy));
+	expbuf_print(buf, "\tNodes Ready: %d\n", q->nodes_ready.count);
+	for (nq = q->nodes_ready.head; nq; nq = nq->next) {
+		assert(nq->node);
+		expbuf_print(buf, "\t\tnode:%d priority=%d waiting=%d max=%d\n",
+			nq->node->handle, nq->priority, nq->waiting, nq->max);
+	}
+	expbuf_print(buf, "\tNodes Busy: %d\n", q->nodes_busy.count);
 	// todo: show info about the busy nodes.
-	expbuf_print(buf, "\tNodes Waiting: %d\n", ll_count(&q->nodes_waiting));
+	expbuf_print(buf, "\tNodes Waiting: %d\n", q->nodes_waiting.count);
 	// todo: show info about the waiting nodes.
 }
 
@@ -5,6 +5,7 @@
 #include <linklist.h>
 
 //---------------------------------------------------------------------
+#include "histogram.h"
 #include "node.h"
 #include "message.h"
 #include "system_data.h"
@@ -14,10 +15,79 @@
 
 #define QUEUE_LOW_PRIORITY	10
 
+// most requests that another controller or worker can be given for a queue at
+// one time.  Each one is given the capacity of the consumers connected to it
+// (its credit), which is used when a consumer does not have a max.
+#define QUEUE_CREDIT_MAX    1024
+
 #define QUEUE_FLAG_EXCLUSIVE 0x0001
+#define QUEUE_FLAG_DELIVERY  0x0002		// a delivery pass has been scheduled.
+#define QUEUE_FLAG_DURABLE   0x0004		// messages are recorded in the journal.
+
+// maximum number of messages that will be delivered from a queue in one pass
+// before giving the event loop a chance to process other events.
+#define QUEUE_DRAIN_LIMIT    256
+
+// most messages that will be sent to a consumer together in one BATCH.  Only
+// payloads that would be copied into the outgoing buffer anyway are batched.
+#define QUEUE_BATCH_MAX      128
+
+// how often (in milliseconds) the timing wheel is advanced while there are
+// messages with timeouts.
+#define QUEUE_TIMEOUT_TICK   10
 
 
+struct __queue_t;
+struct __node_queue_t;
+
+
+// counters and latencies of a queue, collected over one stats interval.
 typedef struct {
+	unsigned int requests, replies, broadcasts, timeouts;
+	unsigned long long bytes_in, bytes_out;		// payloads of requests, and replies.
+	unsigned int depth_max, inflight_max;		// most messages pending, and being processed.
+	histogram_t wait;				// from being queued, to being sent to a consumer.
+	histogram_t service;		// from being sent, to the consumer being done with it.
+	histogram_t total;			// from being queued, to being done.
+	histogram_t failover;		// from the exclusive consumer leaving, to a standby taking over.
+} queue_stats_t;
+
+// an intrusive list of node_queue_t entries.  The entries themselves contain
+// the links, so adding and removing them does not need any searching.
+typedef struct {
+	struct __node_queue_t *head, *tail;
+	int count;
+} nq_list_t;
+
+// an indexed binary heap of node_queue_t entries.  Each entry knows its
+// position in the heap, so it can be removed or re-ordered without searching.
+typedef struct {
+	struct __node_queue_t **items;
+	int count, size;
+} nq_heap_t;
+
+
+// structure to keep track of the node that is consuming the queue.  The entry
+// is in one of the node lists of the queue, and is also in the list of
+// memberships that the node keeps.  This way the node can find all the queues
+// it is in, and the queue can remove the node from its list without searching.
+typedef struct __node_queue_t {
+	node_t *node;
+	struct __queue_t *queue;
+	short int priority;
+	int max;				// maximum number of messages this node will process at a time.
+	int waiting;
+	int expired;							// messages that timed out while this node had them.
+	unsigned int last_used;		// the queue sequence when a message was last sent.
+
+	nq_list_t *list;											// the queue list that this entry is in.
+	struct __node_queue_t *prev, *next;		// position in the queue list.
+	struct __node_queue_t *node_prev, *node_next;		// position in the node memberships.
+	int heap_index;												// position in the ready heap, or -1.
+} node_queue_t;
+
+
+typedef struct __queue_t {
 	char *name;
 	queue_id_t qid;
 	unsigned int flags;
@@ -28,41 +98,83 @@ typedef struct {
 	// put in msgproc list;
 	list_t msg_pending, msg_proc;		/// message_t
 
+	// bytes of the pending payloads that are held in memory, and the number of
+	// pending messages that have been spilled to disk.
+	unsigned long long pending_bytes;
+	unsigned int pending_spilled;
+
+	// bytes of all the pending payloads, whether in memory or not, and the
+	// nodes that we have stopped reading from because it went over the limit.
+	unsigned long long backlog;
+	list_t paused;		/// node_t
+
 	// a list of nodes that have subscribed to this queue.  The busy list will
 	// include all the nodes that have reached their MAX message allocations.
 	// Nodes that can receive messages will be in ready.  When a message has
 	// been replied, if the head node is processing messages, and if the current
 	// node has more capacity, then it will be moved to the head.
-	list_t nodes_busy, nodes_ready;	/// node_queue_t
+	nq_list_t nodes_busy, nodes_ready;
+
+	// the entries in nodes_ready are also kept in a heap, ordered by the
+	// selection policy, so that the best node can be found without rotating
+	// thru the list.
+	int policy;
+	nq_heap_t ready_heap;
+	unsigned int deliver_seq;
+
+	// number of messages that have timed out in this queue.
+	unsigned int timeouts;
+
+	// the stats being collected for the current interval, and the ones from the
+	// interval before, which are complete.
+	queue_stats_t qstats, qstats_last;
 
 	// when a queue is being consumed exclusively, this list contains the nodes
 	// that are waiting.  When an exclusive consumer has disconnected, the next
-	// entry in this list will 
-	list_t nodes_waiting;						/// node_queue_t
-	list_t nodes_consuming;					/// node_t
+	// entry in this list will take over.  If the consumer still had requests
+	// when it left (it sent CLOSING), the standby is not promoted until they are
+	// done, so that only one consumer is ever processing the queue.
+	nq_list_t nodes_waiting;
+	unsigned int handover;							// requests the consumer that left still has.
+	unsigned long long failover_at;			// when it left, or 0.
+
+	// the controller nodes that we have sent a consume request to for this queue.
+	nq_list_t nodes_consuming;
 
 	system_data_t *sysdata;
 } queue_t;
 
-void queue_set_id(list_t *queues, const char *name, queue_id_t id);
+void queue_set_id(system_data_t *sysdata, const char *name, queue_id_t id);
 
-queue_t * queue_get_id(list_t *queues, queue_id_t qid);
-queue_t * queue_get_name(list_t *queues, const char *qname);
+queue_t * queue_get_id(system_data_t *sysdata, queue_id_t qid);
+queue_t * queue_get_name(system_data_t *sysdata, const char *qname);
 void      queue_cancel_node(node_t *node);
+void      queue_node_lost(node_t *node);
 
 queue_t * queue_create(system_data_t *sysdata, char *qname);
 void      queue_init(queue_t *queue);
 void      queue_free(queue_t *queue);
 void      queue_addmsg(queue_t *queue, message_t *msg);
+void      queue_throttle(queue_t *queue, node_t *node);
 int       queue_add_node(queue_t *queue, node_t *node, int max, int priority, unsigned int flags);
 int				queue_check_node(queue_t *queue, node_t *node);
+void      queue_notify_controller(queue_t *queue, node_t *node);
+void      queue_set_credit(queue_t *queue, node_t *node, int max);
 void      queue_shutdown(queue_t *queue);
+void      queue_set_durable(queue_t *queue);
+void      queue_restore(const char *name, void *arg);
+void      queue_restore_msg(const char *name, unsigned int flags, int timeout, char *data, unsigned int length, void *arg);
 
 
 void      queue_deliver(queue_t *queue);
+void      queue_schedule(queue_t *queue);
 // void      queue_notify(queue_t *queue, void *server);
-void      queue_msg_done(queue_t *queue, node_t *node);
+void      queue_msg_done(queue_t *queue, message_t *msg);
+void      queue_msg_expired_done(queue_t *queue, message_t *msg);
+void      queue_msg_lost(queue_t *queue, message_t *msg);
+void      queue_timeout_handler(int fd, short int flags, void *arg);
 
+void      queue_stats_roll(queue_t *queue);
 void      queue_dump(queue_t *queue, expbuf_t *buf);
 
 #endif
@@ -9,6 +9,7 @@
 #include "commands.h"
 #include "controllers.h"
 #include "daemon.h"
+#include "node.h"
 #include "queue.h"
 #include "server.h"
 #include "settings.h"
@@ -25,6 +26,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 
@@ -41,9 +48,20 @@ static void usage(void) {
 	printf(PACKAGE " " VERSION "\n");
 	printf("-p <num>      TCP port to listen on (default: %d)\n", RQ_DEFAULT_PORT);
 	printf("-i <ip_addr>  interface to listen on, default is INADDR_ANY\n");
-	printf("-C <num>      max simultaneous connections, default is 1024\n");
-	printf("-S <ip:port>  Controller to connect to. (can be used more than once)\n");
+	printf("-u <path>     unix socket to listen on as well (only by the first worker),\n");
+	printf("              where clients can also use shared-memory rings\n");
+	printf("-C <num>      max simultaneous connections (default: %d)\n", DEFAULT_MAXCONNS);
+	printf("-S <ip:port>  Controller to connect to, or unix:<path>. (can be used more than once)\n");
 	printf("-l <file>     Local log file\n");
+	printf("-L <policy>   consumer selection: priority, least, p2c (default: priority)\n");
+	printf("-w <num>      number of worker processes sharing the port (default: 1)\n");
+	printf("-s <dir>      spill pending payloads to files in <dir> when memory is full\n");
+	printf("-M <mb>       pending data kept in memory before spilling (default: %d)\n", SPILL_DEFAULT_LIMIT);
+	printf("-Q <mb>       pending data kept in memory for each queue (default: no limit)\n");
+	printf("-j <dir>      keep a journal of durable queues in <dir>\n");
+	printf("-B <mb>       pending data before producers are paused (default: no limit)\n");
+	printf("-b <mb>       pending data for each queue before producers are paused\n");
+	printf("-F            send SERVER_FULL to paused producers, and refused connections\n");
 	printf("\n");
 	printf("-D            run as a daemon\n");
 	printf("-P <file>     save PID in <file>, only used with -d option\n");
@@ -70,8 +88,18 @@ static void get_options(settings_t *settings, int argc, char **argv)
 		"S:"	/* Server to connect to, can be supplied more than once. */
 		
 		"i:"  /* interfaces to bind to */
+		"u:"  /* unix socket to listen on. */
 		"p:"  /* port to listen on. */
 		"l:"  /* logfile. */
+		"L:"  /* consumer selection policy. */
+		"w:"  /* number of worker processes. */
+		"s:"  /* spill directory. */
+		"M:"  /* total memory limit before spilling. */
+		"Q:"  /* queue memory limit before spilling. */
+		"j:"  /* journal directory. */
+		"B:"  /* total pending limit before pausing producers. */
+		"b:"  /* queue pending limit before pausing producers. */
+		"F"   /* send SERVER_FULL to paused producers and refused connections. */
 	)) != -1) {
 		switch (c) {
 
@@ -115,6 +143,56 @@ static void get_options(settings_t *settings, int argc, char **argv)
 			case 'i':
 				ll_push_tail(settings->interfaces, strdup(optarg));
 				break;
+
+			case 'u':
+				settings->unix_path = optarg;
+				break;
+
+			case 'L':
+				if      (strcmp(optarg, "priority") == 0) { settings->policy = QUEUE_POLICY_PRIORITY; }
+				else if (strcmp(optarg, "least") == 0)    { settings->policy = QUEUE_POLICY_LEAST; }
+				else if (strcmp(optarg, "p2c") == 0)      { settings->policy = QUEUE_POLICY_P2C; }
+				else {
+					fprintf(stderr, "Unknown policy \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'w':
+				settings->workers = atoi(optarg);
+				if (settings->workers < 1 || settings->workers > MAX_WORKERS) {
+					fprintf(stderr, "Number of workers must be between 1 and %d\n", MAX_WORKERS);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 's':
+				settings->spill_path = optarg;
+				break;
+
+			case 'M':
+				settings->spill_limit = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+
+			case 'Q':
+				settings->spill_queue = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+
+			case 'j':
+				settings->journal_path = optarg;
+				break;
+
+			case 'B':
+				settings->backlog_limit = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+
+			case 'b':
+				settings->backlog_queue = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+
+			case 'F':
+				settings->server_full = true;
+				break;
 				
 			default:
 				fprintf(stderr, "Illegal argument \"%c\"\n", c);
@@ -135,29 +213,42 @@ static void init_sysdata(system_data_t *sysdata)
 	sysdata->stats         = NULL;
 	sysdata->risp          = NULL;
 	sysdata->queues        = NULL;
+	sysdata->qdir          = NULL;
+	sysdata->paused        = NULL;
 	sysdata->sighup_event  = NULL;
 	sysdata->sigint_event  = NULL;
 	sysdata->sigusr1_event = NULL;
 	sysdata->sigusr2_event = NULL;
 	sysdata->nodelist      = NULL;
+	sysdata->flushlist     = NULL;
+	sysdata->connections   = 0;
+	sysdata->accept_paused = 0;
 	sysdata->controllers   = NULL;
 	sysdata->logging       = NULL;
-	sysdata->in_buf        = NULL;
 	sysdata->build_buf     = NULL;
 
-	sysdata->msg_list = NULL;
-	sysdata->msg_max = 0;
-	sysdata->msg_next = 0;
+	sysdata->msglist = NULL;
+	sysdata->timewheel = NULL;
+	sysdata->timeout_event = NULL;
+	sysdata->spill = NULL;
+	sysdata->journal = NULL;
+
+	sysdata->worker = 0;
+	sysdata->worker_pids = NULL;
+	sysdata->peer_handles = NULL;
 }
 
 static void cleanup_sysdata(system_data_t *sysdata)
 {
 	assert(sysdata);
 
-	assert(sysdata->msg_list == NULL);
-	assert(sysdata->msg_max == 0);
-	assert(sysdata->msg_used == 0);
-	assert(sysdata->msg_next == -1);
+	assert(sysdata->msglist == NULL);
+	assert(sysdata->timewheel == NULL);
+	assert(sysdata->timeout_event == NULL);
+	assert(sysdata->spill == NULL);
+	assert(sysdata->journal == NULL);
+	assert(sysdata->worker_pids == NULL);
+	assert(sysdata->peer_handles == NULL);
 	
 	assert(sysdata->evbase == NULL);
 	assert(sysdata->bufpool == NULL);
@@ -166,6 +257,7 @@ static void cleanup_sysdata(system_data_t *sysdata)
 	assert(sysdata->stats == NULL);
 	assert(sysdata->risp == NULL);
 	assert(sysdata->queues == NULL);
+	assert(sysdata->qdir == NULL);
 	assert(sysdata->sighup_event == NULL);
 	assert(sysdata->sigint_event == NULL);
 	assert(sysdata->sigusr1_event == NULL);
@@ -173,7 +265,6 @@ static void cleanup_sysdata(system_data_t *sysdata)
 	assert(sysdata->nodelist == NULL);
 	assert(sysdata->controllers == NULL);
 	assert(sysdata->logging == NULL);
-	assert(sysdata->in_buf == NULL);
 	assert(sysdata->build_buf == NULL);
 }
 
@@ -233,11 +324,118 @@ static void cleanup_daemon(system_data_t *sysdata)
 	assert(sysdata);
 	assert(sysdata->settings);
 	
-	if (sysdata->settings->daemonize && sysdata->settings->pid_file != NULL) {
+	if (sysdata->settings->daemonize && sysdata->settings->pid_file != NULL && sysdata->worker == 0) {
 		unlink(sysdata->settings->pid_file);
 	}
 }
 
+// If more than one worker was asked for, fork the other worker processes.
+// Each worker has its own event loop and its own nodes and queues, and they
+// all listen on the same port.  Every pair of workers is linked by a socket,
+// which is used to hand off requests for queues that only have consumers
+// connected to the other worker.  This has to be done before the event base
+// is created, because it cannot be shared by the processes.
+static void init_workers(system_data_t *sysdata)
+{
+	int pairs[MAX_WORKERS][MAX_WORKERS];
+	int handles[2];
+	int workers;
+	int i, j;
+	pid_t pid;
+
+	assert(sysdata);
+	assert(sysdata->settings);
+	assert(sysdata->worker == 0);
+	assert(sysdata->worker_pids == NULL);
+	assert(sysdata->peer_handles == NULL);
+
+	workers = sysdata->settings->workers;
+	assert(workers > 0 && workers <= MAX_WORKERS);
+	if (workers == 1) {
+		return;
+	}
+
+	// create the links between the workers.  pairs[i][j] is the end that
+	// worker 'i' uses to talk to worker 'j'.
+	for (i=0; i<workers; i++) {
+		pairs[i][i] = INVALID_HANDLE;
+		for (j=i+1; j<workers; j++) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, handles) != 0) {
+				perror("socketpair()");
+				exit(EXIT_FAILURE);
+			}
+			pairs[i][j] = handles[0];
+			pairs[j][i] = handles[1];
+		}
+	}
+
+	sysdata->worker_pids = (pid_t *) calloc(workers, sizeof(pid_t));
+	assert(sysdata->worker_pids);
+	for (i=1; i<workers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork()");
+			exit(EXIT_FAILURE);
+		}
+		else if (pid == 0) {
+			// the other workers are stopped by the first one, so they should not
+			// get the signals from the terminal as well.
+			setpgid(0, 0);
+#ifdef __linux__
+			// and if the first worker goes away without stopping us, we stop too.
+			prctl(PR_SET_PDEATHSIG, SIGINT);
+#endif
+			sysdata->worker = i;
+			free(sysdata->worker_pids);
+			sysdata->worker_pids = NULL;
+			break;
+		}
+		sysdata->worker_pids[i] = pid;
+	}
+
+	// keep only the ends of the links that belong to this worker.
+	sysdata->peer_handles = (int *) malloc(sizeof(int) * workers);
+	assert(sysdata->peer_handles);
+	for (i=0; i<workers; i++) {
+		sysdata->peer_handles[i] = INVALID_HANDLE;
+	}
+	for (i=0; i<workers; i++) {
+		for (j=0; j<workers; j++) {
+			if (i != j) {
+				if (i == sysdata->worker) { sysdata->peer_handles[j] = pairs[i][j]; }
+				else { close(pairs[i][j]); }
+			}
+		}
+	}
+}
+
+// the first worker waits for the others to finish.
+static void cleanup_workers(system_data_t *sysdata)
+{
+	int i;
+
+	assert(sysdata);
+	assert(sysdata->settings);
+
+	if (sysdata->worker_pids) {
+		assert(sysdata->worker == 0);
+		for (i=1; i<sysdata->settings->workers; i++) {
+			assert(sysdata->worker_pids[i] > 0);
+			waitpid(sysdata->worker_pids[i], NULL, 0);
+		}
+		free(sysdata->worker_pids);
+		sysdata->worker_pids = NULL;
+	}
+
+	if (sysdata->peer_handles) {
+		for (i=0; i<sysdata->settings->workers; i++) {
+			assert(sysdata->peer_handles[i] == INVALID_HANDLE);
+		}
+		free(sysdata->peer_handles);
+		sysdata->peer_handles = NULL;
+	}
+}
+
 // initialize main thread libevent instance
 static void init_events(system_data_t *sysdata)
 {
@@ -310,6 +508,10 @@ static void init_signals(system_data_t *sysdata)
 	sysdata->sigusr2_event = evsignal_new(sysdata->evbase, SIGUSR2, sigusr2_handler, sysdata);
 	assert(sysdata->sigusr2_event);
 	event_add(sysdata->sigusr2_event, NULL);
+
+	// a node that has gone away is noticed when writing to it fails, which
+	// would otherwise kill us with SIGPIPE.
+	signal(SIGPIPE, SIG_IGN);
 }
 
 static void cleanup_signals(system_data_t *sysdata)
@@ -329,10 +531,6 @@ static void init_buffers(system_data_t *sysdata)
 	sysdata->bufpool = (expbuf_pool_t *) malloc(sizeof(expbuf_pool_t));
 	expbuf_pool_init(sysdata->bufpool, 0);
 
-	assert(sysdata->in_buf == NULL);
-	sysdata->in_buf = (expbuf_t *) malloc(sizeof(expbuf_t));
-	expbuf_init(sysdata->in_buf, DEFAULT_BUFFSIZE);
-
 	assert(sysdata->build_buf == NULL);
 	sysdata->build_buf = (expbuf_t *) malloc(sizeof(expbuf_t));
 	expbuf_init(sysdata->build_buf, 0);
@@ -349,12 +547,9 @@ static void cleanup_buffers(system_data_t *sysdata)
 	free(sysdata->bufpool);
 	sysdata->bufpool = NULL;
 
-	assert(sysdata->in_buf && sysdata->build_buf);
-	expbuf_free(sysdata->in_buf);
+	assert(sysdata->build_buf);
 	expbuf_free(sysdata->build_buf);
-	free(sysdata->in_buf);
 	free(sysdata->build_buf);
-	sysdata->in_buf = NULL;
 	sysdata->build_buf = NULL;
 }
 
@@ -393,6 +588,16 @@ static void init_servers(system_data_t *sysdata)
 			free(str);
 		}
 	}
+
+	// nodes on the same host can connect thru a unix socket instead.  It can
+	// only be bound once, so the other workers get those nodes thru the links
+	// to the first one.
+	if (sysdata->settings->unix_path && sysdata->worker == 0) {
+		server = (server_t *) malloc(sizeof(server_t));
+		server_init(server, sysdata);
+		ll_push_tail(sysdata->servers, server);
+		server_listen_unix(server, sysdata->settings->unix_path);
+	}
 }
 
 // cleanup 'server'
@@ -465,6 +670,11 @@ static void init_nodes(system_data_t *sysdata)
 	
 	sysdata->nodelist = (list_t *) malloc(sizeof(list_t));
 	ll_init(sysdata->nodelist);
+
+	assert(sysdata->flushlist == NULL);
+	sysdata->flushlist = (list_t *) malloc(sizeof(list_t));
+	ll_init(sysdata->flushlist);
+	sysdata->flush_scheduled = 0;
 }
 
 // nodelist should already be empty, otherwise how did we break out of the loop?
@@ -477,30 +687,25 @@ static void cleanup_nodes(system_data_t *sysdata)
 	ll_free(sysdata->nodelist);
 	free(sysdata->nodelist);
 	sysdata->nodelist = NULL;
+
+	assert(ll_count(sysdata->flushlist) == 0);
+	ll_free(sysdata->flushlist);
+	free(sysdata->flushlist);
+	sysdata->flushlist = NULL;
 }
 
 //-----------------------------------------------------------------------------
-// Create the message array.  During the running of the daemon we should assume
-// that this array exists.  So we will create it, and pre-fill it with a number
-// of empty message objects.
+// Create the message list.  During the running of the daemon we should assume
+// that this list exists.  So we will create it, and pre-fill it with a slab of
+// empty message objects.
 static void init_msglist(system_data_t *sysdata)
 {
-	int i;
-
 	assert(sysdata);
-	assert(sysdata->msg_list == NULL);
+	assert(sysdata->msglist == NULL);
 	
-	sysdata->msg_list = (message_t **) malloc(sizeof(message_t *) * 10);
-	assert(sysdata->msg_list);
-	sysdata->msg_max = 10;
-	sysdata->msg_next = 0;
-	sysdata->msg_used = 0;
-
-	for (i=0; i<10; i++) {
-		sysdata->msg_list[i] = (message_t *) malloc(sizeof(message_t));
-		assert(sysdata->msg_list[i]);
-		message_init(sysdata->msg_list[i], i);
-	}
+	sysdata->msglist = (msglist_t *) malloc(sizeof(msglist_t));
+	assert(sysdata->msglist);
+	msglist_init(sysdata->msglist, MSGLIST_DEFAULT_SIZE);
 }
 
 //-----------------------------------------------------------------------------
@@ -508,34 +713,95 @@ static void init_msglist(system_data_t *sysdata)
 static void cleanup_msglist(system_data_t *sysdata)
 {
 	assert(sysdata);
-	assert(sysdata->msg_list);
-	assert(sysdata->msg_max > 0);
-	assert(sysdata->msg_used == 0);
+	assert(sysdata->msglist);
+	assert(sysdata->msglist->used == 0);
+
+	msglist_free(sysdata->msglist);
+	free(sysdata->msglist);
+	sysdata->msglist = NULL;
+}
+
+// initialise the empty linked-list of queues, and the directory used to find them.
+// create the timing wheel that is used for message timeouts.  The event is
+// created now, but is only added when there are timers in the wheel.
+static void init_timeouts(system_data_t *sysdata)
+{
+	assert(sysdata);
+	assert(sysdata->timewheel == NULL);
+	assert(sysdata->timeout_event == NULL);
+	assert(sysdata->evbase);
+
+	sysdata->timewheel = (timewheel_t *) malloc(sizeof(timewheel_t));
+	assert(sysdata->timewheel);
+	tw_init(sysdata->timewheel, tw_now());
+
+	sysdata->timeout_event = evtimer_new(sysdata->evbase, queue_timeout_handler, (void *) sysdata);
+	assert(sysdata->timeout_event);
+}
+
+// the timeout event would have been removed when shutting down.
+static void cleanup_timeouts(system_data_t *sysdata)
+{
+	assert(sysdata);
+	assert(sysdata->timewheel);
+	assert(sysdata->timeout_event == NULL);
+
+	tw_free(sysdata->timewheel);
+	free(sysdata->timewheel);
+	sysdata->timewheel = NULL;
+}
 
-	while (sysdata->msg_max > 0) {
-		sysdata->msg_max --;
-		assert(sysdata->msg_list[sysdata->msg_max]);
-		assert(sysdata->msg_list[sysdata->msg_max]->id == sysdata->msg_max);
-		message_free(sysdata->msg_list[sysdata->msg_max]);
-		free(sysdata->msg_list[sysdata->msg_max]);
-		sysdata->msg_list[sysdata->msg_max] = NULL;
+// If a spill directory was given, pending payloads will be written to disk
+// once there is too much of it in memory.
+static void init_spill(system_data_t *sysdata)
+{
+	assert(sysdata);
+	assert(sysdata->settings);
+	assert(sysdata->spill == NULL);
+
+	if (sysdata->settings->spill_path) {
+		if (sysdata->settings->spill_limit == 0) {
+			sysdata->settings->spill_limit = (unsigned long long) SPILL_DEFAULT_LIMIT * 1024 * 1024;
+		}
+
+		sysdata->spill = (spill_t *) malloc(sizeof(spill_t));
+		assert(sysdata->spill);
+		spill_init(sysdata->spill, sysdata->settings->spill_path, SPILL_SEGMENT_SIZE);
+		logger(sysdata->logging, 1, "Spilling pending data to '%s' above %llu bytes.",
+			sysdata->settings->spill_path, sysdata->settings->spill_limit);
+	}
+}
+
+// all the messages should have been released by now.
+static void cleanup_spill(system_data_t *sysdata)
+{
+	assert(sysdata);
+
+	if (sysdata->spill) {
+		spill_free(sysdata->spill);
+		free(sysdata->spill);
+		sysdata->spill = NULL;
 	}
-	
-	free(sysdata->msg_list);
-	sysdata->msg_list = NULL;
-	sysdata->msg_next = -1;
-	assert(sysdata->msg_max == 0);
 }
 
-// initialise the empty linked-list of queues.
 static void init_queues(system_data_t *sysdata)
 {
 	assert(sysdata);
 	assert(sysdata->queues == NULL);
+	assert(sysdata->qdir == NULL);
 	
 	sysdata->queues = (list_t *) malloc(sizeof(list_t));
 	ll_init(sysdata->queues);
 	assert(sysdata->queues);
+
+	sysdata->qdir = (qdir_t *) malloc(sizeof(qdir_t));
+	qdir_init(sysdata->qdir);
+	assert(sysdata->qdir);
+
+	sysdata->paused = (list_t *) malloc(sizeof(list_t));
+	ll_init(sysdata->paused);
+	assert(sysdata->paused);
+	sysdata->backlog = 0;
 }
 
 // The queue list would not be empty, but the queues themselves should already be cleared as part of the server shutdown event.
@@ -543,19 +809,68 @@ static void cleanup_queues(system_data_t *sysdata)
 {
  	queue_t *q;
  	
+	node_t *node;
+
 	assert(sysdata);
 	assert(sysdata->queues);
+	assert(sysdata->qdir);
+	assert(sysdata->paused);
+
+	while ((node = ll_get_head(sysdata->paused))) {
+		node_resume(node);
+	}
+	ll_free(sysdata->paused);
+	free(sysdata->paused);
+	sysdata->paused = NULL;
 
 	while ((q = ll_pop_head(sysdata->queues))) {
+		qdir_remove(sysdata->qdir, q->name, q->qid);
 		queue_free(q);
 		free(q);
 	}
+	assert(sysdata->qdir->count == 0);
+	qdir_free(sysdata->qdir);
+	free(sysdata->qdir);
+	sysdata->qdir = NULL;
+
 	assert(ll_count(sysdata->queues) == 0);
 	ll_free(sysdata->queues);
 	free(sysdata->queues);
 	sysdata->queues = NULL;
 }
 
+// If a journal directory was given, then the messages in durable queues are
+// recorded, and any that were left from the last run are queued again.
+static void init_journal(system_data_t *sysdata)
+{
+	int restored;
+
+	assert(sysdata);
+	assert(sysdata->settings);
+	assert(sysdata->journal == NULL);
+
+	if (sysdata->settings->journal_path) {
+		sysdata->journal = (journal_t *) malloc(sizeof(journal_t));
+		assert(sysdata->journal);
+		journal_init(sysdata->journal, sysdata->settings->journal_path, sysdata->worker, sysdata->evbase, sysdata->stats);
+
+		restored = journal_replay(sysdata->journal, queue_restore, queue_restore_msg, sysdata);
+		logger(sysdata->logging, 1, "Journal in '%s', %d messages restored.", sysdata->settings->journal_path, restored);
+	}
+}
+
+// the messages that are not finished stay in the journal for next time.
+static void cleanup_journal(system_data_t *sysdata)
+{
+	assert(sysdata);
+
+	if (sysdata->journal) {
+		journal_free(sysdata->journal);
+		free(sysdata->journal);
+		sysdata->journal = NULL;
+	}
+}
+
 static void init_controllers(system_data_t *sysdata)
 {
 	char         *str;
@@ -602,6 +917,38 @@ static void cleanup_controllers(system_data_t *sysdata)
 
 
 
+// create the nodes for the links to the other workers.  They are treated
+// much like controllers, in that consume requests are sent to them, but the
+// requests that are received from them are only given to local consumers.
+static void init_peers(system_data_t *sysdata)
+{
+	node_t *node;
+	int i;
+
+	assert(sysdata);
+	assert(sysdata->settings);
+
+	if (sysdata->peer_handles == NULL) {
+		assert(sysdata->settings->workers == 1);
+		return;
+	}
+
+	for (i=0; i<sysdata->settings->workers; i++) {
+		if (i != sysdata->worker) {
+			assert(sysdata->peer_handles[i] > 0);
+			evutil_make_socket_nonblocking(sysdata->peer_handles[i]);
+			node = node_create(sysdata, sysdata->peer_handles[i]);
+			assert(node);
+			BIT_SET(node->flags, FLAG_NODE_PEER);
+			logger(sysdata->logging, 2, "Linked to worker %d [%d]", i, node->handle);
+
+			// the node owns the handle now.
+			sysdata->peer_handles[i] = INVALID_HANDLE;
+		}
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Main... process command line parameters, and then setup our listening 
 // sockets and event loop.
@@ -620,10 +967,11 @@ int main(int argc, char **argv)
 	
 	init_maxconns(&sysdata);
 	init_daemon(&sysdata);
+	init_workers(&sysdata);
 	init_events(&sysdata);
 	init_logging(&sysdata);
 
-	logger(sysdata.logging, 1, "System starting up");
+	logger(sysdata.logging, 1, "System starting up (worker %d)", sysdata.worker);
 
 	init_signals(&sysdata);
 	init_buffers(&sysdata);
@@ -632,8 +980,12 @@ int main(int argc, char **argv)
 	init_risp(&sysdata);
 	init_nodes(&sysdata);
 	init_msglist(&sysdata);
+	init_timeouts(&sysdata);
+	init_spill(&sysdata);
 	init_queues(&sysdata);
+	init_journal(&sysdata);
 	init_controllers(&sysdata);
+	init_peers(&sysdata);
 
 
 ///============================================================================
@@ -653,8 +1005,11 @@ int main(int argc, char **argv)
 
 	cleanup_events(&sysdata);
 	cleanup_controllers(&sysdata);
+	cleanup_journal(&sysdata);
 	cleanup_queues(&sysdata);
 	cleanup_msglist(&sysdata);
+	cleanup_spill(&sysdata);
+	cleanup_timeouts(&sysdata);
 	cleanup_nodes(&sysdata);
 	cleanup_risp(&sysdata);
 	cleanup_stats(&sysdata);
@@ -666,6 +1021,7 @@ int main(int argc, char **argv)
 
 	cleanup_logging(&sysdata);
 	cleanup_daemon(&sysdata);
+	cleanup_workers(&sysdata);
 	cleanup_maxconns(&sysdata);
 	cleanup_settings(&sysdata);
 	cleanup_sysdata(&sysdata);
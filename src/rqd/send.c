@@ -9,9 +9,47 @@
 #include <rispbuf.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 
+//-----------------------------------------------------------------------------
+// Add the command and length of a large string, but not the string itself.
+// This is used for payloads, so that the payload can be sent from its own
+// buffer instead of being copied into the build buffer.
+static void addCmdLargeStrHeader(expbuf_t *build, risp_command_t cmd, risp_length_t length)
+{
+	unsigned char hdr[5];
+
+	assert(build);
+	assert(cmd >= 224 && cmd <= 255);
+	
+	hdr[0] = cmd;
+	hdr[1] = (unsigned char) (length >> 24) & 0xff;
+	hdr[2] = (unsigned char) (length >> 16) & 0xff;
+	hdr[3] = (unsigned char) (length >> 8) & 0xff;
+	hdr[4] = (unsigned char) length & 0xff;
+	expbuf_add(build, hdr, 5);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a 32-bit value in network byte order, as the values packed in the
+// payload of a BATCH or DELIVERED are.
+static void addBatchInt(expbuf_t *build, unsigned int value)
+{
+	unsigned char data[4];
+
+	assert(build);
+
+	data[0] = (value >> 24) & 0xff;
+	data[1] = (value >> 16) & 0xff;
+	data[2] = (value >> 8) & 0xff;
+	data[3] = value & 0xff;
+	expbuf_add(build, data, 4);
+}
+
+
 //-----------------------------------------------------------------------------
 // 
 void sendConsumeReply(node_t *node, char *queue, int qid)
@@ -43,6 +81,7 @@ void sendMessage(node_t *node, message_t *msg)
 {
 	queue_t *q;
 	expbuf_t *build;
+	int hlength;
 	
 	assert(node != NULL);
 	assert(msg != NULL);
@@ -63,29 +102,174 @@ void sendMessage(node_t *node, message_t *msg)
 
 	// add the commands to the out queue.
 	addCmd(build, RQ_CMD_CLEAR);
-	addCmdInt(build, RQ_CMD_QUEUEID, q->qid);
-	addCmdLargeStr(build, RQ_CMD_PAYLOAD, msg->data->length, msg->data->data);
+	if (BIT_TEST(node->flags, FLAG_NODE_PEER)) {
+		// the other worker might be using a different id for the queue.
+		addCmdShortStr(build, RQ_CMD_QUEUE, strlen(q->name), q->name);
+	}
+	else {
+		addCmdInt(build, RQ_CMD_QUEUEID, q->qid);
+	}
+	addCmdLargeStrHeader(build, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data->buf));
+	hlength = BUF_LENGTH(build);
+
+
+	// broadcasts are sent with sendBroadcast().
+	assert(BIT_TEST(msg->flags, FLAG_MSG_BROADCAST) == 0);
+	assert(msg->target_node);
+
+	if (BIT_TEST(msg->flags, FLAG_MSG_NOREPLY)) 
+		addCmd(build, RQ_CMD_NOREPLY);
+	
+	assert(msg->id >= 0);
+	addCmdLargeInt(build, RQ_CMD_ID, msg->id);
+	addCmd(build, RQ_CMD_REQUEST);
+
+	// the header and trailer are in the build buffer, the payload is sent from
+	// its own buffer.
+	node_write_payload(node, hlength, BUF_DATA(build), msg->data, BUF_LENGTH(build) - hlength, BUF_DATA(build) + hlength);
+	expbuf_clear(build);
+}
+
+
+//-----------------------------------------------------------------------------
+// Send several messages from the same queue to the node in one BATCH.  They
+// all have small payloads, which are copied in along with the ids and
+// lengths, and they are either all NOREPLY or none of them are.
+void sendBatch(node_t *node, message_t **msgs, int count)
+{
+	queue_t *q;
+	expbuf_t *build;
+	unsigned int length;
+	int i;
+
+	assert(node);
+	assert(msgs);
+	assert(count > 1);
+
+	assert(node->sysdata);
+	assert(node->sysdata->build_buf);
+	build = node->sysdata->build_buf;
+	assert(build->length == 0);
+
+	assert(msgs[0]->queue);
+	q = msgs[0]->queue;
+	assert(q->qid > 0);
 
+	logger(node->sysdata->logging, 2, "sendBatch.  Node:%d, msg_id:%d, count:%d", node->handle, msgs[0]->id, count);
 
-	if (BIT_TEST(msg->flags, FLAG_MSG_BROADCAST)) {
-		// We are sending a broadcast message
-		assert(msg->id == 0);
-		assert(msg->target_node == NULL);
-		addCmd(build, RQ_CMD_BROADCAST);
+	length = 4 + (count * 8);
+	for (i = 0; i < count; i++) {
+		assert(msgs[i]->queue == q);
+		assert(msgs[i]->data);
+		assert(payload_spilled(msgs[i]->data) == 0);
+		length += BUF_LENGTH(msgs[i]->data->buf);
+	}
+
+	addCmd(build, RQ_CMD_CLEAR);
+	if (BIT_TEST(node->flags, FLAG_NODE_PEER)) {
+		// the other worker might be using a different id for the queue.
+		addCmdShortStr(build, RQ_CMD_QUEUE, strlen(q->name), q->name);
 	}
 	else {
-		assert(msg->target_node);
-
-		if (BIT_TEST(msg->flags, FLAG_MSG_NOREPLY)) 
-			addCmd(build, RQ_CMD_NOREPLY);
-		
-		assert(msg->id >= 0);
-		addCmdLargeInt(build, RQ_CMD_ID, msg->id);
-		addCmd(build, RQ_CMD_REQUEST);
+		addCmdInt(build, RQ_CMD_QUEUEID, q->qid);
+	}
+	if (BIT_TEST(msgs[0]->flags, FLAG_MSG_NOREPLY)) {
+		addCmd(build, RQ_CMD_NOREPLY);
+	}
+
+	addCmdLargeStrHeader(build, RQ_CMD_PAYLOAD, length);
+	addBatchInt(build, count);
+	for (i = 0; i < count; i++) {
+		addBatchInt(build, msgs[i]->id);
+	}
+	for (i = 0; i < count; i++) {
+		addBatchInt(build, BUF_LENGTH(msgs[i]->data->buf));
+	}
+	for (i = 0; i < count; i++) {
+		expbuf_add(build, BUF_DATA(msgs[i]->data->buf), BUF_LENGTH(msgs[i]->data->buf));
 	}
+	addCmd(build, RQ_CMD_BATCH);
 
 	node_write_now(node, build->length, build->data);
 	expbuf_clear(build);
+
+	// it went as one frame, but the node was sent all the messages.
+	node->msgs_out += count - 1;
+	assert(node->sysdata->stats);
+	node->sysdata->stats->batches_out ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a broadcast message to all the ready nodes of the queue.  The frame is
+// encoded only once, and every node is given the same header and trailer,
+// with a reference to the same payload.  It is not built in the common build
+// buffer, because a node that fails while we are sending can cause other
+// commands to be built.  Returns the number of nodes it was sent to.
+int sendBroadcast(struct __queue_t *queue, message_t *msg)
+{
+	queue_t *q = queue;
+	expbuf_t *frame;
+	node_queue_t *nq, *next;
+	system_data_t *sysdata;
+	int hlength, tlength, plength;
+	int count = 0;
+
+	assert(q);
+	assert(q->qid > 0);
+	assert(q->sysdata);
+	assert(msg);
+	assert(msg->data);
+	assert(BIT_TEST(msg->flags, FLAG_MSG_BROADCAST));
+	assert(msg->target_node == NULL);
+
+	sysdata = q->sysdata;
+	assert(sysdata->bufpool);
+	frame = expbuf_pool_new(sysdata->bufpool, 32);
+	assert(frame);
+
+	addCmd(frame, RQ_CMD_CLEAR);
+	addCmdInt(frame, RQ_CMD_QUEUEID, q->qid);
+	addCmdLargeStrHeader(frame, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data->buf));
+	hlength = BUF_LENGTH(frame);
+	addCmd(frame, RQ_CMD_BROADCAST);
+
+	tlength = BUF_LENGTH(frame) - hlength;
+	plength = 0;
+
+	for (nq = q->nodes_ready.head; nq; nq = next) {
+		// get the next one first, the send could fail and remove this node.
+		next = nq->next;
+		assert(nq->node);
+		if (BIT_TEST(nq->node->flags, FLAG_NODE_PEER)) {
+
+			// broadcasts we got from another worker are only for our own nodes.
+			if (BIT_TEST(msg->flags, FLAG_MSG_PEER)) {
+				continue;
+			}
+
+			// other workers get a header with the queue name instead of the id.
+			// It is added after the trailer the first time it is needed.
+			if (plength == 0) {
+				addCmd(frame, RQ_CMD_CLEAR);
+				addCmdShortStr(frame, RQ_CMD_QUEUE, strlen(q->name), q->name);
+				addCmdLargeStrHeader(frame, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data->buf));
+				plength = BUF_LENGTH(frame) - (hlength + tlength);
+			}
+			logger(sysdata->logging, 2, "sendBroadcast: sending broadcast msg to worker node:%d", nq->node->handle);
+			node_write_payload(nq->node, plength, BUF_DATA(frame) + hlength + tlength, msg->data, tlength, BUF_DATA(frame) + hlength);
+		}
+		else {
+			logger(sysdata->logging, 2, "sendBroadcast: sending broadcast msg to node:%d", nq->node->handle);
+			node_write_payload(nq->node, hlength, BUF_DATA(frame), msg->data, tlength, BUF_DATA(frame) + hlength);
+		}
+		count ++;
+	}
+
+	expbuf_clear(frame);
+	expbuf_pool_return(sysdata->bufpool, frame);
+
+	return(count);
 }
 
 
@@ -94,6 +278,7 @@ void sendMessage(node_t *node, message_t *msg)
 void sendReply(node_t *node, message_t *msg)
 {
 	expbuf_t *build;
+	int hlength;
 	
 	assert(node);
 	assert(msg);
@@ -112,10 +297,11 @@ void sendReply(node_t *node, message_t *msg)
 	// add the commands to the out queue.
 	addCmd(build, RQ_CMD_CLEAR);
 	addCmdLargeInt(build, RQ_CMD_ID, msg->source_id);
-	addCmdLargeStr(build, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data), BUF_DATA(msg->data));
+	addCmdLargeStrHeader(build, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data->buf));
+	hlength = BUF_LENGTH(build);
 	addCmd(build, RQ_CMD_REPLY);
 
-	node_write_now(node, BUF_LENGTH(build), BUF_DATA(build));
+	node_write_payload(node, hlength, BUF_DATA(build), msg->data, BUF_LENGTH(build) - hlength, BUF_DATA(build) + hlength);
 	expbuf_clear(build);
 }
 
@@ -137,7 +323,7 @@ void sendDelivered(node_t *node, message_id_t msgid)
 
 	// add the commands to the out queue.
 	addCmd(build, RQ_CMD_CLEAR);
-	addCmdLargeInt(build, RQ_CMD_ID, (short int) msgid);
+	addCmdLargeInt(build, RQ_CMD_ID, msgid);
 	addCmd(build, RQ_CMD_DELIVERED);
 
 	node_write_now(node, build->length, build->data);
@@ -149,6 +335,43 @@ void sendDelivered(node_t *node, message_id_t msgid)
 }
 
 
+//-----------------------------------------------------------------------------
+// Tell the node about all the NOREPLY requests it sent during this pass of the
+// event loop in one DELIVERED, with the ids packed in the payload.
+void sendAcks(node_t *node)
+{
+	expbuf_t *build;
+	unsigned int count;
+	
+	assert(node);
+	assert(node->acks);
+	assert(BUF_LENGTH(node->acks) > 0);
+	assert(BUF_LENGTH(node->acks) % 4 == 0);
+
+	assert(node->sysdata);
+	assert(node->sysdata->build_buf);
+	build = node->sysdata->build_buf;
+	assert(build->length == 0);
+
+	count = BUF_LENGTH(node->acks) / 4;
+
+	addCmd(build, RQ_CMD_CLEAR);
+	addCmdLargeStrHeader(build, RQ_CMD_PAYLOAD, 4 + BUF_LENGTH(node->acks));
+	addBatchInt(build, count);
+	expbuf_add(build, BUF_DATA(node->acks), BUF_LENGTH(node->acks));
+	addCmd(build, RQ_CMD_DELIVERED);
+
+	node_write_now(node, build->length, build->data);
+	expbuf_clear(build);
+	expbuf_clear(node->acks);
+
+	assert(node->sysdata->stats);
+	node->sysdata->stats->acks_out ++;
+
+	logger(node->sysdata->logging, 2, "sendAcks.  node=%d, count=%u", node->handle, count);
+}
+
+
 //-----------------------------------------------------------------------------
 // Tell a node that a message was not delivered.
 void sendUndelivered(node_t *node, message_id_t msgid)
@@ -156,7 +379,7 @@ void sendUndelivered(node_t *node, message_id_t msgid)
 	expbuf_t *build;
 	
 	assert(node);
-	assert(msgid > 0);
+	assert(msgid >= 0);
 
 	assert(node->sysdata);
 	assert(node->sysdata->build_buf);
@@ -165,7 +388,7 @@ void sendUndelivered(node_t *node, message_id_t msgid)
 
 	// add the commands to the out queue.
 	addCmd(build, RQ_CMD_CLEAR);
-	addCmdLargeInt(build, RQ_CMD_ID, (short int) msgid);
+	addCmdLargeInt(build, RQ_CMD_ID, msgid);
 	addCmd(build, RQ_CMD_UNDELIVERED);
 
 	node_write_now(node, build->length, build->data);
@@ -204,9 +427,197 @@ void sendClosing(node_t *node)
 }
 
 
+//-----------------------------------------------------------------------------
+// let the node know that the server is full, and that we have stopped reading
+// from it for now.
+void sendServerFull(node_t *node)
+{
+	expbuf_t *build;
+	
+	assert(node != NULL);
+	
+	assert(node->sysdata);
+	assert(node->sysdata->build_buf);
+	build = node->sysdata->build_buf;
+	assert(build->length == 0);
+
+	// add the commands to the out queue.
+	addCmd(build, RQ_CMD_CLEAR);
+	addCmd(build, RQ_CMD_SERVER_FULL);
+	
+	node_write_now(node, build->length, build->data);
+	expbuf_clear(build);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a summary of the histogram to the stats snapshot.
+static void addStatsLatency(expbuf_t *snap, risp_command_t cmd, const histogram_t *hist)
+{
+	unsigned int values[6];
+	unsigned char data[RQ_STAT_LATENCY_SIZE];
+	int i;
+
+	assert(snap);
+	assert(hist);
+	assert(sizeof(data) == sizeof(values));
+
+	values[0] = hist->count;
+	values[1] = hist_mean(hist);
+	values[2] = hist_percentile(hist, 50);
+	values[3] = hist_percentile(hist, 90);
+	values[4] = hist_percentile(hist, 99);
+	values[5] = hist->max;
+
+	for (i=0; i<6; i++) {
+		data[(i*4)+0] = (unsigned char) (values[i] >> 24) & 0xff;
+		data[(i*4)+1] = (unsigned char) (values[i] >> 16) & 0xff;
+		data[(i*4)+2] = (unsigned char) (values[i] >> 8) & 0xff;
+		data[(i*4)+3] = (unsigned char) values[i] & 0xff;
+	}
+
+	addCmdLargeStr(snap, cmd, sizeof(data), (char *) data);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the consumers in one of the lists of the queue to the stats snapshot.
+static void addStatsConsumers(expbuf_t *snap, nq_list_t *list, int standby)
+{
+	node_queue_t *nq;
+
+	assert(snap);
+	assert(list);
+
+	for (nq = list->head; nq; nq = nq->next) {
+		assert(nq->node);
+		addCmdLargeInt(snap, RQ_STAT_CONSUMER, nq->node->handle);
+		addCmdLargeInt(snap, RQ_STAT_WAITING, nq->waiting);
+		addCmdLargeInt(snap, RQ_STAT_MAX, nq->max);
+		if (standby) { addCmd(snap, RQ_STAT_STANDBY); }
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the details of a queue to the stats snapshot.  The counters and
+// latencies are from the last complete stats interval.
+static void addStatsQueue(expbuf_t *snap, queue_t *q)
+{
+	queue_stats_t *qs;
+	int length;
+
+	assert(snap);
+	assert(q);
+	assert(q->name);
+
+	length = strlen(q->name);
+	if (length > 255) { length = 255; }
+	addCmdShortStr(snap, RQ_STAT_QUEUE, length, q->name);
+	addCmdLargeInt(snap, RQ_STAT_DEPTH, ll_count(&q->msg_pending));
+	addCmdLargeInt(snap, RQ_STAT_INFLIGHT, ll_count(&q->msg_proc));
+
+	qs = &q->qstats_last;
+	addCmdLargeInt(snap, RQ_STAT_REQUESTS, qs->requests);
+	addCmdLargeInt(snap, RQ_STAT_REPLIES, qs->replies);
+	addCmdLargeInt(snap, RQ_STAT_BROADCASTS, qs->broadcasts);
+	addCmdLargeInt(snap, RQ_STAT_TIMEOUTS, qs->timeouts);
+	addCmdLargeInt(snap, RQ_STAT_BYTES_IN, (risp_int_t) qs->bytes_in);
+	addCmdLargeInt(snap, RQ_STAT_BYTES_OUT, (risp_int_t) qs->bytes_out);
+	addStatsLatency(snap, RQ_STAT_WAIT, &qs->wait);
+	addStatsLatency(snap, RQ_STAT_SERVICE, &qs->service);
+	addStatsLatency(snap, RQ_STAT_TOTAL, &qs->total);
+	if (qs->failover.count > 0) {
+		addStatsLatency(snap, RQ_STAT_FAILOVER, &qs->failover);
+	}
+
+	addStatsConsumers(snap, &q->nodes_ready, 0);
+	addStatsConsumers(snap, &q->nodes_busy, 0);
+	addStatsConsumers(snap, &q->nodes_waiting, 1);
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the details of a connection to the stats snapshot.
+static void addStatsNode(expbuf_t *snap, node_t *node)
+{
+	assert(snap);
+	assert(node);
+
+	addCmdLargeInt(snap, RQ_STAT_NODE, node->handle);
+	addCmdLargeInt(snap, RQ_STAT_BYTES_IN, (risp_int_t) node->bytes_in);
+	addCmdLargeInt(snap, RQ_STAT_BYTES_OUT, (risp_int_t) node->bytes_out);
+	addCmdLargeInt(snap, RQ_STAT_MSGS_IN, node->msgs_in);
+	addCmdLargeInt(snap, RQ_STAT_MSGS_OUT, node->msgs_out);
+	addCmdInt(snap, RQ_STAT_IDLE, node->idle > 0x7fff ? 0x7fff : node->idle);
+	if (BIT_TEST(node->flags, FLAG_NODE_CONTROLLER) || BIT_TEST(node->flags, FLAG_NODE_PEER) || BIT_TEST(node->flags, FLAG_NODE_FORWARDER)) {
+		addCmd(snap, RQ_STAT_CONTROLLER);
+	}
+	if (BIT_TEST(node->flags, FLAG_NODE_PAUSED)) {
+		addCmd(snap, RQ_STAT_PAUSED);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a snapshot of the queues and connections of this worker to the node.
+// The snapshot is a RISP stream of its own (see RQ_STAT_* in rq.h), which is
+// sent as the payload of a STATS_REPLY.
+void sendStats(node_t *node)
+{
+	system_data_t *sysdata;
+	expbuf_t *build, *snap;
+	queue_t *q;
+	node_t *n;
+
+	assert(node);
+	assert(node->sysdata);
+	sysdata = node->sysdata;
+	assert(sysdata->build_buf);
+	build = sysdata->build_buf;
+	assert(BUF_LENGTH(build) == 0);
+
+	assert(sysdata->bufpool);
+	snap = expbuf_pool_new(sysdata->bufpool, DEFAULT_BUFFSIZE);
+	assert(snap);
+
+	addCmdShortInt(snap, RQ_STAT_VERSION, RQ_STAT_VERSION_1);
+	addCmdShortInt(snap, RQ_STAT_WORKER, sysdata->worker);
+	addCmdLargeInt(snap, RQ_STAT_TIME, (risp_int_t) time(NULL));
+
+	assert(sysdata->queues);
+	ll_start(sysdata->queues);
+	while ((q = ll_next(sysdata->queues))) {
+		addStatsQueue(snap, q);
+	}
+	ll_finish(sysdata->queues);
+
+	assert(sysdata->nodelist);
+	ll_start(sysdata->nodelist);
+	while ((n = ll_next(sysdata->nodelist))) {
+		if (n->handle != INVALID_HANDLE) {
+			addStatsNode(snap, n);
+		}
+	}
+	ll_finish(sysdata->nodelist);
+
+	addCmd(build, RQ_CMD_CLEAR);
+	addCmdLargeStr(build, RQ_CMD_PAYLOAD, BUF_LENGTH(snap), BUF_DATA(snap));
+	addCmd(build, RQ_CMD_STATS_REPLY);
+
+	node_write_now(node, BUF_LENGTH(build), BUF_DATA(build));
+	expbuf_clear(build);
+
+	expbuf_clear(snap);
+	expbuf_pool_return(sysdata->bufpool, snap);
+}
+
+
 //-----------------------------------------------------------------------------
 // The node is a controller, and we are making a consume request for a new
-// queue that another node is consuming.
+// queue that another node is consuming.  The other controller has to be the
+// same version as us, because FORWARD and BATCHING are always sent, and an
+// older one treats them as invalid commands.
 void sendConsume(node_t *node, char *queue, short int max, unsigned char priority, short int exclusive)
 {
 	expbuf_t *build;
@@ -220,7 +631,7 @@ void sendConsume(node_t *node, char *queue, short int max, unsigned char priorit
 	build = node->sysdata->build_buf;
 	assert(build->length == 0);
 
-	assert(BIT_TEST(node->flags, FLAG_NODE_CONTROLLER));
+	assert(BIT_TEST(node->flags, FLAG_NODE_CONTROLLER) || BIT_TEST(node->flags, FLAG_NODE_PEER));
 
 	// add the commands to the out queue.
 	addCmd(build, RQ_CMD_CLEAR);
@@ -228,6 +639,8 @@ void sendConsume(node_t *node, char *queue, short int max, unsigned char priorit
 	addCmdInt(build, RQ_CMD_MAX, max);
 	addCmdShortInt(build, RQ_CMD_PRIORITY, priority);
 	if (exclusive != 0) { addCmd(build, RQ_CMD_EXCLUSIVE); }
+	addCmd(build, RQ_CMD_FORWARD);
+	addCmd(build, RQ_CMD_BATCHING);
 	addCmd(build, RQ_CMD_CONSUME);
 
 	node_write_now(node, build->length, build->data);
@@ -235,6 +648,34 @@ void sendConsume(node_t *node, char *queue, short int max, unsigned char priorit
 }
 
 
+//-----------------------------------------------------------------------------
+// The capacity of our consumers for the queue has changed, so the controller
+// that we are consuming it from is told how many requests it can give us.
+void sendCredit(node_t *node, char *queue, short int max)
+{
+	expbuf_t *build;
+
+	assert(node);
+	assert(queue);
+	assert(max > 0);
+
+	assert(node->sysdata);
+	assert(node->sysdata->build_buf);
+	build = node->sysdata->build_buf;
+	assert(build->length == 0);
+
+	assert(BIT_TEST(node->flags, FLAG_NODE_CONTROLLER) || BIT_TEST(node->flags, FLAG_NODE_PEER));
+
+	addCmd(build, RQ_CMD_CLEAR);
+	addCmdShortStr(build, RQ_CMD_QUEUE, strlen(queue), queue);
+	addCmdInt(build, RQ_CMD_MAX, max);
+	addCmd(build, RQ_CMD_CREDIT);
+
+	node_write_now(node, build->length, build->data);
+	expbuf_clear(build);
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Send the ping command.
@@ -8,15 +8,22 @@
 #include "message.h"
 #include "node.h"
 
+struct __queue_t;
 
 
 void sendConsumeReply(node_t *node, char *queue, int qid);
 void sendMessage(node_t *node, message_t *msg);
+void sendBatch(node_t *node, message_t **msgs, int count);
+int  sendBroadcast(struct __queue_t *queue, message_t *msg);
 void sendReply(node_t *node, message_t *msg);
 void sendDelivered(node_t *node, message_id_t msgid);
+void sendAcks(node_t *node);
 void sendUndelivered(node_t *node, message_id_t msgid);
 void sendClosing(node_t *node);
+void sendServerFull(node_t *node);
+void sendStats(node_t *node);
 void sendConsume(node_t *node, char *queue, short int max, unsigned char priority, short int exclusive);
+void sendCredit(node_t *node, char *queue, short int max);
 
 void sendPing(node_t *node);
 void sendPong(node_t *node);
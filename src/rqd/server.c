@@ -1,5 +1,7 @@
 // server.c
 
+#define _GNU_SOURCE
+
 #include "server.h"
 #include "commands.h"
 #include "queue.h"
@@ -12,6 +14,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 //-----------------------------------------------------------------------------
@@ -29,6 +34,7 @@ void server_init(server_t *server, system_data_t *sysdata)
 	server->sysdata = sysdata;
 	server->handle = INVALID_HANDLE;
 	server->event = NULL;
+	server->path = NULL;
 }
 
 
@@ -41,6 +47,7 @@ void server_free(server_t *server)
 	assert(server);
 	assert(server->handle == INVALID_HANDLE);
 	assert(server->event == NULL);
+	assert(server->path == NULL);
 }
 
 
@@ -66,24 +73,47 @@ static int new_socket(struct addrinfo *ai) {
 
 
 //-----------------------------------------------------------------------------
-// this function is called when we have received a new socket connection.   We
-// need to create a new node, and add it to our node list.  We need to pass to
-// the node any pointers to other sub-systems that it will need to have, and
-// then we insert the node into the 'node-circle' somewhere.  Finally, we need
-// to add the new node to the event base.
-//
-// If we have reached our limit, we would want to accept the socket, send out
-// a 'FULL' command and then close the socket.   That way the client knows
-// what the problem is, and can connect to the other server.
+// We are at maxconns, but there is a connection waiting.  We accept it just to
+// tell it that the server is full, so that it can try another controller
+// straight away, rather than waiting for us.
+static void server_refuse(server_t *server, int sfd)
+{
+	char full[2] = { RQ_CMD_CLEAR, RQ_CMD_SERVER_FULL };
+
+	assert(server);
+	assert(server->sysdata);
+	assert(sfd >= 0);
+
+	logger(server->sysdata->logging, 2, "Refusing Connection [%d], server is full.", sfd);
+	if (write(sfd, full, sizeof(full)) < 0) {
+		// nothing we can do about it, the connection is being closed anyway.
+	}
+	close(sfd);
+
+	assert(server->sysdata->stats);
+	server->sysdata->stats->refused ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// this function is called when there are new socket connections waiting.  We
+// accept as many as there are (up to a limit, so that other events get a
+// turn), and create a new node for each one.  The node adds itself to the
+// node list and the event base.
 //
-// ** Ideally, we want to stop receiving events when we have reached our
-//    maximum, and let TCP handle the busy state.
+// If we have reached maxconns, then we stop receiving events on the listening
+// sockets, and let TCP handle the busy state.  The connections will wait in
+// the listen backlog until one of the nodes closes.  If we have been asked to
+// tell them that the server is full, then we keep accepting, and each new
+// connection is told, and closed, so that it can go to another controller.
 static void server_event_handler(int hid, short flags, void *data)
 {
 	server_t *server;
+	system_data_t *sysdata;
 	socklen_t addrlen;
 	struct sockaddr_storage addr;
 	int sfd;
+	int count;
 	node_t *node = NULL;
 	
 	assert(hid >= 0);
@@ -92,54 +122,119 @@ static void server_event_handler(int hid, short flags, void *data)
   server = (server_t *) data;
 	assert(server != NULL);
 	assert(server->sysdata != NULL);
+	sysdata = server->sysdata;
+	assert(sysdata->settings);
+	assert(sysdata->stats);
+
+	for (count = 0; count < SERVER_ACCEPT_MAX; count ++) {
+
+		if (sysdata->connections >= sysdata->settings->maxconns && sysdata->settings->server_full == false) {
+			server_pause(sysdata);
+			return;
+		}
 
-	addrlen = sizeof(addr);
-	assert(sizeof(addr) >= sizeof(struct sockaddr));
-	sfd = accept(hid, (struct sockaddr *)&addr, &addrlen);
+		addrlen = sizeof(addr);
+		assert(sizeof(addr) >= sizeof(struct sockaddr));
+#ifdef SOCK_NONBLOCK
+		sfd = accept4(hid, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		sfd = accept(hid, (struct sockaddr *)&addr, &addrlen);
+		if (sfd >= 0) {
+			evutil_make_socket_nonblocking(sfd);
+			evutil_make_socket_closeonexec(sfd);
+		}
+#endif
 	
-	if (sfd == -1) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				/* these are transient, so don't log anything */
-		} else if (errno == EMFILE) {
-			fprintf(stderr, "Too many open connections\n");
-			assert(0);
-		} else {
-			perror("accept()");
+		if (sfd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					/* these are transient, so don't log anything */
+			} else if (errno == EMFILE || errno == ENFILE) {
+				// we cant accept any more until a connection closes.
+				logger(sysdata->logging, 1, "Too many open connections (%d).", sysdata->connections);
+				server_pause(sysdata);
+			} else if (errno != EINTR && errno != ECONNABORTED) {
+				perror("accept()");
+			}
+			return;
 		}
-		return;
-	}
 
-	logger(server->sysdata->logging, 2, "New Connection [%d]", sfd);
-	node = node_create(server->sysdata, sfd);
-	assert(node);
+		if (sysdata->connections >= sysdata->settings->maxconns) {
+			server_refuse(server, sfd);
+			continue;
+		}
 
-	// mark socket as non-blocking
-	evutil_make_socket_nonblocking(sfd);
+		logger(sysdata->logging, 2, "New Connection [%d]", sfd);
+		node = node_create(sysdata, sfd);
+		assert(node);
+		BIT_SET(node->flags, FLAG_NODE_ACCEPTED);
+		if (server->path) {
+			BIT_SET(node->flags, FLAG_NODE_UNIX);
+		}
+		sysdata->connections ++;
+		sysdata->stats->accepted ++;
+	}
 }
 
 
+//-----------------------------------------------------------------------------
+// Stop receiving events for new connections on all of the listening sockets.
+void server_pause(system_data_t *sysdata)
+{
+	server_t *server;
+
+	assert(sysdata);
+	assert(sysdata->servers);
+
+	if (sysdata->accept_paused == 0) {
+		logger(sysdata->logging, 1, "Not accepting connections, %d are open.", sysdata->connections);
+		ll_start(sysdata->servers);
+		while ((server = ll_next(sysdata->servers))) {
+			if (server->event) {
+				event_del(server->event);
+			}
+		}
+		ll_finish(sysdata->servers);
+		sysdata->accept_paused = 1;
+	}
+}
 
-static void server_listen_ai(server_t *server, struct addrinfo *ai)
+
+//-----------------------------------------------------------------------------
+// If we stopped accepting connections, and there is room for more now, then
+// start receiving the events again.
+void server_resume(system_data_t *sysdata)
 {
-  struct linger ling = {0, 0};
-	int flags;
+	server_t *server;
 
-	assert(server);
-	assert(ai);
+	assert(sysdata);
+	assert(sysdata->settings);
 
-	assert(server->handle == INVALID_HANDLE);
-	assert(server->event == NULL);
-	
-	// create the new socket.  if that fails, free the memory we've already allocated, and return NULL.
-	server->handle = new_socket(ai);
-	assert(server->handle != INVALID_HANDLE);
+	if (sysdata->accept_paused != 0 && sysdata->connections < sysdata->settings->maxconns && sysdata->servers) {
+		logger(sysdata->logging, 1, "Accepting connections again, %d are open.", sysdata->connections);
+		ll_start(sysdata->servers);
+		while ((server = ll_next(sysdata->servers))) {
+			if (server->event) {
+				event_add(server->event, NULL);
+			}
+		}
+		ll_finish(sysdata->servers);
+		sysdata->accept_paused = 0;
+	}
+}
 
-	flags = 1;
-	setsockopt(server->handle, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-	setsockopt(server->handle, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-	setsockopt(server->handle, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
 
-	if (bind(server->handle, ai->ai_addr, ai->ai_addrlen) == -1) {
+
+//-----------------------------------------------------------------------------
+// Bind the socket of the server to the address, and start listening on it.  If
+// that fails, the socket is closed.
+static void server_bind(server_t *server, struct sockaddr *addr, socklen_t addrlen)
+{
+	assert(server);
+	assert(server->handle >= 0);
+	assert(server->event == NULL);
+	assert(addr);
+
+	if (bind(server->handle, addr, addrlen) == -1) {
 		close(server->handle);
 		server->handle = INVALID_HANDLE;
 	} else {
@@ -162,6 +257,38 @@ static void server_listen_ai(server_t *server, struct addrinfo *ai)
 }
 
 
+static void server_listen_ai(server_t *server, struct addrinfo *ai)
+{
+  struct linger ling = {0, 0};
+	int flags;
+
+	assert(server);
+	assert(ai);
+
+	assert(server->handle == INVALID_HANDLE);
+	assert(server->event == NULL);
+	
+	// create the new socket.  if that fails, free the memory we've already allocated, and return NULL.
+	server->handle = new_socket(ai);
+	assert(server->handle != INVALID_HANDLE);
+
+	flags = 1;
+	setsockopt(server->handle, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+	setsockopt(server->handle, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+	setsockopt(server->handle, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+
+	// when there are several workers, they each bind their own socket to the
+	// port, and the kernel spreads the new connections between them.
+#ifdef SO_REUSEPORT
+	if (server->sysdata->settings->workers > 1) {
+		setsockopt(server->handle, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+	}
+#endif
+
+	server_bind(server, ai->ai_addr, ai->ai_addrlen);
+}
+
+
 //-----------------------------------------------------------------------------
 // Initialise and return a server struct that we will use to control the nodes 
 // that we are connected to.   We will bind the listening port on the socket.
@@ -221,6 +348,92 @@ void server_listen(server_t *server, int port, char *address)
 }
 
 
+//-----------------------------------------------------------------------------
+// Remove a socket file that was left behind by an instance that has gone
+// away.  Anything that is not a socket, or a socket that something is still
+// listening on, is left alone, and we cant start.
+static void server_unix_stale(const char *path, struct sockaddr_un *addr)
+{
+	struct stat st;
+	int handle, res;
+
+	assert(path);
+	assert(addr);
+
+	if (lstat(path, &st) != 0) {
+		if (errno == ENOENT) { return; }
+		perror("lstat()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (S_ISSOCK(st.st_mode) == 0) {
+		fprintf(stderr, "Unix socket path already exists, and is not a socket: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	handle = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (handle < 0) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+	res = connect(handle, (struct sockaddr *) addr, sizeof(*addr));
+	if (res != 0 && errno != ECONNREFUSED) {
+		perror("connect()");
+		exit(EXIT_FAILURE);
+	}
+	close(handle);
+
+	if (res == 0) {
+		fprintf(stderr, "Unix socket is already being listened on: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(path);
+}
+
+
+//-----------------------------------------------------------------------------
+// Listen on a unix socket, for nodes that are on the same host.  A socket file
+// that was left behind by an earlier instance is removed first.  The accepted
+// connections are handled the same as the TCP ones.
+void server_listen_unix(server_t *server, const char *path)
+{
+	struct sockaddr_un addr;
+	int flags;
+
+	assert(server);
+	assert(path && path[0] != '\0');
+	assert(server->sysdata);
+	assert(server->handle == INVALID_HANDLE);
+	assert(server->path == NULL);
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Unix socket path is too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	server->handle = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->handle < 0 || (flags = fcntl(server->handle, F_GETFL, 0)) < 0 || fcntl(server->handle, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	server_unix_stale(path, &addr);
+	server_bind(server, (struct sockaddr *) &addr, sizeof(addr));
+	if (server->handle == INVALID_HANDLE) {
+		perror("bind()");
+		exit(EXIT_FAILURE);
+	}
+
+	server->path = strdup(path);
+	logger(server->sysdata->logging, 1, "Listening on unix socket %s.", path);
+}
+
+
 // When the system is shutting down, it will close all listening servers.
 void server_shutdown(server_t *server)
 {
@@ -228,13 +441,24 @@ void server_shutdown(server_t *server)
 	assert(server->sysdata);
 	logger(server->sysdata->logging, 1, "Closing socket %d.", server->handle);
 
-	assert(server->event);
-	event_free(server->event);
-	server->event = NULL;
+	// a server that could not bind its address (such as IPv6, when the IPv4
+	// socket already covers it) has nothing to close.
+	assert((server->handle == INVALID_HANDLE && server->event == NULL) || (server->handle >= 0 && server->event));
+	if (server->event) {
+		event_free(server->event);
+		server->event = NULL;
+	}
 	
-	assert(server->handle != INVALID_HANDLE);
-	close(server->handle);
-	server->handle = INVALID_HANDLE;
+	if (server->handle != INVALID_HANDLE) {
+		close(server->handle);
+		server->handle = INVALID_HANDLE;
+	}
+
+	if (server->path) {
+		unlink(server->path);
+		free(server->path);
+		server->path = NULL;
+	}
 }
 
 
@@ -10,9 +10,15 @@
 #include "system_data.h"
 
 
+// maximum number of connections that will be accepted in one go, before
+// letting the other events have a turn.
+#define SERVER_ACCEPT_MAX   64
+
+
 typedef struct {
 	int handle;
 	struct event *event;
+	char *path;					// the file of a unix socket, removed when it is closed.
 	system_data_t *sysdata;
 } server_t;
 
@@ -21,8 +27,12 @@ void server_init(server_t *server, system_data_t *sysdata);
 void server_free(server_t *server);
 
 void server_listen(server_t *server, int port, char *address);
+void server_listen_unix(server_t *server, const char *path);
 void server_shutdown(server_t *server);
 
+void server_pause(system_data_t *sysdata);
+void server_resume(system_data_t *sysdata);
+
 void server_cleanup(server_t *server);
 // void server_event_handler(int hid, short flags, void *data);
 
@@ -24,11 +24,24 @@ void settings_init(settings_t *ptr)
 
 	ptr->interfaces = (list_t *) malloc(sizeof(list_t));
 	ll_init(ptr->interfaces);
+	ptr->unix_path = NULL;
 
 	ptr->controllers = (list_t *) malloc(sizeof(list_t));
 	ll_init(ptr->controllers);
 
 	ptr->logfile = NULL;
+	ptr->policy = QUEUE_POLICY_PRIORITY;
+	ptr->workers = 1;
+
+	ptr->spill_path = NULL;
+	ptr->spill_limit = 0;
+	ptr->spill_queue = 0;
+
+	ptr->journal_path = NULL;
+
+	ptr->backlog_limit = 0;
+	ptr->backlog_queue = 0;
+	ptr->server_full = false;
 }
 
 
@@ -7,6 +7,18 @@
 #define MAX_INTERFACES	5
 #define DEFAULT_MAXCONNS 128
 
+// policies that can be used by the queues to select which of the ready nodes
+// a request will be sent to.
+#define QUEUE_POLICY_PRIORITY  0		// highest priority first, then least outstanding.
+#define QUEUE_POLICY_LEAST     1		// least outstanding requests.
+#define QUEUE_POLICY_P2C       2		// best of two random choices.
+
+// maximum number of worker processes that can share the listening port.
+#define MAX_WORKERS     64
+
+// when reading from producers has been paused, it is started again once the
+// pending data is down to this much of the limit.
+#define BACKLOG_RESUME(limit)   (((limit) / 4) * 3)
 
 
 
@@ -20,8 +32,28 @@ typedef struct {
 	char *pid_file;
 	int port;
 	list_t *interfaces;
+	char *unix_path;			// unix socket to listen on as well, or NULL.
 	list_t *controllers;
 	char *logfile;
+	int policy;
+	int workers;
+
+	// spilling pending payloads to disk.  The limits are in bytes.
+	char *spill_path;
+	unsigned long long spill_limit;
+	unsigned long long spill_queue;
+
+	// directory for the journal of durable queues.
+	char *journal_path;
+
+	// pending data (in bytes) that the queues can have before we stop reading
+	// from the nodes sending requests.  0 means there is no limit.
+	unsigned long long backlog_limit;
+	unsigned long long backlog_queue;
+
+	// send SERVER_FULL to nodes that are paused, or connections that are
+	// refused because we are at maxconns.
+	char server_full;
 } settings_t;
 
 
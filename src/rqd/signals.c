@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <event.h>
 #include <evlogging.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -31,11 +32,20 @@ void sigint_handler(evutil_socket_t fd, short what, void *arg)
 	queue_t *q;
 	node_t *node;
 	controller_t *ct;
+	int i;
 	
 	logger(sysdata->logging, 3, "SIGINT");
 
 	assert(sysdata);
 	assert(sysdata->servers);
+	assert(sysdata->settings);
+
+	// if we started other workers, they need to shutdown too.
+	if (sysdata->worker_pids) {
+		for (i=1; i<sysdata->settings->workers; i++) {
+			kill(sysdata->worker_pids[i], SIGINT);
+		}
+	}
 
 	// delete the sigint event, we dont need it anymore.
 	assert(sysdata->sigint_event);
@@ -98,6 +108,14 @@ void sigint_handler(evutil_socket_t fd, short what, void *arg)
 	}
 	ll_finish(sysdata->controllers);
 
+	// stop the message timeouts, we dont want them keeping the event loop
+	// going.
+	if (sysdata->timeout_event) {
+		event_del(sysdata->timeout_event);
+		event_free(sysdata->timeout_event);
+		sysdata->timeout_event = NULL;
+	}
+
 	// Put stats event on notice that we are shutting down, so that as soon as there are no more nodes, it needs to stop its event.
 	assert(sysdata != NULL);
 	assert(sysdata->stats != NULL);
@@ -123,12 +141,11 @@ void sighup_handler(evutil_socket_t fd, short what, void *arg)
 
 	expbuf_print(buf, "Complete data dump\n");
 
-	assert(sysdata->msg_list);
-	expbuf_print(buf, "Messages:\n\tMax=%d\n\tActive=%d\n\n", sysdata->msg_max, sysdata->msg_used);
+	assert(sysdata->msglist);
+	expbuf_print(buf, "Messages:\n\tMax=%d\n\tActive=%d\n\tSlabs=%d\n\n",
+		sysdata->msglist->max, sysdata->msglist->used, sysdata->msglist->slab_count);
 
-	assert(sysdata->in_buf);
 	assert(sysdata->build_buf);
-	expbuf_print(buf, "In Buffer size: %d\n", BUF_MAX(sysdata->in_buf));
 	expbuf_print(buf, "Build Buffer size: %d\n", BUF_MAX(sysdata->build_buf));
 
 	expbuf_print(buf, "\nEvents:\n");
@@ -0,0 +1,242 @@
+// spill.c
+
+#include "spill.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+//-----------------------------------------------------------------------------
+// Initialise the spill object.  Segments are not created until they are
+// needed.
+void spill_init(spill_t *spill, const char *path, unsigned int segment_size)
+{
+	assert(spill);
+	assert(path);
+	assert(segment_size > 0);
+
+	spill->path = strdup(path);
+	spill->segment_size = segment_size;
+	spill->current = NULL;
+	spill->segments = 0;
+	spill->resident = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Create a new segment file, and map it.
+static spill_segment_t * spill_segment_new(spill_t *spill, unsigned int size)
+{
+	spill_segment_t *seg;
+	char filename[PATH_MAX];
+	int handle;
+	void *map;
+
+	assert(spill);
+	assert(spill->path);
+	assert(size > 0);
+
+	snprintf(filename, sizeof(filename), "%s/rqd-spill-XXXXXX", spill->path);
+	handle = mkstemp(filename);
+	if (handle < 0) {
+		return(NULL);
+	}
+
+	// we dont need the name, the file will stay until it is unmapped.
+	unlink(filename);
+
+	// the blocks are allocated now, rather than when the payloads are copied
+	// in.  If the disk is full, we find out here, instead of getting a SIGBUS
+	// when writing to the map.
+	map = MAP_FAILED;
+	if (posix_fallocate(handle, 0, size) == 0) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+	}
+	close(handle);
+	if (map == MAP_FAILED) {
+		return(NULL);
+	}
+
+	// the payloads will be read back in the order they were written.
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	seg = (spill_segment_t *) malloc(sizeof(spill_segment_t));
+	assert(seg);
+	seg->map = (char *) map;
+	seg->size = size;
+	seg->used = 0;
+	seg->refs = 0;
+	seg->spill = spill;
+
+	spill->segments ++;
+
+	return(seg);
+}
+
+
+//-----------------------------------------------------------------------------
+// Unmap the segment, which will also remove the file.
+static void spill_segment_delete(spill_segment_t *seg)
+{
+	assert(seg);
+	assert(seg->refs == 0);
+	assert(seg->map);
+	assert(seg->spill);
+	assert(seg->spill->segments > 0);
+
+	munmap(seg->map, seg->size);
+	seg->map = NULL;
+	seg->spill->segments --;
+	free(seg);
+}
+
+
+//-----------------------------------------------------------------------------
+// free the resources used by the spill object.  All the payloads should have
+// been released by now.
+void spill_free(spill_t *spill)
+{
+	assert(spill);
+
+	if (spill->current) {
+		spill_segment_delete(spill->current);
+		spill->current = NULL;
+	}
+	assert(spill->segments == 0);
+	assert(spill->resident == 0);
+
+	free(spill->path);
+	spill->path = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// A payload that was in the segment has been read back or released.  When
+// the segment is empty, it is removed, unless it is the current one, which
+// can then be filled again from the start.
+static void spill_segment_unref(spill_segment_t *seg)
+{
+	assert(seg);
+	assert(seg->refs > 0);
+	assert(seg->spill);
+
+	seg->refs --;
+	if (seg->refs == 0) {
+		if (seg == seg->spill->current) {
+			seg->used = 0;
+		}
+		else {
+			spill_segment_delete(seg);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Write the payload to the current segment, and release its buffer.  Returns
+// 1 if it was spilled, or 0 if it has to stay in memory.  Payloads that are
+// larger than a segment are given a segment of their own.
+int spill_payload(spill_t *spill, payload_t *payload)
+{
+	spill_segment_t *seg;
+	unsigned int length;
+
+	assert(spill);
+	assert(payload);
+	assert(payload->refs > 0);
+
+	// only payloads that are not being sent to anyone can be spilled.
+	if (payload->buf == NULL || payload->refs > 1) {
+		return(0);
+	}
+
+	length = BUF_LENGTH(payload->buf);
+	if (length == 0) {
+		return(0);
+	}
+
+	seg = spill->current;
+	if (length > spill->segment_size) {
+		seg = spill_segment_new(spill, length);
+	}
+	else if (seg == NULL || seg->size - seg->used < length) {
+		// the current segment is full.  It will be removed when the payloads in
+		// it have all been read back.
+		if (seg && seg->refs == 0) {
+			seg->used = 0;
+		}
+		else {
+			seg = spill_segment_new(spill, spill->segment_size);
+			if (seg) {
+				if (spill->current && spill->current->refs == 0) {
+					spill_segment_delete(spill->current);
+				}
+				spill->current = seg;
+			}
+		}
+	}
+
+	if (seg == NULL) {
+		return(0);
+	}
+
+	assert(seg->size - seg->used >= length);
+	memcpy(seg->map + seg->used, BUF_DATA(payload->buf), length);
+
+	payload->segment = seg;
+	payload->offset = seg->used;
+	payload->length = length;
+	seg->used += length;
+	seg->refs ++;
+
+	expbuf_clear(payload->buf);
+	expbuf_pool_return(payload->pool, payload->buf);
+	payload->buf = NULL;
+
+	return(1);
+}
+
+
+//-----------------------------------------------------------------------------
+// Read a spilled payload back into a buffer.
+void spill_load(payload_t *payload)
+{
+	spill_segment_t *seg;
+
+	assert(payload);
+	assert(payload->buf == NULL);
+	assert(payload->segment);
+	assert(payload->pool);
+
+	seg = payload->segment;
+	assert(payload->offset + payload->length <= seg->used);
+
+	payload->buf = expbuf_pool_new(payload->pool, payload->length);
+	assert(payload->buf);
+	expbuf_set(payload->buf, seg->map + payload->offset, payload->length);
+
+	payload->segment = NULL;
+	spill_segment_unref(seg);
+}
+
+
+//-----------------------------------------------------------------------------
+// The spilled payload is not needed anymore.
+void spill_release(payload_t *payload)
+{
+	spill_segment_t *seg;
+
+	assert(payload);
+	assert(payload->buf == NULL);
+	assert(payload->segment);
+
+	seg = payload->segment;
+	payload->segment = NULL;
+	spill_segment_unref(seg);
+}
@@ -0,0 +1,47 @@
+#ifndef __SPILL_H
+#define __SPILL_H
+
+// When there is too much pending data, the payloads of new messages are
+// written to segment files instead of being kept in memory.  The segments are
+// mapped into memory, and the payloads are appended to them in the order they
+// arrive, which is also the order they will be delivered, so they are read
+// back sequentially.  A segment is removed once all of the payloads in it have
+// been read back or released.  The files are unlinked as soon as they are
+// mapped, so nothing is left behind if the daemon stops.
+
+#include "payload.h"
+
+
+#define SPILL_SEGMENT_SIZE   (64 * 1024 * 1024)
+#define SPILL_DEFAULT_LIMIT  256			// megabytes of pending data that can be in memory.
+
+
+struct __spill_t;
+
+typedef struct __spill_segment_t {
+	char *map;
+	unsigned int size;
+	unsigned int used;
+	int refs;										// payloads in the segment that are still spilled.
+	struct __spill_t *spill;
+} spill_segment_t;
+
+typedef struct __spill_t {
+	char *path;									// directory that the segment files are created in.
+	unsigned int segment_size;
+	spill_segment_t *current;		// the segment that payloads are being added to.
+	int segments;
+
+	// bytes of pending payloads that are in memory, across all the queues.
+	unsigned long long resident;
+} spill_t;
+
+
+void spill_init(spill_t *spill, const char *path, unsigned int segment_size);
+void spill_free(spill_t *spill);
+
+int  spill_payload(spill_t *spill, payload_t *payload);
+void spill_load(payload_t *payload);
+void spill_release(payload_t *payload);
+
+#endif
@@ -18,11 +18,38 @@ void stats_init(stats_t *stats)
 	stats->out_bytes = 0;
 	stats->in_bytes = 0;
 	stats->requests = 0;
+	stats->batches = 0;
+	stats->batches_out = 0;
+	stats->acks_in = 0;
+	stats->acks_out = 0;
 	stats->replies = 0;
 	stats->broadcasts = 0;
 	stats->re = 0;
 	stats->we = 0;
 	stats->te = 0;
+	stats->msg_grows = 0;
+	stats->drain_passes = 0;
+	stats->drained = 0;
+	stats->drain_max = 0;
+	stats->out_copied = 0;
+	stats->out_referenced = 0;
+	stats->in_adopted = 0;
+	stats->out_writes = 0;
+	stats->out_frames = 0;
+	stats->timeouts = 0;
+	stats->redelivered = 0;
+	stats->lost = 0;
+	stats->forwarded = 0;
+	stats->accepted = 0;
+	stats->refused = 0;
+	stats->spilled = 0;
+	stats->unspilled = 0;
+	stats->journal_records = 0;
+	stats->journal_commits = 0;
+	stats->paused = 0;
+	stats->resumed = 0;
+	stats->rings = 0;
+	stats->ring_wakes = 0;
 
 	stats->shutdown = 0;
 
@@ -35,6 +62,34 @@ void stats_init(stats_t *stats)
 
 
 
+//-----------------------------------------------------------------------------
+// Log the stats of a queue for this interval, if anything happened in it.  The
+// latencies are the median, 99th percentile and max, in microseconds.
+static void stats_queue(system_data_t *sysdata, queue_t *q)
+{
+	queue_stats_t *qs;
+
+	assert(sysdata);
+	assert(q);
+
+	qs = &q->qstats;
+	if (qs->requests || qs->replies || qs->broadcasts || qs->wait.count || qs->total.count || qs->failover.count) {
+		logger(sysdata->logging, 1, "Queue[%s], Requests[%u], Replies[%u], Broadcasts[%u], Bytes[%llu/%llu], Depth[%u/%u], InFlight[%u/%u], Wait[%u/%u/%u], Service[%u/%u/%u], Total[%u/%u/%u], Failover[%u/%u]",
+			q->name,
+			qs->requests, qs->replies, qs->broadcasts,
+			qs->bytes_in, qs->bytes_out,
+			ll_count(&q->msg_pending), qs->depth_max,
+			ll_count(&q->msg_proc), qs->inflight_max,
+			hist_percentile(&qs->wait, 50), hist_percentile(&qs->wait, 99), qs->wait.max,
+			hist_percentile(&qs->service, 50), hist_percentile(&qs->service, 99), qs->service.max,
+			hist_percentile(&qs->total, 50), hist_percentile(&qs->total, 99), qs->total.max,
+			qs->failover.count, qs->failover.max);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Log the stats for the interval that has just finished, and reset them.
 static void stats_handler(int fd, short int flags, void *arg)
 {
 	stats_t *stats;
@@ -76,30 +131,79 @@ static void stats_handler(int fd, short int flags, void *arg)
 	ll_finish(sysdata->queues);
 
 	assert(stats != NULL);
-	if (stats->in_bytes || stats->out_bytes || stats->requests || stats->replies || stats->broadcasts || stats->re || stats->we) {
+	if (stats->in_bytes || stats->out_bytes || stats->requests || stats->replies || stats->broadcasts || stats->re || stats->we || stats->msg_grows || stats->drain_passes || stats->timeouts || stats->redelivered || stats->lost || stats->forwarded || stats->spilled || stats->unspilled || stats->journal_records || stats->paused || stats->resumed || stats->accepted || stats->refused || stats->rings || stats->ring_wakes || stats->batches_out || stats->acks_in) {
 
-		logger(sysdata->logging, 1, "Bytes[%u/%u], Clients[%u], Requests[%u], Replies[%u], Broadcasts[%u], Queues[%u], Msgs[%d/%d], MsgPool[%u/%u], Events[%u/%u/%u]",
+		logger(sysdata->logging, 1, "Bytes[%u/%u], Clients[%u], Accepted[%u/%u], Requests[%u], Replies[%u], Broadcasts[%u], Queues[%u], Msgs[%d/%d], MsgPool[%u/%u/%u], Drain[%u/%u/%u], Batches[%u/%u], Acks[%u/%u], Copied[%u/%u], Writes[%u/%u/%.2f], Adopted[%u], Timeouts[%u], Redelivered[%u/%u], Forwarded[%u], Spill[%u/%u], Journal[%u/%u], Paused[%u/%u/%llu], Rings[%u/%u], Events[%u/%u/%u]",
 			stats->in_bytes,
 			stats->out_bytes,
 			clients,
+			stats->accepted, stats->refused,
 			stats->requests,
 			stats->replies,
 			stats->broadcasts,
 			queues,
 			msg_pending, msg_proc,
-			sysdata->msg_used, sysdata->msg_max,
+			sysdata->msglist->used, sysdata->msglist->max, stats->msg_grows,
+			stats->drained, stats->drain_passes, stats->drain_max,
+			stats->batches, stats->batches_out,
+			stats->acks_in, stats->acks_out,
+			stats->out_copied, stats->out_referenced,
+			stats->out_writes, stats->out_frames, stats->out_frames ? (double) stats->out_writes / stats->out_frames : 0.0,
+			stats->in_adopted,
+			stats->timeouts,
+			stats->redelivered, stats->lost,
+			stats->forwarded,
+			stats->spilled, stats->unspilled,
+			stats->journal_records, stats->journal_commits,
+			stats->paused, stats->resumed, sysdata->backlog,
+			stats->rings, stats->ring_wakes,
 			stats->re, stats->we, stats->te);
 		
 		stats->in_bytes = 0;
 		stats->out_bytes = 0;
 		stats->requests = 0;
+		stats->batches = 0;
+		stats->batches_out = 0;
+		stats->acks_in = 0;
+		stats->acks_out = 0;
 		stats->replies = 0;
 		stats->broadcasts = 0;
 		stats->re = 0;
 		stats->we = 0;
 		stats->te = 0;
+		stats->msg_grows = 0;
+		stats->drain_passes = 0;
+		stats->drained = 0;
+		stats->drain_max = 0;
+		stats->out_copied = 0;
+		stats->out_referenced = 0;
+		stats->in_adopted = 0;
+		stats->out_writes = 0;
+		stats->out_frames = 0;
+		stats->timeouts = 0;
+		stats->redelivered = 0;
+		stats->lost = 0;
+		stats->forwarded = 0;
+		stats->accepted = 0;
+		stats->refused = 0;
+		stats->spilled = 0;
+		stats->unspilled = 0;
+		stats->journal_records = 0;
+		stats->journal_commits = 0;
+		stats->paused = 0;
+		stats->resumed = 0;
+		stats->rings = 0;
+		stats->ring_wakes = 0;
 	}
 
+	// the stats of each queue that was used, and then start the next interval.
+	ll_start(sysdata->queues);
+	while ((q = ll_next(sysdata->queues))) {
+		stats_queue(sysdata, q);
+		queue_stats_roll(q);
+	}
+	ll_finish(sysdata->queues);
+
 	// if we are not shutting down, then schedule the stats event again.
 	if (stats->shutdown == 0) {
 		stats_start(stats);
@@ -7,10 +7,25 @@
 typedef struct {
 	unsigned int out_bytes;
 	unsigned int in_bytes;
+	unsigned int in_adopted;			// payloads read straight into the buffer the message uses.
 	unsigned int requests;
+	unsigned int batches, batches_out;		// BATCH commands received with several requests, and sent to consumers.
+	unsigned int acks_in, acks_out;			// DELIVERED that covered several ids, received and sent.
 	unsigned int replies;
 	unsigned int broadcasts;
 	unsigned int re, we, te;
+	unsigned int msg_grows;
+	unsigned int drain_passes, drained, drain_max;
+	unsigned int timeouts;
+	unsigned int redelivered, lost;		// requests sent again after their consumer went away, or given up on.
+	unsigned int forwarded;			// requests handed off to other worker processes.
+	unsigned int accepted, refused;			// new connections, and those refused because we are full.
+	unsigned int spilled, unspilled;		// payloads written to disk, and read back.
+	unsigned int journal_records, journal_commits;
+	unsigned int paused, resumed;				// nodes that we stopped reading from, and started again.
+	unsigned int out_copied, out_referenced;		// outgoing bytes copied, or sent from the payload.
+	unsigned int out_writes, out_frames;				// write calls, and the frames they sent.
+	unsigned int rings, ring_wakes;		// nodes that moved to shared-memory rings, and times they woke us.
 	short shutdown;
 	void *sysdata;
 	struct event *stats_event;
@@ -2,8 +2,12 @@
 #define __SYSTEM_DATA_H
 
 #include "message.h"
+#include "qdir.h"
+#include "journal.h"
 #include "settings.h"
+#include "spill.h"
 #include "stats.h"
+#include "timewheel.h"
 
 #include <event.h>
 #include <evlogging.h>
@@ -11,24 +15,19 @@
 #include <linklist.h>
 #include <mempool.h>
 #include <risp.h>
+#include <sys/types.h>
 
 
 typedef struct {
 	struct event_base *evbase;
 	risp_t *risp;
 	
-	// message list.  We keep an array of message_t structures.   This array is
-	// used for all the requests received by the system.  The index in the array
-	// is used as the message ID that is passed to the nodes for processing.
-	// When replies are returned, the message ID is again specified so that the
-	// reply payload can be returned to the node that delivered it.
-	message_t **msg_list;
-	int msg_max;
-	int msg_next;
-	int msg_used;
+	// message list.  This is used for all the requests received by the system.
+	// The id of the message is the index in the list.
+	msglist_t *msglist;
 
 	expbuf_pool_t *bufpool;
-	expbuf_t *in_buf, *build_buf;
+	expbuf_t *build_buf;
 
 	struct event *sigint_event;
 	struct event *sighup_event;
@@ -38,10 +37,46 @@ typedef struct {
 	settings_t *settings;
 	stats_t *stats;
 	list_t *queues;
+	qdir_t *qdir;			// used to find queues by name or id, without walking 'queues'.
+
+	// bytes of pending data in all the queues, and the nodes that we have
+	// stopped reading from because it went over the limit.
+	unsigned long long backlog;
+	list_t *paused;
 	list_t *nodelist;
+
+	// nodes that have data to send.  They are all flushed at the end of the
+	// current pass of the event loop.
+	list_t *flushlist;
+	int flush_scheduled;
 	list_t *controllers;
 	list_t *servers;
 
+	// number of connections that we have accepted, and whether we have stopped
+	// accepting more because it has reached maxconns.
+	int connections;
+	int accept_paused;
+
+	// message timeouts.  The event is only set while there are timers in the
+	// wheel.
+	timewheel_t *timewheel;
+	struct event *timeout_event;
+
+	// pending payloads are written to disk when there is too much in memory.
+	// NULL if spilling has not been enabled.
+	spill_t *spill;
+
+	// messages in durable queues are recorded in the journal.  NULL if there is
+	// no journal.
+	journal_t *journal;
+
+	// worker processes.  'worker' is the index of this process.  Only the first
+	// worker keeps the pids of the others, so that it can stop them.  The peer
+	// handles are the sockets used to talk to each of the other workers.
+	int worker;
+	pid_t *worker_pids;
+	int *peer_handles;
+
 	logging_t *logging;
 } system_data_t;
 
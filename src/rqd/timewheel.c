@@ -0,0 +1,226 @@
+// timewheel.c
+
+#include "timewheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+
+//-----------------------------------------------------------------------------
+// Initialise the wheel, with all the slots empty.  'now' is the current time
+// in milliseconds.
+void tw_init(timewheel_t *tw, tw_time_t now)
+{
+	int i, j;
+
+	assert(tw);
+
+	for (i=0; i < TW_SIZE0; i++) {
+		tw->wheel0[i] = NULL;
+	}
+	for (j=0; j < TW_LEVELS; j++) {
+		for (i=0; i < TW_SIZE; i++) {
+			tw->wheels[j][i] = NULL;
+		}
+	}
+
+	tw->current = now;
+	tw->count = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// free the resources of the wheel.  The entries are owned by other objects,
+// so they should all have been cancelled before this.
+void tw_free(timewheel_t *tw)
+{
+	assert(tw);
+	assert(tw->count == 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the current time in milliseconds.
+tw_time_t tw_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return(((tw_time_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000));
+}
+
+
+//-----------------------------------------------------------------------------
+// Initialise a timer entry that is embedded in another object.
+void tw_entry_init(tw_entry_t *entry, void *arg)
+{
+	assert(entry);
+
+	entry->prev = NULL;
+	entry->next = NULL;
+	entry->slot = NULL;
+	entry->tw = NULL;
+	entry->expires = 0;
+	entry->arg = arg;
+}
+
+
+//-----------------------------------------------------------------------------
+// put the entry in the slot that matches its expiry time.
+static void tw_place(timewheel_t *tw, tw_entry_t *entry)
+{
+	tw_entry_t **slot;
+	tw_time_t delay;
+	int level;
+	int shift;
+
+	assert(tw && entry);
+	assert(entry->slot == NULL);
+
+	if (entry->expires < tw->current) {
+		// already expired, so it will be processed on the next tick.
+		slot = &tw->wheel0[tw->current & (TW_SIZE0 - 1)];
+	}
+	else {
+		delay = entry->expires - tw->current;
+		if (delay > TW_MAX_DELAY) {
+			entry->expires = tw->current + TW_MAX_DELAY;
+			delay = TW_MAX_DELAY;
+		}
+
+		if (delay < TW_SIZE0) {
+			slot = &tw->wheel0[entry->expires & (TW_SIZE0 - 1)];
+		}
+		else {
+			shift = TW_BITS0;
+			for (level = 0; level < TW_LEVELS - 1; level++) {
+				if (delay < (1ULL << (shift + TW_BITS))) {
+					break;
+				}
+				shift += TW_BITS;
+			}
+			slot = &tw->wheels[level][(entry->expires >> shift) & (TW_SIZE - 1)];
+		}
+	}
+
+	entry->prev = NULL;
+	entry->next = *slot;
+	if (*slot) { (*slot)->prev = entry; }
+	*slot = entry;
+	entry->slot = slot;
+}
+
+
+//-----------------------------------------------------------------------------
+// remove the entry from the slot it is in.
+static void tw_unlink(tw_entry_t *entry)
+{
+	assert(entry);
+	assert(entry->slot);
+
+	if (entry->prev) { entry->prev->next = entry->next; }
+	else             { assert(*entry->slot == entry); *entry->slot = entry->next; }
+	if (entry->next) { entry->next->prev = entry->prev; }
+
+	entry->prev = NULL;
+	entry->next = NULL;
+	entry->slot = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Add the entry to the wheel, to expire at the specified time (in
+// milliseconds).  The entry must not already be pending.
+void tw_add(timewheel_t *tw, tw_entry_t *entry, tw_time_t expires)
+{
+	assert(tw);
+	assert(entry);
+	assert(tw_pending(entry) == 0);
+
+	entry->expires = expires;
+	entry->tw = tw;
+	tw_place(tw, entry);
+	tw->count ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove the entry from the wheel, before it has expired.
+void tw_cancel(tw_entry_t *entry)
+{
+	assert(entry);
+	assert(tw_pending(entry));
+	assert(entry->tw);
+	assert(entry->tw->count > 0);
+
+	tw_unlink(entry);
+	entry->tw->count --;
+	entry->tw = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// move all the entries in an outer slot to the slots they now belong in.
+// Returns the index of the slot, so that the caller knows if the next wheel
+// also needs to be cascaded.
+static int tw_cascade(timewheel_t *tw, int level)
+{
+	tw_entry_t *entry, *list;
+	int index;
+
+	assert(tw);
+	assert(level >= 0 && level < TW_LEVELS);
+
+	index = (tw->current >> (TW_BITS0 + (level * TW_BITS))) & (TW_SIZE - 1);
+	list = tw->wheels[level][index];
+	tw->wheels[level][index] = NULL;
+
+	while ((entry = list)) {
+		list = entry->next;
+		entry->prev = NULL;
+		entry->next = NULL;
+		entry->slot = NULL;
+		tw_place(tw, entry);
+	}
+
+	return(index);
+}
+
+
+//-----------------------------------------------------------------------------
+// Process all the entries that expire up to the time 'now'.  Each expired
+// entry is removed from the wheel before the handler is called, so the
+// handler is free to add it again, or to add or cancel other entries.
+void tw_advance(timewheel_t *tw, tw_time_t now, void (*handler)(tw_entry_t *entry, void *arg))
+{
+	tw_entry_t *entry;
+	int index;
+	int level;
+
+	assert(tw);
+	assert(handler);
+
+	while (tw->current <= now) {
+		if (tw->count == 0) {
+			// nothing in the wheel, so there is no need to step thru each tick.
+			tw->current = now + 1;
+			break;
+		}
+		
+		index = tw->current & (TW_SIZE0 - 1);
+		if (index == 0) {
+			for (level = 0; level < TW_LEVELS && tw_cascade(tw, level) == 0; level++) {
+				// nothing more to do, tw_cascade has done it.
+			}
+		}
+		tw->current ++;
+
+		while ((entry = tw->wheel0[index])) {
+			tw_unlink(entry);
+			tw->count --;
+			entry->tw = NULL;
+			handler(entry, entry->arg);
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef __TIMEWHEEL_H
+#define __TIMEWHEEL_H
+
+// A hierarchical timing wheel, with millisecond resolution.  The entries are
+// embedded in the objects that need a timer, so adding and cancelling a timer
+// does not need any allocation or searching.  The first wheel has a slot for
+// each millisecond, and each of the following wheels has slots that each cover
+// the whole range of the wheel below it.  As time advances, the entries in the
+// outer wheels are moved (cascaded) to the inner ones.
+
+#define TW_BITS0     8
+#define TW_BITS      6
+#define TW_SIZE0     (1 << TW_BITS0)
+#define TW_SIZE      (1 << TW_BITS)
+#define TW_LEVELS    3
+#define TW_MAX_DELAY ((1ULL << (TW_BITS0 + (TW_LEVELS * TW_BITS))) - 1)
+
+
+typedef unsigned long long tw_time_t;
+
+struct __timewheel_t;
+
+typedef struct __tw_entry_t {
+	struct __tw_entry_t *prev, *next;
+	struct __tw_entry_t **slot;			// the slot the entry is in, NULL if not pending.
+	struct __timewheel_t *tw;
+	tw_time_t expires;
+	void *arg;
+} tw_entry_t;
+
+typedef struct __timewheel_t {
+	tw_entry_t *wheel0[TW_SIZE0];
+	tw_entry_t *wheels[TW_LEVELS][TW_SIZE];
+	tw_time_t current;		// the next millisecond to be processed.
+	int count;
+} timewheel_t;
+
+
+void      tw_init(timewheel_t *tw, tw_time_t now);
+void      tw_free(timewheel_t *tw);
+tw_time_t tw_now(void);
+
+void tw_entry_init(tw_entry_t *entry, void *arg);
+void tw_add(timewheel_t *tw, tw_entry_t *entry, tw_time_t expires);
+void tw_cancel(tw_entry_t *entry);
+void tw_advance(timewheel_t *tw, tw_time_t now, void (*handler)(tw_entry_t *entry, void *arg));
+
+#define tw_pending(e)  ((e)->slot != NULL)
+
+#endif